@@ -0,0 +1,26 @@
+#! /bin/bash
+
+# Compare how many connections per second each calcServer mode accepts.
+
+if [ $# -lt 1 ] || [ $# -gt 3 ]; then
+	echo "Usage: bench_conns.sh <port> [clients] [seconds]"
+	exit 1
+fi
+
+port="$1"
+clients="${2:-8}"
+seconds="${3:-5}"
+
+for mode in thread pool epoll reuseport; do
+	# Start server process
+	./calcServer -m $mode $port &
+	CALC_PID=$!
+	sleep 1
+
+	echo -n "$mode: "
+	./calcConnBench $port $clients $seconds
+
+	# Kill server process
+	kill -9 $CALC_PID
+	wait $CALC_PID 2> /dev/null || true
+done
@@ -1,51 +1,366 @@
 #include "calc.h"
+#include "varTable.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
 
-#include <iostream>
 #include <string>
-#include <map>
-#include <vector>
-#include <sstream>
+#include <string_view>
 #include <cctype>
-#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
 #include <pthread.h>
+#include <unistd.h>
+#include <new>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+// most steps in a parsed expression; longer expressions are rejected
+#define MAX_STEPS 256
+
+// deepest nesting of parentheses and unary minus signs
+#define MAX_DEPTH 64
+
+// magnitudes of integer literals saturate here, just past the largest valid one (-INT_MIN)
+#define MAX_MAGNITUDE (2147483648ull + 1)
+
+// bucket count of a lock-free Calc when the caller does not choose one
+#define DEFAULT_LOCK_FREE_BUCKETS 65536
+
+// plans evalBatch keeps per thread between batches; a Plan takes about 12 KB
+#define KEPT_PLANS 4
+
+// most shards a Calc may be split into
+#define MAX_SHARDS 4096
+
+// most variables in one expression (its target plus one per step), hence most shards it locks
+#define MAX_PLAN_VARS (MAX_STEPS + 1)
+
+/**
+ * One slice of the variables of a locked Calc, with the lock that guards it.
+ * Aligned so that neighbouring shards' locks do not share a cache line.
+ * Assignments record their entries in dirty for the next checkpoint; the
+ * fields after vars change only with the shard locked exclusively, or
+ * shared by the checkpointing thread. With a feed, assignments also append
+ * their records to outbox, which one thread at a time passes on to the
+ * feed once it has unlocked the shard.
+ */
+struct alignas(64) Shard {
+    pthread_rwlock_t lock;      // shared for expressions that only read the shard
+    VarTable vars;
+    std::vector<VarEntry *> dirty;      // entries assigned since the last checkpoint began
+    std::vector<std::pair<VarEntry *, int>> captured;   // their values when the running checkpoint began
+    bool capture_pending;       // a checkpoint began, but has not captured dirty yet
+    std::string outbox;         // records assigned but not yet fed, in the order of assignment
+    pthread_mutex_t outbox_lock;        // guards outbox, which is appended to with lock held too
+    pthread_mutex_t feeding;    // held while passing outbox to the feed, so records go in order
+};
+
+/**
+ * A shard an expression needs to lock, and whether it needs it exclusively
+ */
+struct ShardLock {
+    uint32_t index;
+    bool write;
+};
+
+/**
+ * One operand of an expression, either an integer literal or a variable.
+ * A variable's hash is computed once at parse time; slot is its entry in
+ * the variable table once resolved.
+ */
+struct Operand {
+    enum { INT, VAR } kind;
+    int value;                  // value of an integer literal
+    const char *name;           // name of a variable, not NUL-terminated
+    uint32_t name_len;          // (not a string_view, so a Plan's steps need no constructor)
+    uint64_t hash;              // VarTable::hash of name
+    VarEntry *slot;             // entry of the variable, NULL until resolved
+
+    std::string_view get_name() const { return std::string_view(name, name_len); }
+};
+
+/**
+ * One step of a parsed expression, which is evaluated with a stack: op 0
+ * pushes operand, '+', '-', '*' and '/' pop two values and push the result,
+ * and '~' negates the top value.
+ */
+struct Step {
+    char op;
+    Operand operand;
+};
+
+/**
+ * A parsed expression of the form [VAR =] expr, where expr is any
+ * arithmetic expression with parentheses, in postfix order.
+ */
+struct Plan {
+    bool assign;                // whether the result is stored into target
+    std::string_view target;
+    uint64_t target_hash;
+    VarEntry *target_slot;      // entry of target, NULL until resolved
+    int num_steps;
+    int num_vars;               // number of steps that push a variable
+    Step steps[MAX_STEPS];
+};
+
+/**
+ * A token of an expression, which views the expression's text
+ */
+struct Token {
+    enum { END, INT, VAR, OP, BAD } kind;
+    std::string_view text;
+    uint64_t magnitude;     // value of an INT token, saturated at MAX_MAGNITUDE
+};
+
+/**
+ * Scans an expression one token at a time without copying it
+ */
+struct Lexer {
+    const char *p;      // first character after tok
+    const char *end;    // the expression's terminating NUL
+    Token tok;          // current token
+};
+
+/**
+ * An expression compiled by calc_compile. text owns the characters that
+ * the string_views in plan refer to. Every variable in plan is resolved,
+ * so executing it never touches the variable table's index.
+ */
+struct CalcCompiled {
+    struct Calc *calc;
+    std::string text;
+    Plan plan;
+};
+
+/**
+ * Wakes an event loop through its eventfd once deferred commits settle.
+ * refs counts the loop's own reference and one per notification a log
+ * has yet to give; fd is -1 once the loop has let go.
+ */
+struct CalcNotifier {
+    pthread_mutex_t lock;
+    int fd;
+    int refs;
+};
 
 struct Calc{
 private:
     // fields
-    std::map<std::string, int> var_dict;
+    Shard *shards;          // variables are split across shards by hash
+    uint32_t num_shards;
+    LockFreeVarTable *lock_free_vars;       // used instead of shards if not NULL
+    Wal *wal;               // log of assignments, or NULL
+    Snapshot *base;         // values of variables that are not in memory, or NULL
+    pthread_mutex_t checkpoint_lock;        // one checkpoint or snapshot at a time
+    uint64_t checkpoint_seq;        // number of the last checkpoint written or applied
+    bool read_only;         // whether evaluations may not assign
+    CalcFeed feed;          // receives every assignment, or NULL
+    void *feed_arg;
 
-    // tokenize expression
-    std::vector<std::string> tokenize(const std::string &expr);
+    // scan the next token of an expression
+    void next_token(Lexer &lex);
 
     // check whether operand is a variable
-    int is_variable(std::string operand);
+    int is_variable(std::string_view operand);
 
-    // check whether operand is an integer
-    int is_integer(std::string operand);
+    // parse an expression into plan
+    int parse(const char *expr, Plan &plan);
 
-    // check whether op is an operator
-    int is_operator(std::string op);
+    // parse operators of at least min_prec precedence and their operands
+    int parse_binary(Lexer &lex, Plan &plan, int min_prec, int depth);
 
-public:
-    pthread_mutex_t lock;
+    // parse a possibly negated operand or parenthesized expression
+    int parse_unary(Lexer &lex, Plan &plan, int depth);
+
+    // append a step to plan
+    Step *add_step(Plan &plan, char op);
+
+    // convert an integer or variable token to an operand
+    int parse_operand(const Token &tok, bool negative, Operand &operand);
+
+    // get the value of an operand, looking up its entry if unresolved
+    int load_operand(const Operand &operand, int &value);
+
+    // look up a variable in whichever table is in use
+    VarEntry *find_var(std::string_view name, uint64_t hash);
+
+    // intern a variable in whichever table is in use
+    VarEntry *intern_var(std::string_view name, uint64_t hash);
+
+    // get the shard that holds a variable
+    Shard &shard_for(uint64_t hash);
+
+    // lock the shards a plan touches, returning how many were locked
+    int lock_shards(const Plan &plan, bool all_write, ShardLock *locked);
+
+    // list the shards a plan touches
+    int plan_shards(const Plan &plan, bool all_write, ShardLock *wanted);
+
+    // sort and deduplicate a list of shards
+    int sort_shards(ShardLock *wanted, int num_wanted);
+
+    // lock shards already sorted by index
+    int lock_shards_sorted(const ShardLock *locked, int num_locked);
+
+    // release shards locked by lock_shards
+    void unlock_shards(const ShardLock *locked, int num_locked);
+
+    // pass the records this thread's assignments left in outboxes to the feed
+    void feed_assigned();
+
+    // pass a shard's outbox to the feed, unless another thread is doing so
+    void drain_outbox(Shard &shard);
 
+    // take every shard's feeding lock, once all shards are locked
+    void lock_feeding();
+
+    // release the feeding locks taken by lock_feeding
+    void unlock_feeding();
+
+    // evaluate a plan, with its shards already locked if there are any
+    int eval_plan(const Plan &plan, int &result, uint64_t &lsn);
+
+    // lock, evaluate and commit a plan whose evaluation started at start
+    int run(const Plan &plan, int &result, uint64_t start);
+
+    // wait for the log to reach lsn, unless this thread defers commits
+    bool commit_or_defer(uint64_t lsn);
+
+    // write every defined variable to a snapshot, with assignments blocked
+    bool write_snapshot(const char *path, long &count);
+
+    // list every defined variable in name order, with assignments blocked
+    void collect_vars(std::vector<std::pair<std::string_view, int>> &vars);
+
+    // lock every shard for reading, in order
+    void lock_all(std::vector<ShardLock> &locked);
+
+    // record an assignment to entry, in shard, for the next checkpoint
+    void track(Shard &shard, VarEntry *entry);
+
+    // copy the values of a shard's dirty entries for the running checkpoint
+    void capture(Shard &shard);
+
+public:
     // public member functions
-    Calc();
+    explicit Calc(const CalcOptions &opts);
     ~Calc();
 
-    int evalExpr(const std::string &expr, int &result);
+    int evalExpr(const char *expr, int &result);
+
+    int evalBatch(const char **exprs, size_t n, int *results, int *status);
+
+    int compile(const char *expr, Plan &plan);
+
+    void resolve(Plan &plan);
+
+    int exec(const Plan &plan, int &result);
+
+    VarEntry *var(std::string_view name);
 
-    int var_exist(std::string var);
+    int execProgram(VarEntry *target, const CalcInstr *code, size_t n, VarEntry *const *vars, size_t num_vars, int &result);
+
+    int var_exist(std::string_view var);
+
+    int openWal(const char *path, unsigned interval_us);
+
+    long loadSnapshot(const char *path);
+
+    long saveSnapshot(const char *path, uint64_t &seq);
+
+    int checkpoint(const char *path, CalcCheckpointStats &stats);
+
+    long applyCheckpoint(const char *path);
+
+    uint64_t checkpointSeq();
+
+    int setFeed(CalcFeed feed, void *arg);
+
+    long feedDump();
+
+    long applyRecords(const char *records, size_t len);
+
+    int commitStatus(uint64_t lsn);
+
+    int notifyCommit(uint64_t lsn, CalcNotifier *notifier);
 };
 
 // constructor
-Calc::Calc() {pthread_mutex_init(&this->lock, NULL);}
+Calc::Calc(const CalcOptions &opts)
+    : shards(NULL), num_shards(0), lock_free_vars(NULL), wal(NULL), base(NULL), checkpoint_seq(0),
+      read_only(opts.read_only != 0), feed(NULL), feed_arg(NULL) {
+    pthread_mutex_init(&checkpoint_lock, NULL);
+    if (opts.concurrency == CALC_LOCK_FREE)
+    {
+        lock_free_vars = new LockFreeVarTable(opts.num_buckets != 0 ? opts.num_buckets : DEFAULT_LOCK_FREE_BUCKETS);
+        return;
+    }
+
+    num_shards = opts.num_shards;
+    if (num_shards == 0)
+    {
+        num_shards = 1;
+    } else if (num_shards > MAX_SHARDS) {
+        num_shards = MAX_SHARDS;
+    }
+    shards = new Shard[num_shards];
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    // otherwise a steady stream of readers can starve assignments
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (uint32_t i = 0; i < num_shards; i++)
+    {
+        pthread_rwlock_init(&shards[i].lock, &attr);
+        shards[i].capture_pending = false;
+        pthread_mutex_init(&shards[i].outbox_lock, NULL);
+        pthread_mutex_init(&shards[i].feeding, NULL);
+    }
+    pthread_rwlockattr_destroy(&attr);
+}
 
 // destructor
-Calc::~Calc() {pthread_mutex_destroy(&this->lock);}
+Calc::~Calc() {
+    for (uint32_t i = 0; i < num_shards; i++)
+    {
+        pthread_rwlock_destroy(&shards[i].lock);
+        pthread_mutex_destroy(&shards[i].outbox_lock);
+        pthread_mutex_destroy(&shards[i].feeding);
+    }
+    delete[] shards;
+    delete lock_free_vars;
+    delete wal;
+    delete base;
+    pthread_mutex_destroy(&checkpoint_lock);
+}
+
+extern "C" void calc_options_init(struct CalcOptions *opts) {
+    opts->concurrency = CALC_LOCKED;
+    opts->num_shards = 1;
+    opts->num_buckets = 0;
+    opts->read_only = 0;
+}
+
+extern "C" struct Calc *calc_create_ex(const struct CalcOptions *opts) {
+    return new Calc(*opts);
+}
 
 extern "C" struct Calc *calc_create(void) {
-    return new Calc();
+    CalcOptions opts;
+    calc_options_init(&opts);
+    return calc_create_ex(&opts);
+}
+
+extern "C" struct Calc *calc_create_lockfree(unsigned num_buckets) {
+    CalcOptions opts;
+    calc_options_init(&opts);
+    opts.concurrency = CALC_LOCK_FREE;
+    opts.num_buckets = num_buckets;
+    return calc_create_ex(&opts);
 }
 
 extern "C" void calc_destroy(struct Calc *calc) {
@@ -56,475 +371,1814 @@ extern "C" int calc_eval(struct Calc *calc, const char *expr, int *result) {
     return calc->evalExpr(expr, *result);
 }
 
-/**
- * Evaluate a given expression and store the answer into result
- * @return 1 if successfully evaluated, 0 otherwise
- */
-extern "C" int Calc::evalExpr(const std::string &expr, int &result) {
-    std::vector<std::string> tokens = tokenize(expr);       // tokenize the expression
-    int num_tokens = tokens.size();     
+extern "C" int calc_eval_batch(struct Calc *calc, const char **exprs, size_t n, int *results, int *status) {
+    return calc->evalBatch(exprs, n, results, status);
+}
+
+extern "C" struct CalcCompiled *calc_compile(struct Calc *calc, const char *expr) {
+    CalcCompiled *compiled = new CalcCompiled();
+    compiled->calc = calc;
+    compiled->text = expr;      // plan refers into this copy, not the caller's buffer
+
+    if (calc->compile(compiled->text.c_str(), compiled->plan) == 0) {
+        delete compiled;
+        return NULL;        // expression is not syntactically valid
+    }
+    calc->resolve(compiled->plan);
+    return compiled;
+}
+
+extern "C" int calc_exec(struct CalcCompiled *compiled, int *result) {
+    return compiled->calc->exec(compiled->plan, *result);
+}
+
+extern "C" void calc_free_compiled(struct CalcCompiled *compiled) {
+    delete compiled;
+}
+
+// a CalcVar handle is the variable's entry, which never moves
+extern "C" struct CalcVar *calc_var(struct Calc *calc, const char *name, size_t len) {
+    return reinterpret_cast<CalcVar *>(calc->var(std::string_view(name, len)));
+}
+
+extern "C" int calc_exec_program(struct Calc *calc, struct CalcVar *target, const struct CalcInstr *code, size_t n,
+                                 struct CalcVar *const *vars, size_t num_vars, int *result) {
+    return calc->execProgram(reinterpret_cast<VarEntry *>(target), code, n,
+                             reinterpret_cast<VarEntry *const *>(vars), num_vars, *result);
+}
+
+extern "C" int calc_open_wal(struct Calc *calc, const char *path, unsigned commit_interval_us) {
+    return calc->openWal(path, commit_interval_us);
+}
+
+extern "C" long calc_load_snapshot(struct Calc *calc, const char *path) {
+    return calc->loadSnapshot(path);
+}
 
-    //  switch to correct number of tokens
-    pthread_mutex_lock(&this->lock);
-    switch (num_tokens)
+extern "C" long calc_save_snapshot(struct Calc *calc, const char *path, unsigned long long *seq) {
+    uint64_t covered;
+    long count = calc->saveSnapshot(path, covered);
+    if (seq != NULL)
     {
-        case 1:
-        {
-            std::string operand = tokens.at(0);     // get the operand
-            if (is_integer(operand) == 1)       // if operand is integer
-            {
-                result = std::stoi(operand);
-                pthread_mutex_unlock(&this->lock);
-                return 1;       // evaluation succeeds
-            }
-            else if (is_variable(operand) == 1)     // if operand is variable
-            {
-                if (var_exist(operand) == 1)        // check whether variable is in the dictionary
-                {
-                    result = this->var_dict.at(operand);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;       // evaluation succeeds
-                }
-            }
-            
-            break;
-        }
+        *seq = covered;
+    }
+    return count;
+}
 
-        case 3:
-        {
-            std::string operand1 = tokens.at(0);
-            std::string op = tokens.at(1);
-            std::string operand2 = tokens.at(2);
-            
-            // INT op INT
-            if (is_integer(operand1) == 1 && is_integer(operand2) == 1 && is_operator(op) == 1)     
-            {
-                switch (op[0])      // use this syntax so that switch works
-                {
-                case '+':
-                    result = std::stoi(operand1) + std::stoi(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                case '-':
-                    result = std::stoi(operand1) - std::stoi(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                case '*':
-                    result = std::stoi(operand1) * std::stoi(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                case '/':
-                    if (std::stoi(operand2) == 0) {     // divide by zero error
-                        // std::cout << "Expression is invalid (attempt to divide by 0)." << std::endl;
-                        pthread_mutex_unlock(&this->lock);
-                        return 0;
-                    }
-                    result = std::stoi(operand1) / std::stoi(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                default:
-                    break;
-                }
-            }
-            // VAR op INT
-            else if (is_variable(operand1) == 1 && is_integer(operand2) == 1 && is_operator(op) == 1)
-            {   
-                if (var_exist(operand1) == 0)       // return 0 if operand1 is not in dictionary
-                {
-                    pthread_mutex_unlock(&this->lock);
-                    return 0;
-                }
-                
-                switch (op[0])
-                {
-                case '+':
-                    result = var_dict.at(operand1) + std::stoi(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                case '-':
-                    result = var_dict.at(operand1) - std::stoi(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                case '*':
-                    result = var_dict.at(operand1) * std::stoi(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                case '/':
-                    if (std::stoi(operand2) == 0) {
-                        // std::cout << "Expression is invalid (attempt to divide by 0)." << std::endl;
-                        pthread_mutex_unlock(&this->lock);
-                        return 0;
-                    }
-                    result = var_dict.at(operand1) / std::stoi(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                default:
-                    break;
-                }
-            } 
-            // INT op VAR
-            else if (is_integer(operand1) == 1 && is_variable(operand2) == 1 && is_operator(op) == 1)
-            {   
-                if (var_exist(operand2) == 0)       // check whether operand2 exist in dictionary
-                {
-                    pthread_mutex_unlock(&this->lock);
-                    return 0;
-                }
-
-                switch (op[0])
-                {
-                case '+':
-                    result = std::stoi(operand1) + var_dict.at(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                case '-':
-                    result = std::stoi(operand1) - var_dict.at(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                case '*':
-                    result = std::stoi(operand1) * var_dict.at(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                case '/':
-                    if (var_dict.at(operand2) == 0) {
-                        // std::cout << "Expression is invalid (attempt to divide by 0)." << std::endl;
-                        pthread_mutex_unlock(&this->lock);
-                        return 0;
-                    }
-                    result = std::stoi(operand1) / var_dict.at(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                default:
-                    break;
-                }
-            }
-            // VAR op VAR
-            else if (is_variable(operand1) == 1 && is_variable(operand2) == 1 && is_operator(op) == 1)
-            {   
-                if (var_exist(operand1) == 0 || var_exist(operand2) == 0)       // return 0 is either operand1 or operand2 is not in dictionary
-                {
-                    pthread_mutex_unlock(&this->lock);
-                    return 0;
-                }
-
-                switch (op[0])
-                {
-                case '+':
-                    result = var_dict.at(operand1) + var_dict.at(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                case '-':
-                    result = var_dict.at(operand1) - var_dict.at(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                case '*':
-                    result = var_dict.at(operand1) * var_dict.at(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                case '/':
-                    if (var_dict.at(operand2) == 0) {
-                        // std::cout << "Expression is invalid (attempt to divide by 0)." << std::endl;
-                        pthread_mutex_unlock(&this->lock);
-                        return 0;
-                    }
-                    result = var_dict.at(operand1) / var_dict.at(operand2);
-                    pthread_mutex_unlock(&this->lock);
-                    return 1;
-                    break;
-                default:
-                    break;
-                }
-            }
-            // VAR = INT
-            else if (is_variable(operand1) == 1 && is_integer(operand2) == 1 && op == "=")
-            {
-                if (var_exist(operand1) == 0)       // insert into dictionary if operand1 does not exist
-                {
-                    var_dict.insert(std::pair<std::string, int>(operand1, std::stoi(operand2)));
-                } else {        // otherwise change the value in dictionary
-                    var_dict.at(operand1) = std::stoi(operand2);
-                }
-                result = var_dict.at(operand1);
-                pthread_mutex_unlock(&this->lock);
-                return 1;
-            }
-            // VAR = VAR
-            else if (is_variable(operand1) == 1 && is_variable(operand2) == 1 && op == "=")
-            {   
-                if (var_exist(operand2) == 0)       // return 0 if operand2 is not in dictionary 
-                {
-                    pthread_mutex_unlock(&this->lock);
-                    return 0;
-                }
-                 else if (var_exist(operand1) == 0)     // insert into dictionary if operand1 does not exist
-                {
-                    var_dict.insert(std::pair<std::string, int>(operand1, var_dict.at(operand2)));
-                } else {        // otherwise change the value in dictionary
-                    var_dict.at(operand1) = var_dict.at(operand2);
-                }
-                result = var_dict.at(operand1);
-                pthread_mutex_unlock(&this->lock);
-                return 1;
-            }
-            
-            break;
-        }
+extern "C" int calc_checkpoint(struct Calc *calc, const char *path, struct CalcCheckpointStats *stats) {
+    CalcCheckpointStats ignored;
+    return calc->checkpoint(path, stats != NULL ? *stats : ignored);
+}
 
-        case 5:
-        {
-            std::string var = tokens.at(0);
-            std::string op1 = tokens.at(1);
-            std::string operand1 = tokens.at(2);
-            std::string op2 = tokens.at(3);
-            std::string operand2 = tokens.at(4);
-            int temp_res = 0;       // store the value of expression after '='
+extern "C" long calc_apply_checkpoint(struct Calc *calc, const char *path) {
+    return calc->applyCheckpoint(path);
+}
 
-            if (op1 != "=" || is_variable(var) == 0)        // return 0 if format invalid
-            {
-                pthread_mutex_unlock(&this->lock);
-                return 0;
-            }
-            
-            // VAR = INT op INT
-            if (is_integer(operand1) == 1 && is_integer(operand2) == 1 && is_operator(op2) == 1)
-            {
-                switch (op2[0])
-                {
-                case '+':
-                    temp_res = std::stoi(operand1) + std::stoi(operand2);
-                    break;
-                case '-':
-                    temp_res = std::stoi(operand1) - std::stoi(operand2);
-                    break;
-                case '*':
-                    temp_res = std::stoi(operand1) * std::stoi(operand2);
-                    break;
-                case '/':
-                    if (std::stoi(operand2) == 0) {
-                        // std::cout << "Expression is invalid (attempt to divide by 0)." << std::endl;
-                        pthread_mutex_unlock(&this->lock);
-                        return 0;
-                    }
-                    temp_res = std::stoi(operand1) / std::stoi(operand2);
-                    break;
-                default:
-                    break;
-                }
-            }
-            // VAR = VAR op INT
-            else if (is_variable(operand1) == 1 && is_integer(operand2) == 1 && is_operator(op2) == 1)
-            {   
-                if (var_exist(operand1) == 0)
-                {
-                    pthread_mutex_unlock(&this->lock);
-                    return 0;       // var1 does not exist in dictionary
-                }
-
-                switch (op2[0])
-                {
-                case '+':
-                    temp_res = var_dict.at(operand1) + std::stoi(operand2);
-                    break;
-                case '-':
-                    temp_res = var_dict.at(operand1) - std::stoi(operand2);
-                    break;
-                case '*':
-                    temp_res = var_dict.at(operand1) * std::stoi(operand2);
-                    break;
-                case '/':
-                    if (std::stoi(operand2) == 0) {
-                        // std::cout << "Expression is invalid (attempt to divide by 0)." << std::endl;
-                        pthread_mutex_unlock(&this->lock);
-                        return 0;
-                    }
-                    temp_res = var_dict.at(operand1) / std::stoi(operand2);
-                    break;
-                default:
-                    break;
-                }
-            }
-            // VAR = INT op VAR
-            else if (is_integer(operand1) == 1 && is_variable(operand2) == 1 && is_operator(op2) == 1)
-            {   
-                if (var_exist(operand2) == 0)
-                {
-                    pthread_mutex_unlock(&this->lock);
-                    return 0;
-                }
-
-                switch (op2[0])
-                {
-                case '+':
-                    temp_res = std::stoi(operand1) + var_dict.at(operand2);
-                    break;
-                case '-':
-                    temp_res = std::stoi(operand1) - var_dict.at(operand2);
-                    break;
-                case '*':
-                    temp_res = std::stoi(operand1) * var_dict.at(operand2);
-                    break;
-                case '/':
-                    if (var_dict.at(operand2) == 0) {
-                        // std::cout << "Expression is invalid (attempt to divide by 0)." << std::endl;
-                        pthread_mutex_unlock(&this->lock);
-                        return 0;
-                    }
-                    temp_res = std::stoi(operand1) / var_dict.at(operand2);
-                    break;
-                default:
-                    break;
-                }
-            } 
-            // VAR = VAR op VAR
-            else if (is_variable(operand1) == 1 && is_variable(operand2) == 1 && is_operator(op2) == 1)
-            {   
-                if (var_exist(operand1) == 0 || var_exist(operand2) == 0)
-                {
-                    pthread_mutex_unlock(&this->lock);
-                    return 0;       // var1 or var2 does not exist in dictionary
-                }
-
-                switch (op2[0])
-                {
-                case '+':
-                    temp_res = var_dict.at(operand1) + var_dict.at(operand2);
-                    break;
-                case '-':
-                    temp_res = var_dict.at(operand1) - var_dict.at(operand2);
-                    break;
-                case '*':
-                    temp_res = var_dict.at(operand1) * var_dict.at(operand2);
-                    break;
-                case '/':
-                    if (var_dict.at(operand2) == 0) {
-                        // std::cout << "Expression is invalid (attempt to divide by 0)." << std::endl;
-                        pthread_mutex_unlock(&this->lock);
-                        return 0;
-                    }
-                    temp_res = var_dict.at(operand1) / var_dict.at(operand2);
-                    break;
-                default:
-                    break;
-                }
-            }
-            
+extern "C" unsigned long long calc_checkpoint_seq(struct Calc *calc) {
+    return calc->checkpointSeq();
+}
 
-            if (var_exist(var) == 0) {      // insert into dictionary if not exist
-                var_dict.insert(std::pair<std::string, int>(var, temp_res));
-            }
-            else {      // otherwise change value in dictionary
-                var_dict.at(var) = temp_res;
-            }
-            result = temp_res;
-            pthread_mutex_unlock(&this->lock);
-            return 1;
-            break;
-        }
-        default:
+extern "C" int calc_set_feed(struct Calc *calc, CalcFeed feed, void *arg) {
+    return calc->setFeed(feed, arg);
+}
+
+extern "C" long calc_feed_dump(struct Calc *calc) {
+    return calc->feedDump();
+}
+
+extern "C" long calc_apply_records(struct Calc *calc, const char *records, size_t len) {
+    return calc->applyRecords(records, len);
+}
+
+extern "C" int calc_commit_status(struct Calc *calc, unsigned long long lsn) {
+    return calc->commitStatus(lsn);
+}
+
+extern "C" int calc_notify_commit(struct Calc *calc, unsigned long long lsn, struct CalcNotifier *notifier) {
+    return calc->notifyCommit(lsn, notifier);
+}
+
+extern "C" void calc_enable_stats(int enable) {
+    ThreadStats::enabled.store(enable != 0, std::memory_order_relaxed);
+}
+
+extern "C" void calc_get_stats(struct CalcStats *stats) {
+    ThreadStats::collect(*stats);
+}
+
+extern "C" void calc_enable_lock_stats(int enable) {
+    ThreadStats::locks_enabled.store(enable != 0, std::memory_order_relaxed);
+}
+
+extern "C" void calc_get_lock_stats(struct CalcLockStats *stats) {
+    ThreadStats::collect(*stats);
+}
+
+extern "C" void calc_enable_trace(int enable) {
+    TraceRing::enabled.store(enable != 0, std::memory_order_relaxed);
+}
+
+extern "C" void calc_trace_begin(enum CalcTracePhase phase, unsigned arg) {
+    TraceRing::begin(phase, arg);
+}
+
+extern "C" void calc_trace_end(enum CalcTracePhase phase, unsigned arg) {
+    TraceRing::end(phase, arg);
+}
+
+extern "C" long calc_trace_dump(const char *path) {
+    return TraceRing::dump(path);
+}
+
+// when this thread's lock_shards_sorted acquired its shards, if it timed them
+static thread_local uint64_t shards_locked_at;
+
+// why the last evaluation of this thread's eval_plan failed
+static thread_local CalcError eval_error;
+
+// whether this thread's evaluations leave waiting for the log to their caller
+static thread_local bool defer_commits;
+
+// shards whose outbox this thread's assignments appended to, to be fed once unlocked
+static thread_local std::vector<Shard *> assigned_outboxes;
+
+// highest log position of each Calc that this thread's deferred assignments reached
+static thread_local std::vector<std::pair<Calc *, uint64_t>> deferred_commits;
+
+extern "C" void calc_defer_commits(int enable) {
+    defer_commits = enable != 0;
+}
+
+extern "C" unsigned long long calc_take_commit(struct Calc *calc) {
+    for (size_t i = 0; i < deferred_commits.size(); i++)
+    {
+        if (deferred_commits[i].first == calc)
         {
-            pthread_mutex_unlock(&this->lock);
-            return 0;
+            uint64_t lsn = deferred_commits[i].second;
+            deferred_commits[i] = deferred_commits.back();
+            deferred_commits.pop_back();
+            return lsn;
         }
     }
-    pthread_mutex_unlock(&this->lock);
     return 0;
 }
 
 /**
- * Tokenize given expression into seperate strings and store in a vector
- * @return a vector of strings
+ * Drop a reference to a notifier, freeing it with the last one
  */
-extern "C" std::vector<std::string> Calc::tokenize(const std::string &expr) {
-    std::vector<std::string> vec;
-    std::stringstream s(expr);
+static void notifier_release(CalcNotifier *notifier) {
+    pthread_mutex_lock(&notifier->lock);
+    int refs = --notifier->refs;
+    pthread_mutex_unlock(&notifier->lock);
+    if (refs == 0)
+    {
+        pthread_mutex_destroy(&notifier->lock);
+        delete notifier;
+    }
+}
 
-    std::string tok;
-    while (s >> tok) {
-        vec.push_back(tok);
+/**
+ * Wake the notifier's loop unless it has let go, and drop the reference
+ * of the notification
+ */
+static void notifier_fire(CalcNotifier *notifier) {
+    pthread_mutex_lock(&notifier->lock);
+    if (notifier->fd >= 0)
+    {
+        uint64_t one = 1;
+        ssize_t written = write(notifier->fd, &one, sizeof(one));       // an eventfd adds it to its count
+        (void) written;
     }
+    pthread_mutex_unlock(&notifier->lock);
+    notifier_release(notifier);
+}
 
-    return vec;
+extern "C" struct CalcNotifier *calc_notifier_create(int fd) {
+    CalcNotifier *notifier = new CalcNotifier;
+    pthread_mutex_init(&notifier->lock, NULL);
+    notifier->fd = fd;
+    notifier->refs = 1;
+    return notifier;
+}
+
+extern "C" void calc_notifier_destroy(struct CalcNotifier *notifier) {
+    pthread_mutex_lock(&notifier->lock);
+    notifier->fd = -1;      // notifications still pending in logs go nowhere
+    pthread_mutex_unlock(&notifier->lock);
+    notifier_release(notifier);
 }
 
 /**
- * Check whether given operand is a valid variable
- * @return 1 is valid variable, 0 otherwise
+ * Classify a parsed expression for the statistics
+ * @return its shape
+ */
+static CalcShape plan_shape(const Plan &plan) {
+    if (plan.assign)
+    {
+        return CALC_SHAPE_ASSIGNMENT;
+    }
+    if (plan.num_steps == 1)
+    {
+        return plan.steps[0].operand.kind == Operand::INT ? CALC_SHAPE_LITERAL : CALC_SHAPE_VARIABLE;
+    }
+    return CALC_SHAPE_ARITHMETIC;
+}
+
+/**
+ * Wait for the log to make the assignments up to lsn durable, tracing the wait
+ * @return true on success, false if the log could not be written
  */
-extern "C" int Calc::is_variable(std::string operand) {
+static bool commit(Wal *wal, uint64_t lsn) {
+    TraceRing::begin(CALC_TRACE_LOG, 0);
+    bool ok = wal->commit(lsn);
+    TraceRing::end(CALC_TRACE_LOG, 0);
+    return ok;
+}
 
-    for (std::string::iterator it = operand.begin(); it != operand.end(); it++)
+/**
+ * Count an evaluation that took ns, and failed because of error unless ok
+ */
+static void count_evaluation(CalcShape shape, int ok, CalcError error, uint64_t ns) {
+    ThreadStats::evaluated(shape, ns);
+    if (!ok)
     {
-        if (isalpha(*it) == 0)
-        {
-            return 0;       // operand is not valid variable
-        }
-        
+        ThreadStats::failed(error);
+    }
+    else if (shape == CALC_SHAPE_ASSIGNMENT)
+    {
+        ThreadStats::assigned();
     }
-    
-    return 1;       // operand is variable
 }
 
 /**
- * Check whether given operand is a valid integer
- * @return 1 is valid integer, 0 otherwise
+ * Count an expression or program that could not be parsed
+ * @return 0, the result of evaluating it
  */
-extern "C" int Calc::is_integer(std::string operand) {
-    for (std::string::iterator it = operand.begin(); it != operand.end(); it++)
-    {   
-        if ((it == operand.begin()) && (*it == 45))
-        {
-            continue;
+static int count_invalid(uint64_t start) {
+    if (start != 0)
+    {
+        count_evaluation(CALC_SHAPE_INVALID, 0, CALC_ERROR_SYNTAX, ThreadStats::now_ns() - start);
+    }
+    return 0;
+}
+
+/**
+ * Compute lhs op rhs. Overflow wraps around rather than trapping.
+ * @return 1 if successfully computed, 0 on divide by zero
+ */
+static int apply_op(char op, int lhs, int rhs, int &result) {
+    switch (op)
+    {
+    case '+':
+        result = (int) ((unsigned) lhs + (unsigned) rhs);
+        return 1;
+    case '-':
+        result = (int) ((unsigned) lhs - (unsigned) rhs);
+        return 1;
+    case '*':
+        result = (int) ((unsigned) lhs * (unsigned) rhs);
+        return 1;
+    case '/':
+        if (rhs == 0) {
+            return 0;       // attempt to divide by 0
         }
-        
-        
-        if (isdigit(*it) == 0)
-        {
-            return 0;       // operand is not valid integer
+        if (rhs == -1) {
+            result = (int) (0u - (unsigned) lhs);       // INT_MIN / -1 would trap
+            return 1;
         }
-        
+        result = lhs / rhs;
+        return 1;
+    default:
+        return 0;
     }
+}
 
-    return 1;       // operand is integer
+/**
+ * Check whether all eight bytes of a word loaded from memory are ASCII digits
+ * @return true if they are
+ */
+static inline bool eight_digits(uint64_t word) {
+    // a byte is a digit if its high nibble is 3 and adding 6 does not carry out of the low nibble
+    return ((word & 0xF0F0F0F0F0F0F0F0ull) | (((word + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4))
+        == 0x3333333333333333ull;
 }
 
 /**
- * Check whether a given variable exists in var_dictionary
- * @return 1 if exist, 0 otherwise
+ * Convert eight ASCII digits loaded little-endian from memory to their value,
+ * by combining adjacent digits, then pairs, then quads, with one multiply each
+ * @return the value of the digits, first digit most significant
  */
-extern "C" int Calc::var_exist(std::string var) {
-    if (var_dict.find(var) != var_dict.end())
-    {
-        return 1;       // variable found
-    }
-    
-    return 0;       // variable not found
+static inline uint32_t eight_digits_value(uint64_t word) {
+    word = ((word & 0x0F0F0F0F0F0F0F0Full) * 2561) >> 8;
+    word = ((word & 0x00FF00FF00FF00FFull) * 6553601) >> 16;
+    return (uint32_t) (((word & 0x0000FFFF0000FFFFull) * 42949672960001ull) >> 32);
 }
 
 /**
- * Check whether a give string op is a valid operator
- * @return 1 if is any of "+", "-", "*", "/", 0 otherwise
+ * Scan the run of digits starting at p, validating and converting them in a
+ * single pass. Runs of eight digits are handled a word at a time (SWAR).
+ * magnitude saturates at MAX_MAGNITUDE, so a too-large literal never wraps.
+ * @return pointer to the first character after the digits
  */
-extern "C" int Calc::is_operator(std::string op) {
-    std::vector<std::string> operators {"+", "-", "*", "/"};
-    if (std::find(operators.begin(), operators.end(), op) != operators.end())
+static const char *scan_integer(const char *p, const char *end, uint64_t &magnitude) {
+    uint64_t value = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t word;
+    while (end - p >= 8 && (memcpy(&word, p, 8), eight_digits(word)))
     {
-        return 1;       // is valid operator
+        value = value * 100000000 + eight_digits_value(word);
+        if (value > MAX_MAGNITUDE)
+        {
+            value = MAX_MAGNITUDE;
+        }
+        p += 8;
     }
-    
-    return 0;       // is not valid operator
+#endif
+
+    while (p < end && isdigit((unsigned char) *p))
+    {
+        value = value * 10 + (*p - '0');
+        if (value > MAX_MAGNITUDE)
+        {
+            value = MAX_MAGNITUDE;
+        }
+        p++;
+    }
+
+    magnitude = value;
+    return p;
+}
+
+/**
+ * Evaluate a given expression and store the answer into result
+ * @return 1 if successfully evaluated, 0 otherwise
+ */
+extern "C" int Calc::evalExpr(const char *expr, int &result) {
+    uint64_t start = ThreadStats::start();
+    Plan plan;
+
+    TraceRing::begin(CALC_TRACE_TOKENIZE, 1);
+    int valid = compile(expr, plan);
+    TraceRing::end(CALC_TRACE_TOKENIZE, 1);
+    if (valid == 0)
+    {
+        return count_invalid(start);        // invalid syntax
+    }
+
+    return run(plan, result, start);
+}
+
+/**
+ * Evaluate n expressions in order, taking the locks of every shard they use
+ * once for the whole batch. status[i] is set to 1 if exprs[i] was evaluated,
+ * in which case results[i] holds its value, and to 0 otherwise.
+ * @return the number of expressions successfully evaluated
+ */
+extern "C" int Calc::evalBatch(const char **exprs, size_t n, int *results, int *status) {
+    // scratch space kept by each thread, so repeated small batches do not allocate
+    static thread_local std::vector<Plan> kept_plans;
+    static thread_local std::vector<ShardLock> wanted;
+    static thread_local std::vector<CalcError> errors;
+    uint64_t start = ThreadStats::start();
+
+    // a larger batch gets plans of its own rather than every thread keeping them
+    std::unique_ptr<Plan[]> batch_plans;
+    Plan *plans;
+    if (n <= KEPT_PLANS)
+    {
+        kept_plans.resize(KEPT_PLANS);
+        plans = kept_plans.data();
+    }
+    else
+    {
+        batch_plans.reset(new Plan[n]);
+        plans = batch_plans.get();
+    }
+    if (errors.size() < n)
+    {
+        errors.resize(n);
+    }
+
+    int num_wanted = 0;
+    TraceRing::begin(CALC_TRACE_TOKENIZE, n);
+    for (size_t i = 0; i < n; i++)
+    {
+        status[i] = compile(exprs[i], plans[i]);
+        if (status[i] == 1 && lock_free_vars == NULL)
+        {
+            if (wanted.size() < (size_t) (num_wanted + plans[i].num_vars + 1))
+            {
+                wanted.resize(num_wanted + plans[i].num_vars + 1);
+            }
+            num_wanted += plan_shards(plans[i], false, &wanted[num_wanted]);
+        }
+    }
+
+    int num_locked = sort_shards(wanted.data(), num_wanted);
+    TraceRing::end(CALC_TRACE_TOKENIZE, n);
+    TraceRing::begin(CALC_TRACE_LOCK, num_locked);
+    lock_shards_sorted(wanted.data(), num_locked);
+    TraceRing::end(CALC_TRACE_LOCK, num_locked);
+
+    int num_ok = 0;
+    uint64_t lsn = 0;
+    TraceRing::begin(CALC_TRACE_EVALUATE, n);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (status[i] == 1)
+        {
+            status[i] = eval_plan(plans[i], results[i], lsn);
+            num_ok += status[i];
+            errors[i] = status[i] == 1 ? CALC_ERROR_LOG : eval_error;
+        }
+        else
+        {
+            errors[i] = CALC_ERROR_SYNTAX;
+        }
+    }
+
+    unlock_shards(wanted.data(), num_locked);
+    TraceRing::end(CALC_TRACE_EVALUATE, n);
+    feed_assigned();
+
+    // one commit covers the whole batch, and it waits with no shard locked
+    if (lsn != 0 && !commit_or_defer(lsn))
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            if (status[i] == 1 && plans[i].assign)
+            {
+                status[i] = 0;      // not durable, so undone
+                num_ok--;
+            }
+        }
+    }
+
+    if (start != 0 && n > 0)
+    {
+        uint64_t share = (ThreadStats::now_ns() - start) / n;
+        for (size_t i = 0; i < n; i++)
+        {
+            CalcShape shape = errors[i] == CALC_ERROR_SYNTAX ? CALC_SHAPE_INVALID : plan_shape(plans[i]);
+            count_evaluation(shape, status[i], errors[i], share);
+        }
+    }
+    return num_ok;
+}
+
+/**
+ * Parse a given expression into plan. The plan refers into expr, which must
+ * outlive it.
+ * @return 1 if expression is syntactically valid, 0 otherwise
+ */
+extern "C" int Calc::compile(const char *expr, Plan &plan) {
+    return parse(expr, plan);
+}
+
+/**
+ * Evaluate a parsed expression, storing into its target if it is an assignment
+ * @return 1 if successfully evaluated, 0 otherwise
+ */
+extern "C" int Calc::exec(const Plan &plan, int &result) {
+    return run(plan, result, ThreadStats::start());
+}
+
+/**
+ * Evaluate a parsed expression as exec does, counting it in the statistics
+ * if they were on at start, when its evaluation began
+ * @return 1 if successfully evaluated, 0 otherwise
+ */
+extern "C" int Calc::run(const Plan &plan, int &result, uint64_t start) {
+    uint64_t lsn = 0;
+    int ok;
+
+    if (lock_free_vars != NULL)
+    {
+        TraceRing::begin(CALC_TRACE_EVALUATE, 1);
+        ok = eval_plan(plan, result, lsn);      // every variable access is a single atomic operation
+        TraceRing::end(CALC_TRACE_EVALUATE, 1);
+    } else {
+        ShardLock locked[MAX_PLAN_VARS];
+        TraceRing::begin(CALC_TRACE_LOCK, 0);
+        int num_locked = lock_shards(plan, false, locked);
+        TraceRing::end(CALC_TRACE_LOCK, num_locked);
+
+        TraceRing::begin(CALC_TRACE_EVALUATE, 1);
+        ok = eval_plan(plan, result, lsn);
+
+        unlock_shards(locked, num_locked);
+        TraceRing::end(CALC_TRACE_EVALUATE, 1);
+        feed_assigned();
+    }
+
+    CalcError error = eval_error;
+    if (lsn != 0 && !commit_or_defer(lsn))
+    {
+        ok = 0;         // the log could not be written, so the assignment was undone
+        error = CALC_ERROR_LOG;
+    }
+
+    if (start != 0)
+    {
+        count_evaluation(plan_shape(plan), ok, error, ThreadStats::now_ns() - start);
+    }
+    return ok;
+}
+
+/**
+ * Make the assignments up to log position lsn durable before their results
+ * are reported, or if this thread defers commits, note lsn for
+ * calc_take_commit and leave that to the caller
+ * @return true on success, false if the log failed and they were undone
+ */
+extern "C" bool Calc::commit_or_defer(uint64_t lsn) {
+    if (!defer_commits)
+    {
+        return commit(wal, lsn);
+    }
+
+    for (auto &deferred : deferred_commits)
+    {
+        if (deferred.first == this)
+        {
+            deferred.second = std::max(deferred.second, lsn);
+            return true;
+        }
+    }
+    deferred_commits.emplace_back(this, lsn);
+    return true;
+}
+
+/**
+ * Check whether the assignments up to log position lsn are durable
+ * @return 1 if they are (or there is no log), -1 if the log failed first
+ *         and they were undone, 0 if not yet
+ */
+extern "C" int Calc::commitStatus(uint64_t lsn) {
+    return wal != NULL ? wal->status(lsn) : 1;
+}
+
+/**
+ * Have the log's flusher make the assignments up to lsn durable, then
+ * wake notifier's loop
+ * @return commitStatus(lsn); only if that is 0 is the loop woken later
+ */
+extern "C" int Calc::notifyCommit(uint64_t lsn, CalcNotifier *notifier) {
+    if (wal == NULL)
+    {
+        return 1;
+    }
+
+    pthread_mutex_lock(&notifier->lock);
+    notifier->refs++;       // for the notification, until it is given
+    pthread_mutex_unlock(&notifier->lock);
+    int status = wal->notify(lsn, [notifier]() { notifier_fire(notifier); });
+    if (status != 0)
+    {
+        notifier_release(notifier);     // nothing to wait for
+    }
+    return status;
+}
+
+/**
+ * Get the entry of a variable, interning it if it does not exist yet
+ * @return the entry, or NULL if name is not a valid variable name
+ */
+extern "C" VarEntry *Calc::var(std::string_view name) {
+    if (name.empty() || is_variable(name) == 0)
+    {
+        return NULL;
+    }
+
+    uint64_t hash = VarTable::hash(name);
+    if (lock_free_vars != NULL)
+    {
+        return lock_free_vars->intern(name, hash);
+    }
+
+    Shard &shard = shard_for(hash);
+    pthread_rwlock_wrlock(&shard.lock);
+    VarEntry *entry = shard.vars.intern(name, hash);
+    pthread_rwlock_unlock(&shard.lock);
+    return entry;
+}
+
+/**
+ * Turn a postfix program over resolved variables into a plan and execute
+ * it, checking first that every instruction has its operands and that
+ * exactly one value is left at the end
+ * @return 1 if successfully evaluated, 0 otherwise
+ */
+extern "C" int Calc::execProgram(VarEntry *target, const CalcInstr *code, size_t n, VarEntry *const *vars,
+                                 size_t num_vars, int &result) {
+    static const char ops[] = { 0, 0, '+', '-', '*', '/', '~' };   // Step op of each CalcOpcode
+    uint64_t start = ThreadStats::start();
+    Plan plan;
+    int depth = 0;
+
+    if (n == 0 || n > MAX_STEPS)
+    {
+        return count_invalid(start);
+    }
+
+    plan.assign = target != NULL;
+    plan.target_slot = target;
+    if (target != NULL)
+    {
+        plan.target = target->get_name();
+        plan.target_hash = target->hash;
+    }
+    plan.num_steps = (int) n;
+    plan.num_vars = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        Step &step = plan.steps[i];
+        switch (code[i].op)
+        {
+        case CALC_OP_PUSH_INT:
+            step.operand.kind = Operand::INT;
+            step.operand.value = code[i].operand;
+            depth++;
+            break;
+        case CALC_OP_PUSH_VAR:
+        {
+            if (code[i].operand < 0 || (size_t) code[i].operand >= num_vars || vars[code[i].operand] == NULL)
+            {
+                return count_invalid(start);        // no such variable
+            }
+            VarEntry *entry = vars[code[i].operand];
+            step.operand.kind = Operand::VAR;
+            step.operand.name = entry->name;
+            step.operand.name_len = entry->name_len;
+            step.operand.hash = entry->hash;
+            step.operand.slot = entry;
+            plan.num_vars++;
+            depth++;
+            break;
+        }
+        case CALC_OP_ADD:
+        case CALC_OP_SUB:
+        case CALC_OP_MUL:
+        case CALC_OP_DIV:
+            if (depth < 2)
+            {
+                return count_invalid(start);
+            }
+            depth--;
+            break;
+        case CALC_OP_NEG:
+            if (depth < 1)
+            {
+                return count_invalid(start);
+            }
+            break;
+        default:
+            return count_invalid(start);        // unknown opcode
+        }
+        step.op = ops[code[i].op];
+    }
+
+    if (depth != 1)
+    {
+        return count_invalid(start);        // the program must leave exactly its result
+    }
+    return run(plan, result, start);
+}
+
+/**
+ * Lock every shard holding a variable of plan, in increasing shard order so
+ * that two expressions can never wait on each other. Only the target's shard
+ * is modified, so it alone is locked exclusively unless all_write is set.
+ * @return the number of shards locked, which are stored into locked
+ */
+extern "C" int Calc::lock_shards(const Plan &plan, bool all_write, ShardLock *locked) {
+    if (num_shards == 1)
+    {
+        if (!plan.assign && plan.num_vars == 0)
+        {
+            return 0;       // literals only, nothing to lock
+        }
+        locked[0] = { 0, plan.assign || all_write };
+        return lock_shards_sorted(locked, 1);
+    }
+
+    int num_locked = plan_shards(plan, all_write, locked);
+    num_locked = sort_shards(locked, num_locked);
+    return lock_shards_sorted(locked, num_locked);
+}
+
+/**
+ * List the shards holding the variables of plan, unsorted and possibly
+ * repeated. The target's shard, or every shard if all_write is set, is
+ * marked for writing.
+ * @return the number of shards stored into wanted, at most MAX_PLAN_VARS
+ */
+extern "C" int Calc::plan_shards(const Plan &plan, bool all_write, ShardLock *wanted) {
+    int num_wanted = 0;
+
+    if (plan.assign)
+    {
+        wanted[num_wanted++] = { (uint32_t) (&shard_for(plan.target_hash) - shards), true };
+    }
+    for (int i = 0; i < plan.num_steps; i++)
+    {
+        const Step &step = plan.steps[i];
+        if (step.op == 0 && step.operand.kind == Operand::VAR)
+        {
+            wanted[num_wanted++] = { (uint32_t) (&shard_for(step.operand.hash) - shards), all_write };
+        }
+    }
+
+    return num_wanted;
+}
+
+/**
+ * Sort shards by index in place, merging a shard listed more than once
+ * (it is written if any listing writes it)
+ * @return the number of distinct shards
+ */
+extern "C" int Calc::sort_shards(ShardLock *wanted, int num_wanted) {
+    std::sort(wanted, wanted + num_wanted, [](const ShardLock &a, const ShardLock &b) {
+        return a.index < b.index;
+    });
+
+    int num_distinct = 0;
+    for (int i = 0; i < num_wanted; i++)
+    {
+        if (num_distinct > 0 && wanted[num_distinct - 1].index == wanted[i].index)
+        {
+            wanted[num_distinct - 1].write = wanted[num_distinct - 1].write || wanted[i].write;
+        } else {
+            wanted[num_distinct++] = wanted[i];
+        }
+    }
+
+    return num_distinct;
+}
+
+/**
+ * Lock shards already sorted by index. With lock statistics on, each shard
+ * is first tried without blocking, and the clock is read only around the
+ * waits for those that are busy.
+ * @return num_locked
+ */
+extern "C" int Calc::lock_shards_sorted(const ShardLock *locked, int num_locked) {
+    if (num_locked == 0 || !ThreadStats::locks_enabled.load(std::memory_order_relaxed))
+    {
+        for (int i = 0; i < num_locked; i++)
+        {
+            if (locked[i].write)
+            {
+                pthread_rwlock_wrlock(&shards[locked[i].index].lock);
+            } else {
+                pthread_rwlock_rdlock(&shards[locked[i].index].lock);
+            }
+        }
+        return num_locked;
+    }
+
+    bool contended = false;
+    uint64_t wait_ns = 0;
+    for (int i = 0; i < num_locked; i++)
+    {
+        pthread_rwlock_t *lock = &shards[locked[i].index].lock;
+        if ((locked[i].write ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock)) != 0)
+        {
+            uint64_t start = ThreadStats::now_ns();
+            if (locked[i].write)
+            {
+                pthread_rwlock_wrlock(lock);
+            } else {
+                pthread_rwlock_rdlock(lock);
+            }
+            wait_ns += ThreadStats::now_ns() - start;
+            contended = true;
+        }
+    }
+    shards_locked_at = ThreadStats::now_ns();
+    ThreadStats::locked(contended, wait_ns);
+
+    return num_locked;
+}
+
+/**
+ * Unlock shards locked by lock_shards, counting how long they were held if
+ * their locking was timed
+ */
+extern "C" void Calc::unlock_shards(const ShardLock *locked, int num_locked) {
+    if (num_locked > 0 && shards_locked_at != 0)
+    {
+        ThreadStats::released(ThreadStats::now_ns() - shards_locked_at);
+        shards_locked_at = 0;
+    }
+
+    for (int i = num_locked - 1; i >= 0; i--)
+    {
+        pthread_rwlock_unlock(&shards[locked[i].index].lock);
+    }
+}
+
+/**
+ * Pick the shard for a variable from the top bits of its hash. The low bits
+ * choose the bucket within a shard, so they must not pick the shard too.
+ * @return the shard that holds the variable
+ */
+extern "C" Shard &Calc::shard_for(uint64_t hash) {
+    return shards[((hash >> 32) * num_shards) >> 32];
+}
+
+/**
+ * Evaluate a parsed expression without taking the lock. An assignment that
+ * is logged sets lsn to the position its record must reach before the
+ * caller reports success; otherwise lsn is left alone.
+ * @return 1 if successfully evaluated, 0 otherwise
+ */
+extern "C" int Calc::eval_plan(const Plan &plan, int &result, uint64_t &lsn) {
+    int stack[MAX_STEPS];       // a plan never pushes more values than it has steps
+    int top = 0;
+
+    for (int i = 0; i < plan.num_steps; i++)
+    {
+        const Step &step = plan.steps[i];
+        if (step.op == 0)
+        {
+            if (load_operand(step.operand, stack[top]) == 0)
+            {
+                eval_error = CALC_ERROR_UNDEFINED;
+                return 0;       // undefined variable
+            }
+            top++;
+        }
+        else if (step.op == '~')
+        {
+            stack[top - 1] = (int) (0u - (unsigned) stack[top - 1]);
+        }
+        else
+        {
+            top--;
+            if (apply_op(step.op, stack[top - 1], stack[top], stack[top - 1]) == 0)
+            {
+                eval_error = CALC_ERROR_DIVIDE_BY_ZERO;
+                return 0;       // attempt to divide by 0
+            }
+        }
+    }
+    int value = stack[0];
+
+    if (plan.assign && read_only)
+    {
+        eval_error = CALC_ERROR_READ_ONLY;
+        return 0;       // only calc_apply_records assigns
+    }
+    if (plan.assign)
+    {
+        VarEntry *target = plan.target_slot;
+        if (target == NULL)
+        {
+            target = intern_var(plan.target, plan.target_hash);        // insert target if it does not exist
+        }
+        if (lock_free_vars == NULL)
+        {
+            track(shard_for(plan.target_hash), target);
+        }
+        if (wal != NULL)
+        {
+            lsn = wal->store(target, value);
+            if (lsn == 0)
+            {
+                eval_error = CALC_ERROR_LOG;
+                return 0;       // the log failed, so nothing more is assigned
+            }
+        } else {
+            target->store(value);
+        }
+        if (feed != NULL)
+        {
+            // fed once the shard is unlocked; the outbox keeps this variable's records in order
+            Shard &shard = shard_for(plan.target_hash);
+            pthread_mutex_lock(&shard.outbox_lock);
+            Wal::encode(shard.outbox, target->get_name(), value);
+            pthread_mutex_unlock(&shard.outbox_lock);
+            if (assigned_outboxes.empty() || assigned_outboxes.back() != &shard)
+            {
+                assigned_outboxes.push_back(&shard);
+            }
+        }
+    }
+
+    result = value;
+    return 1;
+}
+
+/**
+ * Intern every variable in plan so that exec does not have to look them up.
+ * Variables that are not yet defined get undefined entries.
+ */
+extern "C" void Calc::resolve(Plan &plan) {
+    ShardLock locked[MAX_PLAN_VARS];
+    int num_locked = 0;
+
+    if (lock_free_vars == NULL)
+    {
+        num_locked = lock_shards(plan, true, locked);      // interning may add entries to any of them
+    }
+
+    if (plan.assign)
+    {
+        plan.target_slot = intern_var(plan.target, plan.target_hash);
+    }
+    for (int i = 0; i < plan.num_steps; i++)
+    {
+        Operand &operand = plan.steps[i].operand;
+        if (plan.steps[i].op == 0 && operand.kind == Operand::VAR)
+        {
+            operand.slot = intern_var(operand.get_name(), operand.hash);
+        }
+    }
+
+    unlock_shards(locked, num_locked);
+}
+
+/**
+ * Look up a variable in the lock-free table if there is one, otherwise in
+ * its shard, which the caller has locked
+ * @return the entry, or NULL if name was never interned
+ */
+extern "C" VarEntry *Calc::find_var(std::string_view name, uint64_t hash) {
+    if (lock_free_vars != NULL)
+    {
+        return lock_free_vars->find(name, hash);
+    }
+    return shard_for(hash).vars.find(name, hash);
+}
+
+/**
+ * Intern a variable in the lock-free table if there is one, otherwise in
+ * its shard, which the caller has locked for writing
+ * @return the entry for name
+ */
+extern "C" VarEntry *Calc::intern_var(std::string_view name, uint64_t hash) {
+    if (lock_free_vars != NULL)
+    {
+        return lock_free_vars->intern(name, hash);
+    }
+    return shard_for(hash).vars.intern(name, hash);
+}
+
+/**
+ * Get the precedence of a binary operator
+ * @return 2 for '*' and '/', 1 for '+' and '-', 0 if token is not one of them
+ */
+static int precedence(const Token &tok) {
+    if (tok.kind != Token::OP)
+    {
+        return 0;
+    }
+    switch (tok.text[0])
+    {
+    case '*':
+    case '/':
+        return 2;
+    case '+':
+    case '-':
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Parse an expression of the form [VAR =] expr into plan, where expr uses
+ * + - * / with the usual precedence and associativity, parentheses and
+ * unary minus. Nothing is allocated: the plan has room for MAX_STEPS steps
+ * and parentheses may nest MAX_DEPTH deep.
+ * @return 1 if expr is a valid expression that fits, 0 otherwise
+ */
+extern "C" int Calc::parse(const char *expr, Plan &plan) {
+    Lexer lex;
+    lex.p = expr;
+    lex.end = expr + strlen(expr);      // lets the lexer read digits eight at a time
+
+    plan.assign = false;
+    plan.target_slot = NULL;
+    plan.num_steps = 0;
+    plan.num_vars = 0;
+
+    next_token(lex);
+
+    // VAR = ...
+    if (lex.tok.kind == Token::VAR)
+    {
+        Lexer after = lex;
+        next_token(after);
+        if (after.tok.kind == Token::OP && after.tok.text[0] == '=')
+        {
+            plan.assign = true;
+            plan.target = lex.tok.text;
+            plan.target_hash = VarTable::hash(lex.tok.text);
+            lex = after;
+            next_token(lex);
+        }
+    }
+
+    if (parse_binary(lex, plan, 1, 0) == 0)
+    {
+        return 0;
+    }
+
+    return lex.tok.kind == Token::END;       // anything left over is a syntax error
+}
+
+/**
+ * Parse an operand followed by any binary operators of precedence at least
+ * min_prec and their right-hand sides (precedence climbing)
+ * @return 1 if successfully parsed, 0 otherwise
+ */
+extern "C" int Calc::parse_binary(Lexer &lex, Plan &plan, int min_prec, int depth) {
+    if (parse_unary(lex, plan, depth) == 0)
+    {
+        return 0;
+    }
+
+    int prec;
+    while ((prec = precedence(lex.tok)) >= min_prec && prec > 0)
+    {
+        char op = lex.tok.text[0];
+        next_token(lex);
+
+        // operators are left-associative, so the right side binds tighter
+        if (parse_binary(lex, plan, prec + 1, depth) == 0 || add_step(plan, op) == NULL)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Parse an integer, a variable, a parenthesized expression or a negation
+ * of one of those
+ * @return 1 if successfully parsed, 0 otherwise
+ */
+extern "C" int Calc::parse_unary(Lexer &lex, Plan &plan, int depth) {
+    if (depth > MAX_DEPTH)
+    {
+        return 0;       // nested too deeply
+    }
+
+    bool negative = false;
+    if (lex.tok.kind == Token::OP && lex.tok.text[0] == '-')
+    {
+        const char *minus = lex.tok.text.data();
+        next_token(lex);
+
+        if (lex.tok.kind == Token::INT && lex.tok.text.data() == minus + 1)
+        {
+            negative = true;        // a minus sign right before digits is part of the literal, so INT_MIN can be written
+        }
+        else
+        {
+            return parse_unary(lex, plan, depth + 1) == 1 && add_step(plan, '~') != NULL;
+        }
+    }
+
+    if (lex.tok.kind == Token::OP && lex.tok.text[0] == '(')
+    {
+        next_token(lex);
+        if (parse_binary(lex, plan, 1, depth + 1) == 0)
+        {
+            return 0;
+        }
+        if (lex.tok.kind != Token::OP || lex.tok.text[0] != ')')
+        {
+            return 0;       // unbalanced parenthesis
+        }
+        next_token(lex);
+        return 1;
+    }
+
+    if (lex.tok.kind != Token::INT && lex.tok.kind != Token::VAR)
+    {
+        return 0;       // operand expected
+    }
+
+    Step *step = add_step(plan, 0);
+    if (step == NULL || parse_operand(lex.tok, negative, step->operand) == 0)
+    {
+        return 0;
+    }
+    if (step->operand.kind == Operand::VAR)
+    {
+        plan.num_vars++;
+    }
+
+    next_token(lex);
+    return 1;
+}
+
+/**
+ * Append a step with the given op to plan
+ * @return the new step, or NULL if plan already has MAX_STEPS steps
+ */
+extern "C" Step *Calc::add_step(Plan &plan, char op) {
+    if (plan.num_steps == MAX_STEPS)
+    {
+        return NULL;
+    }
+
+    Step *step = &plan.steps[plan.num_steps++];
+    step->op = op;
+    return step;
+}
+
+/**
+ * Convert an integer or variable token to an operand
+ * @return 1 if token is a valid operand, 0 if it is not or is out of range
+ */
+extern "C" int Calc::parse_operand(const Token &tok, bool negative, Operand &operand) {
+    if (tok.kind == Token::INT)
+    {
+        if (tok.magnitude > (negative ? 2147483648ull : 2147483647ull))
+        {
+            return 0;       // does not fit in an int
+        }
+        operand.kind = Operand::INT;
+        operand.value = (int) (negative ? 0u - (unsigned) tok.magnitude : (unsigned) tok.magnitude);
+    }
+    else if (tok.kind == Token::VAR)
+    {
+        operand.kind = Operand::VAR;
+        operand.name = tok.text.data();
+        operand.name_len = (uint32_t) tok.text.size();
+        operand.hash = VarTable::hash(tok.text);       // the only time this name is hashed
+        operand.slot = NULL;
+    }
+    else
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Get the value of an operand. Unresolved variables are looked up in the
+ * variable table by their precomputed hash.
+ * @return 1 if operand has a value, 0 if it is an undefined variable
+ */
+extern "C" int Calc::load_operand(const Operand &operand, int &value) {
+    if (operand.kind == Operand::INT)
+    {
+        value = operand.value;
+        return 1;
+    }
+
+    VarEntry *entry = operand.slot;
+    if (entry == NULL)
+    {
+        entry = find_var(operand.get_name(), operand.hash);
+        if (entry == NULL && base != NULL)
+        {
+            return base->find(operand.get_name(), value) ? 1 : 0;      // never assigned since the snapshot
+        }
+    }
+    if (entry == NULL || !entry->load(value))
+    {
+        return 0;       // variable not found
+    }
+
+    return 1;
+}
+
+/**
+ * Scan the token that starts at lex.p into lex.tok. A token is a run of
+ * letters, a run of digits, or a single operator or parenthesis; whitespace
+ * between tokens is skipped.
+ */
+extern "C" void Calc::next_token(Lexer &lex) {
+    const char *p = lex.p;
+    while (isspace((unsigned char) *p))
+    {
+        p++;        // skip whitespace before the token
+    }
+
+    const char *start = p;
+    if (*p == '\0')
+    {
+        lex.tok.kind = Token::END;
+    }
+    else if (isalpha((unsigned char) *p))
+    {
+        while (isalpha((unsigned char) *p))
+        {
+            p++;
+        }
+        lex.tok.kind = Token::VAR;
+    }
+    else if (isdigit((unsigned char) *p))
+    {
+        p = scan_integer(p, lex.end, lex.tok.magnitude);
+        lex.tok.kind = Token::INT;
+    }
+    else
+    {
+        lex.tok.kind = strchr("+-*/=()", *p) != NULL ? Token::OP : Token::BAD;
+        p++;
+    }
+
+    lex.tok.text = std::string_view(start, p - start);
+    lex.p = p;
+}
+
+/**
+ * Check whether given operand is a valid variable
+ * @return 1 is valid variable, 0 otherwise
+ */
+extern "C" int Calc::is_variable(std::string_view operand) {
+    for (char c : operand)
+    {
+        if (isalpha((unsigned char) c) == 0)
+        {
+            return 0;       // operand is not valid variable
+        }
+    }
+
+    return 1;       // operand is variable
+}
+
+/**
+ * Check whether a given variable exists in the variable table
+ * @return 1 if exist, 0 otherwise
+ */
+extern "C" int Calc::var_exist(std::string_view var) {
+    int value;
+    Plan plan;
+
+    plan.assign = false;
+    plan.num_steps = 1;
+    plan.num_vars = 1;
+    plan.steps[0].op = 0;
+
+    Token tok;
+    tok.kind = Token::VAR;
+    tok.text = var;
+    if (is_variable(var) == 1 && parse_operand(tok, false, plan.steps[0].operand) == 1 && exec(plan, value) == 1)
+    {
+        return 1;       // variable found
+    }
+    
+    return 0;       // variable not found
+}
+
+/**
+ * Replay the log at path into the variables, then log every later
+ * assignment to it
+ * @return the number of assignments replayed, or -1 if the log can't be used
+ */
+extern "C" int Calc::openWal(const char *path, unsigned interval_us) {
+    if (wal != NULL)
+    {
+        return -1;      // already logging
+    }
+
+    int replayed = 0;
+    wal = Wal::open(path, interval_us, [this, &replayed](std::string_view name, int value) {
+        VarEntry *entry = var(name);
+        if (entry != NULL)
+        {
+            if (lock_free_vars == NULL)
+            {
+                track(shard_for(entry->hash), entry);       // only the log has it
+            }
+            entry->store(value);
+            replayed++;
+        }
+    });
+    return wal != NULL ? replayed : -1;
+}
+
+/**
+ * Map the snapshot at path as the values of every variable not assigned
+ * since. Only a calculator with no variables yet can load one.
+ * @return the number of variables in the snapshot, or -1 on error
+ */
+extern "C" long Calc::loadSnapshot(const char *path) {
+    uint32_t num_vars = lock_free_vars != NULL ? lock_free_vars->size() : 0;
+    for (uint32_t i = 0; i < num_shards; i++)
+    {
+        num_vars += shards[i].vars.size();
+    }
+    if (num_vars != 0 || base != NULL || wal != NULL)
+    {
+        return -1;
+    }
+
+    base = Snapshot::open(path);
+    if (base == NULL)
+    {
+        return -1;
+    }
+    checkpoint_seq = base->seq();
+    if (lock_free_vars != NULL)
+    {
+        lock_free_vars->set_base(base);
+    }
+    for (uint32_t i = 0; i < num_shards; i++)
+    {
+        shards[i].vars.set_base(base);
+    }
+    return (long) base->size();
+}
+
+/**
+ * Write every defined variable to a snapshot at path, replacing it. Reads
+ * go on meanwhile, but assignments wait, so the snapshot is the state at
+ * one point in time; in lock-free mode that holds only if there is a log.
+ * The log, if any, is emptied, since the snapshot covers it, and so are
+ * the changes waiting for the next checkpoint.
+ * @return the number of variables written, or -1 on error, with the number
+ *         of the last checkpoint the snapshot covers stored into seq
+ */
+extern "C" long Calc::saveSnapshot(const char *path, uint64_t &seq) {
+    pthread_mutex_lock(&checkpoint_lock);
+    seq = checkpoint_seq;
+    std::vector<ShardLock> locked;
+    lock_all(locked);
+
+    long count = -1;
+    auto save = [this, path, &count]() { return write_snapshot(path, count); };
+    if (wal != NULL)
+    {
+        wal->checkpoint(save);      // its lock keeps out lock-free assignments too
+    } else {
+        save();
+    }
+
+    for (uint32_t i = 0; count >= 0 && i < num_shards; i++)
+    {
+        for (VarEntry *entry : shards[i].dirty)
+        {
+            entry->dirty = false;
+        }
+        shards[i].dirty.clear();
+    }
+
+    unlock_shards(locked.data(), (int) num_shards);
+    pthread_mutex_unlock(&checkpoint_lock);
+    return count;
+}
+
+/**
+ * Merge the variables in memory with those of the base snapshot that were
+ * never interned, in name order, and write them as a snapshot
+ * @return true on success, with the number of variables stored into count
+ */
+extern "C" bool Calc::write_snapshot(const char *path, long &count) {
+    std::vector<std::pair<std::string_view, int>> vars;
+    collect_vars(vars);
+    if (!Snapshot::write(path, checkpoint_seq, vars))
+    {
+        return false;
+    }
+    count = (long) vars.size();
+    return true;
+}
+
+/**
+ * List the variables in memory, merged with those of the base snapshot
+ * that were never interned, in name order. Names point into the tables
+ * and the snapshot.
+ */
+extern "C" void Calc::collect_vars(std::vector<std::pair<std::string_view, int>> &vars) {
+    std::vector<VarEntry *> entries;
+    if (lock_free_vars != NULL)
+    {
+        lock_free_vars->collect(entries);
+    }
+    for (uint32_t i = 0; i < num_shards; i++)
+    {
+        for (uint32_t id = 0; id < shards[i].vars.size(); id++)
+        {
+            entries.push_back(shards[i].vars.get(id));
+        }
+    }
+
+    for (VarEntry *entry : entries)
+    {
+        int value;
+        if (entry->load(value))
+        {
+            vars.emplace_back(entry->get_name(), value);
+        }
+    }
+    std::sort(vars.begin(), vars.end());
+
+    if (base != NULL)
+    {
+        // an interned variable took its base value, so memory wins ties
+        std::vector<std::pair<std::string_view, int>> merged;
+        merged.reserve(vars.size() + base->size());
+        size_t i = 0;
+        for (uint64_t j = 0; j < base->size(); j++)
+        {
+            std::string_view name = base->name(j);
+            while (i < vars.size() && vars[i].first < name)
+            {
+                merged.push_back(vars[i++]);
+            }
+            if (i < vars.size() && vars[i].first == name)
+            {
+                continue;
+            }
+            merged.emplace_back(name, base->value(j));
+        }
+        merged.insert(merged.end(), vars.begin() + i, vars.end());
+        vars.swap(merged);
+    }
+}
+
+/**
+ * Read-lock every shard, which waits for running assignments and keeps
+ * new ones out; release them with unlock_shards
+ */
+extern "C" void Calc::lock_all(std::vector<ShardLock> &locked) {
+    locked.resize(num_shards);
+    for (uint32_t i = 0; i < num_shards; i++)
+    {
+        locked[i] = { i, false };
+    }
+    lock_shards_sorted(locked.data(), (int) num_shards);
+}
+
+/**
+ * Record that entry, in shard, is being assigned; the caller holds the
+ * shard exclusively. If a checkpoint began but has not yet copied the
+ * shard's changed values, they are copied first, before this assignment
+ * overwrites one of them.
+ */
+extern "C" void Calc::track(Shard &shard, VarEntry *entry) {
+    if (shard.capture_pending)
+    {
+        capture(shard);
+    }
+    if (!entry->dirty)
+    {
+        entry->dirty = true;
+        shard.dirty.push_back(entry);
+    }
+}
+
+/**
+ * Move the shard's dirty entries, with their current values, to captured
+ * for the running checkpoint
+ */
+extern "C" void Calc::capture(Shard &shard) {
+    for (VarEntry *entry : shard.dirty)
+    {
+        int value;
+        entry->load(value);     // dirty entries have been assigned, so are defined
+        shard.captured.emplace_back(entry, value);
+        entry->dirty = false;
+    }
+    shard.dirty.clear();
+    shard.capture_pending = false;
+}
+
+/**
+ * Get the time of a monotonic clock
+ * @return the time in seconds
+ */
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Write the variables assigned since the last checkpoint, as of one point
+ * in time, to a checkpoint file at path. Every shard is read-locked just
+ * long enough to mark it for capture and rotate the log; the values are
+ * then copied shard by shard, and written with no lock held.
+ * @return 1 if a checkpoint was written, 0 if nothing changed, or -1
+ *         (with errno set) on error
+ */
+extern "C" int Calc::checkpoint(const char *path, CalcCheckpointStats &stats) {
+    if (lock_free_vars != NULL)
+    {
+        errno = ENOTSUP;        // with no locks, assignments can't be captured consistently
+        return -1;
+    }
+    double start = now_seconds();
+    pthread_mutex_lock(&checkpoint_lock);
+
+    // no assignment is running while every shard is read-locked
+    double pause_start = now_seconds();
+    std::vector<ShardLock> locked;
+    lock_all(locked);
+
+    bool changed = false;
+    for (uint32_t i = 0; i < num_shards; i++)
+    {
+        changed = changed || !shards[i].dirty.empty();
+    }
+    uint64_t segment = 0;
+    if (changed && wal != NULL)
+    {
+        segment = wal->rotate();
+    }
+    bool ok = wal == NULL || segment != 0;
+    for (uint32_t i = 0; changed && ok && i < num_shards; i++)
+    {
+        shards[i].capture_pending = true;
+    }
+    unlock_shards(locked.data(), (int) num_shards);
+    double pause = now_seconds() - pause_start;
+
+    if (!changed || !ok)
+    {
+        pthread_mutex_unlock(&checkpoint_lock);
+        return changed ? -1 : 0;
+    }
+    int saved = 0;
+    if (wal != NULL && !wal->finish_rotate())
+    {
+        ok = false;
+        saved = errno;
+    }
+
+    std::vector<std::pair<VarEntry *, int>> captured;
+    for (uint32_t i = 0; i < num_shards; i++)
+    {
+        Shard &shard = shards[i];
+        pthread_rwlock_rdlock(&shard.lock);     // keeps assignments out, and nothing else writes these
+        if (shard.capture_pending)
+        {
+            capture(shard);
+        }
+        captured.insert(captured.end(), shard.captured.begin(), shard.captured.end());
+        shard.captured.clear();
+        pthread_rwlock_unlock(&shard.lock);
+    }
+
+    std::vector<std::pair<std::string_view, int>> vars;
+    vars.reserve(captured.size());
+    for (const auto &var : captured)
+    {
+        vars.emplace_back(var.first->get_name(), var.second);
+    }
+    std::sort(vars.begin(), vars.end());
+
+    uint64_t bytes = 0;
+    if (ok && !Snapshot::write(path, checkpoint_seq + 1, vars, &bytes))
+    {
+        ok = false;
+        saved = errno;
+    }
+    if (!ok)
+    {
+        // keep the changes, and the log segment, for the next checkpoint
+        for (const auto &var : captured)
+        {
+            Shard &shard = shard_for(var.first->hash);
+            pthread_rwlock_wrlock(&shard.lock);
+            track(shard, var.first);
+            pthread_rwlock_unlock(&shard.lock);
+        }
+        pthread_mutex_unlock(&checkpoint_lock);
+        errno = saved;
+        return -1;
+    }
+
+    if (wal != NULL)
+    {
+        wal->release(segment);
+    }
+    checkpoint_seq++;
+    stats.seq = checkpoint_seq;
+    stats.variables = vars.size();
+    stats.bytes = bytes;
+    stats.pause_seconds = pause;
+    stats.seconds = now_seconds() - start;
+    pthread_mutex_unlock(&checkpoint_lock);
+    return 1;
+}
+
+/**
+ * Assign the variables of the checkpoint file at path, which must be the
+ * next one after the last checkpoint written or applied
+ * @return the number of variables assigned, or -1 (with errno set) on error
+ */
+extern "C" long Calc::applyCheckpoint(const char *path) {
+    Snapshot *delta = Snapshot::open(path);
+    if (delta == NULL)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&checkpoint_lock);
+    if (delta->seq() != checkpoint_seq + 1)
+    {
+        pthread_mutex_unlock(&checkpoint_lock);
+        delete delta;
+        errno = EINVAL;
+        return -1;
+    }
+
+    long count = 0;
+    for (uint64_t i = 0; i < delta->size(); i++)
+    {
+        VarEntry *entry = var(delta->name(i));
+        if (entry != NULL)
+        {
+            entry->store(delta->value(i));     // already durable, so not dirty
+            count++;
+        }
+    }
+    checkpoint_seq = delta->seq();
+    pthread_mutex_unlock(&checkpoint_lock);
+    delete delta;
+    return count;
+}
+
+/**
+ * Get the number of the last checkpoint written or applied, or of the one
+ * the loaded snapshot includes
+ * @return the number, 0 if there is none
+ */
+extern "C" uint64_t Calc::checkpointSeq() {
+    pthread_mutex_lock(&checkpoint_lock);
+    uint64_t seq = checkpoint_seq;
+    pthread_mutex_unlock(&checkpoint_lock);
+    return seq;
+}
+
+/**
+ * Pass the records that this thread's assignments appended to outboxes to
+ * the feed, with no shard locked. Each outbox is drained by one thread at
+ * a time, so records reach the feed in the order of their assignments.
+ */
+extern "C" void Calc::feed_assigned() {
+    for (Shard *shard : assigned_outboxes)
+    {
+        drain_outbox(*shard);
+    }
+    assigned_outboxes.clear();
+}
+
+/**
+ * Pass a shard's outbox to the feed until it is empty. If another thread
+ * is already doing so, it passes this thread's records on too: it checks
+ * the outbox again after letting go of feeding.
+ */
+extern "C" void Calc::drain_outbox(Shard &shard) {
+    static thread_local std::string records;
+
+    while (pthread_mutex_trylock(&shard.feeding) == 0)
+    {
+        while (true)
+        {
+            records.clear();
+            pthread_mutex_lock(&shard.outbox_lock);
+            records.swap(shard.outbox);
+            pthread_mutex_unlock(&shard.outbox_lock);
+            if (records.empty())
+            {
+                break;
+            }
+            if (feed != NULL)       // changes only with feeding held
+            {
+                feed(feed_arg, records.data(), records.size(), 0);
+            }
+        }
+        pthread_mutex_unlock(&shard.feeding);
+
+        pthread_mutex_lock(&shard.outbox_lock);
+        bool appended = !shard.outbox.empty();     // while this thread held feeding
+        pthread_mutex_unlock(&shard.outbox_lock);
+        if (!appended)
+        {
+            break;
+        }
+    }
+}
+
+/**
+ * Take every shard's feeding lock, waiting for threads passing outboxes to
+ * the feed. The caller has locked every shard, so no record is added.
+ */
+extern "C" void Calc::lock_feeding() {
+    for (uint32_t i = 0; i < num_shards; i++)
+    {
+        pthread_mutex_lock(&shards[i].feeding);
+    }
+}
+
+extern "C" void Calc::unlock_feeding() {
+    for (uint32_t i = 0; i < num_shards; i++)
+    {
+        pthread_mutex_unlock(&shards[i].feeding);
+    }
+}
+
+/**
+ * Pass every later assignment to feed, or stop if feed is NULL. The shards
+ * are locked meanwhile, so no assignment sees half of the change, and so
+ * are their outboxes' feeding locks, so the old feed is not called once
+ * this returns; records still in outboxes go to the new one.
+ * @return 0, or -1 for a lock-free calculator
+ */
+extern "C" int Calc::setFeed(CalcFeed feed, void *arg) {
+    if (lock_free_vars != NULL)
+    {
+        errno = ENOTSUP;        // an assignment could slip between its store and the feed
+        return -1;
+    }
+    std::vector<ShardLock> locked;
+    lock_all(locked);
+    lock_feeding();
+    this->feed = feed;
+    feed_arg = arg;
+    unlock_feeding();
+    unlock_shards(locked.data(), (int) num_shards);
+    return 0;
+}
+
+/**
+ * Pass a record of every defined variable to the feed in one call, with
+ * every shard read-locked so that no assignment is made meanwhile. The
+ * records still in outboxes are fed first, since the dump includes them.
+ * @return the number of variables, or -1 if there is no feed
+ */
+extern "C" long Calc::feedDump() {
+    if (lock_free_vars != NULL)
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+    std::vector<ShardLock> locked;
+    lock_all(locked);
+    if (feed == NULL)
+    {
+        unlock_shards(locked.data(), (int) num_shards);
+        errno = EINVAL;
+        return -1;
+    }
+
+    lock_feeding();
+    for (uint32_t i = 0; i < num_shards; i++)
+    {
+        if (!shards[i].outbox.empty())      // no other thread touches it now
+        {
+            feed(feed_arg, shards[i].outbox.data(), shards[i].outbox.size(), 0);
+            shards[i].outbox.clear();
+        }
+    }
+
+    std::vector<std::pair<std::string_view, int>> vars;
+    collect_vars(vars);
+    std::string records;
+    for (const auto &var : vars)
+    {
+        Wal::encode(records, var.first, var.second);
+    }
+    feed(feed_arg, records.data(), records.size(), 1);
+
+    unlock_feeding();
+    unlock_shards(locked.data(), (int) num_shards);
+    return (long) vars.size();
+}
+
+/**
+ * Assign the variables of the complete records at the start of records,
+ * each with its shard locked, bypassing read_only
+ * @return the size of those records, or -1 (with errno set) if one is corrupt
+ */
+extern "C" long Calc::applyRecords(const char *records, size_t len) {
+    bool corrupt;
+    size_t used = Wal::decode(std::string_view(records, len), [this](std::string_view name, int value) {
+        if (name.empty() || is_variable(name) == 0)
+        {
+            return;
+        }
+        uint64_t hash = VarTable::hash(name);
+        if (lock_free_vars != NULL)
+        {
+            lock_free_vars->intern(name, hash)->store(value);
+            return;
+        }
+        Shard &shard = shard_for(hash);
+        pthread_rwlock_wrlock(&shard.lock);
+        VarEntry *entry = shard.vars.intern(name, hash);
+        track(shard, entry);
+        entry->store(value);
+        pthread_rwlock_unlock(&shard.lock);
+    }, &corrupt);
+    if (corrupt)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return (long) used;
 }
@@ -1,29 +1,350 @@
 #ifndef CALC_H
 #define CALC_H
 
+#include <stddef.h>
+#include <stdint.h>
 
+/* Forward declaration of the struct Calc data type. */
+struct Calc;
+
+/* Opaque handle for an expression prepared by calc_compile. */
+struct CalcCompiled;
+
+/* Opaque handle for a variable of a calculator, see calc_var. */
+struct CalcVar;
+
+/* Operations of a postfix program run by calc_exec_program. */
+enum CalcOpcode {
+	CALC_OP_PUSH_INT,	/* push operand */
+	CALC_OP_PUSH_VAR,	/* push the value of vars[operand] */
+	CALC_OP_ADD,		/* pop two values, push their sum */
+	CALC_OP_SUB,		/* pop two values, push the first minus the second */
+	CALC_OP_MUL,		/* pop two values, push their product */
+	CALC_OP_DIV,		/* pop two values, push the first over the second */
+	CALC_OP_NEG		/* negate the top value */
+};
+
+/* One instruction of a program for calc_exec_program. */
+struct CalcInstr {
+	enum CalcOpcode op;
+	int operand;		/* the integer for PUSH_INT, an index into vars for PUSH_VAR */
+};
+
+/* How a calculator synchronizes threads that use it concurrently. */
+enum CalcConcurrency {
+	/*
+	 * Variables are split by name hash into num_shards shards, each with
+	 * its own reader/writer lock. An expression locks only the shards of
+	 * the variables it uses, so every statement is atomic.
+	 */
+	CALC_LOCKED,
+	/* No locks at all, see calc_create_lockfree. */
+	CALC_LOCK_FREE
+};
 
 /*
- * Note: you should NOT need to modify anything in this header file.
+ * Options for calc_create_ex. Initialize with calc_options_init before
+ * setting fields, so that fields added later get their defaults.
  */
-
-/* Forward declaration of the struct Calc data type. */
-struct Calc;
+struct CalcOptions {
+	enum CalcConcurrency concurrency;	/* default CALC_LOCKED */
+	unsigned num_shards;		/* CALC_LOCKED: default 1, at most 4096 */
+	unsigned num_buckets;		/* CALC_LOCK_FREE: 0 picks a default */
+	int read_only;			/* assignments fail, see calc_apply_records; default 0 */
+};
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /*
- * You should implement these functions in calc.c or calc.cpp
- * (according to whether you are programming in C or C++.)
- * If you define them in C++, make sure they have extern "C"
- * linkage.
+ * These functions are implemented in calc.cpp with extern "C" linkage.
+ * calc_eval returns 1 and stores the value into *result if expr could be
+ * evaluated, 0 otherwise. An expression is an optional "VAR =" followed by
+ * integers and variables combined with + - * / (usual precedence, left to
+ * right), unary minus and parentheses, up to 256 operands and operators.
  */
 struct Calc *calc_create(void);
+void calc_options_init(struct CalcOptions *opts);
+struct Calc *calc_create_ex(const struct CalcOptions *opts);
+
+/*
+ * Create a calculator that never takes a lock. Variables live in a hash
+ * table of num_buckets chains (0 picks a default); the bucket count is
+ * fixed, so size it for the expected number of variables. Each variable
+ * read and assignment is a single atomic operation, but an expression
+ * that reads several variables may see assignments made in between.
+ */
+struct Calc *calc_create_lockfree(unsigned num_buckets);
 void calc_destroy(struct Calc *calc);
 int calc_eval(struct Calc *calc, const char *expr, int *result);
 
+/*
+ * Evaluate exprs[0..n-1] in order, as if by calc_eval, while taking the
+ * calculator's locks only once for the whole batch. status[i] is set to 1
+ * and results[i] to the value if exprs[i] was evaluated, otherwise status[i]
+ * is set to 0. Returns the number of expressions evaluated successfully.
+ */
+int calc_eval_batch(struct Calc *calc, const char **exprs, size_t n, int *results, int *status);
+
+/*
+ * Prepared expressions. calc_compile tokenizes and parses expr once and
+ * returns a handle (or NULL if expr is not syntactically valid) that
+ * calc_exec can evaluate repeatedly against calc without any string
+ * handling. calc_exec returns the same result calc_eval would. A handle
+ * may be executed by several threads at once, and must be freed with
+ * calc_free_compiled before calc is destroyed.
+ */
+struct CalcCompiled *calc_compile(struct Calc *calc, const char *expr);
+int calc_exec(struct CalcCompiled *compiled, int *result);
+void calc_free_compiled(struct CalcCompiled *compiled);
+
+/*
+ * Programs that were parsed elsewhere, such as by a client. calc_var
+ * returns a handle for the variable name[0..len-1], creating it undefined
+ * if needed, or NULL if name is not a valid variable name; handles stay
+ * valid until calc is destroyed. calc_exec_program evaluates the postfix
+ * program code[0..n-1], whose PUSH_VAR operands index vars[0..num_vars-1],
+ * and stores the value into target unless target is NULL. It returns what
+ * calc_eval would for the same expression, and 0 for a malformed program
+ * or one longer than 256 instructions.
+ */
+struct CalcVar *calc_var(struct Calc *calc, const char *name, size_t len);
+int calc_exec_program(struct Calc *calc, struct CalcVar *target, const struct CalcInstr *code, size_t n,
+                      struct CalcVar *const *vars, size_t num_vars, int *result);
+
+/*
+ * Write-ahead log. calc_open_wal replays the assignments recorded in the
+ * file at path (creating it if needed) into calc, then appends every later
+ * successful assignment to it. An evaluation that assigns returns only
+ * once its record is on disk; evaluations running concurrently, and the
+ * expressions of one batch, share a single fsync (group commit). With
+ * commit_interval_us > 0 the syncing thread first waits that long for
+ * more records, trading latency for fewer syncs. If the file can't be
+ * written, the assignments not yet on disk evaluate as failed and are
+ * undone, each variable getting back the value it had before them, and
+ * later ones fail too until calc_save_snapshot empties the log.
+ * Returns the number of assignments replayed, or -1 if the file can't be
+ * used.
+ */
+int calc_open_wal(struct Calc *calc, const char *path, unsigned commit_interval_us);
+
+/* Wakes an event loop when deferred commits settle, see calc_defer_commits. */
+struct CalcNotifier;
+
+/*
+ * Deferred commits, for event loops that must not wait for the log.
+ * After calc_defer_commits(1), evaluations by the calling thread return
+ * once their assignments are logged but before they are on disk, and
+ * calc_take_commit(calc) then returns (and forgets) the highest log
+ * position those of calc reached, or 0 if none. The results must not be
+ * reported before calc_commit_status of that position returns 1 (on
+ * disk); -1 means the log failed first and the assignments were undone,
+ * and 0 that they are still waiting. calc_notify_commit returns the same,
+ * and if it is 0, has the log's background thread sync and then add to
+ * the eventfd of notifier, which calc_notifier_create(fd) makes and
+ * calc_notifier_destroy lets go of; the fd must stay open until then.
+ * Evaluations of a calculator without a log are on disk at once.
+ */
+void calc_defer_commits(int enable);
+unsigned long long calc_take_commit(struct Calc *calc);
+int calc_commit_status(struct Calc *calc, unsigned long long lsn);
+struct CalcNotifier *calc_notifier_create(int fd);
+void calc_notifier_destroy(struct CalcNotifier *notifier);
+int calc_notify_commit(struct Calc *calc, unsigned long long lsn, struct CalcNotifier *notifier);
+
+/*
+ * Snapshots. calc_save_snapshot writes every variable of calc to a snapshot
+ * file, replacing path atomically, and empties calc's log, which the
+ * snapshot now covers. Assignments wait while it runs, but reads do not;
+ * a lock-free calculator without a log may mix values assigned during the
+ * save. calc_load_snapshot maps the snapshot at path into a calculator
+ * with no variables yet, before any log is opened. Variables are then
+ * read from the mapping, which pages them in only as they are used, and
+ * assignments are kept in memory on top of it. Both return the number of
+ * variables in the snapshot, or -1 on error. calc_save_snapshot also
+ * stores into *seq (unless seq is NULL) the number of the last checkpoint
+ * the snapshot covers; checkpoints written after it returns are numbered
+ * above that, and still needed.
+ */
+long calc_save_snapshot(struct Calc *calc, const char *path, unsigned long long *seq);
+long calc_load_snapshot(struct Calc *calc, const char *path);
+
+/* What calc_checkpoint did. */
+struct CalcCheckpointStats {
+	unsigned long long seq;		/* number of the checkpoint written */
+	unsigned long long variables;	/* variables written */
+	unsigned long long bytes;	/* size of the file written */
+	double pause_seconds;		/* how long assignments were held off */
+	double seconds;			/* how long the whole checkpoint took */
+};
+
+/*
+ * Incremental checkpoints of a locked calculator. calc_checkpoint writes
+ * the variables assigned since the previous checkpoint, snapshot or start
+ * to a file at path in the snapshot format, numbered one past
+ * calc_checkpoint_seq. It holds assignments off only long enough to fix
+ * the point in time, then copies each shard's changed values either
+ * itself or, if an assignment to the shard comes first, in that
+ * assignment (copy-on-write), so the file is the state at that point
+ * while assignments go on. With a log, the log is started afresh at that
+ * point and its older records are deleted once the file is synced.
+ * Returns 1 and fills *stats (unless stats is NULL) if a file was
+ * written, 0 if nothing changed, or -1 on error; the changes are then
+ * kept for the next checkpoint. calc_apply_checkpoint assigns the
+ * variables of checkpoint file path, which must be numbered one past
+ * calc_checkpoint_seq, returning their number or -1 on error; recovery
+ * loads the snapshot, applies the checkpoints after it in order, then
+ * opens the log. A snapshot saved by calc_save_snapshot covers every
+ * checkpoint up to the seq it reports.
+ */
+int calc_checkpoint(struct Calc *calc, const char *path, struct CalcCheckpointStats *stats);
+long calc_apply_checkpoint(struct Calc *calc, const char *path);
+unsigned long long calc_checkpoint_seq(struct Calc *calc);
+
+/* Receives assignments for replication, see calc_set_feed. */
+typedef void (*CalcFeed)(void *arg, const char *records, size_t len, int dump);
+
+/*
+ * Replication of a locked calculator. calc_set_feed makes calc pass every
+ * later successful assignment to feed(arg, records, len, 0), encoded as a
+ * record in the format of the log (see calc_open_wal). The assigning
+ * thread calls feed once it has unlocked the variable's shard, passing on
+ * the records of every assignment to the shard made meanwhile; one thread
+ * at a time feeds each shard, so records of a variable come in the order
+ * of its assignments, but calls for other shards may run concurrently,
+ * and records of one batch may come in separate calls. A NULL feed stops
+ * this. calc_feed_dump passes a record of every defined variable to feed
+ * in one call with dump 1, at a point between assignments: those fed
+ * before it are included in it, and those fed after it are not. Both
+ * return -1 for a lock-free calculator, and calc_feed_dump for one with no
+ * feed; otherwise they return 0 and the number of variables.
+ * calc_apply_records assigns the variables of the complete records at
+ * the start of records[0..len-1], even in a read-only calculator, and
+ * returns their size, or -1 if a record is corrupt.
+ */
+int calc_set_feed(struct Calc *calc, CalcFeed feed, void *arg);
+long calc_feed_dump(struct Calc *calc);
+long calc_apply_records(struct Calc *calc, const char *records, size_t len);
+
+/* Kinds of expression told apart by calc_get_stats. */
+enum CalcShape {
+	CALC_SHAPE_LITERAL,	/* an integer */
+	CALC_SHAPE_VARIABLE,	/* a variable */
+	CALC_SHAPE_ARITHMETIC,	/* operators and operands, with no assignment */
+	CALC_SHAPE_ASSIGNMENT,	/* VAR = any expression */
+	CALC_SHAPE_INVALID,	/* not an expression, or a malformed program */
+	CALC_NUM_SHAPES
+};
+
+/* Why evaluations failed, for calc_get_stats. */
+enum CalcError {
+	CALC_ERROR_SYNTAX,		/* the expression or program is malformed */
+	CALC_ERROR_UNDEFINED,		/* it reads a variable that has no value */
+	CALC_ERROR_DIVIDE_BY_ZERO,
+	CALC_ERROR_READ_ONLY,		/* it assigns in a read-only calculator */
+	CALC_ERROR_LOG,			/* its assignment could not be logged */
+	CALC_NUM_ERRORS
+};
+
+/* latency buckets of CalcStats: bucket i counts times of 2^i to 2^(i+1) - 1 ns */
+#define CALC_STATS_BUCKETS 32
+
+/* Counters of evaluations in every calculator of the process. */
+struct CalcStats {
+	unsigned long long evaluations[CALC_NUM_SHAPES];	/* by shape */
+	unsigned long long latency_ns[CALC_NUM_SHAPES];	/* total time of those */
+	unsigned long long latency[CALC_NUM_SHAPES][CALC_STATS_BUCKETS];	/* their times; the last bucket takes longer ones too */
+	unsigned long long errors[CALC_NUM_ERRORS];		/* failed evaluations, by cause */
+	unsigned long long assignments;			/* successful ones */
+};
+
+/*
+ * Statistics of evaluations. Once calc_enable_stats(1) is called, every
+ * evaluation by any calculator of the process is counted and timed, in
+ * counters that each thread keeps to itself, until calc_enable_stats(0).
+ * An evaluation's time runs from parsing through locking and logging to
+ * its result, not counting the sync of a deferred commit; an expression of a batch is charged an equal share of the
+ * batch's time. calc_get_stats adds up every thread's counters, past and
+ * present, into *stats. They are consistent only once the evaluations
+ * running meanwhile have finished.
+ */
+void calc_enable_stats(int enable);
+void calc_get_stats(struct CalcStats *stats);
+
+/* Counters of the shard locks taken by evaluations, see calc_get_lock_stats. */
+struct CalcLockStats {
+	unsigned long long acquisitions;	/* times an evaluation or batch locked its shards */
+	unsigned long long contended;		/* of those, times a shard was held by another thread */
+	unsigned long long wait_ns;		/* total time spent waiting for shards */
+	unsigned long long wait[CALC_STATS_BUCKETS];	/* wait of each acquisition, 0 if uncontended */
+	unsigned long long hold_ns;		/* total time shards were held */
+	unsigned long long hold[CALC_STATS_BUCKETS];	/* from acquiring to releasing the shards */
+};
+
+/*
+ * Statistics of the shard locks of locked calculators. Once
+ * calc_enable_lock_stats(1) is called, each time an evaluation, a batch
+ * or a checkpoint locks its shards counts as one acquisition, in every
+ * calculator of the process. An acquisition is contended if a shard could
+ * not be taken at once; only then is the wait timed. The time from
+ * acquiring to releasing is timed too. These are kept per thread like
+ * calc_get_stats's, and calc_get_lock_stats adds them up into *stats.
+ * Counting is apart from calc_enable_stats, since timing the hold reads
+ * the clock twice more per evaluation.
+ */
+void calc_enable_lock_stats(int enable);
+void calc_get_lock_stats(struct CalcLockStats *stats);
+
+/* Phases of handling requests, recorded by calc_trace_begin and calc_trace_end. */
+enum CalcTracePhase {
+	CALC_TRACE_READ,	/* reading a client's input; arg is bytes read */
+	CALC_TRACE_PROCESS,	/* handling the requests of one read; arg is bytes handled */
+	CALC_TRACE_TOKENIZE,	/* parsing expressions; arg is how many */
+	CALC_TRACE_LOCK,	/* waiting for shard locks; arg is how many shards */
+	CALC_TRACE_EVALUATE,	/* evaluating parsed expressions; arg is how many */
+	CALC_TRACE_LOG,		/* waiting for the write-ahead log to sync */
+	CALC_TRACE_WRITE,	/* writing results to a client; arg is bytes */
+	CALC_TRACE_NUM_PHASES
+};
+
+/* kinds of CalcTraceRecord */
+#define CALC_TRACE_BEGIN 'B'
+#define CALC_TRACE_END 'E'
+
+/* first bytes of a file written by calc_trace_dump */
+#define CALC_TRACE_MAGIC "CALCTRC1"
+
+/*
+ * One event of a trace file, in the byte order of the machine that wrote
+ * it. The file is CALC_TRACE_MAGIC followed by these records, grouped by
+ * the buffer they came from; within a thread they are in time order.
+ */
+struct CalcTraceRecord {
+	uint64_t time_ns;	/* CLOCK_MONOTONIC_RAW */
+	uint32_t tid;		/* the thread's kernel id */
+	uint8_t phase;		/* an enum CalcTracePhase */
+	uint8_t kind;		/* CALC_TRACE_BEGIN or CALC_TRACE_END */
+	uint16_t arg;		/* see enum CalcTracePhase, at most 65535 */
+};
+
+/*
+ * Tracing of requests. Once calc_enable_trace(1) is called, calc_eval,
+ * calc_eval_batch and calc_exec record when each of their phases begins
+ * and ends, and callers may record phases of their own. Each thread
+ * records into a ring buffer of its own, without locking, holding its
+ * last CALC_TRACE_EVENTS events; the buffer of a thread that exits is
+ * taken over by the next thread to trace. calc_trace_dump writes the
+ * events of every buffer to the file at path, and returns how many, or
+ * -1 with errno set if the file can't be written. Threads may keep
+ * tracing meanwhile; events they overwrite during the dump are left out.
+ */
+#define CALC_TRACE_EVENTS 32768
+void calc_enable_trace(int enable);
+void calc_trace_begin(enum CalcTracePhase phase, unsigned arg);
+void calc_trace_end(enum CalcTracePhase phase, unsigned arg);
+long calc_trace_dump(const char *path);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,204 @@
+/*
+ * Benchmark for the calc library: compares calc_eval against
+ * calc_compile + calc_exec for each expression shape, then measures
+ * throughput of concurrent threads for several shard counts.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "calc.h"
+
+/* number of evaluations timed per expression */
+#define NUM_ITERS 2000000
+
+/* expressions that are benchmarked, all of which evaluate successfully */
+static const char *exprs[] = {
+	"42",
+	"a",
+	"33 + 15",
+	"a * b",
+	"a = 4",
+	"c = a - 7",
+	"c = a / b",
+};
+
+#define NUM_EXPRS (sizeof(exprs) / sizeof(exprs[0]))
+
+/* variables, distinct expressions per thread, and evaluations per thread in the contention benchmark */
+#define NUM_CONTENTION_VARS 1024
+#define NUM_CONTENTION_EXPRS 4096
+#define NUM_CONTENTION_EVALS 200000
+
+/* percentage of contention benchmark expressions that are assignments */
+#define WRITE_PERCENT 20
+
+/* shard counts compared by the contention benchmark; 0 means lock-free */
+static const unsigned shard_counts[] = { 1, 4, 16, 64, 256, 0 };
+
+#define NUM_SHARD_COUNTS (sizeof(shard_counts) / sizeof(shard_counts[0]))
+
+/**
+ * Work for one thread of the contention benchmark
+ *
+ * @param calc The shared Calc struct
+ * @param exprs The expressions this thread evaluates in turn
+ */
+struct ContentionArgs {
+	struct Calc *calc;
+	char exprs[NUM_CONTENTION_EXPRS][64];
+};
+
+/**
+ * Get the current time in nanoseconds
+ *
+ * @return monotonic clock reading in nanoseconds
+ */
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Write the variable name for n (in base 26 letters) into buf
+ *
+ * @param buf Buffer of at least 16 bytes
+ * @param n Variable number
+ */
+static void var_name(char *buf, int n) {
+	do {
+		*buf++ = 'a' + n % 26;
+		n /= 26;
+	} while (n > 0);
+	*buf = '\0';
+}
+
+/**
+ * Thread body of the contention benchmark
+ *
+ * @param arg ContentionArgs for this thread
+ * @return NULL
+ */
+static void *contention_worker(void *arg) {
+	struct ContentionArgs *args = arg;
+	int result;
+
+	for (int n = 0; n < NUM_CONTENTION_EVALS; n++) {
+		calc_eval(args->calc, args->exprs[n % NUM_CONTENTION_EXPRS], &result);
+	}
+	return NULL;
+}
+
+/**
+ * Measure throughput of threads evaluating a mix of reads and assignments
+ * over a shared set of variables, for each shard count
+ */
+static void bench_contention(void) {
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads < 4) {
+		num_threads = 4;
+	}
+
+	struct ContentionArgs *args = malloc(num_threads * sizeof(struct ContentionArgs));
+	pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+	unsigned seed = 1;
+	char x[16], y[16], z[16];
+
+	for (long t = 0; t < num_threads; t++) {
+		for (int i = 0; i < NUM_CONTENTION_EXPRS; i++) {
+			var_name(x, rand_r(&seed) % NUM_CONTENTION_VARS);
+			var_name(y, rand_r(&seed) % NUM_CONTENTION_VARS);
+			var_name(z, rand_r(&seed) % NUM_CONTENTION_VARS);
+			if ((int) (rand_r(&seed) % 100) < WRITE_PERCENT) {
+				snprintf(args[t].exprs[i], sizeof(args[t].exprs[i]), "%s = %s + %s", x, y, z);
+			} else {
+				snprintf(args[t].exprs[i], sizeof(args[t].exprs[i]), "%s + %s", y, z);
+			}
+		}
+	}
+
+	printf("\n%ld threads, %d variables, %d%% assignments\n", num_threads, NUM_CONTENTION_VARS, WRITE_PERCENT);
+	printf("%-12s %12s\n", "shards", "Mops/s");
+	for (size_t s = 0; s < NUM_SHARD_COUNTS; s++) {
+		struct CalcOptions opts;
+		calc_options_init(&opts);
+		if (shard_counts[s] == 0) {
+			opts.concurrency = CALC_LOCK_FREE;
+		} else {
+			opts.num_shards = shard_counts[s];
+		}
+		struct Calc *calc = calc_create_ex(&opts);
+
+		char expr[32];
+		int result;
+		for (int i = 0; i < NUM_CONTENTION_VARS; i++) {
+			var_name(x, i);
+			snprintf(expr, sizeof(expr), "%s = %d", x, i);
+			calc_eval(calc, expr, &result);
+		}
+
+		long long start = now_ns();
+		for (long t = 0; t < num_threads; t++) {
+			args[t].calc = calc;
+			pthread_create(&threads[t], NULL, contention_worker, &args[t]);
+		}
+		for (long t = 0; t < num_threads; t++) {
+			pthread_join(threads[t], NULL);
+		}
+		double elapsed_ns = (double) (now_ns() - start);
+
+		if (shard_counts[s] == 0) {
+			printf("%-12s", "lock-free");
+		} else {
+			printf("%-12u", shard_counts[s]);
+		}
+		printf(" %12.2f\n", (double) num_threads * NUM_CONTENTION_EVALS * 1000.0 / elapsed_ns);
+		calc_destroy(calc);
+	}
+
+	free(threads);
+	free(args);
+}
+
+int main(void) {
+	struct Calc *calc = calc_create();
+	int result;
+	volatile int sink = 0;		/* keeps the loops from being optimized away */
+
+	calc_eval(calc, "a = 12", &result);
+	calc_eval(calc, "b = 5", &result);
+
+	printf("%-12s %12s %12s %8s\n", "expr", "eval ns/op", "exec ns/op", "speedup");
+	for (size_t i = 0; i < NUM_EXPRS; i++) {
+		struct CalcCompiled *compiled = calc_compile(calc, exprs[i]);
+		if (compiled == NULL) {
+			fprintf(stderr, "Error: could not compile %s\n", exprs[i]);
+			return 1;
+		}
+
+		long long start = now_ns();
+		for (int n = 0; n < NUM_ITERS; n++) {
+			calc_eval(calc, exprs[i], &result);
+			sink += result;
+		}
+		double eval_ns = (double) (now_ns() - start) / NUM_ITERS;
+
+		start = now_ns();
+		for (int n = 0; n < NUM_ITERS; n++) {
+			calc_exec(compiled, &result);
+			sink += result;
+		}
+		double exec_ns = (double) (now_ns() - start) / NUM_ITERS;
+
+		printf("%-12s %12.1f %12.1f %7.2fx\n", exprs[i], eval_ns, exec_ns, eval_ns / exec_ns);
+		calc_free_compiled(compiled);
+	}
+
+	calc_destroy(calc);
+
+	bench_contention();
+	return 0;
+}
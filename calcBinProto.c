@@ -0,0 +1,182 @@
+/*
+ * The binary protocol of calcServer, see calcBinProto.h. Requests carry
+ * postfix programs with raw operands, which go straight to
+ * calc_exec_program with no text to format or parse.
+ */
+
+#include <limits.h>
+#include <string.h>
+#include "csapp.h"
+#include "calcBinProto.h"
+
+/* most instructions in a BIN_EVAL frame, as calc_exec_program allows */
+#define BIN_MAX_INSTRS 256
+
+/**
+ * Read a little-endian 16-bit integer
+ *
+ * @param p The bytes
+ * @return the integer
+ */
+static unsigned get_u16(const char *p) {
+	const unsigned char *b = (const unsigned char *) p;
+	return b[0] | (unsigned) b[1] << 8;
+}
+
+/**
+ * Read a little-endian 32-bit integer
+ *
+ * @param p The bytes
+ * @return the integer
+ */
+static unsigned get_u32(const char *p) {
+	const unsigned char *b = (const unsigned char *) p;
+	return b[0] | (unsigned) b[1] << 8 | (unsigned) b[2] << 16 | (unsigned) b[3] << 24;
+}
+
+/**
+ * Append a response to an output buffer
+ *
+ * @param out The buffer
+ * @param ok Whether the request succeeded
+ * @param value The result
+ */
+static void put_response(struct OutBuf *out, int ok, int value) {
+	unsigned v = (unsigned) value;
+	char response[BIN_RESPONSE_SIZE] = { (char) ok, (char) v, (char) (v >> 8), (char) (v >> 16), (char) (v >> 24) };
+	outbuf_append(out, response, sizeof(response));
+}
+
+/**
+ * Handle a BIN_BIND frame
+ *
+ * @param session The client's session
+ * @param body The frame after its type
+ * @param len Length of body
+ * @return 1 on success, 0 on error
+ */
+static int bind_var(struct ProtoSession *session, const char *body, size_t len) {
+	if (len < 4) {
+		return 0;
+	}
+	unsigned id = get_u32(body);
+	if (id >= BIN_MAX_VARS) {
+		return 0;
+	}
+	struct CalcVar *var = calc_var(session->calc, body + 4, len - 4);
+	if (var == NULL) {
+		return 0;
+	}
+
+	if (id >= session->num_vars) {
+		size_t num_vars = session->num_vars == 0 ? 16 : session->num_vars;
+		while (num_vars <= id) {
+			num_vars *= 2;
+		}
+		session->vars = Realloc(session->vars, num_vars * sizeof(struct CalcVar *));
+		memset(session->vars + session->num_vars, 0, (num_vars - session->num_vars) * sizeof(struct CalcVar *));
+		session->num_vars = num_vars;
+	}
+	session->vars[id] = var;
+	return 1;
+}
+
+/**
+ * Handle a BIN_EVAL frame
+ *
+ * @param session The client's session
+ * @param body The frame after its type
+ * @param len Length of body
+ * @param result Set to the value of the program
+ * @return 1 on success, 0 on error
+ */
+static int eval_program(struct ProtoSession *session, const char *body, size_t len, int *result) {
+	struct CalcInstr code[BIN_MAX_INSTRS];
+	size_t n = 0, pos = 4;
+
+	if (len < 4) {
+		return 0;
+	}
+	unsigned target_id = get_u32(body);
+	struct CalcVar *target = NULL;
+	if (target_id != BIN_NO_TARGET) {
+		if (target_id >= session->num_vars || session->vars[target_id] == NULL) {
+			return 0;		/* unbound id */
+		}
+		target = session->vars[target_id];
+	}
+
+	while (pos < len) {
+		if (n == BIN_MAX_INSTRS) {
+			return 0;
+		}
+		code[n].op = (enum CalcOpcode) (unsigned char) body[pos++];
+		code[n].operand = 0;
+		if (code[n].op == CALC_OP_PUSH_INT || code[n].op == CALC_OP_PUSH_VAR) {
+			if (len - pos < 4) {
+				return 0;		/* truncated operand */
+			}
+			code[n].operand = (int) get_u32(body + pos);
+			pos += 4;
+		}
+		n++;
+	}
+
+	/* calc_exec_program checks the opcodes, the stack and the variable ids */
+	return calc_exec_program(session->calc, target, code, n, session->vars, session->num_vars, result);
+}
+
+/**
+ * Handle every complete frame in a buffer of input, appending a response
+ * to out for each other frame. Processing stops at BIN_QUIT or at a
+ * frame that is too long or of unknown type, which end the session.
+ *
+ * @param session The client's session
+ * @param buf Input received from the client, after the magic byte
+ * @param len Number of bytes in buf
+ * @param out The buffer for the responses
+ * @param command Set to PROTO_QUIT if the session is over, PROTO_EXPR otherwise
+ * @return number of bytes of buf that were used; the rest is an incomplete frame
+ */
+size_t binproto_process(struct ProtoSession *session, const char *buf, size_t len,
+                        struct OutBuf *out, enum ProtoCommand *command) {
+	size_t pos = 0;
+
+	*command = PROTO_EXPR;
+	while (len - pos >= 2) {
+		size_t frame_len = get_u16(buf + pos);
+		if (frame_len == 0 || frame_len > BIN_MAX_FRAME) {
+			*command = PROTO_QUIT;		/* not a frame of this protocol */
+			break;
+		}
+		if (len - pos - 2 < frame_len) {
+			break;		/* wait for the rest of the frame */
+		}
+
+		const char *frame = buf + pos + 2;
+		pos += 2 + frame_len;
+
+		int ok, value = 0;
+		size_t start = out->len;
+		if (frame[0] == BIN_BIND) {
+			ok = bind_var(session, frame + 1, frame_len - 1);
+		} else if (frame[0] == BIN_EVAL) {
+			ok = eval_program(session, frame + 1, frame_len - 1, &value);
+		} else if (frame[0] == BIN_USE) {
+			ok = proto_session_use(session, frame + 1, frame_len - 1);
+		} else if (frame[0] == BIN_SNAPSHOT) {
+			long count = registry_snapshot(session->registry, session->ns_name);
+			ok = count >= 0;
+			value = count > INT_MAX ? INT_MAX : (int) count;
+		} else {
+			*command = PROTO_QUIT;		/* BIN_QUIT, or unknown */
+			break;
+		}
+		put_response(out, ok, ok ? value : 0);
+		if (frame[0] == BIN_EVAL) {
+			proto_session_hold(session, start);
+		}
+	}
+
+	return pos;
+}
@@ -0,0 +1,46 @@
+#ifndef CALCBINPROTO_H
+#define CALCBINPROTO_H
+
+/*
+ * Binary protocol of calcServer, chosen by a client whose first byte is
+ * BIN_MAGIC. All integers are little-endian. Each request is a frame: a
+ * 16-bit length, then that many bytes starting with a frame type.
+ *
+ *   BIN_BIND  u32 id, name   make id stand for the variable name
+ *   BIN_EVAL  u32 target id (or BIN_NO_TARGET), then instructions: a
+ *             u8 CalcOpcode each, followed by an i32 for CALC_OP_PUSH_INT
+ *             and a u32 id for CALC_OP_PUSH_VAR
+ *   BIN_QUIT  end the session
+ *   BIN_USE   name           switch to the namespace name, unbinding every id
+ *   BIN_SNAPSHOT             save the namespace's snapshot
+ *
+ * Every other frame gets a 5-byte response, in order: a u8 that is 1 on
+ * success and 0 on error, then the i32 value (the number of variables
+ * saved for a snapshot, 0 for a bind, a use or an error). A frame that
+ * is too long or of unknown type ends the session.
+ */
+
+#include <stddef.h>
+#include "calcProto.h"
+
+#define BIN_MAGIC 0xCA
+
+#define BIN_BIND 1
+#define BIN_EVAL 2
+#define BIN_QUIT 3
+#define BIN_USE 4
+#define BIN_SNAPSHOT 5
+
+#define BIN_NO_TARGET 0xFFFFFFFFu
+
+/* longest frame after its length, and most variable ids per session */
+#define BIN_MAX_FRAME 2048
+#define BIN_MAX_VARS 65536
+
+/* size of a response */
+#define BIN_RESPONSE_SIZE 5
+
+size_t binproto_process(struct ProtoSession *session, const char *buf, size_t len,
+                        struct OutBuf *out, enum ProtoCommand *command);
+
+#endif /* CALCBINPROTO_H */
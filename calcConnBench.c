@@ -0,0 +1,158 @@
+/*
+ * Connection-rate benchmark for calcServer: client threads repeatedly
+ * connect, evaluate one expression, and wait for the server to close the
+ * connection, for a fixed time. Run bench_conns.sh to compare the server
+ * modes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+/* client threads and seconds to run, unless given on the command line */
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_SECONDS 5
+
+/* what each connection sends: one expression, then end the session */
+static const char request[] = "1 + 1\nquit\n";
+
+/* the answer the server must send back */
+static const char answer[] = "2\n";
+
+/**
+ * Work and results of one client thread
+ *
+ * @param addr The server's address
+ * @param deadline When to stop, in CLOCK_MONOTONIC nanoseconds
+ * @param conns Number of connections completed
+ * @param failures Number of connections that failed or got a wrong answer
+ * @param total_ns Sum of the times from connect to close
+ */
+struct ClientArgs {
+	const struct addrinfo *addr;
+	long long deadline;
+	long conns;
+	long failures;
+	long long total_ns;
+};
+
+/**
+ * Get the current time in nanoseconds
+ *
+ * @return monotonic clock reading in nanoseconds
+ */
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Make one connection, send the request and read the whole response
+ *
+ * @param addr The server's address
+ * @return 1 if the expected answer arrived, 0 otherwise
+ */
+static int one_connection(const struct addrinfo *addr) {
+	int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (fd < 0) {
+		return 0;
+	}
+	if (connect(fd, addr->ai_addr, addr->ai_addrlen) < 0
+			|| write(fd, request, sizeof(request) - 1) != (ssize_t) (sizeof(request) - 1)) {
+		close(fd);
+		return 0;
+	}
+
+	/* the server closes the connection after quit */
+	char buf[64];
+	size_t len = 0;
+	ssize_t n;
+	while ((n = read(fd, buf + len, sizeof(buf) - len)) > 0) {
+		len += n;
+		if (len == sizeof(buf)) {
+			break;
+		}
+	}
+	close(fd);
+	return len == sizeof(answer) - 1 && memcmp(buf, answer, len) == 0;
+}
+
+/**
+ * Thread body of a client
+ *
+ * @param arg ClientArgs for this thread
+ * @return NULL
+ */
+static void *client(void *arg) {
+	struct ClientArgs *args = arg;
+	long long now = now_ns();
+
+	while (now < args->deadline) {
+		long long start = now;
+		if (one_connection(args->addr)) {
+			args->conns++;
+		} else {
+			args->failures++;
+		}
+		now = now_ns();
+		args->total_ns += now - start;
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2 || argc > 4) {
+		fprintf(stderr, "Usage: %s <port> [clients] [seconds]\n", argv[0]);
+		return 1;
+	}
+	int num_clients = argc > 2 ? atoi(argv[2]) : DEFAULT_CLIENTS;
+	int seconds = argc > 3 ? atoi(argv[3]) : DEFAULT_SECONDS;
+	if (num_clients <= 0 || seconds <= 0) {
+		fprintf(stderr, "clients and seconds must be positive\n");
+		return 1;
+	}
+
+	struct addrinfo hints, *addr;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	if (getaddrinfo("localhost", argv[1], &hints, &addr) != 0) {
+		fprintf(stderr, "Error: can't resolve localhost port %s\n", argv[1]);
+		return 1;
+	}
+
+	struct ClientArgs *args = calloc(num_clients, sizeof(struct ClientArgs));
+	pthread_t *threads = malloc(num_clients * sizeof(pthread_t));
+	long long start = now_ns();
+
+	for (int i = 0; i < num_clients; i++) {
+		args[i].addr = addr;
+		args[i].deadline = start + seconds * 1000000000LL;
+		pthread_create(&threads[i], NULL, client, &args[i]);
+	}
+
+	long conns = 0, failures = 0;
+	long long total_ns = 0;
+	for (int i = 0; i < num_clients; i++) {
+		pthread_join(threads[i], NULL);
+		conns += args[i].conns;
+		failures += args[i].failures;
+		total_ns += args[i].total_ns;
+	}
+	double elapsed = (double) (now_ns() - start) / 1e9;
+
+	printf("%d clients, %.1f s: %ld connections, %.0f conn/s, %.1f us/conn, %ld failed\n",
+	       num_clients, elapsed, conns, conns / elapsed,
+	       conns + failures > 0 ? total_ns / 1000.0 / (conns + failures) : 0.0, failures);
+
+	free(threads);
+	free(args);
+	freeaddrinfo(addr);
+	return failures > 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Log-linear histograms of latencies, see calcHistogram.h.
+ */
+
+#include <string.h>
+#include "calcHistogram.h"
+
+/* largest value a histogram tells apart */
+#define HIST_MAX_VALUE ((UINT64_C(1) << HIST_MAX_BITS) - 1)
+
+/**
+ * Find the bucket of a value
+ *
+ * @param value The value, at most HIST_MAX_VALUE
+ * @return the index of its bucket
+ */
+static unsigned bucket_of(uint64_t value) {
+	if (value < (UINT64_C(1) << HIST_SUB_BITS)) {
+		return (unsigned) value;
+	}
+	unsigned shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) + (unsigned) (value >> shift) - (1u << HIST_SUB_BITS);
+}
+
+/**
+ * Find the largest value of a bucket
+ *
+ * @param bucket Index of the bucket
+ * @return the largest value that falls in it
+ */
+static uint64_t bucket_max(unsigned bucket) {
+	if (bucket < (1u << HIST_SUB_BITS)) {
+		return bucket;
+	}
+	unsigned shift = (bucket >> HIST_SUB_BITS) - 1;
+	uint64_t top = (bucket & ((1u << HIST_SUB_BITS) - 1)) + (UINT64_C(1) << HIST_SUB_BITS);
+	return ((top + 1) << shift) - 1;
+}
+
+/**
+ * Empty a histogram
+ *
+ * @param hist The histogram
+ */
+void hist_init(struct Histogram *hist) {
+	memset(hist, 0, sizeof(*hist));
+}
+
+/**
+ * Record a value
+ *
+ * @param hist The histogram
+ * @param value The value
+ */
+void hist_record(struct Histogram *hist, uint64_t value) {
+	hist_record_n(hist, value, 1);
+}
+
+/**
+ * Record a value several times
+ *
+ * @param hist The histogram
+ * @param value The value
+ * @param count How many times
+ */
+void hist_record_n(struct Histogram *hist, uint64_t value, uint64_t count) {
+	if (value > HIST_MAX_VALUE) {
+		value = HIST_MAX_VALUE;
+	}
+	hist->counts[bucket_of(value)] += count;
+	hist->total += count;
+	hist->sum += (double) value * count;
+	if (value > hist->max && count > 0) {
+		hist->max = value;
+	}
+}
+
+/**
+ * Add the values of one histogram to another
+ *
+ * @param dst The histogram added to
+ * @param src The histogram added
+ */
+void hist_merge(struct Histogram *dst, const struct Histogram *src) {
+	for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+		dst->counts[i] += src->counts[i];
+	}
+	dst->total += src->total;
+	dst->sum += src->sum;
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+}
+
+/**
+ * Add the values of src to dst, corrected for coordinated omission. A
+ * closed-loop client sends its next request only once a response arrives,
+ * so while the server stalls it stops sending, and the requests it would
+ * have sent every interval never get measured. For each value longer than
+ * interval, the values those requests would have seen (value - interval,
+ * value - 2 interval, ... while more than interval) are recorded too, as
+ * HdrHistogram does.
+ *
+ * @param dst The histogram added to
+ * @param src The measured values
+ * @param interval Expected time between requests, or 0 for no correction
+ */
+void hist_correct(struct Histogram *dst, const struct Histogram *src, uint64_t interval) {
+	for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+		if (src->counts[i] == 0) {
+			continue;
+		}
+		uint64_t value = bucket_max(i);
+		if (value > src->max) {
+			value = src->max;
+		}
+		hist_record_n(dst, value, src->counts[i]);
+		if (interval == 0) {
+			continue;
+		}
+		for (uint64_t missed = value - interval; value > interval && missed >= interval; missed -= interval) {
+			hist_record_n(dst, missed, src->counts[i]);
+		}
+	}
+}
+
+/**
+ * Find a percentile of the values
+ *
+ * @param hist The histogram
+ * @param percent Which, from 0 to 100
+ * @return the largest value of the bucket holding that percentile, or 0 if
+ *         there are no values
+ */
+uint64_t hist_percentile(const struct Histogram *hist, double percent) {
+	uint64_t rank = (uint64_t) (percent / 100 * hist->total + 0.5);
+	if (rank == 0) {
+		rank = 1;
+	}
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= rank && hist->counts[i] > 0) {
+			uint64_t value = bucket_max(i);
+			return value < hist->max ? value : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+/**
+ * Find the mean of the values
+ *
+ * @param hist The histogram
+ * @return the mean, or 0 if there are no values
+ */
+double hist_mean(const struct Histogram *hist) {
+	return hist->total > 0 ? hist->sum / hist->total : 0;
+}
@@ -0,0 +1,36 @@
+#ifndef CALCHISTOGRAM_H
+#define CALCHISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Histogram of latencies in nanoseconds, in the manner of HdrHistogram:
+ * values below 2^HIST_SUB_BITS get a bucket each, and every power of two
+ * above that is split into 2^HIST_SUB_BITS buckets, so a value is known to
+ * within 1 part in 128 however large it is. Values from 2^HIST_MAX_BITS
+ * nanoseconds (about 18 minutes) up count as that.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/*
+ * Recorded values. Initialize with hist_init; a histogram is not
+ * thread-safe, so each thread records into its own and they are merged.
+ */
+struct Histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;		/* number of values */
+	uint64_t max;		/* largest value */
+	double sum;		/* of the values, for the mean */
+};
+
+void hist_init(struct Histogram *hist);
+void hist_record(struct Histogram *hist, uint64_t value);
+void hist_record_n(struct Histogram *hist, uint64_t value, uint64_t count);
+void hist_merge(struct Histogram *dst, const struct Histogram *src);
+void hist_correct(struct Histogram *dst, const struct Histogram *src, uint64_t interval);
+uint64_t hist_percentile(const struct Histogram *hist, double percent);
+double hist_mean(const struct Histogram *hist);
+
+#endif /* CALCHISTOGRAM_H */
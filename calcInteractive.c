@@ -12,7 +12,12 @@
 /* buffer size for reading lines of input from user */
 #define LINEBUF_SIZE 1024
 
+/* most lines evaluated together by calc_eval_batch */
+#define MAX_BATCH 32
+
 void chat_with_client(struct Calc *calc, int infd, int outfd);
+static int line_buffered(rio_t *rp);
+static void write_results(int outfd, const int *results, const int *status, size_t count);
 
 int main(void) {
 	struct Calc *calc = calc_create();
@@ -27,7 +32,9 @@ int main(void) {
 
 void chat_with_client(struct Calc *calc, int infd, int outfd) {
 	rio_t in;
-	char linebuf[LINEBUF_SIZE];
+	char lines[MAX_BATCH][LINEBUF_SIZE];
+	const char *exprs[MAX_BATCH];
+	int results[MAX_BATCH], status[MAX_BATCH];
 
 	/* wrap standard input (which is file descriptor 0) */
 	rio_readinitb(&in, infd);
@@ -35,30 +42,63 @@ void chat_with_client(struct Calc *calc, int infd, int outfd) {
 	/*
 	 * Read lines of input, evaluate them as calculator expressions,
 	 * and (if evaluation was successful) print the result of each
-	 * expression.  Quit when "quit" command is received.
+	 * expression.  Quit when "quit" command is received.  Lines that
+	 * are already buffered (e.g. pasted or piped input) are evaluated
+	 * together as one batch.
 	 */
 	int done = 0;
 	while (!done) {
-		ssize_t n = rio_readlineb(&in, linebuf, LINEBUF_SIZE);
-		if (n <= 0) {
-			/* error or end of input */
-			done = 1;
-		} else if (strcmp(linebuf, "quit\n") == 0 || strcmp(linebuf, "quit\r\n") == 0) {
-			/* quit command */
-			done = 1;
-		} else {
-			/* process input line */
-			int result;
-			if (calc_eval(calc, linebuf, &result) == 0) {
-				/* expression couldn't be evaluated */
-				rio_writen(outfd, "Error\n", 6);
+		size_t count = 0;
+		do {
+			ssize_t n = rio_readlineb(&in, lines[count], LINEBUF_SIZE);
+			if (n <= 0) {
+				/* error or end of input */
+				done = 1;
+			} else if (strcmp(lines[count], "quit\n") == 0 || strcmp(lines[count], "quit\r\n") == 0) {
+				/* quit command */
+				done = 1;
 			} else {
-				/* output result */
-				int len = snprintf(linebuf, LINEBUF_SIZE, "%d\n", result);
-				if (len < LINEBUF_SIZE) {
-					rio_writen(outfd, linebuf, len);
-				}
+				exprs[count] = lines[count];
+				count++;
 			}
+		} while (!done && count < MAX_BATCH && line_buffered(&in));
+
+		calc_eval_batch(calc, exprs, count, results, status);
+		write_results(outfd, results, status, count);
+	}
+}
+
+/**
+ * Check whether a complete line is already buffered, so that reading it
+ * will not block
+ *
+ * @param rp The buffered input
+ * @return 1 if a newline is buffered, 0 otherwise
+ */
+static int line_buffered(rio_t *rp) {
+	return rp->rio_cnt > 0 && memchr(rp->rio_bufptr, '\n', rp->rio_cnt) != NULL;
+}
+
+/**
+ * Write the result of each expression of a batch, or "Error" if it
+ * couldn't be evaluated
+ *
+ * @param outfd file descriptor to write to
+ * @param results Values of the expressions
+ * @param status Whether each expression was evaluated
+ * @param count Number of expressions
+ */
+static void write_results(int outfd, const int *results, const int *status, size_t count) {
+	char buf[16];
+
+	for (size_t i = 0; i < count; i++) {
+		if (status[i] == 0) {
+			/* expression couldn't be evaluated */
+			rio_writen(outfd, "Error\n", 6);
+		} else {
+			/* output result */
+			int len = snprintf(buf, sizeof(buf), "%d\n", results[i]);
+			rio_writen(outfd, buf, len);
 		}
 	}
 }
@@ -0,0 +1,449 @@
+/*
+ * Load generator for calcServer: connections, each on a thread of its
+ * own, send a mix of reads ("X + Y") and assignments ("X = Y + 1") of
+ * variables picked at random, for a fixed time, and the latency of every
+ * request is recorded in a histogram.
+ *
+ * In closed-loop mode (the default) each connection keeps depth requests
+ * outstanding, sending a new one whenever an answer arrives. With -r, the
+ * connections instead send requests at that total rate, on a fixed
+ * schedule, whether or not the server keeps up, as long as no more than
+ * depth are outstanding. Latency is then measured from when a request was
+ * due rather than when it was sent, so a server that stalls is charged
+ * for the requests that queued up meanwhile. In closed-loop mode the
+ * histogram is corrected for those requests afterwards instead, see
+ * hist_correct.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "calcHistogram.h"
+
+/* settings, unless given on the command line */
+#define DEFAULT_CONNS 16
+#define DEFAULT_DEPTH 1
+#define DEFAULT_WRITE_PERCENT 20
+#define DEFAULT_KEYS 1000
+#define DEFAULT_SECONDS 5
+
+/* most outstanding requests per connection */
+#define MAX_DEPTH 1024
+
+/* longest request */
+#define REQUEST_SIZE 48
+
+/* how long to wait for outstanding answers at the end, in nanoseconds */
+#define DRAIN_NS 5000000000LL
+
+/**
+ * Settings shared by every connection
+ *
+ * @param addr The server's address
+ * @param num_conns Number of connections
+ * @param depth Most outstanding requests per connection
+ * @param interval Time between requests of a connection, or 0 for closed loop
+ * @param write_percent Percentage of requests that are assignments
+ * @param num_keys Number of variables
+ * @param start When the run starts, in CLOCK_MONOTONIC nanoseconds
+ * @param deadline When to stop sending
+ */
+struct LoadConfig {
+	const struct addrinfo *addr;
+	int num_conns;
+	int depth;
+	long long interval;
+	int write_percent;
+	int num_keys;
+	long long start;
+	long long deadline;
+};
+
+/**
+ * Work and results of one connection
+ *
+ * @param config The shared settings
+ * @param id Number of the connection
+ * @param requests Number of answers received
+ * @param errors Number of answers that were "Error"
+ * @param failed Whether the connection broke or answers went missing
+ * @param latency From sending each request to its answer
+ * @param scheduled From when each request was due to its answer (fixed rate only)
+ */
+struct Connection {
+	const struct LoadConfig *config;
+	int id;
+	long requests;
+	long errors;
+	int failed;
+	struct Histogram latency;
+	struct Histogram scheduled;
+};
+
+/**
+ * Get the current time in nanoseconds
+ *
+ * @return monotonic clock reading in nanoseconds
+ */
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Write the variable name for n (in base 26 letters) into buf
+ *
+ * @param buf Buffer of at least 16 bytes
+ * @param n Variable number
+ * @return the length of the name
+ */
+static int var_name(char *buf, int n) {
+	char *p = buf;
+	do {
+		*p++ = 'a' + n % 26;
+		n /= 26;
+	} while (n > 0);
+	*p = '\0';
+	return (int) (p - buf);
+}
+
+/**
+ * Connect to the server
+ *
+ * @param addr The server's address
+ * @return the socket, or -1 on error
+ */
+static int connect_server(const struct addrinfo *addr) {
+	int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+		close(fd);
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));		/* small requests must go out at once */
+	return fd;
+}
+
+/**
+ * Write all of a buffer
+ *
+ * @param fd The socket
+ * @param buf The data
+ * @param len Its length
+ * @return 0 on success, -1 on error
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n <= 0) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Make up a request
+ *
+ * @param config The shared settings
+ * @param buf Where to write it, REQUEST_SIZE bytes
+ * @param seed State of rand_r
+ * @return its length
+ */
+static int make_request(const struct LoadConfig *config, char *buf, unsigned *seed) {
+	int len = var_name(buf, rand_r(seed) % config->num_keys);
+	if ((int) (rand_r(seed) % 100) < config->write_percent) {
+		len += sprintf(buf + len, " = ");
+		len += var_name(buf + len, rand_r(seed) % config->num_keys);
+		len += sprintf(buf + len, " + 1\n");
+	} else {
+		len += sprintf(buf + len, " + ");
+		len += var_name(buf + len, rand_r(seed) % config->num_keys);
+		buf[len++] = '\n';
+	}
+	return len;
+}
+
+/**
+ * Thread body of a connection: send requests until the deadline, as the
+ * mode says, and record the latency of each answer; then wait for the
+ * outstanding ones
+ *
+ * @param arg The Connection
+ * @return NULL
+ */
+static void *connection(void *arg) {
+	struct Connection *conn = arg;
+	const struct LoadConfig *config = conn->config;
+	unsigned seed = conn->id + 1;
+	long long sent_at[MAX_DEPTH], due_at[MAX_DEPTH];	/* ring of outstanding requests */
+	int head = 0, outstanding = 0;
+	char out[MAX_DEPTH * REQUEST_SIZE], in[65536];
+
+	int fd = connect_server(config->addr);
+	if (fd < 0 || fd >= FD_SETSIZE) {
+		conn->failed = 1;
+		if (fd >= 0) {
+			close(fd);
+		}
+		return NULL;
+	}
+
+	/* everyone starts together */
+	struct timespec start = { (time_t) (config->start / 1000000000), (long) (config->start % 1000000000) };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &start, NULL) != 0) {
+	}
+
+	/* stagger the connections' schedules across one interval */
+	long long next_due = config->start + config->interval * conn->id / config->num_conns;
+	int line_start = 1;
+
+	long long now = now_ns();
+	while (now < config->deadline || (outstanding > 0 && now < config->deadline + DRAIN_NS)) {
+		/* send whatever is due */
+		size_t len = 0;
+		while (outstanding < config->depth && now < config->deadline
+		       && (config->interval == 0 || next_due <= now)) {
+			int slot = (head + outstanding) % MAX_DEPTH;
+			sent_at[slot] = now;
+			due_at[slot] = config->interval == 0 ? now : next_due;
+			next_due += config->interval;
+			len += make_request(config, out + len, &seed);
+			outstanding++;
+		}
+		if (len > 0 && write_all(fd, out, len) < 0) {
+			conn->failed = 1;
+			break;
+		}
+
+		/* wait for answers, or until the next request is due */
+		long long wait = (now < config->deadline ? config->deadline : config->deadline + DRAIN_NS) - now;
+		if (config->interval > 0 && outstanding < config->depth && now < config->deadline && next_due - now < wait) {
+			wait = next_due - now;
+		}
+		if (wait < 0) {
+			wait = 0;
+		}
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(fd, &readable);
+		struct timeval timeout = { (time_t) (wait / 1000000000), (suseconds_t) (wait % 1000000000 / 1000) };
+		int ready = select(fd + 1, &readable, NULL, NULL, &timeout);
+		now = now_ns();
+		if (ready <= 0) {
+			continue;
+		}
+
+		ssize_t n = read(fd, in, sizeof(in));
+		now = now_ns();
+		if (n <= 0) {
+			conn->failed = 1;
+			break;
+		}
+		/* each answer is one line; an answer split across reads counts at its end */
+		for (ssize_t i = 0; i < n; i++) {
+			if (line_start) {
+				conn->errors += in[i] == 'E';
+			}
+			line_start = in[i] == '\n';
+			if (!line_start) {
+				continue;
+			}
+			if (outstanding == 0) {
+				conn->failed = 1;		/* an answer to nothing */
+				break;
+			}
+			hist_record(&conn->latency, (uint64_t) (now - sent_at[head]));
+			if (config->interval > 0) {
+				hist_record(&conn->scheduled, (uint64_t) (now - due_at[head]));
+			}
+			head = (head + 1) % MAX_DEPTH;
+			outstanding--;
+			conn->requests++;
+		}
+	}
+	if (outstanding > 0) {
+		conn->failed = 1;
+	}
+	close(fd);
+	return NULL;
+}
+
+/**
+ * Assign every variable, so that reads find them
+ *
+ * @param config The shared settings
+ * @return 0 on success, -1 on error
+ */
+static int preload(const struct LoadConfig *config) {
+	int fd = connect_server(config->addr);
+	if (fd < 0) {
+		return -1;
+	}
+	char *out = malloc((size_t) config->num_keys * 32 + 8);
+	size_t len = 0;
+	for (int i = 0; i < config->num_keys; i++) {
+		len += var_name(out + len, i);
+		len += sprintf(out + len, " = %d\n", i);
+	}
+	len += sprintf(out + len, "quit\n");
+	int rc = write_all(fd, out, len);
+	free(out);
+
+	/* the server answers each assignment, then closes the connection */
+	char in[65536];
+	long lines = 0;
+	ssize_t n;
+	while (rc == 0 && (n = read(fd, in, sizeof(in))) > 0) {
+		for (ssize_t i = 0; i < n; i++) {
+			lines += in[i] == '\n';
+		}
+	}
+	close(fd);
+	return rc == 0 && lines == config->num_keys ? 0 : -1;
+}
+
+/**
+ * Print a line of latency percentiles, in microseconds
+ *
+ * @param label What the latencies are
+ * @param hist Their histogram
+ */
+static void print_latency(const char *label, const struct Histogram *hist) {
+	printf("%-12s %9.1f %9.1f %9.1f %9.1f %9.1f\n", label, hist_mean(hist) / 1000,
+	       hist_percentile(hist, 50) / 1000.0, hist_percentile(hist, 99) / 1000.0,
+	       hist_percentile(hist, 99.9) / 1000.0, hist->max / 1000.0);
+}
+
+/**
+ * Print how to run the load generator and exit
+ *
+ * @param prog Name it was run as
+ */
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-c conns] [-d depth] [-r rate] [-w percent] [-k keys] [-s seconds] <port>\n", prog);
+	fprintf(stderr, "  -c conns    connections, each on a thread (default: %d)\n", DEFAULT_CONNS);
+	fprintf(stderr, "  -d depth    most requests outstanding per connection (default: %d, at most %d)\n",
+	        DEFAULT_DEPTH, MAX_DEPTH);
+	fprintf(stderr, "  -r rate     send this many requests per second in all, on a schedule;\n");
+	fprintf(stderr, "              without it, each connection sends as soon as answers arrive\n");
+	fprintf(stderr, "  -w percent  percentage of requests that are assignments (default: %d)\n", DEFAULT_WRITE_PERCENT);
+	fprintf(stderr, "  -k keys     variables, assigned before the run (default: %d)\n", DEFAULT_KEYS);
+	fprintf(stderr, "  -s seconds  how long to send requests (default: %d)\n", DEFAULT_SECONDS);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	struct LoadConfig config;
+	int seconds = DEFAULT_SECONDS;
+	double rate = 0;
+	int opt;
+
+	config.num_conns = DEFAULT_CONNS;
+	config.depth = DEFAULT_DEPTH;
+	config.write_percent = DEFAULT_WRITE_PERCENT;
+	config.num_keys = DEFAULT_KEYS;
+	while ((opt = getopt(argc, argv, "c:d:r:w:k:s:")) != -1) {
+		if (opt == 'c') {
+			config.num_conns = atoi(optarg);
+		} else if (opt == 'd') {
+			config.depth = atoi(optarg);
+		} else if (opt == 'r') {
+			rate = atof(optarg);
+		} else if (opt == 'w') {
+			config.write_percent = atoi(optarg);
+		} else if (opt == 'k') {
+			config.num_keys = atoi(optarg);
+		} else if (opt == 's') {
+			seconds = atoi(optarg);
+		} else {
+			usage(argv[0]);
+		}
+	}
+	int num_conns = config.num_conns;
+	if (optind != argc - 1 || num_conns <= 0 || config.depth <= 0 || config.depth > MAX_DEPTH || rate < 0
+	    || config.write_percent < 0 || config.write_percent > 100 || config.num_keys <= 0 || seconds <= 0) {
+		usage(argv[0]);
+	}
+	config.interval = rate > 0 ? (long long) (1e9 * num_conns / rate) : 0;
+	if (rate > 0 && config.interval == 0) {
+		config.interval = 1;
+	}
+
+	struct addrinfo hints, *addr;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	if (getaddrinfo("localhost", argv[optind], &hints, &addr) != 0) {
+		fprintf(stderr, "Error: can't resolve localhost port %s\n", argv[optind]);
+		return 1;
+	}
+	config.addr = addr;
+	if (preload(&config) < 0) {
+		fprintf(stderr, "Error: can't assign the variables on localhost port %s\n", argv[optind]);
+		return 1;
+	}
+
+	struct Connection *conns = calloc(num_conns, sizeof(struct Connection));
+	pthread_t *threads = malloc(num_conns * sizeof(pthread_t));
+	config.start = now_ns() + 10000000;		/* give every thread time to connect */
+	config.deadline = config.start + seconds * 1000000000LL;
+	for (int i = 0; i < num_conns; i++) {
+		conns[i].config = &config;
+		conns[i].id = i;
+		hist_init(&conns[i].latency);
+		hist_init(&conns[i].scheduled);
+		pthread_create(&threads[i], NULL, connection, &conns[i]);
+	}
+
+	struct Histogram *latency = malloc(sizeof(struct Histogram));
+	struct Histogram *corrected = malloc(sizeof(struct Histogram));
+	hist_init(latency);
+	hist_init(corrected);
+	long requests = 0, errors = 0;
+	int failed = 0;
+	for (int i = 0; i < num_conns; i++) {
+		pthread_join(threads[i], NULL);
+		requests += conns[i].requests;
+		errors += conns[i].errors;
+		failed += conns[i].failed;
+		hist_merge(latency, &conns[i].latency);
+		hist_merge(corrected, &conns[i].scheduled);
+	}
+	if (rate == 0) {
+		/* a closed loop means to send the next request about one latency later */
+		hist_correct(corrected, latency, (uint64_t) hist_mean(latency));
+	}
+
+	if (rate > 0) {
+		printf("%d connections, depth %d, %.0f req/s scheduled", num_conns, config.depth, rate);
+	} else {
+		printf("%d connections, depth %d, closed loop", num_conns, config.depth);
+	}
+	printf(", %d%% writes, %d keys, %d s: %ld requests, %.0f req/s, %ld errors, %d connections failed\n",
+	       config.write_percent, config.num_keys, seconds, requests, requests / (double) seconds, errors, failed);
+	printf("%-12s %9s %9s %9s %9s %9s\n", "latency us", "mean", "p50", "p99", "p99.9", "max");
+	print_latency("uncorrected", latency);
+	print_latency("corrected", corrected);
+
+	free(corrected);
+	free(latency);
+	free(threads);
+	free(conns);
+	freeaddrinfo(addr);
+	return failed > 0;
+}
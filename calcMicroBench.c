@@ -0,0 +1,302 @@
+/*
+ * Microbenchmark of calc_eval: the time and heap allocations of one
+ * evaluation of each expression shape, in a calculator holding from 10 up
+ * to 10,000,000 variables. Each measurement is warmed up, then repeated,
+ * and the results are printed as CSV, one line per shape and size:
+ *
+ *   shape,vars,reps,ops_per_rep,ns_op_median,ns_op_min,ns_op_max,allocs_op,bytes_op
+ *
+ * The ns/op columns are over the repetitions; allocs_op and bytes_op count
+ * the calls to malloc, calloc and realloc (which C++'s new goes through)
+ * and the bytes they asked for, over all of them. With -S, evaluations are
+ * counted and timed as calcServer does (see calc_enable_stats), to show
+ * what that costs. Progress goes to stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "calc.h"
+
+/* largest dictionary measured, unless -m is given */
+#define DEFAULT_MAX_VARS 10000000
+
+/* timed repetitions of each measurement, unless -r is given */
+#define DEFAULT_REPS 5
+
+/* how long one repetition should take, in milliseconds, unless -t is given */
+#define DEFAULT_REP_MS 20
+
+/*
+ * distinct expressions of each shape, evaluated in turn; enough that in
+ * the large dictionaries the variables they touch don't fit in the caches
+ */
+#define NUM_EXPRS 65536
+
+/* longest expression */
+#define EXPR_SIZE 48
+
+/* glibc's allocator, which the replacements below count calls into */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t num, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+/* allocations and bytes requested since the program started */
+static unsigned long long num_allocs, num_alloc_bytes;
+
+void *malloc(size_t size) {
+	__atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&num_alloc_bytes, size, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+	__atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&num_alloc_bytes, num * size, __ATOMIC_RELAXED);
+	return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	__atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&num_alloc_bytes, size, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+}
+
+/**
+ * One expression shape. Its expressions are made by replacing each X, Y
+ * and Z of the template with a variable picked at random from the
+ * dictionary, and 0 with the variable "nothing", which holds 0 and is
+ * longer than any name in the dictionary.
+ *
+ * @param name Name of the shape in the output
+ * @param template The template
+ * @param ok Whether its expressions evaluate successfully
+ */
+struct Shape {
+	const char *name;
+	const char *template;
+	int ok;
+};
+
+static const struct Shape shapes[] = {
+	{ "literal", "42", 1 },
+	{ "var", "X", 1 },
+	{ "int_op_int", "33 + 15", 1 },
+	{ "var_op_var", "X * Y", 1 },
+	{ "assign_int", "X = 7", 1 },
+	{ "assign_var_op_var", "X = Y - Z", 1 },
+	{ "syntax_error", "X + * Y", 0 },
+	{ "undefined_var", "X + undefined", 0 },
+	{ "divide_by_zero", "X = Y / 0", 0 },
+};
+
+#define NUM_SHAPES (sizeof(shapes) / sizeof(shapes[0]))
+
+/**
+ * Get the current time in nanoseconds
+ *
+ * @return monotonic clock reading in nanoseconds
+ */
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Write the variable name for n (in base 26 letters) into buf
+ *
+ * @param buf Buffer of at least 16 bytes
+ * @param n Variable number
+ */
+static void var_name(char *buf, long n) {
+	do {
+		*buf++ = 'a' + n % 26;
+		n /= 26;
+	} while (n > 0);
+	*buf = '\0';
+}
+
+/**
+ * Fill in the expressions of a shape for a dictionary of num_vars variables
+ *
+ * @param shape The shape
+ * @param num_vars Size of the dictionary
+ * @param exprs Where to write NUM_EXPRS expressions
+ * @param seed State of rand_r
+ */
+static void make_exprs(const struct Shape *shape, long num_vars, char exprs[][EXPR_SIZE], unsigned *seed) {
+	for (int i = 0; i < NUM_EXPRS; i++) {
+		char *out = exprs[i];
+		for (const char *t = shape->template; *t != '\0'; t++) {
+			if (*t == 'X' || *t == 'Y' || *t == 'Z') {
+				/* two calls, since RAND_MAX may be as small as 32767 */
+				long n = ((long) rand_r(seed) * (RAND_MAX + 1L) + rand_r(seed)) % num_vars;
+				var_name(out, n);
+				out += strlen(out);
+			} else if (*t == '0') {
+				out += sprintf(out, "nothing");
+			} else {
+				*out++ = *t;
+			}
+		}
+		*out = '\0';
+	}
+}
+
+/**
+ * Evaluate expressions in turn, carrying on where the last call stopped
+ *
+ * @param calc The calculator
+ * @param exprs NUM_EXPRS expressions
+ * @param ops How many evaluations
+ * @return the number that succeeded
+ */
+static long run(struct Calc *calc, char exprs[][EXPR_SIZE], long ops) {
+	static long next;
+	long succeeded = 0;
+	int result;
+	for (long n = 0; n < ops; n++) {
+		succeeded += calc_eval(calc, exprs[next], &result) != 0;
+		next = (next + 1) % NUM_EXPRS;
+	}
+	return succeeded;
+}
+
+/**
+ * Compare doubles, for qsort
+ */
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Measure one shape at one dictionary size and print its line. The warmup
+ * runs until twice the time of a repetition has passed, and also picks
+ * how many evaluations a repetition makes.
+ *
+ * @param calc The calculator, holding the dictionary
+ * @param shape The shape
+ * @param num_vars Size of the dictionary
+ * @param exprs Space for NUM_EXPRS expressions
+ * @param reps Number of repetitions
+ * @param rep_ms Time a repetition should take
+ * @return 0 on success, -1 if an expression did not evaluate as its shape should
+ */
+static int measure(struct Calc *calc, const struct Shape *shape, long num_vars, char exprs[][EXPR_SIZE],
+                   int reps, int rep_ms) {
+	unsigned seed = 1;
+	make_exprs(shape, num_vars, exprs, &seed);
+
+	/* which also brings them into memory */
+	if (run(calc, exprs, NUM_EXPRS) != (shape->ok ? NUM_EXPRS : 0)) {
+		fprintf(stderr, "Error: shape %s did not evaluate as expected\n", shape->name);
+		return -1;
+	}
+
+	long ops = 1024;
+	long long warmup_end = now_ns() + 2LL * rep_ms * 1000000;
+	while (1) {
+		long long start = now_ns();
+		run(calc, exprs, ops);
+		long long elapsed = now_ns() - start;
+		if (start + elapsed >= warmup_end && elapsed * 2 >= rep_ms * 1000000LL) {
+			break;
+		}
+		if (elapsed * 2 < rep_ms * 1000000LL) {
+			ops *= 2;
+		}
+	}
+
+	double ns_op[reps];
+	unsigned long long allocs = num_allocs, bytes = num_alloc_bytes;
+	for (int r = 0; r < reps; r++) {
+		long long start = now_ns();
+		run(calc, exprs, ops);
+		ns_op[r] = (double) (now_ns() - start) / ops;
+	}
+	allocs = num_allocs - allocs;
+	bytes = num_alloc_bytes - bytes;
+
+	qsort(ns_op, reps, sizeof(double), compare_doubles);
+	double total_ops = (double) ops * reps;
+	printf("%s,%ld,%d,%ld,%.1f,%.1f,%.1f,%.3f,%.1f\n", shape->name, num_vars, reps, ops, ns_op[reps / 2], ns_op[0],
+	       ns_op[reps - 1], allocs / total_ops, bytes / total_ops);
+	fflush(stdout);
+	return 0;
+}
+
+/**
+ * Print how to run the benchmark and exit
+ *
+ * @param prog Name it was run as
+ */
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-m max_vars] [-r reps] [-t ms] [-S]\n", prog);
+	fprintf(stderr, "  -m max_vars  largest dictionary, from 10 up by factors of 10 (default: %d)\n", DEFAULT_MAX_VARS);
+	fprintf(stderr, "  -r reps      timed repetitions of each measurement (default: %d)\n", DEFAULT_REPS);
+	fprintf(stderr, "  -t ms        time of one repetition (default: %d)\n", DEFAULT_REP_MS);
+	fprintf(stderr, "  -S           count and time evaluations, see calc_enable_stats\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	long max_vars = DEFAULT_MAX_VARS;
+	int reps = DEFAULT_REPS, rep_ms = DEFAULT_REP_MS;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:r:t:S")) != -1) {
+		if (opt == 'm') {
+			max_vars = atol(optarg);
+		} else if (opt == 'r') {
+			reps = atoi(optarg);
+		} else if (opt == 't') {
+			rep_ms = atoi(optarg);
+		} else if (opt == 'S') {
+			calc_enable_stats(1);
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || max_vars < 10 || reps < 1 || rep_ms < 1) {
+		usage(argv[0]);
+	}
+
+	struct Calc *calc = calc_create();
+	char (*exprs)[EXPR_SIZE] = malloc(NUM_EXPRS * sizeof(*exprs));
+	char expr[EXPR_SIZE], name[16];
+	int result;
+	long defined = 0;
+
+	calc_eval(calc, "nothing = 0", &result);
+	printf("shape,vars,reps,ops_per_rep,ns_op_median,ns_op_min,ns_op_max,allocs_op,bytes_op\n");
+	for (long num_vars = 10; num_vars <= max_vars; num_vars *= 10) {
+		/* the dictionary only grows, so each size adds to the last */
+		long long start = now_ns();
+		for (; defined < num_vars; defined++) {
+			var_name(name, defined);
+			snprintf(expr, sizeof(expr), "%s = %ld", name, defined % 1000 + 1);
+			calc_eval(calc, expr, &result);
+		}
+		fprintf(stderr, "%ld variables (defined in %.2fs, %llu allocations so far)\n", num_vars,
+		        (now_ns() - start) / 1e9, num_allocs);
+
+		for (size_t s = 0; s < NUM_SHAPES; s++) {
+			if (measure(calc, &shapes[s], num_vars, exprs, reps, rep_ms) < 0) {
+				return 1;
+			}
+		}
+	}
+
+	free(exprs);
+	calc_destroy(calc);
+	return 0;
+}
@@ -0,0 +1,229 @@
+/*
+ * calcServer's pool mode: a fixed set of worker threads, started up front,
+ * serves connections that the accepting thread hands over through a
+ * bounded queue of file descriptors.
+ */
+
+#include <stdio.h>
+#include "csapp.h"
+#include "calcProto.h"
+#include "calcPool.h"
+
+/**
+ * Bounded first-in first-out queue of accepted connections, shared by
+ * any number of producers and consumers
+ *
+ * @param fds Ring buffer of file descriptors
+ * @param capacity Size of fds
+ * @param head Index of the oldest file descriptor
+ * @param count Number of queued file descriptors
+ * @param stopping Set when the pool shuts down, so workers stop waiting
+ * @param lock Protects the fields above, and the workers' fds
+ * @param not_empty Signaled when a file descriptor is added
+ * @param not_full Signaled when a file descriptor is removed
+ */
+struct FdQueue {
+	int *fds;
+	unsigned capacity;
+	unsigned head;
+	unsigned count;
+	int stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+/**
+ * What a worker thread needs
+ *
+ * @param registry The server's namespaces
+ * @param queue Queue the workers take connections from
+ * @param thread The worker
+ * @param fd The connection it is serving, or -1
+ */
+struct PoolWorker {
+	struct CalcRegistry *registry;
+	struct FdQueue *queue;
+	pthread_t thread;
+	int fd;
+};
+
+/**
+ * Make an empty queue
+ *
+ * @param queue The queue
+ * @param capacity Most file descriptors it can hold
+ */
+static void queue_init(struct FdQueue *queue, unsigned capacity) {
+	queue->fds = Malloc(capacity * sizeof(int));
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	queue->stopping = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+}
+
+/**
+ * Add a file descriptor to the queue
+ *
+ * @param queue The queue
+ * @param fd The file descriptor
+ * @param wait Whether to wait for room if the queue is full
+ * @return 1 if fd was added, 0 if the queue was full and wait was 0
+ */
+static int queue_push(struct FdQueue *queue, int fd, int wait) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == queue->capacity) {
+		if (!wait) {
+			pthread_mutex_unlock(&queue->lock);
+			return 0;
+		}
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+	}
+	queue->fds[(queue->head + queue->count) % queue->capacity] = fd;
+	queue->count++;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+	return 1;
+}
+
+/**
+ * Remove the oldest file descriptor from the queue, waiting for one if
+ * the queue is empty
+ *
+ * @param queue The queue
+ * @param taken Set to the file descriptor, with the queue locked, so that
+ *        pool_stop always sees which connection a worker serves
+ * @return the file descriptor, or -1 once the pool is stopping
+ */
+static int queue_pop(struct FdQueue *queue, int *taken) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == 0 && !queue->stopping) {
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	}
+	if (queue->stopping) {
+		pthread_mutex_unlock(&queue->lock);
+		return -1;
+	}
+	int fd = queue->fds[queue->head];
+	*taken = fd;
+	queue->head = (queue->head + 1) % queue->capacity;
+	queue->count--;
+	pthread_cond_signal(&queue->not_full);
+	pthread_mutex_unlock(&queue->lock);
+	return fd;
+}
+
+/**
+ * Thread body of a worker: serve queued connections one after another
+ * until the pool stops
+ *
+ * @param arg The worker's PoolWorker
+ * @return NULL
+ */
+static void *pool_worker(void *arg) {
+	struct PoolWorker *worker = arg;
+	int client_fd;
+
+	while ((client_fd = queue_pop(worker->queue, &worker->fd)) >= 0) {
+		chat_with_client(worker->registry, client_fd);
+		pthread_mutex_lock(&worker->queue->lock);
+		worker->fd = -1;
+		pthread_mutex_unlock(&worker->queue->lock);
+		close(client_fd);
+	}
+	return NULL;
+}
+
+/**
+ * Stop the workers and free the pool: queued connections are closed, and
+ * those being served are shut down, so that every worker finishes its
+ * session and returns, and is joined. Nothing uses the registry once this
+ * returns.
+ *
+ * @param queue The queue
+ * @param workers The workers
+ * @param num_started How many of them were started
+ */
+static void pool_stop(struct FdQueue *queue, struct PoolWorker *workers, unsigned num_started) {
+	pthread_mutex_lock(&queue->lock);
+	queue->stopping = 1;
+	for (; queue->count > 0; queue->count--) {
+		close(queue->fds[queue->head]);
+		queue->head = (queue->head + 1) % queue->capacity;
+	}
+	for (unsigned i = 0; i < num_started; i++) {
+		if (workers[i].fd >= 0) {
+			shutdown(workers[i].fd, SHUT_RDWR);
+		}
+	}
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+
+	for (unsigned i = 0; i < num_started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	free(workers);
+	free(queue->fds);
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+}
+
+/**
+ * Start the workers, then accept connections and queue them forever
+ *
+ * @param registry The server's namespaces
+ * @param listenfd The listening socket
+ * @param num_workers Number of worker threads, 0 for one per online core
+ * @param queue_size Most accepted connections waiting for a worker
+ * @param full_policy What to do with a connection when the queue is full
+ * @return -1 on error, once every worker has stopped (it does not return
+ *         otherwise)
+ */
+int pool_run(struct CalcRegistry *registry, int listenfd, unsigned num_workers,
+             unsigned queue_size, enum PoolFullPolicy full_policy) {
+	if (num_workers == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		num_workers = cores > 0 ? (unsigned) cores : 1;
+	}
+
+	struct FdQueue queue;
+	queue_init(&queue, queue_size > 0 ? queue_size : 1);
+
+	struct PoolWorker *workers = Malloc(num_workers * sizeof(struct PoolWorker));
+	for (unsigned i = 0; i < num_workers; i++) {
+		workers[i].registry = registry;
+		workers[i].queue = &queue;
+		workers[i].fd = -1;
+		int rc = pthread_create(&workers[i].thread, NULL, pool_worker, &workers[i]);
+		if (rc != 0) {
+			pool_stop(&queue, workers, i);
+			errno = rc;
+			return -1;
+		}
+	}
+
+	while (1) {
+		int client_fd = accept(listenfd, NULL, NULL);
+		if (client_fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno == EMFILE || errno == ENFILE) {
+				usleep(10000);		/* out of descriptors until a connection closes */
+				continue;
+			}
+			int saved = errno;
+			pool_stop(&queue, workers, num_workers);
+			errno = saved;		/* for the caller's message */
+			return -1;
+		}
+
+		if (!queue_push(&queue, client_fd, full_policy == POOL_FULL_BLOCK)) {
+			close(client_fd);		/* every worker is busy and the queue is full */
+		}
+	}
+}
@@ -0,0 +1,15 @@
+#ifndef CALCPOOL_H
+#define CALCPOOL_H
+
+#include "calcRegistry.h"
+
+/* What the accepting thread does with a connection when the queue is full */
+enum PoolFullPolicy {
+	POOL_FULL_BLOCK,	/* wait for a worker to take a connection */
+	POOL_FULL_REJECT,	/* close the new connection right away */
+};
+
+int pool_run(struct CalcRegistry *registry, int listenfd, unsigned num_workers,
+             unsigned queue_size, enum PoolFullPolicy full_policy);
+
+#endif /* CALCPOOL_H */
@@ -0,0 +1,671 @@
+/*
+ * The line protocol spoken by calcServer: each line of input is an
+ * expression, whose value (or "Error") is sent back on a line of its own,
+ * or one of the commands "quit" and "shutdown", or "USE <namespace>" or
+ * "SNAPSHOT", which are answered "OK" (or "Error"), or "REPLICATION",
+ * which is answered with a line describing replication (see
+ * replication_status), or "Error" if there is none, or "stats", which is
+ * answered with lines "STAT <name> <value>" and a final "END" (see
+ * format_stats), or "trace dump", which writes the trace buffers to the
+ * file given to proto_set_trace_path and is answered "OK" (or "Error").
+ * A client may instead
+ * speak the binary protocol of calcBinProto.c; a ProtoSession tracks
+ * which. Apart from chat_with_client, which serves a blocking socket,
+ * these functions work on buffers rather than sockets so that every
+ * server mode can share them. Event loops that defer commits hold back a
+ * session's output until its assignments are on disk, see
+ * proto_session_ready.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "csapp.h"
+#include "calcProto.h"
+#include "calcBinProto.h"
+#include "calcReplica.h"
+
+/* initial capacity of an OutBuf */
+#define OUTBUF_INITIAL 4096
+
+/* names of the expression shapes and error causes in the stats output */
+static const char *const shape_names[CALC_NUM_SHAPES] = {
+	"literal", "variable", "arithmetic", "assignment", "invalid"
+};
+static const char *const error_names[CALC_NUM_ERRORS] = {
+	"syntax", "undefined", "divide_by_zero", "read_only", "log"
+};
+
+/* sessions started since the server started, and those not yet ended */
+static unsigned long connections_total, connections_open;
+
+/* where "trace dump" writes, or NULL if the server isn't tracing */
+static const char *trace_path;
+
+/**
+ * Set the file that the "trace dump" command writes the trace buffers to,
+ * see calc_trace_dump
+ *
+ * @param path The file, or NULL to refuse the command
+ */
+void proto_set_trace_path(const char *path) {
+	trace_path = path;
+}
+
+/**
+ * Make an empty output buffer; no memory is allocated until it is needed
+ *
+ * @param out The buffer
+ */
+void outbuf_init(struct OutBuf *out) {
+	out->data = NULL;
+	out->len = 0;
+	out->cap = 0;
+}
+
+/**
+ * Release the memory of an output buffer
+ *
+ * @param out The buffer
+ */
+void outbuf_free(struct OutBuf *out) {
+	free(out->data);
+	outbuf_init(out);
+}
+
+/**
+ * Add bytes to the end of an output buffer, growing it if necessary
+ *
+ * @param out The buffer
+ * @param data Bytes to add
+ * @param len Number of bytes
+ */
+void outbuf_append(struct OutBuf *out, const char *data, size_t len) {
+	if (out->len + len > out->cap) {
+		size_t cap = out->cap == 0 ? OUTBUF_INITIAL : out->cap;
+		while (cap < out->len + len) {
+			cap *= 2;
+		}
+		out->data = Realloc(out->data, cap);
+		out->cap = cap;
+	}
+	memcpy(out->data + out->len, data, len);
+	out->len += len;
+}
+
+/**
+ * Drop bytes that have been written from the front of an output buffer
+ *
+ * @param out The buffer
+ * @param n Number of bytes written, at most out->len
+ */
+void outbuf_consume(struct OutBuf *out, size_t n) {
+	out->len -= n;
+	memmove(out->data, out->data + n, out->len);
+}
+
+/**
+ * Check whether a line is "word" followed only by a line ending. The
+ * ending may be "\r\n", and proto_process leaves the "\r" of it when it
+ * cuts off the "\n".
+ *
+ * @param line The line
+ * @param word The command word
+ * @return 1 if it matches, 0 otherwise
+ */
+static int is_command(const char *line, const char *word) {
+	size_t len = strlen(word);
+	if (strncmp(line, word, len) != 0) {
+		return 0;
+	}
+	line += len;
+	return strcmp(line, "") == 0 || strcmp(line, "\r") == 0 || strcmp(line, "\n") == 0 || strcmp(line, "\r\n") == 0;
+}
+
+/**
+ * Decide what a line of input asks for
+ *
+ * @param line The line, with or without its newline
+ * @return PROTO_QUIT or PROTO_SHUTDOWN for those commands, PROTO_EXPR otherwise
+ */
+enum ProtoCommand proto_command(const char *line) {
+	if (is_command(line, "quit")) {
+		return PROTO_QUIT;
+	}
+	if (is_command(line, "shutdown")) {
+		return PROTO_SHUTDOWN;
+	}
+	return PROTO_EXPR;
+}
+
+/**
+ * Check whether a line is "USE <namespace>", and find the name
+ *
+ * @param line The line, without its newline
+ * @param name Set to the start of the name
+ * @param len Set to the length of the name
+ * @return 1 if it is, 0 otherwise
+ */
+static int is_use(const char *line, const char **name, size_t *len) {
+	if (strncmp(line, "USE", 3) != 0 || (line[3] != ' ' && line[3] != '\t')) {
+		return 0;
+	}
+	line += 3;
+	line += strspn(line, " \t");
+	*name = line;
+	*len = strcspn(line, " \t\r");
+	line += *len;
+	return *len > 0 && line[strspn(line, " \t\r")] == '\0';
+}
+
+/**
+ * Append the result of each expression of a batch, or "Error" if it
+ * couldn't be evaluated, to an output buffer
+ *
+ * @param out The buffer
+ * @param results Values of the expressions
+ * @param status Whether each expression was evaluated
+ * @param count Number of expressions
+ */
+void proto_format_results(struct OutBuf *out, const int *results, const int *status, size_t count) {
+	char buf[16];
+
+	for (size_t i = 0; i < count; i++) {
+		if (status[i] == 0) {
+			/* expression couldn't be evaluated */
+			outbuf_append(out, "Error\n", 6);
+		} else {
+			/* output result */
+			int len = snprintf(buf, sizeof(buf), "%d\n", results[i]);
+			outbuf_append(out, buf, len);
+		}
+	}
+}
+
+/**
+ * Evaluate a batch of expressions in the session's namespace and append
+ * their results
+ *
+ * @param session The client's session
+ * @param exprs The expressions
+ * @param count Number of expressions
+ * @param out The buffer for the results
+ */
+static void eval_batch(struct ProtoSession *session, const char **exprs, size_t count, struct OutBuf *out) {
+	int results[MAX_BATCH], status[MAX_BATCH];
+	size_t start = out->len;
+
+	calc_eval_batch(session->calc, exprs, count, results, status);
+	proto_format_results(out, results, status, count);
+	proto_session_hold(session, start);
+}
+
+/**
+ * Append a "STAT <name> <value>" line to the stats output
+ *
+ * @param out The buffer for the output
+ * @param name The statistic's name
+ * @param value Its value, already formatted
+ */
+static void stat_line(struct OutBuf *out, const char *name, const char *value) {
+	outbuf_append(out, "STAT ", 5);
+	outbuf_append(out, name, strlen(name));
+	outbuf_append(out, " ", 1);
+	outbuf_append(out, value, strlen(value));
+	outbuf_append(out, "\n", 1);
+}
+
+/**
+ * Find the bucket of a latency histogram that holds a percentile
+ *
+ * @param latency The histogram, see CalcStats
+ * @param count Number of values in it
+ * @param percent Which percentile
+ * @return the largest time of that bucket, in nanoseconds, or 0 if there
+ *         are no values
+ */
+static unsigned long long latency_percentile(const unsigned long long *latency, unsigned long long count,
+                                             double percent) {
+	unsigned long long rank = (unsigned long long) (percent / 100 * count + 0.5), seen = 0;
+	int i = 0;
+	if (count == 0) {
+		return 0;
+	}
+	while (i < CALC_STATS_BUCKETS - 1 && (seen += latency[i]) < (rank > 0 ? rank : 1)) {
+		i++;
+	}
+	return (2ULL << i) - 1;
+}
+
+/**
+ * Append the two stats lines of a set of times: "<summary>" with their
+ * count, mean and percentiles (a percentile is the top of the power-of-two
+ * bucket holding it), and "<detail>" with "from:count" pairs for the
+ * non-empty buckets
+ *
+ * @param out The buffer for the output
+ * @param summary Name of the first line
+ * @param detail Name of the second line
+ * @param total_ns Sum of the times
+ * @param latency Their histogram, see CalcStats
+ */
+static void stat_times(struct OutBuf *out, const char *summary, const char *detail, unsigned long long total_ns,
+                       const unsigned long long *latency) {
+	char value[1024];
+	unsigned long long count = 0;
+	size_t len = 0;
+
+	for (int i = 0; i < CALC_STATS_BUCKETS; i++) {
+		count += latency[i];
+	}
+	snprintf(value, sizeof(value), "count %llu mean_ns %llu p50_ns %llu p99_ns %llu p999_ns %llu", count,
+	         count > 0 ? total_ns / count : 0, latency_percentile(latency, count, 50),
+	         latency_percentile(latency, count, 99), latency_percentile(latency, count, 99.9));
+	stat_line(out, summary, value);
+
+	value[0] = '\0';
+	for (int i = 0; i < CALC_STATS_BUCKETS; i++) {
+		if (latency[i] > 0) {
+			len += snprintf(value + len, sizeof(value) - len, "%s%llu:%llu", len > 0 ? " " : "",
+			                i > 0 ? 1ULL << i : 0, latency[i]);
+		}
+	}
+	stat_line(out, detail, value);
+}
+
+/**
+ * Append the server's statistics, from every thread, as the answer to a
+ * "stats" command: connections, then evaluations and failures by cause,
+ * then the times of each expression shape (see stat_times), then the
+ * acquisitions of shard locks and their wait and hold times
+ *
+ * @param out The buffer for the answer
+ */
+static void format_stats(struct OutBuf *out) {
+	struct CalcStats stats;
+	struct CalcLockStats lock_stats;
+	char name[64], detail[64], value[64];
+	unsigned long long evaluations = 0, errors = 0;
+
+	calc_get_stats(&stats);
+	calc_get_lock_stats(&lock_stats);
+	for (int shape = 0; shape < CALC_NUM_SHAPES; shape++) {
+		evaluations += stats.evaluations[shape];
+	}
+	for (int error = 0; error < CALC_NUM_ERRORS; error++) {
+		errors += stats.errors[error];
+	}
+
+	snprintf(value, sizeof(value), "%lu", __atomic_load_n(&connections_open, __ATOMIC_RELAXED));
+	stat_line(out, "connections_open", value);
+	snprintf(value, sizeof(value), "%lu", __atomic_load_n(&connections_total, __ATOMIC_RELAXED));
+	stat_line(out, "connections_total", value);
+	snprintf(value, sizeof(value), "%llu", evaluations);
+	stat_line(out, "requests", value);
+	snprintf(value, sizeof(value), "%llu", stats.assignments);
+	stat_line(out, "assignments", value);
+	snprintf(value, sizeof(value), "%llu", errors);
+	stat_line(out, "errors", value);
+	for (int error = 0; error < CALC_NUM_ERRORS; error++) {
+		snprintf(name, sizeof(name), "errors_%s", error_names[error]);
+		snprintf(value, sizeof(value), "%llu", stats.errors[error]);
+		stat_line(out, name, value);
+	}
+
+	for (int shape = 0; shape < CALC_NUM_SHAPES; shape++) {
+		snprintf(name, sizeof(name), "shape_%s", shape_names[shape]);
+		snprintf(detail, sizeof(detail), "latency_%s", shape_names[shape]);
+		stat_times(out, name, detail, stats.latency_ns[shape], stats.latency[shape]);
+	}
+
+	snprintf(value, sizeof(value), "%llu", lock_stats.acquisitions);
+	stat_line(out, "lock_acquisitions", value);
+	snprintf(value, sizeof(value), "%llu", lock_stats.contended);
+	stat_line(out, "lock_contended", value);
+	stat_times(out, "lock_wait", "latency_lock_wait", lock_stats.wait_ns, lock_stats.wait);
+	stat_times(out, "lock_hold", "latency_lock_hold", lock_stats.hold_ns, lock_stats.hold);
+	outbuf_append(out, "END\n", 4);
+}
+
+/**
+ * Handle every complete line in a buffer of input: expressions are
+ * evaluated in batches and their results appended to out, and processing
+ * stops after a "quit" or "shutdown" command. A "USE" line switches the
+ * session to another namespace for the lines after it. Newlines in buf are
+ * overwritten. A line that doesn't fit in LINEBUF_SIZE is split, as
+ * rio_readlineb would do, and at the end of input a final line without a
+ * newline is handled too.
+ *
+ * @param session The client's session
+ * @param buf Input received from the client
+ * @param len Number of bytes in buf
+ * @param at_eof Whether the client has finished sending
+ * @param out The buffer for the results
+ * @param command Set to the command that stopped processing, or PROTO_EXPR
+ * @return number of bytes of buf that were used; the rest is an incomplete line
+ */
+size_t proto_process(struct ProtoSession *session, char *buf, size_t len, int at_eof,
+                     struct OutBuf *out, enum ProtoCommand *command) {
+	const char *exprs[MAX_BATCH];
+	char split[LINEBUF_SIZE];
+	const char *name;
+	size_t pos = 0, count = 0, name_len;
+
+	*command = PROTO_EXPR;
+	while (pos < len) {
+		char *line = buf + pos;
+		size_t max = len - pos < LINEBUF_SIZE - 1 ? len - pos : LINEBUF_SIZE - 1;
+		char *newline = memchr(line, '\n', max);
+		int copied = 0;
+
+		if (newline != NULL) {
+			*newline = '\0';
+			pos += newline - line + 1;
+		} else if (max == LINEBUF_SIZE - 1 || at_eof) {
+			/* the rest of this line is still in buf, so terminate a copy */
+			memcpy(split, line, max);
+			split[max] = '\0';
+			line = split;
+			pos += max;
+			copied = 1;
+		} else {
+			break;		/* wait for the rest of the line */
+		}
+
+		*command = proto_command(line);
+		if (*command != PROTO_EXPR) {
+			break;
+		}
+		int use = is_use(line, &name, &name_len);
+		if (use || is_command(line, "SNAPSHOT")) {
+			/* the lines before come first */
+			eval_batch(session, exprs, count, out);
+			count = 0;
+			int ok = use ? proto_session_use(session, name, name_len)
+			             : registry_snapshot(session->registry, session->ns_name) >= 0;
+			outbuf_append(out, ok ? "OK\n" : "Error\n", ok ? 3 : 6);
+			continue;
+		}
+		if (is_command(line, "stats")) {
+			eval_batch(session, exprs, count, out);
+			count = 0;
+			format_stats(out);
+			continue;
+		}
+		if (is_command(line, "trace dump")) {
+			eval_batch(session, exprs, count, out);
+			count = 0;
+			int ok = trace_path != NULL && calc_trace_dump(trace_path) >= 0;
+			outbuf_append(out, ok ? "OK\n" : "Error\n", ok ? 3 : 6);
+			continue;
+		}
+		if (is_command(line, "REPLICATION")) {
+			eval_batch(session, exprs, count, out);
+			count = 0;
+			struct Replication *repl = registry_replication(session->registry);
+			char status[LINEBUF_SIZE];
+			int status_len = repl != NULL ? replication_status(repl, status, sizeof(status) - 1) : -1;
+			if (status_len < 0 || status_len >= (int) sizeof(status) - 1) {
+				outbuf_append(out, "Error\n", 6);
+			} else {
+				status[status_len] = '\n';
+				outbuf_append(out, status, status_len + 1);
+			}
+			continue;
+		}
+		exprs[count++] = line;
+		if (count == MAX_BATCH || copied) {
+			/* split can hold only one line, so evaluate it right away */
+			eval_batch(session, exprs, count, out);
+			count = 0;
+		}
+	}
+
+	/* evaluate the lines before any command as one batch */
+	eval_batch(session, exprs, count, out);
+	return pos;
+}
+
+/**
+ * Start the session of a new client, in DEFAULT_NAMESPACE
+ *
+ * @param session The session
+ * @param registry The server's namespaces
+ */
+void proto_session_init(struct ProtoSession *session, struct CalcRegistry *registry) {
+	session->mode = PROTO_UNDECIDED;
+	session->registry = registry;
+	strcpy(session->ns_name, DEFAULT_NAMESPACE);
+	session->calc = registry_default(registry);
+	session->vars = NULL;
+	session->num_vars = 0;
+	session->holds = NULL;
+	session->num_holds = 0;
+	session->holds_cap = 0;
+	__atomic_add_fetch(&connections_total, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&connections_open, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Release the memory of a session
+ *
+ * @param session The session
+ */
+void proto_session_free(struct ProtoSession *session) {
+	free(session->vars);
+	session->vars = NULL;
+	session->num_vars = 0;
+	free(session->holds);
+	session->holds = NULL;
+	session->num_holds = 0;
+	__atomic_sub_fetch(&connections_open, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Switch a session to a namespace, creating it if needed. Variable ids
+ * bound by the binary protocol belong to the old namespace, so they are
+ * all unbound.
+ *
+ * @param session The client's session
+ * @param name The namespace's name, not necessarily NUL-terminated
+ * @param len Length of name
+ * @return 1 on success, 0 if name is not a valid namespace name
+ */
+int proto_session_use(struct ProtoSession *session, const char *name, size_t len) {
+	struct Calc *calc = registry_get(session->registry, name, len);
+	if (calc == NULL) {
+		return 0;
+	}
+	memcpy(session->ns_name, name, len);
+	session->ns_name[len] = '\0';
+	session->calc = calc;
+	if (session->num_vars > 0) {
+		memset(session->vars, 0, session->num_vars * sizeof(struct CalcVar *));
+	}
+	return 1;
+}
+
+/**
+ * Handle a client's input with whichever protocol it speaks, deciding
+ * from the first byte it sends: BIN_MAGIC selects the binary protocol and
+ * anything else is the first character of a line of text.
+ *
+ * @param session The client's session
+ * @param buf Input received from the client, which may be overwritten
+ * @param len Number of bytes in buf
+ * @param at_eof Whether the client has finished sending
+ * @param out The buffer for the results
+ * @param command Set to the command that stopped processing, or PROTO_EXPR
+ * @return number of bytes of buf that were used
+ */
+size_t proto_session_process(struct ProtoSession *session, char *buf, size_t len, int at_eof,
+                             struct OutBuf *out, enum ProtoCommand *command) {
+	size_t skip = 0;
+
+	if (session->mode == PROTO_UNDECIDED && len > 0) {
+		if ((unsigned char) buf[0] == BIN_MAGIC) {
+			session->mode = PROTO_BINARY;
+			skip = 1;
+		} else {
+			session->mode = PROTO_TEXT;
+		}
+	}
+
+	if (session->mode == PROTO_BINARY) {
+		return skip + binproto_process(session, buf + skip, len - skip, out, command);
+	}
+	return proto_process(session, buf, len, at_eof, out, command);
+}
+
+/**
+ * Hold back the output from start on until the assignments that the
+ * calling thread deferred (see calc_defer_commits) in the session's
+ * namespace are on disk. Does nothing if there were none.
+ *
+ * @param session The client's session
+ * @param start Offset in the output buffer of the results of those assignments
+ */
+void proto_session_hold(struct ProtoSession *session, size_t start) {
+	unsigned long long lsn = calc_take_commit(session->calc);
+	if (lsn == 0) {
+		return;
+	}
+
+	struct ProtoHold *last = session->num_holds > 0 ? &session->holds[session->num_holds - 1] : NULL;
+	if (last != NULL && last->calc == session->calc) {
+		/* later output waits for the earlier anyway */
+		if (lsn > last->lsn) {
+			last->lsn = lsn;
+		}
+		return;
+	}
+	if (session->num_holds == session->holds_cap) {
+		session->holds_cap = session->holds_cap == 0 ? 4 : session->holds_cap * 2;
+		session->holds = Realloc(session->holds, session->holds_cap * sizeof(struct ProtoHold));
+	}
+	last = &session->holds[session->num_holds++];
+	last->calc = session->calc;
+	last->lsn = lsn;
+	last->start = start;
+	last->notified_lsn = 0;
+}
+
+/**
+ * Find how much of the session's output may be sent, forgetting the holds
+ * whose assignments are now on disk. If the oldest hold still waits,
+ * notifier is woken once it may be sent, and this is to be asked again;
+ * the later holds are notified about too, so that logs of other
+ * namespaces sync meanwhile.
+ *
+ * @param session The client's session
+ * @param len Length of the output buffer
+ * @param notifier Wakes the session's event loop
+ * @return number of bytes at the start of the output that may be sent, or
+ *         -1 if held assignments were undone because the log failed, in
+ *         which case their results must never be sent
+ */
+long proto_session_ready(struct ProtoSession *session, size_t len, struct CalcNotifier *notifier) {
+	while (session->num_holds > 0) {
+		struct ProtoHold *hold = &session->holds[0];
+		int status;
+		if (hold->notified_lsn != hold->lsn) {
+			status = calc_notify_commit(hold->calc, hold->lsn, notifier);
+			hold->notified_lsn = hold->lsn;
+		} else {
+			status = calc_commit_status(hold->calc, hold->lsn);
+		}
+		if (status < 0) {
+			return -1;
+		}
+		if (status == 0) {
+			for (size_t i = 1; i < session->num_holds; i++) {
+				struct ProtoHold *later = &session->holds[i];
+				if (later->notified_lsn != later->lsn) {
+					calc_notify_commit(later->calc, later->lsn, notifier);
+					later->notified_lsn = later->lsn;
+				}
+			}
+			return (long) hold->start;
+		}
+		session->num_holds--;
+		memmove(session->holds, session->holds + 1, session->num_holds * sizeof(struct ProtoHold));
+	}
+	return (long) len;
+}
+
+/**
+ * Account for bytes sent from the start of the session's output, which
+ * proto_session_ready allowed
+ *
+ * @param session The client's session
+ * @param n Number of bytes sent and consumed from the output buffer
+ */
+void proto_session_sent(struct ProtoSession *session, size_t n) {
+	for (size_t i = 0; i < session->num_holds; i++) {
+		session->holds[i].start -= n;
+	}
+}
+
+/**
+ * Read lines of input, evaluate them as calculator expressions,
+ * and (if evaluation was successful) print the result of each
+ * expression.  Quit when "quit" command is received.
+ *
+ * Every complete line that one read returns is evaluated before anything
+ * is written, and all of their results go out in a single write, so a
+ * client that pipelines many lines costs a couple of system calls per
+ * CHAT_INBUF of input rather than per line. With tracing on, each read,
+ * the handling of what it returned, and each write are traced.
+ * 
+ * @param registry The server's namespaces
+ * @param client_fd client file descriptor
+ * @return 0 if the client sent "shutdown", 1 otherwise
+ */
+int chat_with_client(struct CalcRegistry *registry, int client_fd) {
+	char in[CHAT_INBUF];
+	size_t in_len = 0;
+	struct ProtoSession session;
+	struct OutBuf out;
+	enum ProtoCommand command = PROTO_EXPR;
+
+	proto_session_init(&session, registry);
+	outbuf_init(&out);
+
+	int done = 0;
+	while (!done) {
+		calc_trace_begin(CALC_TRACE_READ, 0);
+		ssize_t n = read(client_fd, in + in_len, sizeof(in) - in_len);
+		calc_trace_end(CALC_TRACE_READ, n > 0 ? n : 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			/* error or end of input */
+			done = 1;
+		} else {
+			in_len += n;
+		}
+
+		/* evaluate every complete request, keeping the start of an incomplete one */
+		calc_trace_begin(CALC_TRACE_PROCESS, in_len);
+		size_t used = proto_session_process(&session, in, in_len, done, &out, &command);
+		calc_trace_end(CALC_TRACE_PROCESS, used);
+		in_len -= used;
+		memmove(in, in + used, in_len);
+		if (command != PROTO_EXPR) {
+			done = 1;
+		}
+
+		if (out.len > 0) {
+			calc_trace_begin(CALC_TRACE_WRITE, out.len);
+			if (rio_writen(client_fd, out.data, out.len) < 0) {
+				done = 1;
+			}
+			calc_trace_end(CALC_TRACE_WRITE, out.len);
+			outbuf_consume(&out, out.len);
+		}
+	}
+
+	outbuf_free(&out);
+	proto_session_free(&session);
+	return command != PROTO_SHUTDOWN;
+}
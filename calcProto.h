@@ -0,0 +1,102 @@
+#ifndef CALCPROTO_H
+#define CALCPROTO_H
+
+#include <stddef.h>
+#include "calc.h"
+#include "calcRegistry.h"
+
+/* longest line of input, including its terminator; longer lines are split */
+#define LINEBUF_SIZE 1024
+
+/* bytes of input chat_with_client reads at once */
+#define CHAT_INBUF 65536
+
+/* most lines evaluated together by calc_eval_batch */
+#define MAX_BATCH 32
+
+/* What a line of input asks the server to do */
+enum ProtoCommand {
+	PROTO_EXPR,		/* evaluate the line as an expression */
+	PROTO_QUIT,		/* end the session */
+	PROTO_SHUTDOWN,	/* end the session, as requested by "shutdown" */
+};
+
+/* Which protocol a client speaks, decided by its first byte */
+enum ProtoMode {
+	PROTO_UNDECIDED,	/* nothing received yet */
+	PROTO_TEXT,		/* lines of text, see proto_process */
+	PROTO_BINARY,	/* frames, see calcBinProto.h */
+};
+
+/*
+ * Output that must not be sent until assignments are on disk, see
+ * proto_session_ready
+ *
+ * @param calc The Calc the assignments went to
+ * @param lsn The log position they reached
+ * @param start Offset in the output buffer of their results
+ * @param notified_lsn The position calc_notify_commit was last asked about
+ */
+struct ProtoHold {
+	struct Calc *calc;
+	unsigned long long lsn;
+	size_t start;
+	unsigned long long notified_lsn;
+};
+
+/*
+ * What the server remembers about one client between reads
+ *
+ * @param mode The protocol the client speaks
+ * @param registry The server's namespaces
+ * @param ns_name The name of the namespace the client uses
+ * @param calc Its Calc
+ * @param vars Variables bound to ids by the binary protocol
+ * @param num_vars Size of vars; unbound ids are NULL
+ * @param holds Output held back for deferred commits, oldest first
+ * @param num_holds Number of holds
+ * @param holds_cap Capacity of holds
+ */
+struct ProtoSession {
+	enum ProtoMode mode;
+	struct CalcRegistry *registry;
+	char ns_name[NAMESPACE_MAX + 1];
+	struct Calc *calc;
+	struct CalcVar **vars;
+	size_t num_vars;
+	struct ProtoHold *holds;
+	size_t num_holds;
+	size_t holds_cap;
+};
+
+/* Output waiting to be written to a client; data grows as needed */
+struct OutBuf {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+void outbuf_init(struct OutBuf *out);
+void outbuf_free(struct OutBuf *out);
+void outbuf_append(struct OutBuf *out, const char *data, size_t len);
+void outbuf_consume(struct OutBuf *out, size_t n);
+
+enum ProtoCommand proto_command(const char *line);
+void proto_format_results(struct OutBuf *out, const int *results, const int *status, size_t count);
+size_t proto_process(struct ProtoSession *session, char *buf, size_t len, int at_eof,
+                     struct OutBuf *out, enum ProtoCommand *command);
+
+void proto_session_init(struct ProtoSession *session, struct CalcRegistry *registry);
+void proto_session_free(struct ProtoSession *session);
+int proto_session_use(struct ProtoSession *session, const char *name, size_t len);
+size_t proto_session_process(struct ProtoSession *session, char *buf, size_t len, int at_eof,
+                             struct OutBuf *out, enum ProtoCommand *command);
+void proto_session_hold(struct ProtoSession *session, size_t start);
+long proto_session_ready(struct ProtoSession *session, size_t len, struct CalcNotifier *notifier);
+void proto_session_sent(struct ProtoSession *session, size_t n);
+
+void proto_set_trace_path(const char *path);
+
+int chat_with_client(struct CalcRegistry *registry, int client_fd);
+
+#endif /* CALCPROTO_H */
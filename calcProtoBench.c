@@ -0,0 +1,235 @@
+/*
+ * Throughput benchmark comparing calcServer's text and binary protocols:
+ * over one connection each, a client pipelines the same assignments as
+ * lines of text and as binary frames, and times until every response
+ * has arrived.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "calcBinProto.h"
+
+/* requests sent over each connection, unless given on the command line */
+#define DEFAULT_REQUESTS 2000000
+
+/**
+ * A connection and everything one side of the benchmark sends over it
+ *
+ * @param fd The connection
+ * @param data Requests to send
+ * @param len Bytes in data
+ */
+struct Sender {
+	int fd;
+	const char *data;
+	size_t len;
+};
+
+/**
+ * Get the current time in nanoseconds
+ *
+ * @return monotonic clock reading in nanoseconds
+ */
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Connect to the server
+ *
+ * @param port The server's port
+ * @return the connection, or -1 on error
+ */
+static int connect_server(const char *port) {
+	struct addrinfo hints, *addr;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	if (getaddrinfo("localhost", port, &hints, &addr) != 0) {
+		return -1;
+	}
+	int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addr);
+	return fd;
+}
+
+/**
+ * Thread body that writes all the requests, so that the responses can be
+ * read at the same time
+ *
+ * @param arg Sender
+ * @return NULL
+ */
+static void *send_all(void *arg) {
+	struct Sender *sender = arg;
+	size_t sent = 0;
+	while (sent < sender->len) {
+		ssize_t n = write(sender->fd, sender->data + sent, sender->len - sent);
+		if (n <= 0) {
+			break;
+		}
+		sent += n;
+	}
+	return NULL;
+}
+
+/**
+ * Send data over a new connection and read response_bytes of responses
+ *
+ * @param port The server's port
+ * @param data Requests
+ * @param len Bytes of requests
+ * @param response_bytes Bytes of responses expected
+ * @return seconds from connecting until the last response, or -1 on error
+ */
+static double run(const char *port, const char *data, size_t len, size_t response_bytes) {
+	int fd = connect_server(port);
+	if (fd < 0) {
+		return -1;
+	}
+
+	long long start = now_ns();
+	struct Sender sender = { fd, data, len };
+	pthread_t thread;
+	pthread_create(&thread, NULL, send_all, &sender);
+
+	static char buf[1 << 16];
+	size_t received = 0;
+	while (received < response_bytes) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n <= 0) {
+			break;
+		}
+		received += n;
+	}
+	double elapsed = (double) (now_ns() - start) / 1e9;
+
+	pthread_join(thread, NULL);
+	close(fd);
+	return received == response_bytes ? elapsed : -1;
+}
+
+/**
+ * Append a little-endian integer of size bytes
+ *
+ * @param p Where to write
+ * @param v The integer
+ * @param size 1, 2 or 4
+ * @return p advanced past the integer
+ */
+static char *put(char *p, unsigned v, int size) {
+	for (int i = 0; i < size; i++) {
+		*p++ = (char) (v >> (8 * i));
+	}
+	return p;
+}
+
+/**
+ * Append a binary frame binding id to name
+ *
+ * @param p Where to write
+ * @param id The variable id
+ * @param name The variable name
+ * @return p advanced past the frame
+ */
+static char *put_bind(char *p, unsigned id, const char *name) {
+	size_t len = strlen(name);
+	p = put(p, 1 + 4 + len, 2);
+	p = put(p, BIN_BIND, 1);
+	p = put(p, id, 4);
+	memcpy(p, name, len);
+	return p + len;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s <port> [requests]\n", argv[0]);
+		return 1;
+	}
+	const char *port = argv[1];
+	long num_requests = argc > 2 ? atol(argv[2]) : DEFAULT_REQUESTS;
+	if (num_requests <= 0) {
+		fprintf(stderr, "requests must be positive\n");
+		return 1;
+	}
+
+	/* text: "a = 17", "b = 4", then "c = a * K + b" for varying K */
+	char *text = malloc(32 * (num_requests + 3));
+	char *p = text;
+	p += sprintf(p, "a = 17\nb = 4\n");
+	for (long i = 0; i < num_requests; i++) {
+		p += sprintf(p, "c = a * %ld + b\n", i % 1000);
+	}
+	p += sprintf(p, "quit\n");
+	size_t text_len = p - text;
+
+	/* binary: the same, with a, b and c bound to ids 0, 1 and 2 */
+	char *binary = malloc(32 * (num_requests + 8));
+	p = binary;
+	*p++ = (char) BIN_MAGIC;
+	p = put_bind(p, 0, "a");
+	p = put_bind(p, 1, "b");
+	p = put_bind(p, 2, "c");
+	p = put(p, 1 + 4 + 5, 2);				/* a = 17 */
+	p = put(p, BIN_EVAL, 1);
+	p = put(p, 0, 4);
+	p = put(p, CALC_OP_PUSH_INT, 1);
+	p = put(p, 17, 4);
+	p = put(p, 1 + 4 + 5, 2);				/* b = 4 */
+	p = put(p, BIN_EVAL, 1);
+	p = put(p, 1, 4);
+	p = put(p, CALC_OP_PUSH_INT, 1);
+	p = put(p, 4, 4);
+	for (long i = 0; i < num_requests; i++) {
+		p = put(p, 1 + 4 + 5 + 5 + 1 + 5 + 1, 2);	/* c = a * K + b */
+		p = put(p, BIN_EVAL, 1);
+		p = put(p, 2, 4);
+		p = put(p, CALC_OP_PUSH_VAR, 1);
+		p = put(p, 0, 4);
+		p = put(p, CALC_OP_PUSH_INT, 1);
+		p = put(p, (unsigned) (i % 1000), 4);
+		p = put(p, CALC_OP_MUL, 1);
+		p = put(p, CALC_OP_PUSH_VAR, 1);
+		p = put(p, 1, 4);
+		p = put(p, CALC_OP_ADD, 1);
+	}
+	p = put(p, 1, 2);
+	p = put(p, BIN_QUIT, 1);
+	size_t binary_len = p - binary;
+
+	/* every text response is the value and a newline */
+	size_t text_response = strlen("17\n4\n");
+	for (long i = 0; i < num_requests; i++) {
+		char buf[16];
+		text_response += sprintf(buf, "%ld\n", 17 * (i % 1000) + 4);
+	}
+	size_t binary_response = (size_t) (num_requests + 5) * BIN_RESPONSE_SIZE;
+
+	double text_s = run(port, text, text_len, text_response);
+	double binary_s = run(port, binary, binary_len, binary_response);
+	if (text_s < 0 || binary_s < 0) {
+		fprintf(stderr, "Error: the server did not answer every request\n");
+		return 1;
+	}
+
+	printf("%ld requests of c = a * K + b\n", num_requests);
+	printf("%-8s %12s %12s %12s\n", "protocol", "bytes sent", "seconds", "Mreq/s");
+	printf("%-8s %12zu %12.3f %12.2f\n", "text", text_len, text_s, num_requests / text_s / 1e6);
+	printf("%-8s %12zu %12.3f %12.2f\n", "binary", binary_len, binary_s, num_requests / binary_s / 1e6);
+
+	free(text);
+	free(binary);
+	return 0;
+}
@@ -0,0 +1,562 @@
+/*
+ * Event loop for calcServer's epoll mode: one thread serves every
+ * connection through non-blocking sockets, keeping each connection's
+ * unprocessed input and unsent output in its own buffers. In reuseport
+ * mode several such loops run, each accepting from a listening socket of
+ * its own. The loop defers commits (see calc_defer_commits), so that it
+ * never waits for the log: output that must wait for assignments to reach
+ * the disk is held back, and its connection parked, until the log's
+ * background thread wakes the loop through an eventfd.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "csapp.h"
+#include "calcProto.h"
+#include "calcReactor.h"
+
+/* bytes of input buffered per connection, at least LINEBUF_SIZE */
+#define CONN_INBUF 4096
+
+/* stop reading from a connection while this much output is unsent */
+#define OUT_HIGH_WATER (64 * 1024)
+
+/* most events handled per epoll_wait */
+#define MAX_EVENTS 256
+
+/**
+ * What a thread of the multi-reactor needs
+ *
+ * @param registry The server's namespaces
+ * @param listenfd This reactor's own listening socket
+ * @param stopfd Readable once the reactors are to stop
+ */
+struct ReactorInfo {
+	struct CalcRegistry *registry;
+	int listenfd;
+	int stopfd;
+};
+
+/* mark the epoll events of a reactor's stopfd and commitfd, as NULL marks its listenfd */
+static const char stop_marker, commit_marker;
+
+/**
+ * State of one event loop
+ *
+ * @param epfd The epoll instance
+ * @param conns The loop's connections, so that it can close them all
+ * @param parked Those whose output is held for deferred commits
+ * @param notifier Wakes the loop through its commitfd once commits settle
+ */
+struct Reactor {
+	int epfd;
+	struct Conn *conns;
+	struct Conn *parked;
+	struct CalcNotifier *notifier;
+};
+
+/**
+ * State of one client connection
+ *
+ * @param fd The connection's socket
+ * @param in Input not yet processed, which is an incomplete request
+ * @param in_len Number of bytes in in
+ * @param session The protocol state of the client
+ * @param out Output not yet written
+ * @param sendable Bytes at the start of out that no deferred commit holds
+ * @param events Events currently registered with epoll
+ * @param closing Set once the session is over; close after out is written
+ * @param prev The previous connection of the same reactor
+ * @param next The next one
+ * @param parked Whether the connection is on the reactor's parked list
+ * @param parked_prev The previous connection on that list
+ * @param parked_next The next one
+ * @param reactor The reactor serving the connection
+ */
+struct Conn {
+	int fd;
+	char in[CONN_INBUF];
+	size_t in_len;
+	struct ProtoSession session;
+	struct OutBuf out;
+	size_t sendable;
+	uint32_t events;
+	int closing;
+	struct Conn *prev, *next;
+	int parked;
+	struct Conn *parked_prev, *parked_next;
+	struct Reactor *reactor;
+};
+
+/**
+ * Make a file descriptor non-blocking
+ *
+ * @param fd The file descriptor
+ * @return 0 on success, -1 on error
+ */
+static int set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) {
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Put a connection whose output is held on its reactor's parked list,
+ * unless it is there already
+ *
+ * @param conn The connection
+ */
+static void conn_park(struct Conn *conn) {
+	if (conn->parked) {
+		return;
+	}
+	conn->parked = 1;
+	conn->parked_prev = NULL;
+	conn->parked_next = conn->reactor->parked;
+	if (conn->parked_next != NULL) {
+		conn->parked_next->parked_prev = conn;
+	}
+	conn->reactor->parked = conn;
+}
+
+/**
+ * Take a connection off its reactor's parked list, if it is on it
+ *
+ * @param conn The connection
+ */
+static void conn_unpark(struct Conn *conn) {
+	if (!conn->parked) {
+		return;
+	}
+	if (conn->parked_prev != NULL) {
+		conn->parked_prev->parked_next = conn->parked_next;
+	} else {
+		conn->reactor->parked = conn->parked_next;
+	}
+	if (conn->parked_next != NULL) {
+		conn->parked_next->parked_prev = conn->parked_prev;
+	}
+	conn->parked = 0;
+}
+
+/**
+ * Stop serving a connection and free it
+ *
+ * @param conn The connection
+ */
+static void conn_close(struct Conn *conn) {
+	if (conn->prev != NULL) {
+		conn->prev->next = conn->next;
+	} else {
+		conn->reactor->conns = conn->next;
+	}
+	if (conn->next != NULL) {
+		conn->next->prev = conn->prev;
+	}
+	conn_unpark(conn);
+	epoll_ctl(conn->reactor->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	outbuf_free(&conn->out);
+	proto_session_free(&conn->session);
+	free(conn);
+}
+
+/**
+ * Accept every pending connection and register it with epoll
+ *
+ * @param registry The server's namespaces
+ * @param reactor The reactor, whose connections new ones join
+ * @param listenfd The non-blocking listening socket
+ */
+static void accept_all(struct CalcRegistry *registry, struct Reactor *reactor, int listenfd) {
+	while (1) {
+		int fd = accept(listenfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+				fprintf(stderr, "accept: %s\n", strerror(errno));
+			}
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			return;		/* no more pending connections, or out of descriptors */
+		}
+		if (set_nonblocking(fd) < 0) {
+			close(fd);
+			continue;
+		}
+
+		struct Conn *conn = Malloc(sizeof(struct Conn));
+		conn->fd = fd;
+		conn->in_len = 0;
+		proto_session_init(&conn->session, registry);
+		outbuf_init(&conn->out);
+		conn->sendable = 0;
+		conn->events = EPOLLIN;
+		conn->closing = 0;
+		conn->prev = NULL;
+		conn->next = reactor->conns;
+		conn->parked = 0;
+		conn->reactor = reactor;
+		if (reactor->conns != NULL) {
+			reactor->conns->prev = conn;
+		}
+		reactor->conns = conn;
+
+		struct epoll_event ev;
+		ev.events = conn->events;
+		ev.data.ptr = conn;
+		if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			conn_close(conn);		/* ends its session, which was counted as open */
+		}
+	}
+}
+
+/**
+ * Read what the client has sent and process its complete requests
+ *
+ * @param conn The connection
+ * @return 0 on success, -1 if the connection failed
+ */
+static int conn_read(struct Conn *conn) {
+	ssize_t n = read(conn->fd, conn->in + conn->in_len, CONN_INBUF - conn->in_len);
+	if (n < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+	}
+
+	int at_eof = n == 0;
+	conn->in_len += n;
+
+	enum ProtoCommand command;
+	size_t used = proto_session_process(&conn->session, conn->in, conn->in_len, at_eof, &conn->out, &command);
+	conn->in_len -= used;
+	memmove(conn->in, conn->in + used, conn->in_len);
+
+	if (at_eof || command != PROTO_EXPR) {
+		conn->closing = 1;
+	}
+	return 0;
+}
+
+/**
+ * Write as much pending output as the socket accepts and no deferred
+ * commit holds, parking the connection while some is held
+ *
+ * @param conn The connection
+ * @return 0 on success, -1 if the connection failed or its log did
+ */
+static int conn_write(struct Conn *conn) {
+	long ready = proto_session_ready(&conn->session, conn->out.len, conn->reactor->notifier);
+	if (ready < 0) {
+		return -1;		/* held results were undone, so they must not be sent */
+	}
+
+	size_t written = 0;
+	while (written < (size_t) ready) {
+		ssize_t n = write(conn->fd, conn->out.data + written, ready - written);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			return -1;
+		}
+		written += n;
+	}
+	outbuf_consume(&conn->out, written);
+	proto_session_sent(&conn->session, written);
+	conn->sendable = ready - written;
+	if ((size_t) ready < conn->out.len + written) {
+		conn_park(conn);
+	} else {
+		conn_unpark(conn);
+	}
+	return 0;
+}
+
+/**
+ * Register interest in the events a connection now needs: output if any
+ * may be sent, and input unless the session is over or too much output
+ * is already waiting
+ *
+ * @param conn The connection
+ * @return 0 on success, -1 on error
+ */
+static int conn_update_events(struct Conn *conn) {
+	uint32_t events = 0;
+	if (!conn->closing && conn->out.len < OUT_HIGH_WATER) {
+		events |= EPOLLIN;
+	}
+	if (conn->sendable > 0) {
+		events |= EPOLLOUT;
+	}
+	if (events == conn->events) {
+		return 0;
+	}
+
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = conn;
+	conn->events = events;
+	return epoll_ctl(conn->reactor->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/**
+ * Handle readiness of a connection
+ *
+ * @param conn The connection
+ * @param events The events epoll reported, or 0 to retry held output
+ */
+static void conn_handle(struct Conn *conn, uint32_t events) {
+	if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !conn->closing) {
+		if (conn_read(conn) < 0) {
+			conn_close(conn);
+			return;
+		}
+	}
+
+	if (conn_write(conn) < 0 || (conn->closing && conn->out.len == 0)) {
+		conn_close(conn);
+		return;
+	}
+
+	if (conn_update_events(conn) < 0) {
+		conn_close(conn);
+	}
+}
+
+/**
+ * Retry the held output of every parked connection, once the log's
+ * background thread has written to commitfd. Those still held are parked
+ * again, on a fresh list.
+ *
+ * @param reactor The reactor
+ * @param commitfd The eventfd of its notifier
+ */
+static void resume_parked(struct Reactor *reactor, int commitfd) {
+	eventfd_t count;
+	eventfd_read(commitfd, &count);		/* non-blocking, and reset to 0 */
+
+	struct Conn *conn = reactor->parked;
+	reactor->parked = NULL;
+	while (conn != NULL) {
+		struct Conn *next = conn->parked_next;
+		conn->parked = 0;
+		conn_handle(conn, 0);
+		conn = next;
+	}
+}
+
+/**
+ * Serve clients on the calling thread until stopfd becomes readable or a
+ * fatal error occurs, then close every connection
+ *
+ * @param registry The server's namespaces
+ * @param listenfd The listening socket
+ * @param stopfd Readable once the loop is to stop, or -1 to never stop
+ * @return 0 once stopped, -1 on error
+ */
+static int reactor_loop(struct CalcRegistry *registry, int listenfd, int stopfd) {
+	if (set_nonblocking(listenfd) < 0) {
+		return -1;
+	}
+
+	struct Reactor reactor;
+	reactor.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor.epfd < 0) {
+		return -1;
+	}
+	int commitfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (commitfd < 0) {
+		close(reactor.epfd);
+		return -1;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;		/* the listening socket has no Conn */
+	int ok = epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, listenfd, &ev) == 0;
+	ev.data.ptr = (void *) &commit_marker;
+	ok = ok && epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, commitfd, &ev) == 0;
+	ev.data.ptr = (void *) &stop_marker;
+	ok = ok && (stopfd < 0 || epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, stopfd, &ev) == 0);
+	if (!ok) {
+		close(commitfd);
+		close(reactor.epfd);
+		return -1;
+	}
+
+	reactor.conns = NULL;
+	reactor.parked = NULL;
+	reactor.notifier = calc_notifier_create(commitfd);
+	calc_defer_commits(1);
+
+	struct epoll_event events[MAX_EVENTS];
+	int rc = 1;
+	while (rc > 0) {
+		int n = epoll_wait(reactor.epfd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno != EINTR) {
+				rc = -1;
+			}
+			continue;
+		}
+
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL) {
+				accept_all(registry, &reactor, listenfd);
+			} else if (events[i].data.ptr == &stop_marker) {
+				rc = 0;
+			} else if (events[i].data.ptr == &commit_marker) {
+				resume_parked(&reactor, commitfd);
+			} else {
+				conn_handle(events[i].data.ptr, events[i].events);
+			}
+		}
+	}
+
+	int saved = errno;
+	while (reactor.conns != NULL) {
+		conn_close(reactor.conns);
+	}
+	calc_defer_commits(0);
+	calc_notifier_destroy(reactor.notifier);		/* before commitfd can be reused */
+	close(commitfd);
+	close(reactor.epfd);
+	errno = saved;
+	return rc;
+}
+
+/**
+ * Serve clients on the calling thread until a fatal error occurs
+ *
+ * @param registry The server's namespaces
+ * @param listenfd The listening socket
+ * @return -1 on error (it does not return otherwise)
+ */
+int reactor_run(struct CalcRegistry *registry, int listenfd) {
+	return reactor_loop(registry, listenfd, -1);
+}
+
+/**
+ * Open a listening socket on port that shares the port with other
+ * sockets opened the same way; the kernel spreads new connections across
+ * them. Otherwise like open_listenfd.
+ *
+ * @param port The port number
+ * @return the listening socket, or -1 on error
+ */
+static int open_reuseport_listenfd(const char *port) {
+	struct addrinfo hints, *listp, *p;
+	int listenfd = -1, optval = 1;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+	if (getaddrinfo(NULL, port, &hints, &listp) != 0) {
+		return -1;
+	}
+
+	for (p = listp; p; p = p->ai_next) {
+		listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (listenfd < 0) {
+			continue;
+		}
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+		if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) == 0
+				&& bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+			break;
+		}
+		close(listenfd);
+		listenfd = -1;
+	}
+	freeaddrinfo(listp);
+
+	if (listenfd >= 0 && listen(listenfd, LISTENQ) < 0) {
+		close(listenfd);
+		return -1;
+	}
+	return listenfd;
+}
+
+/**
+ * Thread body of one reactor of the multi-reactor
+ *
+ * @param arg ReactorInfo for this thread
+ * @return NULL when its event loop stops or fails
+ */
+static void *reactor_thread(void *arg) {
+	struct ReactorInfo *info = arg;
+
+	if (reactor_loop(info->registry, info->listenfd, info->stopfd) < 0) {
+		fprintf(stderr, "reactor: %s\n", strerror(errno));
+	}
+	return NULL;
+}
+
+/**
+ * Run num_threads reactors, each with a listening socket of its own on
+ * port, so that accepting is spread across threads by the kernel rather
+ * than serialized on one socket. Every socket is opened before any
+ * thread starts, so that a port that can't be used is reported here. If
+ * a thread can't be started, those already running are stopped through
+ * an eventfd that every reactor watches, and joined, so that nothing uses
+ * the registry once this returns.
+ *
+ * @param registry The server's namespaces
+ * @param port The port number
+ * @param num_threads Number of reactors, 0 for one per online core
+ * @return -1 on error (it does not return otherwise)
+ */
+int multi_reactor_run(struct CalcRegistry *registry, const char *port, unsigned num_threads) {
+	if (num_threads == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = cores > 0 ? (unsigned) cores : 1;
+	}
+
+	int stopfd = eventfd(0, EFD_CLOEXEC);
+	if (stopfd < 0) {
+		return -1;
+	}
+	struct ReactorInfo *infos = Malloc(num_threads * sizeof(struct ReactorInfo));
+	pthread_t *threads = Malloc(num_threads * sizeof(pthread_t));
+	unsigned num_open = 0, num_started = 0;
+	int error = 0;
+
+	for (; num_open < num_threads; num_open++) {
+		infos[num_open].registry = registry;
+		infos[num_open].stopfd = stopfd;
+		infos[num_open].listenfd = open_reuseport_listenfd(port);
+		if (infos[num_open].listenfd < 0) {
+			error = errno;
+			break;
+		}
+	}
+
+	for (; error == 0 && num_started < num_threads; num_started++) {
+		error = pthread_create(&threads[num_started], NULL, reactor_thread, &infos[num_started]);
+		if (error != 0) {
+			eventfd_write(stopfd, 1);		/* stays readable, so every reactor sees it */
+			break;
+		}
+	}
+	for (unsigned i = 0; i < num_started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (unsigned i = 0; i < num_open; i++) {
+		close(infos[i].listenfd);
+	}
+	close(stopfd);
+	free(infos);
+	free(threads);
+	if (error != 0) {
+		errno = error;
+	}
+	return -1;		/* a reactor could not be set up, or every one failed */
+}
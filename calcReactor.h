@@ -0,0 +1,9 @@
+#ifndef CALCREACTOR_H
+#define CALCREACTOR_H
+
+#include "calcRegistry.h"
+
+int reactor_run(struct CalcRegistry *registry, int listenfd);
+int multi_reactor_run(struct CalcRegistry *registry, const char *port, unsigned num_threads);
+
+#endif /* CALCREACTOR_H */
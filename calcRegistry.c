@@ -0,0 +1,656 @@
+/*
+ * Registry of the server's namespaces: each name maps to a calculator of
+ * its own, so clients in different namespaces share neither variables nor
+ * locks. A namespace is created by the first client that uses it and
+ * lives as long as the server; an idle one costs only an empty Calc,
+ * which for a lock-free Calc is a table of opts.namespace_buckets chains,
+ * and there are at most opts.max_namespaces of them. A new namespace is
+ * entered as initializing while its Calc is loaded outside the registry's
+ * lock, so other namespaces stay usable meanwhile; clients wanting the
+ * same one wait for it.
+ * With a log directory, namespace NAME logs its assignments to
+ * NAME.wal there, which is replayed when the namespace is first used.
+ * With a snapshot directory, NAME.snap there is mapped first, and
+ * registry_snapshot saves it. Given an interval too, a background thread
+ * writes each namespace's changes as incremental checkpoints NAME.N.ckpt,
+ * which are applied after the snapshot; a snapshot replaces them.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "csapp.h"
+#include "calcRegistry.h"
+
+/* bucket count of a new registry, a power of two */
+#define INITIAL_BUCKETS 16
+
+/* Where a namespace is in its creation */
+enum NamespaceState {
+	NS_INITIALIZING,	/* its Calc is being loaded */
+	NS_READY,		/* calc can be used */
+	NS_FAILED,		/* its Calc couldn't be loaded; no longer in the registry */
+};
+
+/**
+ * One namespace, in the chain of its bucket
+ *
+ * @param name The name, NUL-terminated
+ * @param hash Hash of name
+ * @param calc The namespace's calculator, once ready
+ * @param state Changed with the registry's lock held exclusively and its
+ *              init_lock held
+ * @param ready Signalled when state leaves NS_INITIALIZING
+ * @param waiting Threads waiting on ready; the last frees a failed namespace
+ * @param next Next namespace in the same bucket
+ */
+struct Namespace {
+	char name[NAMESPACE_MAX + 1];
+	uint64_t hash;
+	struct Calc *calc;
+	enum NamespaceState state;
+	pthread_cond_t ready;
+	int waiting;
+	struct Namespace *next;
+};
+
+/**
+ * @param lock Shared for lookups, exclusive for entering or publishing a namespace
+ * @param init_lock Guards waiting for namespaces being initialized
+ * @param buckets Chains of namespaces by hash
+ * @param mask Bucket count - 1
+ * @param count Number of namespaces, those being initialized included
+ * @param opts Options every namespace is created with
+ * @param wal_dir Copy of opts.wal_dir
+ * @param snapshot_dir Copy of opts.snapshot_dir
+ * @param default_calc Calculator of DEFAULT_NAMESPACE
+ * @param checkpointer Thread writing checkpoints, if checkpointing
+ * @param checkpointing Whether checkpointer was started
+ * @param stop_lock Guards stopping
+ * @param stop Signalled when stopping is set
+ * @param stopping Whether checkpointer should exit
+ * @param watcher Called with every namespace created, or NULL
+ * @param watcher_arg Argument of watcher
+ * @param replication The server's replication, or NULL
+ */
+struct CalcRegistry {
+	pthread_rwlock_t lock;
+	pthread_mutex_t init_lock;
+	struct Namespace **buckets;
+	size_t mask;
+	size_t count;
+	struct RegistryOptions opts;
+	char *wal_dir;
+	char *snapshot_dir;
+	struct Calc *default_calc;
+	pthread_t checkpointer;
+	int checkpointing;
+	pthread_mutex_t stop_lock;
+	pthread_cond_t stop;
+	int stopping;
+	RegistryVisitor watcher;
+	void *watcher_arg;
+	struct Replication *replication;
+};
+
+/**
+ * Hash a name with 64-bit FNV-1a
+ *
+ * @param name The name
+ * @param len Length of name
+ * @return the hash
+ */
+static uint64_t hash_name(const char *name, size_t len) {
+	uint64_t h = 14695981039346656037ull;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char) name[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+/**
+ * Check whether a namespace name is valid: 1 to NAMESPACE_MAX letters,
+ * digits, '_' or '-'
+ *
+ * @param name The name
+ * @param len Length of name
+ * @return 1 if valid, 0 otherwise
+ */
+static int valid_name(const char *name, size_t len) {
+	if (len == 0 || len > NAMESPACE_MAX) {
+		return 0;
+	}
+	for (size_t i = 0; i < len; i++) {
+		if (!isalnum((unsigned char) name[i]) && name[i] != '_' && name[i] != '-') {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Find a namespace; the caller holds the lock
+ *
+ * @param registry The registry
+ * @param name The name
+ * @param len Length of name
+ * @param hash Hash of name
+ * @return the namespace, or NULL if there is none by that name
+ */
+static struct Namespace *find(struct CalcRegistry *registry, const char *name, size_t len, uint64_t hash) {
+	struct Namespace *ns = registry->buckets[hash & registry->mask];
+	for (; ns != NULL; ns = ns->next) {
+		if (ns->hash == hash && strlen(ns->name) == len && memcmp(ns->name, name, len) == 0) {
+			return ns;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Double the bucket count; the caller holds the lock exclusively
+ *
+ * @param registry The registry
+ */
+static void grow(struct CalcRegistry *registry) {
+	size_t num_buckets = (registry->mask + 1) * 2;
+	struct Namespace **buckets = Calloc(num_buckets, sizeof(struct Namespace *));
+
+	for (size_t i = 0; i <= registry->mask; i++) {
+		struct Namespace *ns = registry->buckets[i];
+		while (ns != NULL) {
+			struct Namespace *next = ns->next;
+			ns->next = buckets[ns->hash & (num_buckets - 1)];
+			buckets[ns->hash & (num_buckets - 1)] = ns;
+			ns = next;
+		}
+	}
+	free(registry->buckets);
+	registry->buckets = buckets;
+	registry->mask = num_buckets - 1;
+}
+
+/**
+ * Copy a string, if there is one
+ *
+ * @param str The string, or NULL
+ * @return a copy to free, or NULL
+ */
+static char *copy_string(const char *str) {
+	if (str == NULL) {
+		return NULL;
+	}
+	char *copy = Malloc(strlen(str) + 1);
+	strcpy(copy, str);
+	return copy;
+}
+
+/**
+ * Format the name of a namespace's checkpoint file
+ *
+ * @param path Buffer of MAXLINE characters for the name
+ * @param registry The registry
+ * @param name The namespace's name
+ * @param seq The checkpoint's number
+ */
+static void checkpoint_path(char *path, struct CalcRegistry *registry, const char *name, unsigned long long seq) {
+	snprintf(path, MAXLINE, "%s/%s.%llu.ckpt", registry->snapshot_dir, name, seq);
+}
+
+/**
+ * Create a namespace's calculator, mapping its snapshot, applying the
+ * checkpoints after it and replaying its log if there are any
+ *
+ * @param registry The registry
+ * @param name The namespace's name, NUL-terminated
+ * @return the Calc, or NULL if its snapshot or log can't be used
+ */
+static struct Calc *create_calc(struct CalcRegistry *registry, const char *name) {
+	struct CalcOptions calc_opts = registry->opts.calc;
+	if (strcmp(name, DEFAULT_NAMESPACE) != 0) {
+		calc_opts.num_buckets = registry->opts.namespace_buckets;		/* most namespaces stay small */
+	}
+	struct Calc *calc = calc_create_ex(&calc_opts);
+	char path[MAXLINE];
+
+	if (registry->snapshot_dir != NULL) {
+		snprintf(path, sizeof(path), "%s/%s.snap", registry->snapshot_dir, name);
+		if (access(path, F_OK) == 0 && calc_load_snapshot(calc, path) < 0) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			calc_destroy(calc);
+			return NULL;
+		}
+
+		checkpoint_path(path, registry, name, calc_checkpoint_seq(calc) + 1);
+		while (access(path, F_OK) == 0) {
+			if (calc_apply_checkpoint(calc, path) < 0) {
+				fprintf(stderr, "%s: %s\n", path, strerror(errno));
+				calc_destroy(calc);
+				return NULL;
+			}
+			checkpoint_path(path, registry, name, calc_checkpoint_seq(calc) + 1);
+		}
+	}
+
+	if (registry->wal_dir != NULL) {
+		snprintf(path, sizeof(path), "%s/%s.wal", registry->wal_dir, name);
+		if (calc_open_wal(calc, path, registry->opts.wal_interval_us) < 0) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			calc_destroy(calc);
+			return NULL;
+		}
+	}
+	return calc;
+}
+
+/**
+ * Set the default options: default Calc options and no logs
+ *
+ * @param opts The options
+ */
+void registry_options_init(struct RegistryOptions *opts) {
+	calc_options_init(&opts->calc);
+	opts->namespace_buckets = NAMESPACE_BUCKETS;
+	opts->max_namespaces = MAX_NAMESPACES;
+	opts->wal_dir = NULL;
+	opts->wal_interval_us = 0;
+	opts->snapshot_dir = NULL;
+	opts->checkpoint_interval = 0;
+}
+
+/**
+ * Write a checkpoint of every namespace that changed, reporting each one
+ * on stderr. The namespaces are listed first, so that clients can create
+ * new ones while the checkpoints are written.
+ *
+ * @param registry The registry
+ */
+static void checkpoint_all(struct CalcRegistry *registry) {
+	pthread_rwlock_rdlock(&registry->lock);
+	size_t count = 0;
+	struct Namespace **list = Malloc(registry->count * sizeof(struct Namespace *));
+	for (size_t i = 0; i <= registry->mask; i++) {
+		for (struct Namespace *ns = registry->buckets[i]; ns != NULL; ns = ns->next) {
+			if (ns->state == NS_READY) {
+				list[count++] = ns;		/* ready namespaces live as long as the registry */
+			}
+		}
+	}
+	pthread_rwlock_unlock(&registry->lock);
+
+	for (size_t i = 0; i < count; i++) {
+		char path[MAXLINE];
+		struct CalcCheckpointStats stats;
+		checkpoint_path(path, registry, list[i]->name, calc_checkpoint_seq(list[i]->calc) + 1);
+		int rc = calc_checkpoint(list[i]->calc, path, &stats);
+		if (rc < 0) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		} else if (rc > 0) {
+			fprintf(stderr, "checkpoint %s: %llu variables, %llu bytes in %.1f ms (assignments paused %.0f us)\n",
+				path, stats.variables, stats.bytes, stats.seconds * 1e3, stats.pause_seconds * 1e6);
+		}
+	}
+	free(list);
+}
+
+/**
+ * Write checkpoints every opts.checkpoint_interval seconds until the
+ * registry is destroyed
+ *
+ * @param arg The registry
+ * @return NULL
+ */
+static void *checkpoint_loop(void *arg) {
+	struct CalcRegistry *registry = arg;
+
+	pthread_mutex_lock(&registry->stop_lock);
+	while (!registry->stopping) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += registry->opts.checkpoint_interval;
+		while (!registry->stopping && pthread_cond_timedwait(&registry->stop, &registry->stop_lock, &deadline) == 0) {
+			/* woken early, but not to stop */
+		}
+		if (registry->stopping) {
+			break;
+		}
+		pthread_mutex_unlock(&registry->stop_lock);
+		checkpoint_all(registry);
+		pthread_mutex_lock(&registry->stop_lock);
+	}
+	pthread_mutex_unlock(&registry->stop_lock);
+	return NULL;
+}
+
+/**
+ * Create a registry holding just DEFAULT_NAMESPACE, and start writing
+ * checkpoints if opts asks for them
+ *
+ * @param opts Options for every namespace
+ * @return the registry, or NULL if the log of DEFAULT_NAMESPACE can't be opened
+ */
+struct CalcRegistry *registry_create(const struct RegistryOptions *opts) {
+	struct CalcRegistry *registry = Malloc(sizeof(struct CalcRegistry));
+	pthread_rwlock_init(&registry->lock, NULL);
+	pthread_mutex_init(&registry->init_lock, NULL);
+	registry->buckets = Calloc(INITIAL_BUCKETS, sizeof(struct Namespace *));
+	registry->mask = INITIAL_BUCKETS - 1;
+	registry->count = 0;
+	registry->opts = *opts;
+	registry->wal_dir = copy_string(opts->wal_dir);
+	registry->snapshot_dir = copy_string(opts->snapshot_dir);
+	registry->checkpointing = 0;
+	pthread_mutex_init(&registry->stop_lock, NULL);
+	pthread_cond_init(&registry->stop, NULL);
+	registry->stopping = 0;
+	registry->watcher = NULL;
+	registry->watcher_arg = NULL;
+	registry->replication = NULL;
+
+	registry->default_calc = registry_get(registry, DEFAULT_NAMESPACE, strlen(DEFAULT_NAMESPACE));
+	if (registry->default_calc == NULL) {
+		registry_destroy(registry);
+		return NULL;
+	}
+	if (registry->snapshot_dir != NULL && opts->checkpoint_interval > 0) {
+		registry->checkpointing = pthread_create(&registry->checkpointer, NULL, checkpoint_loop, registry) == 0;
+	}
+	return registry;
+}
+
+/**
+ * Destroy a registry and the Calc of every namespace. No namespace may be
+ * being created.
+ *
+ * @param registry The registry
+ */
+void registry_destroy(struct CalcRegistry *registry) {
+	if (registry->checkpointing) {
+		pthread_mutex_lock(&registry->stop_lock);
+		registry->stopping = 1;
+		pthread_cond_signal(&registry->stop);
+		pthread_mutex_unlock(&registry->stop_lock);
+		pthread_join(registry->checkpointer, NULL);
+	}
+
+	for (size_t i = 0; i <= registry->mask; i++) {
+		struct Namespace *ns = registry->buckets[i];
+		while (ns != NULL) {
+			struct Namespace *next = ns->next;
+			calc_destroy(ns->calc);
+			pthread_cond_destroy(&ns->ready);
+			free(ns);
+			ns = next;
+		}
+	}
+	free(registry->buckets);
+	free(registry->wal_dir);
+	free(registry->snapshot_dir);
+	pthread_cond_destroy(&registry->stop);
+	pthread_mutex_destroy(&registry->stop_lock);
+	pthread_mutex_destroy(&registry->init_lock);
+	pthread_rwlock_destroy(&registry->lock);
+	free(registry);
+}
+
+/**
+ * Take a namespace that failed to initialize out of its bucket; the
+ * caller holds the lock exclusively
+ *
+ * @param registry The registry
+ * @param ns The namespace
+ */
+static void unlink_namespace(struct CalcRegistry *registry, struct Namespace *ns) {
+	struct Namespace **link = &registry->buckets[ns->hash & registry->mask];
+	while (*link != ns) {
+		link = &(*link)->next;
+	}
+	*link = ns->next;
+	registry->count--;
+}
+
+/**
+ * Load the Calc of a namespace this thread entered as initializing, with
+ * the registry unlocked, then publish the namespace, or take it out of the
+ * registry if loading fails, and wake the threads waiting for it
+ *
+ * @param registry The registry
+ * @param ns The namespace
+ * @return its Calc, or NULL if it can't be loaded
+ */
+static struct Calc *initialize(struct CalcRegistry *registry, struct Namespace *ns) {
+	struct Calc *calc = create_calc(registry, ns->name);
+
+	pthread_rwlock_wrlock(&registry->lock);
+	if (calc == NULL) {
+		unlink_namespace(registry, ns);		/* a later use tries again */
+	} else {
+		ns->calc = calc;
+		if (registry->watcher != NULL) {
+			registry->watcher(registry->watcher_arg, ns->name, calc);		/* before any client uses it */
+		}
+	}
+	pthread_mutex_lock(&registry->init_lock);
+	ns->state = calc != NULL ? NS_READY : NS_FAILED;
+	pthread_cond_broadcast(&ns->ready);
+	int unused = calc == NULL && ns->waiting == 0;
+	pthread_mutex_unlock(&registry->init_lock);
+	pthread_rwlock_unlock(&registry->lock);
+
+	if (unused) {
+		pthread_cond_destroy(&ns->ready);
+		free(ns);
+	}
+	return calc;
+}
+
+/**
+ * Wait for a namespace that another thread is initializing; the caller
+ * holds the lock exclusively, and this releases it
+ *
+ * @param registry The registry
+ * @param ns The namespace
+ * @return its Calc, or NULL if it couldn't be loaded
+ */
+static struct Calc *wait_ready(struct CalcRegistry *registry, struct Namespace *ns) {
+	pthread_mutex_lock(&registry->init_lock);
+	pthread_rwlock_unlock(&registry->lock);
+	ns->waiting++;
+	while (ns->state == NS_INITIALIZING) {
+		pthread_cond_wait(&ns->ready, &registry->init_lock);
+	}
+	struct Calc *calc = ns->state == NS_READY ? ns->calc : NULL;
+	int unused = --ns->waiting == 0 && ns->state == NS_FAILED;
+	pthread_mutex_unlock(&registry->init_lock);
+
+	if (unused) {
+		pthread_cond_destroy(&ns->ready);
+		free(ns);		/* the initializing thread left it to the last waiter */
+	}
+	return calc;
+}
+
+/**
+ * Get the calculator of a namespace, creating the namespace if needed.
+ * Loading a new namespace holds up only the clients that want it.
+ *
+ * @param registry The registry
+ * @param name The name, not necessarily NUL-terminated
+ * @param len Length of name
+ * @return the namespace's Calc, or NULL if name is not a valid name, the
+ *         namespace's log can't be opened, or there are already
+ *         opts.max_namespaces namespaces
+ */
+struct Calc *registry_get(struct CalcRegistry *registry, const char *name, size_t len) {
+	if (!valid_name(name, len)) {
+		return NULL;
+	}
+	uint64_t hash = hash_name(name, len);
+
+	pthread_rwlock_rdlock(&registry->lock);
+	struct Namespace *ns = find(registry, name, len, hash);
+	struct Calc *calc = ns != NULL && ns->state == NS_READY ? ns->calc : NULL;
+	pthread_rwlock_unlock(&registry->lock);
+	if (calc != NULL) {
+		return calc;
+	}
+
+	pthread_rwlock_wrlock(&registry->lock);
+	ns = find(registry, name, len, hash);		/* another thread may have entered it meanwhile */
+	if (ns != NULL) {
+		if (ns->state == NS_READY) {
+			calc = ns->calc;
+			pthread_rwlock_unlock(&registry->lock);
+			return calc;
+		}
+		return wait_ready(registry, ns);
+	}
+	if (registry->opts.max_namespaces > 0 && registry->count >= registry->opts.max_namespaces) {
+		pthread_rwlock_unlock(&registry->lock);
+		return NULL;
+	}
+
+	ns = Malloc(sizeof(struct Namespace));
+	memcpy(ns->name, name, len);
+	ns->name[len] = '\0';
+	ns->hash = hash;
+	ns->calc = NULL;
+	ns->state = NS_INITIALIZING;
+	pthread_cond_init(&ns->ready, NULL);
+	ns->waiting = 0;
+	ns->next = registry->buckets[hash & registry->mask];
+	registry->buckets[hash & registry->mask] = ns;
+	if (++registry->count > registry->mask + 1) {
+		grow(registry);
+	}
+	pthread_rwlock_unlock(&registry->lock);
+	return initialize(registry, ns);
+}
+
+/**
+ * Get the calculator of DEFAULT_NAMESPACE
+ *
+ * @param registry The registry
+ * @return its Calc
+ */
+struct Calc *registry_default(struct CalcRegistry *registry) {
+	return registry->default_calc;
+}
+
+/**
+ * Count the namespaces
+ *
+ * @param registry The registry
+ * @return the number of namespaces, including DEFAULT_NAMESPACE and those
+ *         being created
+ */
+size_t registry_size(struct CalcRegistry *registry) {
+	pthread_rwlock_rdlock(&registry->lock);
+	size_t count = registry->count;
+	pthread_rwlock_unlock(&registry->lock);
+	return count;
+}
+
+/**
+ * Save a namespace's variables to its snapshot, which also empties its log
+ * and makes its checkpoints obsolete, so they are deleted
+ *
+ * @param registry The registry
+ * @param name The namespace's name, NUL-terminated
+ * @return the number of variables saved, or -1 if there is no snapshot
+ *         directory or the snapshot can't be written
+ */
+long registry_snapshot(struct CalcRegistry *registry, const char *name) {
+	struct Calc *calc = registry_get(registry, name, strlen(name));
+	if (calc == NULL || registry->snapshot_dir == NULL) {
+		return -1;
+	}
+
+	char path[MAXLINE];
+	snprintf(path, sizeof(path), "%s/%s.snap", registry->snapshot_dir, name);
+	unsigned long long seq;
+	long count = calc_save_snapshot(calc, path, &seq);
+	if (count < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return count;
+	}
+
+	/*
+	 * the snapshot records that it includes them, so a crash meanwhile is
+	 * harmless; a checkpoint written since holds assignments the snapshot
+	 * lacks, so only those up to seq go
+	 */
+	for (; seq > 0; seq--) {
+		checkpoint_path(path, registry, name, seq);
+		if (unlink(path) < 0) {
+			break;		/* older ones went with an earlier snapshot */
+		}
+	}
+	return count;
+}
+
+/**
+ * Call visit with every ready namespace. The registry is read-locked
+ * meanwhile, so namespaces can't be published until it returns.
+ *
+ * @param registry The registry
+ * @param visit Called with arg and each namespace's name and Calc
+ * @param arg Passed to visit
+ */
+void registry_for_each(struct CalcRegistry *registry, RegistryVisitor visit, void *arg) {
+	pthread_rwlock_rdlock(&registry->lock);
+	for (size_t i = 0; i <= registry->mask; i++) {
+		for (struct Namespace *ns = registry->buckets[i]; ns != NULL; ns = ns->next) {
+			if (ns->state == NS_READY) {
+				visit(arg, ns->name, ns->calc);
+			}
+		}
+	}
+	pthread_rwlock_unlock(&registry->lock);
+}
+
+/**
+ * Call visit with every ready namespace now, and with every namespace
+ * published later before any client can use it. Both happen with the registry
+ * locked, so no namespace is missed or visited twice. Names stay valid as
+ * long as the registry. A NULL visit stops watching.
+ *
+ * @param registry The registry
+ * @param visit Called with arg and each namespace's name and Calc, or NULL
+ * @param arg Passed to visit
+ */
+void registry_watch(struct CalcRegistry *registry, RegistryVisitor visit, void *arg) {
+	pthread_rwlock_wrlock(&registry->lock);
+	registry->watcher = visit;
+	registry->watcher_arg = arg;
+	for (size_t i = 0; visit != NULL && i <= registry->mask; i++) {
+		for (struct Namespace *ns = registry->buckets[i]; ns != NULL; ns = ns->next) {
+			if (ns->state == NS_READY) {
+				visit(arg, ns->name, ns->calc);
+			}
+		}
+	}
+	pthread_rwlock_unlock(&registry->lock);
+}
+
+/**
+ * Record the server's replication, so that sessions can report on it
+ *
+ * @param registry The registry
+ * @param replication The replication, or NULL
+ */
+void registry_set_replication(struct CalcRegistry *registry, struct Replication *replication) {
+	registry->replication = replication;
+}
+
+/**
+ * Get the server's replication
+ *
+ * @param registry The registry
+ * @return the replication, or NULL if the server neither is nor has a replica
+ */
+struct Replication *registry_replication(struct CalcRegistry *registry) {
+	return registry->replication;
+}
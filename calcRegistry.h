@@ -0,0 +1,54 @@
+#ifndef CALCREGISTRY_H
+#define CALCREGISTRY_H
+
+#include <stddef.h>
+#include "calc.h"
+
+/* longest namespace name */
+#define NAMESPACE_MAX 64
+
+/* the namespace every client starts in */
+#define DEFAULT_NAMESPACE "default"
+
+/* default RegistryOptions.namespace_buckets */
+#define NAMESPACE_BUCKETS 1024
+
+/* default RegistryOptions.max_namespaces */
+#define MAX_NAMESPACES 1024
+
+/* Named calculators of a server, created on first use. */
+struct CalcRegistry;
+
+/* Replication of a server's namespaces, see calcReplica.h. */
+struct Replication;
+
+/* Called with each namespace, see registry_for_each and registry_watch. */
+typedef void (*RegistryVisitor)(void *arg, const char *name, struct Calc *calc);
+
+/*
+ * Options for registry_create. Initialize with registry_options_init
+ * before setting fields.
+ */
+struct RegistryOptions {
+	struct CalcOptions calc;	/* options of every namespace's Calc */
+	unsigned namespace_buckets;	/* CALC_LOCK_FREE: calc.num_buckets of namespaces but DEFAULT_NAMESPACE */
+	unsigned max_namespaces;	/* most namespaces, DEFAULT_NAMESPACE included, or 0 for no limit */
+	const char *wal_dir;		/* directory of the namespaces' logs, or NULL for none */
+	unsigned wal_interval_us;	/* commit interval of the logs, see calc_open_wal */
+	const char *snapshot_dir;	/* directory of the namespaces' snapshots, or NULL for none */
+	unsigned checkpoint_interval;	/* seconds between checkpoints into snapshot_dir, or 0 for none */
+};
+
+void registry_options_init(struct RegistryOptions *opts);
+struct CalcRegistry *registry_create(const struct RegistryOptions *opts);
+void registry_destroy(struct CalcRegistry *registry);
+struct Calc *registry_get(struct CalcRegistry *registry, const char *name, size_t len);
+struct Calc *registry_default(struct CalcRegistry *registry);
+size_t registry_size(struct CalcRegistry *registry);
+long registry_snapshot(struct CalcRegistry *registry, const char *name);
+void registry_for_each(struct CalcRegistry *registry, RegistryVisitor visit, void *arg);
+void registry_watch(struct CalcRegistry *registry, RegistryVisitor visit, void *arg);
+void registry_set_replication(struct CalcRegistry *registry, struct Replication *replication);
+struct Replication *registry_replication(struct CalcRegistry *registry);
+
+#endif /* CALCREGISTRY_H */
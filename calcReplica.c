@@ -0,0 +1,876 @@
+/*
+ * Replication of calcServer's namespaces over a Unix domain socket, see
+ * calcReplica.h for the stream. On the primary every namespace's Calc
+ * feeds its assignments into a lock-free queue, so that assigning threads
+ * never wait for each other here. A sender thread per replica moves what
+ * is queued into a buffer per replica and writes its own buffer out, so a
+ * slow replica never holds up assignments; one that falls MAX_BACKLOG
+ * bytes behind is dropped, and
+ * gets a fresh dump when it connects again. On a replica one thread reads
+ * the stream and applies it, reconnecting whenever the primary goes away.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sched.h>
+#include <sys/un.h>
+#include "csapp.h"
+#include "calcProto.h"
+#include "calcReplica.h"
+
+/* how long a sender waits for records before sending a heartbeat, in milliseconds */
+#define HEARTBEAT_MS 100
+
+/* most bytes waiting to be sent to one replica */
+#define MAX_BACKLOG (64 << 20)
+
+/* how long a replica waits before connecting again, in milliseconds */
+#define RETRY_MS 100
+
+/* bytes a replica reads at once, and its initial buffer size */
+#define REPLICA_INBUF 65536
+
+/* no frame of a replica's buffer can be extended */
+#define NO_FRAME ((size_t) -1)
+
+/**
+ * One replica connected to the primary
+ *
+ * @param repl The primary's replication
+ * @param fd The connection
+ * @param out Frames waiting to be sent
+ * @param frame Offset in out of the last frame if it holds records, or NO_FRAME
+ * @param frame_ns Namespace of that frame
+ * @param dropped Whether it fell too far behind or its connection failed
+ * @param next Next replica of the primary
+ */
+struct Replica {
+	struct Replication *repl;
+	int fd;
+	struct OutBuf out;
+	size_t frame;
+	const char *frame_ns;
+	int dropped;
+	struct Replica *next;
+};
+
+/**
+ * What a namespace's Calc passes to feed
+ *
+ * @param repl The primary's replication
+ * @param name The namespace's name, which lives as long as the registry
+ * @param calc The namespace's Calc
+ * @param next Next feed of the primary
+ */
+struct Feed {
+	struct Replication *repl;
+	const char *name;
+	struct Calc *calc;
+	struct Feed *next;
+};
+
+/**
+ * Records or a dump fed by a namespace, waiting in the primary's queue
+ * until a sender queues its frames for the replicas
+ *
+ * @param next The item fed after it, or NULL
+ * @param ns The namespace's name
+ * @param type REPL_RECORDS or REPL_DUMP
+ * @param target Replica that gets a dump, or NULL for every one; only compared
+ * @param position The primary's position after these records
+ * @param time When they were fed
+ * @param len Size of records
+ * @param records The records
+ */
+struct FeedItem {
+	struct FeedItem *next;
+	const char *ns;
+	int type;
+	struct Replica *target;
+	unsigned long long position;
+	uint64_t time;
+	size_t len;
+	char records[];
+};
+
+/**
+ * Either side of replication
+ *
+ * @param primary Whether this is the primary
+ * @param registry The server's namespaces
+ * @param path The socket's path
+ * @param fd The listening socket on the primary, the connection (or -1) on a replica
+ * @param thread Accepts replicas on the primary, applies the stream on a replica
+ * @param lock Protects the fields below
+ * @param ready Signalled when frames are queued or a replica goes away
+ * @param stopping Whether replication_stop was called
+ * @param replicas Replicas connected to the primary
+ * @param num_replicas Number of replicas, including dropped ones not yet cleaned up;
+ *                     feeding threads read it without the lock
+ * @param position Bytes of assignment records produced by the primary,
+ *                 counted by feeding threads without the lock
+ * @param queue_head Item last taken off the queue of fed items; the oldest
+ *                   one still queued is its next
+ * @param queue_tail Item fed last, which feeding threads swap without the lock
+ * @param sleepers Senders waiting for frames, which feeding threads wake
+ * @param sent Highest position of the items taken off the queue
+ * @param feeds Feeds of the primary's namespaces
+ * @param dump_lock Held while a dump is fed, so dump_target stays put
+ * @param dump_target Replica that gets the dump being fed, or NULL for every one
+ * @param connected Whether the replica is connected
+ * @param applied Position up to which the replica has applied the stream
+ * @param heard Latest position the primary has reported
+ * @param lag Seconds between the primary producing the last records applied and applying them
+ */
+struct Replication {
+	int primary;
+	struct CalcRegistry *registry;
+	char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	int stopping;
+	struct Replica *replicas;
+	size_t num_replicas;
+	unsigned long long position;
+	struct FeedItem *queue_head;
+	struct FeedItem *queue_tail;
+	int sleepers;
+	unsigned long long sent;
+	struct Feed *feeds;
+	pthread_mutex_t dump_lock;
+	struct Replica *dump_target;
+	int connected;
+	unsigned long long applied;
+	unsigned long long heard;
+	double lag;
+};
+
+/**
+ * Read the monotonic clock
+ *
+ * @return the time in nanoseconds
+ */
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Write a little-endian integer of size bytes
+ *
+ * @param p Where to write it
+ * @param v The integer
+ * @param size Its size in bytes
+ */
+static void put_le(char *p, uint64_t v, int size) {
+	for (int i = 0; i < size; i++) {
+		p[i] = (char) (v >> (8 * i));
+	}
+}
+
+/**
+ * Read a little-endian integer of size bytes
+ *
+ * @param p Where to read it
+ * @param size Its size in bytes
+ * @return the integer
+ */
+static uint64_t get_le(const char *p, int size) {
+	uint64_t v = 0;
+	for (int i = size - 1; i >= 0; i--) {
+		v = v << 8 | (unsigned char) p[i];
+	}
+	return v;
+}
+
+/**
+ * Fill in the address of a Unix domain socket
+ *
+ * @param addr The address
+ * @param path The socket's path
+ * @return 0 on success, -1 if path is too long
+ */
+static int unix_address(struct sockaddr_un *addr, const char *path) {
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/**
+ * Make a new, idle replication; the caller fills in the rest
+ *
+ * @param registry The server's namespaces
+ * @param path The socket's path
+ * @return the replication, or NULL if path is too long
+ */
+static struct Replication *replication_new(struct CalcRegistry *registry, const char *path) {
+	struct sockaddr_un addr;
+	if (unix_address(&addr, path) < 0) {
+		return NULL;
+	}
+
+	struct Replication *repl = Calloc(1, sizeof(struct Replication));
+	repl->registry = registry;
+	strcpy(repl->path, path);
+	repl->fd = -1;
+	pthread_mutex_init(&repl->lock, NULL);
+	pthread_cond_init(&repl->ready, NULL);
+	pthread_mutex_init(&repl->dump_lock, NULL);
+	repl->queue_head = Calloc(1, sizeof(struct FeedItem));		/* empty, as if taken already */
+	repl->queue_tail = repl->queue_head;
+	return repl;
+}
+
+/**
+ * Free a replication whose threads are done
+ *
+ * @param repl The replication
+ */
+static void replication_free(struct Replication *repl) {
+	while (repl->queue_head != NULL) {
+		struct FeedItem *next = repl->queue_head->next;
+		free(repl->queue_head);
+		repl->queue_head = next;
+	}
+	pthread_mutex_destroy(&repl->dump_lock);
+	pthread_cond_destroy(&repl->ready);
+	pthread_mutex_destroy(&repl->lock);
+	free(repl);
+}
+
+/**
+ * Queue a frame for a replica, with the primary's lock held. Records of
+ * the same namespace as the last frame, if that frame holds records and
+ * has not been taken for sending yet, extend it instead.
+ *
+ * @param r The replica
+ * @param type REPL_RECORDS, REPL_DUMP or REPL_HEARTBEAT
+ * @param ns The namespace's name, or NULL for a heartbeat
+ * @param payload The frame's records
+ * @param len Size of payload
+ * @param position The primary's position after these records
+ * @param time When they were produced
+ */
+static void queue_frame(struct Replica *r, int type, const char *ns, const char *payload, size_t len,
+                        uint64_t position, uint64_t time) {
+	if (type == REPL_RECORDS && r->frame != NO_FRAME && r->frame_ns == ns) {
+		char *header = r->out.data + r->frame;
+		put_le(header + 2, get_le(header + 2, 4) + len, 4);
+		put_le(header + 6, position, 8);		/* time stays that of its oldest record */
+		outbuf_append(&r->out, payload, len);
+		return;
+	}
+
+	char header[REPL_HEADER];
+	size_t ns_len = ns != NULL ? strlen(ns) : 0;
+	header[0] = (char) type;
+	header[1] = (char) ns_len;
+	put_le(header + 2, len, 4);
+	put_le(header + 6, position, 8);
+	put_le(header + 14, time, 8);
+
+	r->frame = type == REPL_RECORDS ? r->out.len : NO_FRAME;
+	r->frame_ns = ns;
+	outbuf_append(&r->out, header, REPL_HEADER);
+	if (ns_len > 0) {
+		outbuf_append(&r->out, ns, ns_len);
+	}
+	if (len > 0) {
+		outbuf_append(&r->out, payload, len);
+	}
+}
+
+/**
+ * Receive assignments, or a dump, from a namespace's Calc and add them to
+ * the queue for the senders. Called by assigning threads, which may feed
+ * concurrently, so it takes no lock unless a sender is waiting: the item
+ * is linked in with an atomic exchange of the queue's tail. Items of one
+ * thread stay in order, and so do the assignments of a variable, which
+ * its Calc feeds from one thread at a time.
+ *
+ * @param arg The namespace's Feed
+ * @param records Log records
+ * @param len Size of records
+ * @param dump Whether records are a dump of the namespace
+ */
+static void feed(void *arg, const char *records, size_t len, int dump) {
+	struct Feed *f = arg;
+	struct Replication *repl = f->repl;
+	unsigned long long position = dump ? __atomic_load_n(&repl->position, __ATOMIC_RELAXED)
+	                                   : __atomic_add_fetch(&repl->position, len, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&repl->num_replicas, __ATOMIC_RELAXED) == 0) {
+		return;		/* a replica that connects later gets a dump, which includes these */
+	}
+
+	struct FeedItem *item = Malloc(sizeof(struct FeedItem) + len);
+	item->next = NULL;
+	item->ns = f->name;
+	item->type = dump ? REPL_DUMP : REPL_RECORDS;
+	item->target = dump ? repl->dump_target : NULL;		/* dump_to set it on this thread */
+	item->position = position;
+	item->time = now_ns();
+	item->len = len;
+	memcpy(item->records, records, len);
+
+	struct FeedItem *prev = __atomic_exchange_n(&repl->queue_tail, item, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&prev->next, item, __ATOMIC_RELEASE);
+
+	/* a sender counts itself in sleepers before it checks the tail, so one of them sees the other */
+	if (__atomic_load_n(&repl->sleepers, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&repl->lock);
+		pthread_cond_broadcast(&repl->ready);
+		pthread_mutex_unlock(&repl->lock);
+	}
+}
+
+/**
+ * Take every item fed so far off the queue and queue its frames for the
+ * replicas, with the primary's lock held. Items fed from different shards
+ * may carry their positions out of order, so frames carry the highest
+ * position taken so far.
+ *
+ * @param repl The primary's replication
+ * @return 1 if the queue is now empty, 0 if a feeding thread has swapped
+ *         the tail but not linked its item in yet
+ */
+static int dispatch(struct Replication *repl) {
+	int taken = 0;
+	struct FeedItem *item;
+	while ((item = __atomic_load_n(&repl->queue_head->next, __ATOMIC_ACQUIRE)) != NULL) {
+		free(repl->queue_head);		/* its frames were queued when it was taken */
+		repl->queue_head = item;
+		if (item->position > repl->sent) {
+			repl->sent = item->position;
+		}
+		for (struct Replica *r = repl->replicas; r != NULL; r = r->next) {
+			if (r->dropped || (item->target != NULL && item->target != r)) {
+				continue;
+			}
+			queue_frame(r, item->type, item->ns, item->records, item->len, repl->sent, item->time);
+			if (r->out.len > MAX_BACKLOG) {
+				r->dropped = 1;		/* it can catch up from a new dump */
+			}
+		}
+		taken = 1;
+	}
+	if (taken) {
+		pthread_cond_broadcast(&repl->ready);		/* the other senders have frames too */
+	}
+	return __atomic_load_n(&repl->queue_tail, __ATOMIC_SEQ_CST) == repl->queue_head;
+}
+
+/**
+ * Feed a dump of a namespace to one replica, or to every one. Records fed
+ * before the dump are included in it, so a replica that gets them first
+ * still ends up right.
+ *
+ * @param repl The primary's replication
+ * @param calc The namespace's Calc
+ * @param target The replica, or NULL for every one
+ */
+static void dump_to(struct Replication *repl, struct Calc *calc, struct Replica *target) {
+	pthread_mutex_lock(&repl->dump_lock);
+	pthread_mutex_lock(&repl->lock);
+	repl->dump_target = target;
+	pthread_mutex_unlock(&repl->lock);
+	calc_feed_dump(calc);
+	pthread_mutex_unlock(&repl->dump_lock);
+}
+
+/**
+ * Start feeding a namespace to the replicas, called by the registry for
+ * every namespace before clients can use it
+ *
+ * @param arg The primary's replication
+ * @param name The namespace's name
+ * @param calc Its Calc
+ */
+static void attach(void *arg, const char *name, struct Calc *calc) {
+	struct Replication *repl = arg;
+	struct Feed *f = Malloc(sizeof(struct Feed));
+	f->repl = repl;
+	f->name = name;
+	f->calc = calc;
+	if (calc_set_feed(calc, feed, f) < 0) {
+		fprintf(stderr, "replication of %s: %s\n", name, strerror(errno));
+		free(f);
+		return;
+	}
+
+	pthread_mutex_lock(&repl->lock);
+	f->next = repl->feeds;
+	repl->feeds = f;
+	int have_replicas = repl->num_replicas > 0;
+	pthread_mutex_unlock(&repl->lock);
+
+	/* what it recovered from disk; a replica connecting later dumps it itself */
+	if (have_replicas) {
+		dump_to(repl, calc, NULL);
+	}
+}
+
+/**
+ * A new replica to dump the namespaces to. Its sender may free it
+ * meanwhile, so it is only compared with others, never dereferenced.
+ *
+ * @param repl The primary's replication
+ * @param target The replica
+ */
+struct DumpTarget {
+	struct Replication *repl;
+	struct Replica *target;
+};
+
+/**
+ * Feed a dump of one namespace to a new replica, for registry_for_each
+ *
+ * @param arg The DumpTarget
+ * @param name The namespace's name
+ * @param calc Its Calc
+ */
+static void dump_namespace(void *arg, const char *name, struct Calc *calc) {
+	struct DumpTarget *dump = arg;
+	(void) name;
+	dump_to(dump->repl, calc, dump->target);
+}
+
+/**
+ * Send a replica its frames as they are fed, and a heartbeat whenever
+ * there has been nothing to send for HEARTBEAT_MS, until it is dropped or
+ * replication stops; then remove it. Whichever sender runs first takes
+ * the fed items off the queue for every replica.
+ *
+ * @param arg The replica
+ * @return NULL
+ */
+static void *sender(void *arg) {
+	struct Replica *r = arg;
+	struct Replication *repl = r->repl;
+	struct OutBuf sending;
+	outbuf_init(&sending);
+
+	pthread_mutex_lock(&repl->lock);
+	while (!repl->stopping && !r->dropped) {
+		int drained = dispatch(repl);
+		if (r->out.len == 0 && !drained) {
+			/* the item being linked in is just a few instructions away */
+			pthread_mutex_unlock(&repl->lock);
+			sched_yield();
+			pthread_mutex_lock(&repl->lock);
+			continue;
+		}
+		if (r->out.len == 0) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += HEARTBEAT_MS * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			int timed_out = 0;
+			__atomic_add_fetch(&repl->sleepers, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&repl->queue_tail, __ATOMIC_SEQ_CST) == repl->queue_head) {
+				timed_out = pthread_cond_timedwait(&repl->ready, &repl->lock, &deadline) == ETIMEDOUT;
+			}
+			__atomic_sub_fetch(&repl->sleepers, 1, __ATOMIC_SEQ_CST);
+			if (timed_out && r->out.len == 0) {
+				queue_frame(r, REPL_HEARTBEAT, NULL, NULL, 0, repl->sent, now_ns());
+			}
+			continue;
+		}
+
+		/* take the queued frames, so that feeding goes on while they are written */
+		struct OutBuf queued = r->out;
+		r->out = sending;
+		sending = queued;
+		r->frame = NO_FRAME;
+		pthread_mutex_unlock(&repl->lock);
+
+		int ok = rio_writen(r->fd, sending.data, sending.len) >= 0;
+		sending.len = 0;
+
+		pthread_mutex_lock(&repl->lock);
+		if (!ok) {
+			r->dropped = 1;
+		}
+	}
+
+	struct Replica **link = &repl->replicas;
+	while (*link != r) {
+		link = &(*link)->next;
+	}
+	*link = r->next;
+	__atomic_sub_fetch(&repl->num_replicas, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&repl->ready);
+	int stopping = repl->stopping;
+	pthread_mutex_unlock(&repl->lock);
+
+	if (!stopping) {
+		fprintf(stderr, "replica disconnected\n");
+	}
+	close(r->fd);
+	outbuf_free(&r->out);
+	outbuf_free(&sending);
+	free(r);
+	return NULL;
+}
+
+/**
+ * Accept replicas until replication stops. Each new replica gets the
+ * frames fed from then on, then a dump of every namespace.
+ *
+ * @param arg The primary's replication
+ * @return NULL
+ */
+static void *acceptor(void *arg) {
+	struct Replication *repl = arg;
+
+	while (1) {
+		int fd = accept(repl->fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;		/* replication_stop shut the socket down */
+		}
+
+		struct Replica *r = Malloc(sizeof(struct Replica));
+		r->repl = repl;
+		r->fd = fd;
+		outbuf_init(&r->out);
+		r->frame = NO_FRAME;
+		r->frame_ns = NULL;
+		r->dropped = 0;
+
+		pthread_mutex_lock(&repl->lock);
+		r->next = repl->replicas;
+		repl->replicas = r;
+		__atomic_add_fetch(&repl->num_replicas, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&repl->lock);
+
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, sender, r) != 0) {
+			fprintf(stderr, "replica refused: %s\n", strerror(errno));
+			pthread_mutex_lock(&repl->lock);
+			struct Replica **link = &repl->replicas;
+			while (*link != r) {
+				link = &(*link)->next;
+			}
+			*link = r->next;
+			__atomic_sub_fetch(&repl->num_replicas, 1, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&repl->lock);
+			close(fd);
+			outbuf_free(&r->out);
+			free(r);
+			continue;
+		}
+		pthread_detach(thread);
+
+		struct DumpTarget dump = { repl, r };
+		registry_for_each(repl->registry, dump_namespace, &dump);
+	}
+	return NULL;
+}
+
+/**
+ * Become a primary: listen for replicas on a Unix domain socket at path,
+ * replacing any file there, and feed them every namespace
+ *
+ * @param registry The server's namespaces
+ * @param path The socket's path
+ * @return the replication, or NULL (with errno set) on error
+ */
+struct Replication *replication_primary(struct CalcRegistry *registry, const char *path) {
+	struct Replication *repl = replication_new(registry, path);
+	if (repl == NULL) {
+		return NULL;
+	}
+	repl->primary = 1;
+
+	struct sockaddr_un addr;
+	unix_address(&addr, path);
+	unlink(path);		/* left by an earlier run */
+	repl->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (repl->fd < 0 || bind(repl->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(repl->fd, 16) < 0) {
+		int saved = errno;
+		if (repl->fd >= 0) {
+			close(repl->fd);
+		}
+		replication_free(repl);
+		errno = saved;
+		return NULL;
+	}
+
+	registry_watch(registry, attach, repl);
+	if (pthread_create(&repl->thread, NULL, acceptor, repl) != 0) {
+		replication_stop(repl);
+		return NULL;
+	}
+	return repl;
+}
+
+/**
+ * Connect a replica to its primary
+ *
+ * @param repl The replica's replication
+ * @return the connection, or -1 if the primary is not there
+ */
+static int connect_primary(struct Replication *repl) {
+	struct sockaddr_un addr;
+	unix_address(&addr, repl->path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Apply one frame of the stream
+ *
+ * @param repl The replica's replication
+ * @param frame The frame, whose header has been checked
+ * @param ns_len Length of its namespace's name
+ * @param len Length of its payload
+ * @return 0 on success, -1 if the frame is corrupt
+ */
+static int apply_frame(struct Replication *repl, const char *frame, size_t ns_len, size_t len) {
+	int type = (unsigned char) frame[0];
+	unsigned long long position = get_le(frame + 6, 8);
+	uint64_t time = get_le(frame + 14, 8);
+	const char *payload = frame + REPL_HEADER + ns_len;
+
+	if (type == REPL_RECORDS || type == REPL_DUMP) {
+		struct Calc *calc = registry_get(repl->registry, frame + REPL_HEADER, ns_len);
+		if (calc == NULL || calc_apply_records(calc, payload, len) != (long) len) {
+			return -1;
+		}
+	} else if (type != REPL_HEARTBEAT) {
+		return -1;
+	}
+
+	/* both clocks are CLOCK_MONOTONIC of one machine, so they compare */
+	double lag = (double) (int64_t) (now_ns() - time) / 1e9;
+	pthread_mutex_lock(&repl->lock);
+	if (type == REPL_RECORDS) {
+		repl->applied = position;
+		repl->lag = lag;
+	} else if (type == REPL_DUMP) {
+		if (position > repl->applied) {
+			repl->applied = position;
+		}
+	} else if (repl->applied >= position) {
+		repl->lag = lag;		/* caught up, so lag is just how long the heartbeat took */
+	}
+	if (position > repl->heard) {
+		repl->heard = position;
+	}
+	pthread_mutex_unlock(&repl->lock);
+	return 0;
+}
+
+/**
+ * Apply the stream from one connection to the primary until it ends
+ *
+ * @param repl The replica's replication
+ * @param fd The connection
+ */
+static void apply_stream(struct Replication *repl, int fd) {
+	size_t cap = REPLICA_INBUF;
+	char *buf = Malloc(cap);
+	size_t len = 0;
+
+	while (1) {
+		/* apply every whole frame in buf */
+		size_t done = 0;
+		size_t need = REPL_HEADER;
+		while (len - done >= REPL_HEADER) {
+			const char *frame = buf + done;
+			size_t ns_len = (unsigned char) frame[1];
+			size_t payload_len = get_le(frame + 2, 4);
+			need = REPL_HEADER + ns_len + payload_len;
+			if (len - done < need) {
+				break;
+			}
+			if (apply_frame(repl, frame, ns_len, payload_len) < 0) {
+				fprintf(stderr, "replication stream is corrupt\n");
+				free(buf);
+				return;
+			}
+			done += need;
+			need = REPL_HEADER;
+		}
+		len -= done;
+		memmove(buf, buf + done, len);
+
+		if (need > cap) {
+			while (cap < need) {
+				cap *= 2;
+			}
+			buf = Realloc(buf, cap);
+		}
+		ssize_t n = read(fd, buf + len, cap - len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			free(buf);
+			return;
+		}
+		len += (size_t) n;
+	}
+}
+
+/**
+ * Keep a replica connected to its primary and apply the stream, until
+ * replication stops
+ *
+ * @param arg The replica's replication
+ * @return NULL
+ */
+static void *applier(void *arg) {
+	struct Replication *repl = arg;
+
+	pthread_mutex_lock(&repl->lock);
+	while (!repl->stopping) {
+		pthread_mutex_unlock(&repl->lock);
+		int fd = connect_primary(repl);
+		pthread_mutex_lock(&repl->lock);
+
+		if (fd >= 0 && !repl->stopping) {
+			repl->fd = fd;
+			repl->connected = 1;
+			pthread_mutex_unlock(&repl->lock);
+			fprintf(stderr, "replicating from %s\n", repl->path);
+
+			apply_stream(repl, fd);
+
+			pthread_mutex_lock(&repl->lock);
+			repl->fd = -1;
+			repl->connected = 0;
+			close(fd);
+			if (!repl->stopping) {
+				fprintf(stderr, "lost the primary at %s\n", repl->path);
+			}
+		} else if (fd >= 0) {
+			close(fd);
+		}
+
+		if (!repl->stopping) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += RETRY_MS * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&repl->ready, &repl->lock, &deadline);
+		}
+	}
+	pthread_mutex_unlock(&repl->lock);
+	return NULL;
+}
+
+/**
+ * Become a replica: connect to the primary at path, retrying until it is
+ * there, and apply its stream to the registry's namespaces. Their Calcs
+ * should have been made read-only, see CalcOptions.
+ *
+ * @param registry The server's namespaces
+ * @param path The primary's socket
+ * @return the replication, or NULL (with errno set) on error
+ */
+struct Replication *replication_replica(struct CalcRegistry *registry, const char *path) {
+	struct Replication *repl = replication_new(registry, path);
+	if (repl == NULL) {
+		return NULL;
+	}
+	if (pthread_create(&repl->thread, NULL, applier, repl) != 0) {
+		replication_free(repl);
+		return NULL;
+	}
+	return repl;
+}
+
+/**
+ * Stop replicating and free a replication. On the primary, the
+ * namespaces stop feeding it and the replicas are disconnected.
+ *
+ * @param repl The replication
+ */
+void replication_stop(struct Replication *repl) {
+	if (repl->primary) {
+		registry_watch(repl->registry, NULL, NULL);		/* no more feeds are attached */
+	}
+
+	pthread_mutex_lock(&repl->lock);
+	repl->stopping = 1;
+	pthread_cond_broadcast(&repl->ready);
+	if (repl->fd >= 0) {
+		shutdown(repl->fd, SHUT_RDWR);		/* wakes accept on the primary, read on a replica */
+	}
+	for (struct Replica *r = repl->replicas; r != NULL; r = r->next) {
+		shutdown(r->fd, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&repl->lock);
+
+	if (repl->primary) {
+		pthread_join(repl->thread, NULL);
+		close(repl->fd);
+		unlink(repl->path);
+
+		for (struct Feed *f = repl->feeds; f != NULL; ) {
+			struct Feed *next = f->next;
+			calc_set_feed(f->calc, NULL, NULL);
+			free(f);
+			f = next;
+		}
+		repl->feeds = NULL;
+
+		pthread_mutex_lock(&repl->lock);
+		while (repl->num_replicas > 0) {
+			pthread_cond_wait(&repl->ready, &repl->lock);
+		}
+		pthread_mutex_unlock(&repl->lock);
+	} else {
+		pthread_join(repl->thread, NULL);
+	}
+	replication_free(repl);
+}
+
+/**
+ * Describe the state of replication in one line, for the REPLICATION
+ * command. A replica reports how many bytes of records the primary has
+ * produced that it has not applied yet, and how long after their
+ * production it applied the last ones.
+ *
+ * @param repl The replication
+ * @param buf Where to write the line, without a line ending
+ * @param size Size of buf
+ * @return the line's length, as snprintf
+ */
+int replication_status(struct Replication *repl, char *buf, size_t size) {
+	pthread_mutex_lock(&repl->lock);
+	int len;
+	if (repl->primary) {
+		len = snprintf(buf, size, "primary replicas %zu position %llu", repl->num_replicas,
+		               __atomic_load_n(&repl->position, __ATOMIC_RELAXED));
+	} else {
+		len = snprintf(buf, size, "replica connected %d position %llu behind %llu lag_ms %.3f", repl->connected,
+		               repl->applied, repl->heard - repl->applied, repl->lag * 1000);
+	}
+	pthread_mutex_unlock(&repl->lock);
+	return len;
+}
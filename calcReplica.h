@@ -0,0 +1,40 @@
+#ifndef CALCREPLICA_H
+#define CALCREPLICA_H
+
+#include <stddef.h>
+#include "calcRegistry.h"
+
+/*
+ * Replication between calcServer processes on one machine. A primary
+ * listens on a Unix domain socket and streams every namespace's
+ * assignments to each replica that connects, starting with a dump of
+ * each namespace. A replica applies them to calculators of its own, which
+ * serve reads but reject assignments from clients. The stream is a
+ * sequence of frames:
+ *
+ *   u8 type, u8 namespace length, u32 payload length, u64 position,
+ *   u64 time, then the namespace's name and the payload
+ *
+ *   REPL_RECORDS    assignments, as records in the format of the log
+ *   REPL_DUMP       every variable of the namespace, in the same format
+ *   REPL_HEARTBEAT  no name or payload; sent when there is nothing else
+ *
+ * position counts the bytes of assignment records the primary has
+ * produced, up to the end of the frame. time is CLOCK_MONOTONIC, in
+ * nanoseconds, when the oldest record of the frame was produced, or when
+ * a heartbeat was sent. All integers are little-endian.
+ */
+
+#define REPL_RECORDS 1
+#define REPL_DUMP 2
+#define REPL_HEARTBEAT 3
+
+/* bytes of a frame before the namespace's name */
+#define REPL_HEADER 22
+
+struct Replication *replication_primary(struct CalcRegistry *registry, const char *path);
+struct Replication *replication_replica(struct CalcRegistry *registry, const char *path);
+void replication_stop(struct Replication *repl);
+int replication_status(struct Replication *repl, char *buf, size_t size);
+
+#endif /* CALCREPLICA_H */
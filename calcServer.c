@@ -1,21 +1,28 @@
-#include <stdio.h>      /* for snprintf */
+#include <stdio.h>
 #include "csapp.h"
 #include "calc.h"
+#include "calcRegistry.h"
+#include "calcProto.h"
+#include "calcReactor.h"
+#include "calcPool.h"
+#include "calcReplica.h"
+#ifdef CALC_URING
+#include "calcUring.h"
+#endif
 
-#define LINEBUF_SIZE 1024
-
-int chat_with_client(struct Calc *calc, int client_fd);
+/* connections that may wait for a worker in pool mode, unless -q is given */
+#define DEFAULT_QUEUE_SIZE 128
 
 /**
  * This is the connection information for one thread.
  * Every thread will have their own ConnInfo
  * 
  * @param clientfd The file descriptor of client 
- * @param calc The pointer to the shared Calc struct
+ * @param registry The pointer to the server's namespaces
  */
 struct ConnInfo {
 	int clientfd;
-	struct Calc *calc;
+	struct CalcRegistry *registry;
 };
 
 
@@ -28,24 +35,21 @@ struct ConnInfo {
 void *worker(void *arg) {
 	struct ConnInfo *info = arg;
 	pthread_detach(pthread_self());		// Let the client threads be detached so that the server does not wait for it to complete
-	chat_with_client(info->calc, info->clientfd);		// interact with the server
+	chat_with_client(info->registry, info->clientfd);		// interact with the server
 	close(info->clientfd);		// close the client thread
 	free(info);
 
 	return NULL;
 }
 
-int main(int argc, char **argv) {
-	if (argc != 2) {
-		exit(0); 	// incorrect number of command line argument
-	}
-
-	struct Calc *calc = calc_create();		// create calc and initialize pthread mutex
-	const char *port = argv[1];
-
-	int server_fd = open_listenfd((char*) port);		// Open and return a listening socket on port for the server
-	if (server_fd < 0) { return 0; } // fatal error
-
+/**
+ * Accept connections forever, serving each on a thread of its own
+ *
+ * @param registry The server's namespaces
+ * @param server_fd The listening socket
+ * @return 0 after a fatal error
+ */
+static int serve_threads(struct CalcRegistry *registry, int server_fd) {
 	int keep_going = 1;
 	while (keep_going) {
 		int client_fd = Accept(server_fd, NULL, NULL);		// establish client connection with the server
@@ -56,7 +60,7 @@ int main(int argc, char **argv) {
 		
 		struct ConnInfo *info = malloc(sizeof(struct ConnInfo));		// reserve memory for ConnInfo
 		info->clientfd = client_fd;
-		info->calc = calc;
+		info->registry = registry;
 
 		pthread_t thr_id;
 
@@ -67,55 +71,235 @@ int main(int argc, char **argv) {
 			return 0;		 // fatal: pthread_create failed
 		}
 	}
-	close(server_fd);		// close server file descriptor
-
-	calc_destroy(calc);		// delete calc and destory pthread mutex
 	return 0;
 }
 
 /**
- * Read lines of input, evaluate them as calculator expressions,
- * and (if evaluation was successful) print the result of each
- * expression.  Quit when "quit" command is received.
- * 
- * @param calc The shared Calc struct
- * @param client_fd client file descriptor
- * @return int 
+ * Write the trace buffers to a file each time the server gets SIGUSR1.
+ * The signal is blocked in every thread, so it is only ever taken here,
+ * where a dump may lock and write as a signal handler could not.
+ *
+ * @param arg The file to write
+ * @return never returns
  */
-int chat_with_client(struct Calc *calc, int client_fd) {
-	rio_t in;
-	char linebuf[LINEBUF_SIZE];
-
-	rio_readinitb(&in, client_fd);
-
-	int done = 0;
-	while (!done) {
-		ssize_t n = rio_readlineb(&in, linebuf, LINEBUF_SIZE);
-		if (n <= 0) {
-			/* error or end of input */
-			done = 1;
-		} else if (strcmp(linebuf, "quit\n") == 0 || strcmp(linebuf, "quit\r\n") == 0) {
-			/* quit command */
-			done = 1;
-		} else if (strcmp(linebuf, "shutdown\n") == 0 || strcmp(linebuf, "shutdown\r\n") == 0) {
-			done = 1;
-			return 0;
+static void *trace_dumper(void *arg) {
+	const char *path = arg;
+	sigset_t signals;
+	int sig;
+
+	pthread_detach(pthread_self());
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	for (;;) {
+		if (sigwait(&signals, &sig) != 0) {
+			continue;
 		}
-		else {
-			/* process input line */
-			int result;
-			if (calc_eval(calc, linebuf, &result) == 0) {
-				/* expression couldn't be evaluated */
-				rio_writen(client_fd, "Error\n", 6);
-			} else {
-				/* output result */
-				int len = snprintf(linebuf, LINEBUF_SIZE, "%d\n", result);
-				if (len < LINEBUF_SIZE) {
-					rio_writen(client_fd, linebuf, len);
-				}
-			}
+		long events = calc_trace_dump(path);
+		if (events < 0) {
+			fprintf(stderr, "Trace dump to %s failed: %s\n", path, strerror(errno));
+		} else {
+			fprintf(stderr, "Trace dump: %ld events to %s\n", events, path);
 		}
 	}
-	return 1;
+	return NULL;
 }
 
+/**
+ * Print how to run the server and exit
+ *
+ * @param prog Name the server was run as
+ */
+static void usage(const char *prog) {
+#ifdef CALC_URING
+	fprintf(stderr, "Usage: %s [-m uring|thread|epoll|reuseport|pool] [-t threads] [-q size] [-f block|reject] [-n count] [-w dir] [-i usec] [-s dir] [-c sec] [-P path | -R path] [-L] [-T path] <port>\n", prog);
+	fprintf(stderr, "  -m uring      one thread serves all connections with io_uring (default),\n");
+	fprintf(stderr, "                or with epoll if the kernel lacks io_uring\n");
+#else
+	fprintf(stderr, "Usage: %s [-m thread|epoll|reuseport|pool] [-t threads] [-q size] [-f block|reject] [-n count] [-w dir] [-i usec] [-s dir] [-c sec] [-P path | -R path] [-L] [-T path] <port>\n", prog);
+#endif
+#ifdef CALC_URING
+	fprintf(stderr, "  -m thread     one thread per connection\n");
+#else
+	fprintf(stderr, "  -m thread     one thread per connection (default)\n");
+#endif
+	fprintf(stderr, "  -m epoll      one thread serves all connections with epoll\n");
+	fprintf(stderr, "  -m reuseport  like epoll, with several threads that each accept on their own socket\n");
+	fprintf(stderr, "  -m pool       a fixed pool of threads serves queued connections\n");
+	fprintf(stderr, "  -t threads    threads in reuseport and pool modes (default: one per core)\n");
+	fprintf(stderr, "  -q size       connections waiting for a worker in pool mode (default: %d)\n", DEFAULT_QUEUE_SIZE);
+	fprintf(stderr, "  -f block      when the queue is full, stop accepting until a worker is free (default)\n");
+	fprintf(stderr, "  -f reject     when the queue is full, close new connections\n");
+	fprintf(stderr, "  -n count      most namespaces, the default one included; 0 for no limit (default: %d)\n", MAX_NAMESPACES);
+	fprintf(stderr, "  -w dir        log assignments to dir/NAMESPACE.wal, replaying the logs on startup\n");
+	fprintf(stderr, "  -i usec       wait this long for more assignments before each sync of a log (default: 0)\n");
+	fprintf(stderr, "                event loop modes hold replies and wait on a background thread;\n");
+	fprintf(stderr, "                thread and pool modes wait on the connection's thread\n");
+	fprintf(stderr, "  -s dir        map dir/NAMESPACE.snap on startup; SNAPSHOT saves it\n");
+	fprintf(stderr, "  -c sec        with -s, write the changes as checkpoints this often in the background\n");
+	fprintf(stderr, "  -P path       be a primary, streaming assignments to replicas that connect to path\n");
+	fprintf(stderr, "  -R path       be a read-only replica of the primary at path; not with -w or -c\n");
+	fprintf(stderr, "  -L            time the waits for and holds of shard locks, for the stats command\n");
+	fprintf(stderr, "  -T path       trace requests, writing the traces to path on SIGUSR1 or \"trace dump\"\n");
+	exit(1);
+}
+
+/**
+ * Check whether this build of the server has a mode
+ *
+ * @param mode The mode's name
+ * @return 1 if it does, 0 otherwise
+ */
+static int valid_mode(const char *mode) {
+#ifdef CALC_URING
+	if (strcmp(mode, "uring") == 0) {
+		return 1;
+	}
+#endif
+	return strcmp(mode, "thread") == 0 || strcmp(mode, "epoll") == 0
+		|| strcmp(mode, "reuseport") == 0 || strcmp(mode, "pool") == 0;
+}
+
+int main(int argc, char **argv) {
+#ifdef CALC_URING
+	const char *mode = "uring";
+#else
+	const char *mode = "thread";
+#endif
+	unsigned num_workers = 0;		// 0 means one per core
+	unsigned queue_size = DEFAULT_QUEUE_SIZE;
+	enum PoolFullPolicy full_policy = POOL_FULL_BLOCK;
+	struct RegistryOptions opts;
+	const char *primary_path = NULL;
+	const char *replica_path = NULL;
+	const char *trace_path = NULL;
+	int opt;
+
+	registry_options_init(&opts);
+	while ((opt = getopt(argc, argv, "m:t:q:f:n:w:i:s:c:P:R:LT:")) != -1) {
+		if (opt == 'm') {
+			mode = optarg;
+		} else if (opt == 't') {
+			num_workers = (unsigned) atoi(optarg);
+		} else if (opt == 'q') {
+			queue_size = (unsigned) atoi(optarg);
+		} else if (opt == 'f' && strcmp(optarg, "block") == 0) {
+			full_policy = POOL_FULL_BLOCK;
+		} else if (opt == 'f' && strcmp(optarg, "reject") == 0) {
+			full_policy = POOL_FULL_REJECT;
+		} else if (opt == 'n') {
+			opts.max_namespaces = (unsigned) atoi(optarg);
+		} else if (opt == 'w') {
+			opts.wal_dir = optarg;
+		} else if (opt == 'i') {
+			opts.wal_interval_us = (unsigned) atoi(optarg);
+		} else if (opt == 's') {
+			opts.snapshot_dir = optarg;
+		} else if (opt == 'c') {
+			opts.checkpoint_interval = (unsigned) atoi(optarg);
+		} else if (opt == 'P') {
+			primary_path = optarg;
+		} else if (opt == 'R') {
+			replica_path = optarg;
+			opts.calc.read_only = 1;		// only the primary's stream assigns
+		} else if (opt == 'L') {
+			calc_enable_lock_stats(1);
+		} else if (opt == 'T') {
+			trace_path = optarg;
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);		// incorrect number of command line arguments
+	}
+	if (!valid_mode(mode)) {
+		usage(argv[0]);
+	}
+	if (opts.checkpoint_interval > 0 && opts.snapshot_dir == NULL) {
+		usage(argv[0]);		// checkpoints go next to the snapshots
+	}
+	if (replica_path != NULL && (primary_path != NULL || opts.wal_dir != NULL || opts.checkpoint_interval > 0)) {
+		usage(argv[0]);		// a replica's state comes from its primary
+	}
+
+	Signal(SIGPIPE, SIG_IGN);		// a client that disconnects early must not kill the server
+
+	calc_enable_stats(1);		// answered by the "stats" command
+
+	if (trace_path != NULL) {
+		// before any other thread starts, so that they all leave SIGUSR1 to trace_dumper
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &signals, NULL);
+		pthread_t dumper;
+		if (pthread_create(&dumper, NULL, trace_dumper, (void *) trace_path) != 0) {
+			fprintf(stderr, "Fatal: pthread_create failed\n");
+			return 1;
+		}
+		calc_enable_trace(1);
+		proto_set_trace_path(trace_path);
+	}
+
+	struct CalcRegistry *registry = registry_create(&opts);		// namespaces are created as clients use them
+	if (registry == NULL) { return 1; }		// fatal: the default namespace's log can't be used
+
+	struct Replication *replication = NULL;
+	if (primary_path != NULL || replica_path != NULL) {
+		replication = primary_path != NULL ? replication_primary(registry, primary_path)
+		                                   : replication_replica(registry, replica_path);
+		if (replication == NULL) {
+			fprintf(stderr, "Fatal: %s: %s\n", primary_path != NULL ? primary_path : replica_path, strerror(errno));
+			registry_destroy(registry);
+			return 1;
+		}
+		registry_set_replication(registry, replication);
+	}
+	const char *port = argv[optind];
+
+	if (strcmp(mode, "reuseport") == 0) {
+		// every reactor opens a listening socket of its own
+		if (multi_reactor_run(registry, port, num_workers) < 0) {
+			fprintf(stderr, "Fatal: %s\n", strerror(errno));
+		}
+		if (replication != NULL) {
+			replication_stop(replication);
+		}
+		registry_destroy(registry);
+		return 0;
+	}
+
+	int server_fd = open_listenfd((char*) port);		// Open and return a listening socket on port for the server
+	if (server_fd < 0) { return 0; } // fatal error
+
+#ifdef CALC_URING
+	if (strcmp(mode, "uring") == 0) {
+		int rc = uring_run(registry, server_fd);
+		if (rc == URING_UNSUPPORTED) {
+			fprintf(stderr, "io_uring is not available, using epoll\n");
+			mode = "epoll";
+		} else if (rc < 0) {
+			fprintf(stderr, "Fatal: %s\n", strerror(errno));
+		}
+	}
+#endif
+
+	if (strcmp(mode, "epoll") == 0) {
+		if (reactor_run(registry, server_fd) < 0) {
+			fprintf(stderr, "Fatal: %s\n", strerror(errno));
+		}
+	} else if (strcmp(mode, "pool") == 0) {
+		if (pool_run(registry, server_fd, num_workers, queue_size, full_policy) < 0) {
+			fprintf(stderr, "Fatal: %s\n", strerror(errno));
+		}
+	} else if (strcmp(mode, "thread") == 0) {
+		serve_threads(registry, server_fd);
+	}
+	close(server_fd);		// close server file descriptor
+
+	if (replication != NULL) {
+		replication_stop(replication);		// before the namespaces it feeds from go
+	}
+	registry_destroy(registry);		// delete every namespace's calc
+	return 0;
+}
@@ -1,5 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include "tctest.h"
 
 #include "calc.h"
@@ -28,6 +35,27 @@ void testComputation(TestObjs *objs);
 void testComputationAndAssignment(TestObjs *objs);
 void testUpdate(TestObjs *objs);
 void testInvalidExpr(TestObjs *objs);
+void testInvalidInteger(TestObjs *objs);
+void testCompiled(TestObjs *objs);
+void testManyVariables(TestObjs *objs);
+void testConcurrentReadWrite(TestObjs *objs);
+void testLockFree(TestObjs *objs);
+void testSharded(TestObjs *objs);
+void testBatch(TestObjs *objs);
+void testPrecedence(TestObjs *objs);
+void testInvalidLongExpr(TestObjs *objs);
+void testIntegerLiterals(TestObjs *objs);
+void testProgram(TestObjs *objs);
+void testWal(TestObjs *objs);
+void testWalFailure(TestObjs *objs);
+void testDeferredCommit(TestObjs *objs);
+void testSnapshot(TestObjs *objs);
+void testCheckpoint(TestObjs *objs);
+void testSnapshotThenCheckpoint(TestObjs *objs);
+void testReplicationFeed(TestObjs *objs);
+void testStats(TestObjs *objs);
+void testLockStats(TestObjs *objs);
+void testTrace(TestObjs *objs);
 
 int main(void) {
 	TEST_INIT();
@@ -41,6 +69,27 @@ int main(void) {
 	TEST(testComputationAndAssignment);
 	TEST(testUpdate);
 	TEST(testInvalidExpr);
+	TEST(testInvalidInteger);
+	TEST(testCompiled);
+	TEST(testManyVariables);
+	TEST(testConcurrentReadWrite);
+	TEST(testLockFree);
+	TEST(testSharded);
+	TEST(testBatch);
+	TEST(testPrecedence);
+	TEST(testInvalidLongExpr);
+	TEST(testIntegerLiterals);
+	TEST(testProgram);
+	TEST(testWal);
+	TEST(testWalFailure);
+	TEST(testDeferredCommit);
+	TEST(testSnapshot);
+	TEST(testCheckpoint);
+	TEST(testSnapshotThenCheckpoint);
+	TEST(testReplicationFeed);
+	TEST(testStats);
+	TEST(testLockStats);
+	TEST(testTrace);
 
 	TEST_FINI();
 }
@@ -192,3 +241,944 @@ void testInvalidExpr(TestObjs *objs) {
 	/* attempt to divide by 0 */
 	ASSERT(0 == calc_eval(objs->calc, "4 / 0", &result));
 }
+
+void testInvalidInteger(TestObjs *objs) {
+	int result;
+
+	/* a lone minus sign is not an integer */
+	ASSERT(0 == calc_eval(objs->calc, "- + 3", &result));
+	/* out of range for int */
+	ASSERT(0 == calc_eval(objs->calc, "2147483648", &result));
+	ASSERT(0 == calc_eval(objs->calc, "a = 99999999999 + 1", &result));
+
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "-2147483648", &result));
+	ASSERT(-2147483647 - 1 == result);
+
+}
+
+void testCompiled(TestObjs *objs) {
+	int result;
+	struct CalcCompiled *sum, *incr, *div;
+
+	/* bad syntax is rejected at compile time */
+	ASSERT(NULL == calc_compile(objs->calc, "+ 4"));
+	ASSERT(NULL == calc_compile(objs->calc, "4 = a"));
+
+	sum = calc_compile(objs->calc, "a + b");
+	incr = calc_compile(objs->calc, "a = a + 1");
+	div = calc_compile(objs->calc, "b / a");
+	ASSERT(NULL != sum && NULL != incr && NULL != div);
+
+	/* variables need not exist at compile time */
+	ASSERT(0 == calc_exec(sum, &result));
+	ASSERT(0 != calc_eval(objs->calc, "a = 0", &result));
+	ASSERT(0 != calc_eval(objs->calc, "b = 10", &result));
+	ASSERT(0 == calc_exec(div, &result));
+
+	result = 0;
+	ASSERT(0 != calc_exec(incr, &result));
+	ASSERT(1 == result);
+	result = 0;
+	ASSERT(0 != calc_exec(incr, &result));
+	ASSERT(2 == result);
+
+	/* compiled and uncompiled evaluation see the same variables */
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "a", &result));
+	ASSERT(2 == result);
+	result = 0;
+	ASSERT(0 != calc_exec(sum, &result));
+	ASSERT(12 == result);
+	result = 0;
+	ASSERT(0 != calc_exec(div, &result));
+	ASSERT(5 == result);
+
+	calc_free_compiled(sum);
+	calc_free_compiled(incr);
+	calc_free_compiled(div);
+}
+
+/* write the variable name for n (in base 26 letters) into buf */
+static void var_name(char *buf, int n) {
+	do {
+		*buf++ = 'a' + n % 26;
+		n /= 26;
+	} while (n > 0);
+	*buf = '\0';
+}
+
+void testManyVariables(TestObjs *objs) {
+	char expr[64], name[16];
+	int result;
+
+	for (int i = 0; i < 20000; i++) {
+		var_name(name, i);
+		snprintf(expr, sizeof(expr), "%s = %d", name, i);
+		ASSERT(0 != calc_eval(objs->calc, expr, &result));
+	}
+
+	for (int i = 0; i < 20000; i++) {
+		var_name(name, i);
+		result = -1;
+		ASSERT(0 != calc_eval(objs->calc, name, &result));
+		ASSERT(i == result);
+	}
+}
+
+/* number of reader threads and evaluations per thread in testConcurrentReadWrite */
+#define NUM_READERS 4
+#define NUM_CONCURRENT_EVALS 20000
+
+/* evaluate a read-only expression repeatedly, returning (void *) 1 on any failure */
+static void *concurrent_reader(void *arg) {
+	struct Calc *calc = arg;
+	int result;
+
+	for (int i = 0; i < NUM_CONCURRENT_EVALS; i++) {
+		if (calc_eval(calc, "a - b", &result) == 0 || result < 0 || result > 1) {
+			return (void *) 1;
+		}
+	}
+	return NULL;
+}
+
+void testConcurrentReadWrite(TestObjs *objs) {
+	pthread_t readers[NUM_READERS];
+	int result;
+
+	ASSERT(0 != calc_eval(objs->calc, "a = 0", &result));
+	ASSERT(0 != calc_eval(objs->calc, "b = 0", &result));
+
+	for (int i = 0; i < NUM_READERS; i++) {
+		ASSERT(0 == pthread_create(&readers[i], NULL, concurrent_reader, objs->calc));
+	}
+
+	/* readers only ever see a equal to b or one ahead of it */
+	for (int i = 0; i < NUM_CONCURRENT_EVALS; i++) {
+		ASSERT(0 != calc_eval(objs->calc, "a = a + 1", &result));
+		ASSERT(0 != calc_eval(objs->calc, "b = a", &result));
+	}
+
+	for (int i = 0; i < NUM_READERS; i++) {
+		void *failed;
+		pthread_join(readers[i], &failed);
+		ASSERT(NULL == failed);
+	}
+
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "b", &result));
+	ASSERT(NUM_CONCURRENT_EVALS == result);
+}
+
+/* number of variables each thread assigns in testLockFree */
+#define NUM_LOCK_FREE_VARS 2000
+
+/* assign the same set of variables as every other thread, returning (void *) 1 on failure */
+static void *lock_free_writer(void *arg) {
+	struct Calc *calc = arg;
+	char expr[64], name[16];
+	int result;
+
+	for (int i = 0; i < NUM_LOCK_FREE_VARS; i++) {
+		var_name(name, i);
+		snprintf(expr, sizeof(expr), "%s = %d", name, i);
+		if (calc_eval(calc, expr, &result) == 0 || result != i) {
+			return (void *) 1;
+		}
+	}
+	return NULL;
+}
+
+void testLockFree(TestObjs *objs) {
+	/* a tiny bucket count forces long chains and races on the same heads */
+	struct Calc *calc = calc_create_lockfree(4);
+	pthread_t writers[NUM_READERS];
+	char name[16];
+	int result;
+
+	(void) objs;
+
+	ASSERT(0 == calc_eval(calc, "a", &result));
+	ASSERT(0 != calc_eval(calc, "a = 2", &result));
+	ASSERT(0 != calc_eval(calc, "a = a * 21", &result));
+	ASSERT(42 == result);
+
+	struct CalcCompiled *incr = calc_compile(calc, "b = b + 1");
+	ASSERT(NULL != incr);
+	ASSERT(0 == calc_exec(incr, &result));		/* b is interned but undefined */
+	ASSERT(0 != calc_eval(calc, "b = 0", &result));
+	ASSERT(0 != calc_exec(incr, &result));
+	ASSERT(1 == result);
+	calc_free_compiled(incr);
+
+	for (int i = 0; i < NUM_READERS; i++) {
+		ASSERT(0 == pthread_create(&writers[i], NULL, lock_free_writer, calc));
+	}
+	for (int i = 0; i < NUM_READERS; i++) {
+		void *failed;
+		pthread_join(writers[i], &failed);
+		ASSERT(NULL == failed);
+	}
+
+	for (int i = 0; i < NUM_LOCK_FREE_VARS; i++) {
+		var_name(name, i);
+		result = -1;
+		ASSERT(0 != calc_eval(calc, name, &result));
+		ASSERT(i == result);
+	}
+
+	calc_destroy(calc);
+}
+
+/* number of variables and evaluations per thread in testSharded */
+#define NUM_SHARDED_VARS 64
+#define NUM_SHARDED_EVALS 20000
+
+/* repeatedly assign sums of pseudo-random variables, returning (void *) 1 on failure */
+static void *sharded_worker(void *arg) {
+	struct Calc *calc = arg;
+	char expr[64], x[16], y[16], z[16];
+	unsigned seed = (unsigned) (size_t) pthread_self();
+	int result;
+
+	for (int i = 0; i < NUM_SHARDED_EVALS; i++) {
+		var_name(x, rand_r(&seed) % NUM_SHARDED_VARS);
+		var_name(y, rand_r(&seed) % NUM_SHARDED_VARS);
+		var_name(z, rand_r(&seed) % NUM_SHARDED_VARS);
+		snprintf(expr, sizeof(expr), "%s = %s * %s", x, y, z);
+		if (calc_eval(calc, expr, &result) == 0 || result != 1) {
+			return (void *) 1;
+		}
+	}
+	return NULL;
+}
+
+void testSharded(TestObjs *objs) {
+	struct CalcOptions opts;
+	pthread_t workers[NUM_READERS];
+	char expr[64], name[16];
+	int result;
+
+	(void) objs;
+
+	calc_options_init(&opts);
+	opts.num_shards = 7;
+	struct Calc *calc = calc_create_ex(&opts);
+
+	ASSERT(0 != calc_eval(calc, "a = 6", &result));
+	ASSERT(0 != calc_eval(calc, "b = 7", &result));
+	ASSERT(0 != calc_eval(calc, "c = a * b", &result));
+	ASSERT(42 == result);
+	ASSERT(0 != calc_eval(calc, "a = a + a", &result));
+	ASSERT(12 == result);
+	ASSERT(0 == calc_eval(calc, "d = a / e", &result));
+
+	/* every variable is 1, so every product is 1 whatever the interleaving */
+	for (int i = 0; i < NUM_SHARDED_VARS; i++) {
+		var_name(name, i);
+		snprintf(expr, sizeof(expr), "%s = 1", name);
+		ASSERT(0 != calc_eval(calc, expr, &result));
+	}
+
+	/* statements touching overlapping shards in any order must not deadlock */
+	for (int i = 0; i < NUM_READERS; i++) {
+		ASSERT(0 == pthread_create(&workers[i], NULL, sharded_worker, calc));
+	}
+	for (int i = 0; i < NUM_READERS; i++) {
+		void *failed;
+		pthread_join(workers[i], &failed);
+		ASSERT(NULL == failed);
+	}
+
+	calc_destroy(calc);
+}
+
+void testBatch(TestObjs *objs) {
+	const char *exprs[] = { "a = 3", "b = a * 2", "c", "4 +", "a + b", "b / 0", "c = b - a" };
+	int results[7], status[7];
+	struct CalcOptions opts;
+
+	/* later expressions see assignments made earlier in the same batch */
+	ASSERT(4 == calc_eval_batch(objs->calc, exprs, 7, results, status));
+	ASSERT(1 == status[0] && 3 == results[0]);
+	ASSERT(1 == status[1] && 6 == results[1]);
+	ASSERT(0 == status[2]);
+	ASSERT(0 == status[3]);
+	ASSERT(1 == status[4] && 9 == results[4]);
+	ASSERT(0 == status[5]);
+	ASSERT(1 == status[6] && 3 == results[6]);
+
+	/* same again with several shards */
+	calc_options_init(&opts);
+	opts.num_shards = 5;
+	struct Calc *calc = calc_create_ex(&opts);
+	ASSERT(4 == calc_eval_batch(calc, exprs, 7, results, status));
+	ASSERT(1 == status[6] && 3 == results[6]);
+	ASSERT(0 == calc_eval_batch(calc, exprs, 0, results, status));
+	calc_destroy(calc);
+}
+
+void testPrecedence(TestObjs *objs) {
+	int result;
+
+	ASSERT(0 != calc_eval(objs->calc, "a = 2", &result));
+	ASSERT(0 != calc_eval(objs->calc, "b = 3", &result));
+	ASSERT(0 != calc_eval(objs->calc, "c = 4", &result));
+
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "x = a * b + c", &result));
+	ASSERT(10 == result);
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "a + b * c", &result));
+	ASSERT(14 == result);
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "(a + b) * c", &result));
+	ASSERT(20 == result);
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "x", &result));
+	ASSERT(10 == result);
+
+	/* left associativity */
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "20 - 5 - 3", &result));
+	ASSERT(12 == result);
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "100 / 10 / 5", &result));
+	ASSERT(2 == result);
+
+	/* spaces are optional, unary minus applies to any operand */
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "y=((a+b)*(c-1))/-b", &result));
+	ASSERT(-5 == result);
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "-(a - c) - -1", &result));
+	ASSERT(3 == result);
+
+	/* errors anywhere in the expression */
+	ASSERT(0 == calc_eval(objs->calc, "a * (b + c", &result));
+	ASSERT(0 == calc_eval(objs->calc, "a * b + c)", &result));
+	ASSERT(0 == calc_eval(objs->calc, "a + z * 2", &result));
+	ASSERT(0 == calc_eval(objs->calc, "a + 4 / (c - 4)", &result));
+	ASSERT(0 == calc_eval(objs->calc, "a = b = c", &result));
+	ASSERT(0 == calc_eval(objs->calc, "a b", &result));
+	ASSERT(0 == calc_eval(objs->calc, "a1", &result));
+	ASSERT(0 == calc_eval(objs->calc, "()", &result));
+
+	/* a failed assignment leaves the target alone */
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "x", &result));
+	ASSERT(10 == result);
+}
+
+void testInvalidLongExpr(TestObjs *objs) {
+	char expr[2048];
+	int len = 0, result;
+
+	/* 100 operands is within the limit */
+	len = sprintf(expr, "1");
+	for (int i = 1; i < 100; i++) {
+		len += sprintf(expr + len, " + 1");
+	}
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, expr, &result));
+	ASSERT(100 == result);
+
+	/* 200 operands is not */
+	for (int i = 100; i < 200; i++) {
+		len += sprintf(expr + len, " + 1");
+	}
+	ASSERT(0 == calc_eval(objs->calc, expr, &result));
+
+	/* nor is deep nesting */
+	len = 0;
+	for (int i = 0; i < 100; i++) {
+		expr[len++] = '(';
+	}
+	expr[len++] = '1';
+	for (int i = 0; i < 100; i++) {
+		expr[len++] = ')';
+	}
+	expr[len] = '\0';
+	ASSERT(0 == calc_eval(objs->calc, expr, &result));
+}
+
+void testIntegerLiterals(TestObjs *objs) {
+	int result;
+
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "12345678", &result));
+	ASSERT(12345678 == result);
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "123456789", &result));
+	ASSERT(123456789 == result);
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "2147483647", &result));
+	ASSERT(2147483647 == result);
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "0000000000000000000042", &result));
+	ASSERT(42 == result);
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "98765432+1", &result));
+	ASSERT(98765433 == result);
+
+	/* out of range, however many digits */
+	ASSERT(0 == calc_eval(objs->calc, "-2147483649", &result));
+	ASSERT(0 == calc_eval(objs->calc, "4294967296", &result));
+	ASSERT(0 == calc_eval(objs->calc, "99999999999999999999999999999999", &result));
+	/* only -INT_MIN written as a negative literal fits */
+	ASSERT(0 == calc_eval(objs->calc, "- 2147483648", &result));
+}
+
+void testProgram(TestObjs *objs) {
+	int result;
+	struct CalcVar *vars[2];
+
+	/* only valid names get handles */
+	ASSERT(NULL == calc_var(objs->calc, "a1", 2));
+	ASSERT(NULL == calc_var(objs->calc, "", 0));
+	vars[0] = calc_var(objs->calc, "abc", 2);		/* just "ab" */
+	vars[1] = calc_var(objs->calc, "c", 1);
+	ASSERT(NULL != vars[0] && NULL != vars[1]);
+
+	/* c = (ab + 4) * -3, with ab = 6 */
+	struct CalcInstr set[] = { { CALC_OP_PUSH_INT, 6 } };
+	struct CalcInstr expr[] = {
+		{ CALC_OP_PUSH_VAR, 0 }, { CALC_OP_PUSH_INT, 4 }, { CALC_OP_ADD, 0 },
+		{ CALC_OP_PUSH_INT, 3 }, { CALC_OP_NEG, 0 }, { CALC_OP_MUL, 0 },
+	};
+	ASSERT(0 == calc_exec_program(objs->calc, NULL, expr, 6, vars, 2, &result));		/* ab undefined */
+	ASSERT(0 != calc_exec_program(objs->calc, vars[0], set, 1, vars, 2, &result));
+	ASSERT(6 == result);
+	ASSERT(0 != calc_exec_program(objs->calc, vars[1], expr, 6, vars, 2, &result));
+	ASSERT(-30 == result);
+	ASSERT(0 != calc_eval(objs->calc, "c", &result));
+	ASSERT(-30 == result);
+	ASSERT(0 != calc_eval(objs->calc, "ab", &result));
+	ASSERT(6 == result);
+
+	/* malformed programs */
+	struct CalcInstr missing[] = { { CALC_OP_PUSH_INT, 1 }, { CALC_OP_ADD, 0 } };
+	struct CalcInstr extra[] = { { CALC_OP_PUSH_INT, 1 }, { CALC_OP_PUSH_INT, 2 } };
+	struct CalcInstr bad_var[] = { { CALC_OP_PUSH_VAR, 2 } };
+	struct CalcInstr div_zero[] = { { CALC_OP_PUSH_INT, 1 }, { CALC_OP_PUSH_INT, 0 }, { CALC_OP_DIV, 0 } };
+	ASSERT(0 == calc_exec_program(objs->calc, NULL, missing, 2, vars, 2, &result));
+	ASSERT(0 == calc_exec_program(objs->calc, NULL, extra, 2, vars, 2, &result));
+	ASSERT(0 == calc_exec_program(objs->calc, NULL, bad_var, 1, vars, 2, &result));
+	ASSERT(0 == calc_exec_program(objs->calc, NULL, expr, 0, vars, 2, &result));
+	ASSERT(0 == calc_exec_program(objs->calc, vars[1], div_zero, 3, vars, 2, &result));
+	ASSERT(0 != calc_eval(objs->calc, "c", &result));
+	ASSERT(-30 == result);
+}
+
+void testWal(TestObjs *objs) {
+	char path[] = "/tmp/calcTestWalXXXXXX";
+	int fd = mkstemp(path);
+	ASSERT(fd >= 0);
+	close(fd);
+	int result, status[3];
+	(void) objs;
+
+	struct Calc *calc = calc_create();
+	ASSERT(0 == calc_open_wal(calc, path, 0));
+	ASSERT(-1 == calc_open_wal(calc, path, 0));		/* already logging */
+	ASSERT(0 != calc_eval(calc, "a = 3", &result));
+	ASSERT(0 != calc_eval(calc, "b = a * 2", &result));
+	ASSERT(0 == calc_eval(calc, "c = 1 / 0", &result));		/* failed, so not logged */
+	const char *exprs[] = { "a = a + 1", "a", "x = y" };
+	int results[3];
+	ASSERT(2 == calc_eval_batch(calc, exprs, 3, results, status));
+	calc_destroy(calc);
+
+	/* a crash in the middle of a write leaves a torn record at the end */
+	FILE *f = fopen(path, "a");
+	ASSERT(NULL != f);
+	fputs("\x01\x02\x03", f);
+	fclose(f);
+
+	/* replaying restores the last value of each variable, lock-free too */
+	calc = calc_create_lockfree(0);
+	ASSERT(3 == calc_open_wal(calc, path, 100));
+	ASSERT(0 != calc_eval(calc, "a", &result));
+	ASSERT(4 == result);
+	ASSERT(0 != calc_eval(calc, "b", &result));
+	ASSERT(6 == result);
+	ASSERT(0 == calc_eval(calc, "c", &result));
+	ASSERT(0 != calc_eval(calc, "c = a + b", &result));
+	calc_destroy(calc);
+
+	/* the torn record was cut off, so records appended after it are read */
+	calc = calc_create();
+	ASSERT(4 == calc_open_wal(calc, path, 0));
+	ASSERT(0 != calc_eval(calc, "c", &result));
+	ASSERT(10 == result);
+	calc_destroy(calc);
+
+	unlink(path);
+}
+
+void testWalFailure(TestObjs *objs) {
+	char path[] = "/tmp/calcTestWalXXXXXX";
+	close(mkstemp(path));
+	struct rlimit limit, full;
+	struct stat st;
+	int result, results[3], status[3];
+	(void) objs;
+
+	struct Calc *calc = calc_create();
+	ASSERT(0 == calc_open_wal(calc, path, 0));
+	ASSERT(0 != calc_eval(calc, "a = 1", &result));
+
+	/* writing past the log's current size now fails, as on a full disk */
+	ASSERT(0 == stat(path, &st));
+	ASSERT(0 == getrlimit(RLIMIT_FSIZE, &limit));
+	full = limit;
+	full.rlim_cur = st.st_size;
+	signal(SIGXFSZ, SIG_IGN);
+	ASSERT(0 == setrlimit(RLIMIT_FSIZE, &full));
+	const char *exprs[] = { "c = 4", "a = 2", "c + a" };
+	ASSERT(1 == calc_eval_batch(calc, exprs, 3, results, status));
+	ASSERT(0 == status[0] && 0 == status[1] && 1 == status[2]);
+	ASSERT(6 == results[2]);		/* read before the commit failed */
+	ASSERT(0 == setrlimit(RLIMIT_FSIZE, &limit));
+
+	/* the failed assignments were undone, and the log takes no more */
+	ASSERT(0 != calc_eval(calc, "a", &result));
+	ASSERT(1 == result);
+	ASSERT(0 == calc_eval(calc, "c", &result));
+	ASSERT(0 == calc_eval(calc, "b = 3", &result));
+	ASSERT(0 == calc_eval(calc, "b", &result));
+	calc_destroy(calc);
+
+	/* which matches what a restart finds */
+	calc = calc_create();
+	ASSERT(1 == calc_open_wal(calc, path, 0));
+	ASSERT(0 != calc_eval(calc, "a", &result));
+	ASSERT(1 == result);
+	ASSERT(0 == calc_eval(calc, "c", &result));
+	calc_destroy(calc);
+
+	unlink(path);
+}
+
+void testDeferredCommit(TestObjs *objs) {
+	char path[] = "/tmp/calcTestWalXXXXXX";
+	close(mkstemp(path));
+	int result;
+	eventfd_t count;
+
+	/* without a log there is nothing to wait for */
+	calc_defer_commits(1);
+	ASSERT(0 != calc_eval(objs->calc, "a = 1", &result));
+	ASSERT(0 == calc_take_commit(objs->calc));
+
+	/* a long interval keeps the assignment off the disk for a while */
+	struct Calc *calc = calc_create();
+	ASSERT(0 == calc_open_wal(calc, path, 200000));
+	ASSERT(0 != calc_eval(calc, "a = 1", &result));
+	ASSERT(0 != calc_eval(calc, "b = a + 1", &result));
+	unsigned long long lsn = calc_take_commit(calc);
+	ASSERT(0 != lsn);
+	ASSERT(0 == calc_take_commit(calc));		/* taken already */
+	ASSERT(0 == calc_commit_status(calc, lsn));
+
+	/* the log's thread syncs, then wakes the eventfd */
+	int fd = eventfd(0, EFD_CLOEXEC);
+	struct CalcNotifier *notifier = calc_notifier_create(fd);
+	ASSERT(0 == calc_notify_commit(calc, lsn, notifier));
+	ASSERT(0 == eventfd_read(fd, &count));
+	ASSERT(1 == calc_commit_status(calc, lsn));
+	ASSERT(1 == calc_notify_commit(calc, lsn, notifier));
+	calc_notifier_destroy(notifier);
+	close(fd);
+	calc_defer_commits(0);
+	calc_destroy(calc);
+
+	calc = calc_create();
+	ASSERT(2 == calc_open_wal(calc, path, 0));
+	ASSERT(0 != calc_eval(calc, "b", &result));
+	ASSERT(2 == result);
+	calc_destroy(calc);
+
+	unlink(path);
+}
+
+void testSnapshot(TestObjs *objs) {
+	char snap[] = "/tmp/calcTestSnapXXXXXX", wal[] = "/tmp/calcTestWalXXXXXX";
+	close(mkstemp(snap));
+	close(mkstemp(wal));
+	struct stat st;
+	int result;
+
+	/* a calculator with variables can't load one, and neither can garbage */
+	ASSERT(0 != calc_eval(objs->calc, "a = 1", &result));
+	ASSERT(-1 == calc_load_snapshot(objs->calc, snap));
+	struct Calc *calc = calc_create();
+	ASSERT(-1 == calc_load_snapshot(calc, snap));
+
+	/* saving empties the log */
+	ASSERT(0 == calc_open_wal(calc, wal, 0));
+	ASSERT(0 != calc_eval(calc, "b = 2", &result));
+	ASSERT(0 != calc_eval(calc, "a = 1", &result));
+	ASSERT(0 == calc_eval(calc, "c", &result));		/* interned, but undefined */
+	ASSERT(2 == calc_save_snapshot(calc, snap, NULL));
+	ASSERT(0 == stat(wal, &st) && 0 == st.st_size);
+	ASSERT(0 != calc_eval(calc, "d = 4", &result));
+	calc_destroy(calc);
+
+	/* the snapshot, then the log after it */
+	calc = calc_create_ex(&(struct CalcOptions) { CALC_LOCKED, 8, 0, 0 });
+	ASSERT(2 == calc_load_snapshot(calc, snap));
+	ASSERT(1 == calc_open_wal(calc, wal, 0));
+	ASSERT(0 != calc_eval(calc, "a + b + d", &result));
+	ASSERT(7 == result);
+	ASSERT(0 == calc_eval(calc, "c", &result));
+	ASSERT(0 != calc_eval(calc, "b = b * 10", &result));
+	ASSERT(0 != calc_eval(calc, "e = 5", &result));
+	ASSERT(4 == calc_save_snapshot(calc, snap, NULL));
+	calc_destroy(calc);
+
+	/* assignments in memory win over the snapshot they were made on */
+	calc = calc_create_lockfree(0);
+	ASSERT(4 == calc_load_snapshot(calc, snap));
+	ASSERT(0 != calc_eval(calc, "a * 10000 + b * 1000 + d * 10 + e", &result));
+	ASSERT(10000 + 20000 + 40 + 5 == result);
+	ASSERT(0 != calc_eval(calc, "a = 9", &result));
+	ASSERT(0 != calc_eval(calc, "a", &result));
+	ASSERT(9 == result);
+	calc_destroy(calc);
+
+	unlink(snap);
+	unlink(wal);
+}
+
+/* batches run by checkpoint_writer, each keeping y equal to x */
+#define NUM_CHECKPOINT_BATCHES 20000
+
+/* keep assigning x and y together while checkpoints are taken */
+static void *checkpoint_writer(void *arg) {
+	const char *exprs[] = { "x = x + 1", "y = x" };
+	int results[2], status[2];
+
+	for (int i = 0; i < NUM_CHECKPOINT_BATCHES; i++) {
+		if (calc_eval_batch(arg, exprs, 2, results, status) != 2) {
+			return (void *) 1;
+		}
+	}
+	return NULL;
+}
+
+void testCheckpoint(TestObjs *objs) {
+	char dir[] = "/tmp/calcTestCkptXXXXXX", wal[64], path[64];
+	struct CalcCheckpointStats stats;
+	struct stat st;
+	pthread_t writer;
+	int result, num_ckpts = 0;
+	(void) objs;
+
+	ASSERT(NULL != mkdtemp(dir));
+	snprintf(wal, sizeof(wal), "%s/wal", dir);
+	snprintf(path, sizeof(path), "%s/0.ckpt", dir);
+
+	/* lock-free calculators can't take one */
+	struct Calc *calc = calc_create_lockfree(0);
+	ASSERT(-1 == calc_checkpoint(calc, path, &stats));
+	calc_destroy(calc);
+
+	calc = calc_create_ex(&(struct CalcOptions) { CALC_LOCKED, 8, 0, 0 });
+	ASSERT(0 == calc_open_wal(calc, wal, 0));
+	ASSERT(0 != calc_eval(calc, "x = 0", &result));
+	ASSERT(0 != calc_eval(calc, "y = 0", &result));
+	ASSERT(0 != calc_eval(calc, "z = 7", &result));
+
+	/* every checkpoint holds the values of one point in time, so y == x */
+	ASSERT(0 == pthread_create(&writer, NULL, checkpoint_writer, calc));
+	for (int i = 0; i < 20; i++) {
+		snprintf(path, sizeof(path), "%s/%d.ckpt", dir, num_ckpts + 1);
+		int rc = calc_checkpoint(calc, path, &stats);
+		ASSERT(rc >= 0);
+		if (rc == 1) {
+			num_ckpts++;
+			ASSERT((unsigned long long) num_ckpts == stats.seq);
+			ASSERT(0 == stat(path, &st) && (unsigned long long) st.st_size == stats.bytes);
+			struct Calc *image = calc_create();
+			ASSERT((long) stats.variables == calc_load_snapshot(image, path));
+			int x, y;
+			ASSERT(0 != calc_eval(image, "x", &x));
+			ASSERT(0 != calc_eval(image, "y", &y));
+			ASSERT(x == y);
+			calc_destroy(image);
+		}
+		usleep(1000);
+	}
+	void *failed;
+	pthread_join(writer, &failed);
+	ASSERT(NULL == failed);
+
+	/* the last checkpoint covers the whole log, and then nothing changed */
+	ASSERT(0 != calc_eval(calc, "z = z + 1", &result));
+	snprintf(path, sizeof(path), "%s/%d.ckpt", dir, num_ckpts + 1);
+	ASSERT(1 == calc_checkpoint(calc, path, &stats));
+	num_ckpts++;
+	ASSERT(0 == calc_checkpoint(calc, path, &stats));
+	ASSERT(0 == stat(wal, &st) && 0 == st.st_size);
+	ASSERT(0 != calc_eval(calc, "w = 1", &result));
+	calc_destroy(calc);
+
+	/* recovery applies the checkpoints in order, then the log */
+	calc = calc_create();
+	snprintf(path, sizeof(path), "%s/2.ckpt", dir);
+	ASSERT(-1 == calc_apply_checkpoint(calc, path));		/* out of order */
+	for (int i = 1; i <= num_ckpts; i++) {
+		snprintf(path, sizeof(path), "%s/%d.ckpt", dir, i);
+		ASSERT(0 <= calc_apply_checkpoint(calc, path));
+	}
+	ASSERT((unsigned long long) num_ckpts == calc_checkpoint_seq(calc));
+	ASSERT(1 == calc_open_wal(calc, wal, 0));
+	ASSERT(0 != calc_eval(calc, "x * 10 + y + z + w", &result));
+	ASSERT(NUM_CHECKPOINT_BATCHES * 11 + 8 + 1 == result);
+
+	/* a snapshot includes the checkpoints applied before it */
+	unsigned long long seq;
+	snprintf(path, sizeof(path), "%s/snap", dir);
+	ASSERT(4 == calc_save_snapshot(calc, path, &seq));
+	ASSERT((unsigned long long) num_ckpts == seq);
+	calc_destroy(calc);
+	calc = calc_create();
+	ASSERT(4 == calc_load_snapshot(calc, path));
+	ASSERT((unsigned long long) num_ckpts == calc_checkpoint_seq(calc));
+	calc_destroy(calc);
+
+	for (int i = 1; i <= num_ckpts; i++) {
+		snprintf(path, sizeof(path), "%s/%d.ckpt", dir, i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/snap", dir);
+	unlink(path);
+	unlink(wal);
+	rmdir(dir);
+}
+
+void testSnapshotThenCheckpoint(TestObjs *objs) {
+	char dir[] = "/tmp/calcTestSnapCkptXXXXXX", wal[64], snap[64], path[64];
+	unsigned long long seq;
+	int result;
+	(void) objs;
+
+	ASSERT(NULL != mkdtemp(dir));
+	snprintf(wal, sizeof(wal), "%s/wal", dir);
+	snprintf(snap, sizeof(snap), "%s/snap", dir);
+
+	struct Calc *calc = calc_create_ex(&(struct CalcOptions) { CALC_LOCKED, 8, 0, 0 });
+	ASSERT(0 == calc_open_wal(calc, wal, 0));
+	ASSERT(0 != calc_eval(calc, "a = 1", &result));
+	snprintf(path, sizeof(path), "%s/1.ckpt", dir);
+	ASSERT(1 == calc_checkpoint(calc, path, NULL));
+	ASSERT(1 == calc_save_snapshot(calc, snap, &seq));
+	ASSERT(1 == seq);
+
+	/* a checkpoint lands between the save and the deletion of the covered ones */
+	ASSERT(0 != calc_eval(calc, "b = 2", &result));
+	snprintf(path, sizeof(path), "%s/2.ckpt", dir);
+	ASSERT(1 == calc_checkpoint(calc, path, NULL));
+	ASSERT(2 == calc_checkpoint_seq(calc));
+	for (; seq > 0; seq--) {
+		snprintf(path, sizeof(path), "%s/%llu.ckpt", dir, seq);
+		ASSERT(0 == unlink(path));
+	}
+	ASSERT(0 != calc_eval(calc, "c = 3", &result));
+	calc_destroy(calc);
+
+	/* the checkpoint after the snapshot still holds b, which the log no longer has */
+	calc = calc_create();
+	ASSERT(1 == calc_load_snapshot(calc, snap));
+	ASSERT(1 == calc_checkpoint_seq(calc));
+	snprintf(path, sizeof(path), "%s/2.ckpt", dir);
+	ASSERT(1 == calc_apply_checkpoint(calc, path));
+	ASSERT(1 == calc_open_wal(calc, wal, 0));
+	ASSERT(0 != calc_eval(calc, "a + b + c", &result));
+	ASSERT(6 == result);
+	calc_destroy(calc);
+
+	unlink(path);
+	unlink(snap);
+	unlink(wal);
+	rmdir(dir);
+}
+
+/* what test_feed has received */
+struct FeedLog {
+	char records[256];
+	size_t len;
+	int calls, dumps;
+};
+
+/* append fed records to a FeedLog */
+static void test_feed(void *arg, const char *records, size_t len, int dump) {
+	struct FeedLog *log = arg;
+	if (log->len + len <= sizeof(log->records)) {
+		memcpy(log->records + log->len, records, len);
+		log->len += len;
+	}
+	log->calls++;
+	log->dumps += dump;
+}
+
+void testReplicationFeed(TestObjs *objs) {
+	struct FeedLog log = { .len = 0 };
+	int result;
+
+	/* lock-free calculators can't feed, and there is nothing to dump yet */
+	struct Calc *calc = calc_create_lockfree(0);
+	ASSERT(-1 == calc_set_feed(calc, test_feed, &log));
+	calc_destroy(calc);
+	ASSERT(-1 == calc_feed_dump(objs->calc));
+
+	/* successful assignments are fed, reads and failures aren't */
+	ASSERT(0 != calc_eval(objs->calc, "a = 1", &result));
+	ASSERT(0 == calc_set_feed(objs->calc, test_feed, &log));
+	ASSERT(0 != calc_eval(objs->calc, "b = a + 1", &result));
+	ASSERT(0 != calc_eval(objs->calc, "a = b * 3", &result));
+	ASSERT(0 != calc_eval(objs->calc, "a + b", &result));
+	ASSERT(0 == calc_eval(objs->calc, "c = 1 / 0", &result));
+	ASSERT(2 == log.calls);
+
+	/* a read-only calculator takes them from the records only */
+	struct CalcOptions opts;
+	calc_options_init(&opts);
+	opts.read_only = 1;
+	calc = calc_create_ex(&opts);
+	ASSERT(0 == calc_eval(calc, "a = 5", &result));
+	ASSERT((long) log.len == calc_apply_records(calc, log.records, log.len));
+	ASSERT(0 != calc_eval(calc, "a * 10 + b", &result));
+	ASSERT(62 == result);
+	ASSERT(0 == calc_apply_records(calc, log.records, 5));		/* incomplete */
+	log.records[log.len - 1] ^= 1;
+	ASSERT(-1 == calc_apply_records(calc, log.records, log.len));
+	calc_destroy(calc);
+
+	/* a dump holds every variable in one call */
+	log.len = 0;
+	log.calls = 0;
+	ASSERT(2 == calc_feed_dump(objs->calc));
+	ASSERT(1 == log.calls && 1 == log.dumps);
+	ASSERT(0 == calc_set_feed(objs->calc, NULL, NULL));
+	ASSERT(0 != calc_eval(objs->calc, "a = 0", &result));
+	ASSERT(1 == log.calls);
+	calc = calc_create();
+	ASSERT((long) log.len == calc_apply_records(calc, log.records, log.len));
+	ASSERT(0 != calc_eval(calc, "a * 10 + b", &result));
+	ASSERT(62 == result);
+	calc_destroy(calc);
+}
+
+void testStats(TestObjs *objs) {
+	struct CalcStats before, after;
+	int result, results[3], status[3];
+	const char *batch[] = { "x + 1", "2 * 3", "1 +" };
+
+	/* nothing is counted while stats are off */
+	calc_get_stats(&before);
+	ASSERT(0 != calc_eval(objs->calc, "x = 4", &result));
+	calc_get_stats(&after);
+	ASSERT(before.assignments == after.assignments);
+
+	calc_enable_stats(1);
+	ASSERT(0 != calc_eval(objs->calc, "7", &result));
+	ASSERT(0 != calc_eval(objs->calc, "x", &result));
+	ASSERT(0 != calc_eval(objs->calc, "x * 2", &result));
+	ASSERT(0 != calc_eval(objs->calc, "y = x - 1", &result));
+	ASSERT(0 == calc_eval(objs->calc, "x +", &result));
+	ASSERT(0 == calc_eval(objs->calc, "nope + 1", &result));
+	ASSERT(0 == calc_eval(objs->calc, "x / 0", &result));
+	calc_eval_batch(objs->calc, batch, 3, results, status);
+	calc_enable_stats(0);
+	calc_get_stats(&after);
+
+	ASSERT(1 == after.evaluations[CALC_SHAPE_LITERAL] - before.evaluations[CALC_SHAPE_LITERAL]);
+	ASSERT(1 == after.evaluations[CALC_SHAPE_VARIABLE] - before.evaluations[CALC_SHAPE_VARIABLE]);
+	ASSERT(5 == after.evaluations[CALC_SHAPE_ARITHMETIC] - before.evaluations[CALC_SHAPE_ARITHMETIC]);
+	ASSERT(1 == after.evaluations[CALC_SHAPE_ASSIGNMENT] - before.evaluations[CALC_SHAPE_ASSIGNMENT]);
+	ASSERT(2 == after.evaluations[CALC_SHAPE_INVALID] - before.evaluations[CALC_SHAPE_INVALID]);
+	ASSERT(2 == after.errors[CALC_ERROR_SYNTAX] - before.errors[CALC_ERROR_SYNTAX]);
+	ASSERT(1 == after.errors[CALC_ERROR_UNDEFINED] - before.errors[CALC_ERROR_UNDEFINED]);
+	ASSERT(1 == after.errors[CALC_ERROR_DIVIDE_BY_ZERO] - before.errors[CALC_ERROR_DIVIDE_BY_ZERO]);
+	ASSERT(1 == after.assignments - before.assignments);
+
+	/* every evaluation lands in one latency bucket */
+	for (int shape = 0; shape < CALC_NUM_SHAPES; shape++) {
+		unsigned long long counted = 0;
+		for (int i = 0; i < CALC_STATS_BUCKETS; i++) {
+			counted += after.latency[shape][i] - before.latency[shape][i];
+		}
+		ASSERT(counted == after.evaluations[shape] - before.evaluations[shape]);
+	}
+}
+
+void testLockStats(TestObjs *objs) {
+	struct CalcLockStats before, after;
+	unsigned long long waits = 0, holds = 0;
+	int result;
+
+	calc_get_lock_stats(&before);
+	ASSERT(0 != calc_eval(objs->calc, "a = 1", &result));
+	calc_get_lock_stats(&after);
+	ASSERT(before.acquisitions == after.acquisitions);
+
+	/* each evaluation that locks a shard is one acquisition, timed */
+	calc_enable_lock_stats(1);
+	ASSERT(0 != calc_eval(objs->calc, "a = a + 1", &result));
+	ASSERT(0 != calc_eval(objs->calc, "a * 2", &result));
+	ASSERT(0 != calc_eval(objs->calc, "3 + 4", &result));
+	calc_enable_lock_stats(0);
+	calc_get_lock_stats(&after);
+
+	ASSERT(2 == after.acquisitions - before.acquisitions);
+	ASSERT(after.contended - before.contended <= 2);
+	for (int i = 0; i < CALC_STATS_BUCKETS; i++) {
+		waits += after.wait[i] - before.wait[i];
+		holds += after.hold[i] - before.hold[i];
+	}
+	ASSERT(2 == waits && 2 == holds);
+	ASSERT(after.hold_ns > before.hold_ns);
+}
+
+void testTrace(TestObjs *objs) {
+	char path[] = "/tmp/calcTestTraceXXXXXX";
+	char magic[sizeof(CALC_TRACE_MAGIC) - 1];
+	struct CalcTraceRecord records[16];
+	int result, fd = mkstemp(path);
+	ASSERT(fd >= 0);
+	close(fd);
+
+	/* nothing is recorded while tracing is off */
+	ASSERT(0 != calc_eval(objs->calc, "a = 1", &result));
+	ASSERT(0 == calc_trace_dump(path));
+
+	/* the phases of an evaluation nest within the caller's */
+	calc_enable_trace(1);
+	calc_trace_begin(CALC_TRACE_PROCESS, 100000);
+	ASSERT(0 != calc_eval(objs->calc, "a = 6 * 7", &result));
+	calc_trace_end(CALC_TRACE_PROCESS, 5);
+	calc_enable_trace(0);
+	ASSERT(8 == calc_trace_dump(path));
+
+	FILE *in = fopen(path, "rb");
+	ASSERT(NULL != in);
+	ASSERT(1 == fread(magic, sizeof(magic), 1, in));
+	ASSERT(0 == memcmp(magic, CALC_TRACE_MAGIC, sizeof(magic)));
+	ASSERT(8 == fread(records, sizeof(records[0]), 16, in));
+	fclose(in);
+	unlink(path);
+
+	const int phases[8] = { CALC_TRACE_PROCESS, CALC_TRACE_TOKENIZE, CALC_TRACE_TOKENIZE, CALC_TRACE_LOCK,
+	                        CALC_TRACE_LOCK, CALC_TRACE_EVALUATE, CALC_TRACE_EVALUATE, CALC_TRACE_PROCESS };
+	const char kinds[] = "BBEBEBEE";
+	for (int i = 0; i < 8; i++) {
+		ASSERT(phases[i] == records[i].phase);
+		ASSERT(kinds[i] == records[i].kind);
+		ASSERT(records[0].tid == records[i].tid);
+		ASSERT(i == 0 || records[i - 1].time_ns <= records[i].time_ns);
+	}
+	ASSERT(65535 == records[0].arg && 5 == records[7].arg);		/* clamped */
+}
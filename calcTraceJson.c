@@ -0,0 +1,184 @@
+/*
+ * Convert a trace written by calc_trace_dump (calcServer -T) into the
+ * JSON of the Chrome trace event format, which chrome://tracing and
+ * Perfetto display as a timeline per thread. Each phase whose begin and
+ * end are both in the trace becomes one complete ("X") event; a begin or
+ * end whose partner was overwritten in the ring buffer is left out. Times
+ * are in microseconds from the first event.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "calc.h"
+
+/* deepest nesting of phases within a thread */
+#define MAX_DEPTH 16
+
+/* names of the phases in the JSON output */
+static const char *const phase_names[CALC_TRACE_NUM_PHASES] = {
+	"read", "process", "tokenize", "lock", "evaluate", "log", "write"
+};
+
+/*
+ * A record of the trace and its position in the file, which keeps the
+ * sort stable
+ */
+struct Event {
+	struct CalcTraceRecord record;
+	size_t index;
+};
+
+/**
+ * Order events by thread, then time, then position in the file
+ *
+ * @param a The first event
+ * @param b The second event
+ * @return negative, zero or positive as for qsort
+ */
+static int compare_events(const void *a, const void *b) {
+	const struct Event *x = a, *y = b;
+	if (x->record.tid != y->record.tid) {
+		return x->record.tid < y->record.tid ? -1 : 1;
+	}
+	if (x->record.time_ns != y->record.time_ns) {
+		return x->record.time_ns < y->record.time_ns ? -1 : 1;
+	}
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/**
+ * Read every record of a trace file
+ *
+ * @param path The file
+ * @param count Set to the number of records
+ * @return the records, or NULL if the file can't be read or is not a trace
+ */
+static struct Event *read_trace(const char *path, size_t *count) {
+	FILE *in = fopen(path, "rb");
+	char magic[sizeof(CALC_TRACE_MAGIC) - 1];
+	struct CalcTraceRecord record;
+	struct Event *events = NULL;
+	size_t cap = 0;
+
+	if (in == NULL) {
+		perror(path);
+		return NULL;
+	}
+	if (fread(magic, sizeof(magic), 1, in) != 1 || memcmp(magic, CALC_TRACE_MAGIC, sizeof(magic)) != 0) {
+		fprintf(stderr, "%s: not a trace\n", path);
+		fclose(in);
+		return NULL;
+	}
+
+	*count = 0;
+	while (fread(&record, sizeof(record), 1, in) == 1) {
+		if (*count == cap) {
+			cap = cap == 0 ? 4096 : cap * 2;
+			events = realloc(events, cap * sizeof(*events));
+			if (events == NULL) {
+				fprintf(stderr, "%s: out of memory\n", path);
+				fclose(in);
+				return NULL;
+			}
+		}
+		events[*count].record = record;
+		events[*count].index = *count;
+		(*count)++;
+	}
+	fclose(in);
+	if (events == NULL) {
+		events = malloc(sizeof(*events));		/* an empty trace is still a trace */
+	}
+	return events;
+}
+
+/**
+ * Print an event as the JSON of a complete event
+ *
+ * @param out Where to print it
+ * @param begin The record of its begin
+ * @param end The record of its end
+ * @param origin Time of the first event of the trace
+ * @param first Whether it is the first event printed
+ */
+static void print_event(FILE *out, const struct CalcTraceRecord *begin, const struct CalcTraceRecord *end,
+                        unsigned long long origin, int first) {
+	fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+	        "\"args\":{\"begin\":%u,\"end\":%u}}", first ? "\n" : ",\n", phase_names[begin->phase],
+	        (unsigned) begin->tid, (begin->time_ns - origin) / 1e3, (end->time_ns - begin->time_ns) / 1e3,
+	        (unsigned) begin->arg, (unsigned) end->arg);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: %s <trace> [json]\n", argv[0]);
+		fprintf(stderr, "  converts a trace from calcServer -T to Chrome's JSON, on stdout unless json is given\n");
+		return 1;
+	}
+
+	size_t count;
+	struct Event *events = read_trace(argv[1], &count);
+	if (events == NULL) {
+		return 1;
+	}
+	FILE *out = argc == 3 ? fopen(argv[2], "w") : stdout;
+	if (out == NULL) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	unsigned long long origin = count > 0 ? events[0].record.time_ns : 0;
+	for (size_t i = 0; i < count; i++) {
+		if (events[i].record.time_ns < origin) {
+			origin = events[i].record.time_ns;
+		}
+	}
+	qsort(events, count, sizeof(*events), compare_events);
+
+	/* match each end with the latest open begin of its phase in its thread */
+	const struct CalcTraceRecord *open[MAX_DEPTH];
+	int depth = 0, first = 1;
+	size_t printed = 0, dropped = 0;
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (size_t i = 0; i < count; i++) {
+		const struct CalcTraceRecord *record = &events[i].record;
+		if (i > 0 && record->tid != events[i - 1].record.tid) {
+			dropped += depth;		/* still open when the trace was dumped */
+			depth = 0;
+		}
+		if (record->phase >= CALC_TRACE_NUM_PHASES) {
+			dropped++;
+		} else if (record->kind == CALC_TRACE_BEGIN) {
+			if (depth == MAX_DEPTH) {
+				dropped++;
+			} else {
+				open[depth++] = record;
+			}
+		} else {
+			int match = depth - 1;
+			while (match >= 0 && open[match]->phase != record->phase) {
+				match--;
+			}
+			if (match < 0) {
+				dropped++;		/* its begin was overwritten */
+				continue;
+			}
+			print_event(out, open[match], record, origin, first);
+			first = 0;
+			printed++;
+			dropped += depth - 1 - match;		/* begins never ended */
+			depth = match;
+		}
+	}
+	dropped += depth;
+	fprintf(out, "\n]}\n");
+
+	fprintf(stderr, "%zu events, %zu phases, %zu records without a partner\n", count, printed, dropped);
+	free(events);
+	if (out != stdout && fclose(out) != 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,732 @@
+/*
+ * io_uring event loop for calcServer_uring: one thread accepts with a
+ * multishot accept, receives into buffers from a provided buffer ring and
+ * sends results, all submitted through a single ring, so that a batch of
+ * completions costs one io_uring_enter instead of a syscall per
+ * operation. The ring is set up with the raw system calls so that no
+ * library is needed. Commits are deferred (see calc_defer_commits), so
+ * the loop never waits for the log: output that must wait for assignments
+ * to reach the disk is held back, and its connection parked, until the
+ * log's background thread completes a read of an eventfd.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "csapp.h"
+#include "calcProto.h"
+#include "calcUring.h"
+
+/* submission queue entries; the completion queue gets twice as many */
+#define RING_ENTRIES 4096
+
+/* provided receive buffers, a power of two, and the size of each */
+#define NUM_BUFS 1024
+#define BUF_SIZE 4096
+
+/* buffer group id of the provided buffers */
+#define BUF_GROUP 0
+
+/* bytes of partial line kept per connection, at least LINEBUF_SIZE */
+#define CONN_INBUF 4096
+
+/* stop receiving from a connection while this much output is unsent */
+#define OUT_HIGH_WATER (64 * 1024)
+
+/* kinds of operation, kept in the low bits of a completion's user_data; a UringConn is 8-byte aligned */
+#define OP_ACCEPT 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_RETRY_ACCEPT 3
+#define OP_COMMIT 4
+#define OP_MASK 7
+
+/* wait before accepting again when out of file descriptors or memory */
+#define ACCEPT_BACKOFF_MS 100
+
+/**
+ * A mapped io_uring with its provided buffer ring
+ *
+ * @param fd The ring's file descriptor
+ * @param mem Mapping of both queues
+ * @param mem_size Size of mem
+ * @param sqes_size Size of the mapping of sqes
+ * @param sq_head Kernel's submission queue head
+ * @param sq_tail Submission queue tail shared with the kernel
+ * @param sq_mask Index mask of the submission queue
+ * @param sq_array Indices of submitted entries
+ * @param sq_entries Size of the submission queue
+ * @param sqes Submission queue entries
+ * @param tail Our submission queue tail, published at the next enter
+ * @param to_submit Entries added since the last enter
+ * @param cq_head Completion queue head shared with the kernel
+ * @param cq_tail Kernel's completion queue tail
+ * @param cq_mask Index mask of the completion queue
+ * @param cqes Completion queue entries
+ * @param buf_ring Provided buffer ring shared with the kernel
+ * @param bufs Memory of the provided buffers
+ * @param buf_tail Our provided buffer ring tail
+ * @param backoff Timeout of the pending OP_RETRY_ACCEPT
+ * @param accept_failing Set once a failed accept is reported, until one succeeds
+ * @param commitfd Eventfd that notifier adds to once deferred commits settle
+ * @param commit_count Where the pending OP_COMMIT reads commitfd
+ * @param notifier Wakes the loop through commitfd
+ * @param parked Connections whose output is held for deferred commits
+ */
+struct Uring {
+	int fd;
+	char *mem;
+	size_t mem_size;
+	size_t sqes_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned tail;
+	unsigned to_submit;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *buf_ring;
+	char *bufs;
+	unsigned short buf_tail;
+	struct __kernel_timespec backoff;
+	int accept_failing;
+	int commitfd;
+	uint64_t commit_count;
+	struct CalcNotifier *notifier;
+	struct UringConn *parked;
+};
+
+/**
+ * State of one client connection. Results are appended to out while an
+ * earlier send of sending may still be in flight, since the kernel reads
+ * sending's memory until that send completes.
+ *
+ * @param fd The connection's socket
+ * @param in Start of a request whose end hasn't been received yet
+ * @param in_len Number of bytes in in
+ * @param session The protocol state of the client
+ * @param out Output not yet sent
+ * @param sending Output of the send in flight
+ * @param recv_pending Whether a receive is in flight
+ * @param send_pending Whether a send is in flight
+ * @param closing Set once the session is over; close after output is sent
+ * @param failed Set if the connection failed; close without sending
+ * @param parked Whether the connection is on the ring's parked list
+ * @param parked_prev The previous connection on that list
+ * @param parked_next The next one
+ */
+struct UringConn {
+	int fd;
+	char in[CONN_INBUF];
+	size_t in_len;
+	struct ProtoSession session;
+	struct OutBuf out;
+	struct OutBuf sending;
+	int recv_pending;
+	int send_pending;
+	int closing;
+	int failed;
+	int parked;
+	struct UringConn *parked_prev, *parked_next;
+};
+
+/**
+ * Submit the queued entries and wait for completions
+ *
+ * @param ring The ring
+ * @param min_complete Number of completions to wait for
+ * @return 0 on success, -1 on error
+ */
+static int uring_enter(struct Uring *ring, unsigned min_complete) {
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+	int rc = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete,
+	                 min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (rc < 0) {
+		/* interrupted, or completions must be reaped before more can be submitted */
+		return errno == EINTR || errno == EBUSY || errno == EAGAIN ? 0 : -1;
+	}
+	ring->to_submit -= rc;
+	return 0;
+}
+
+/**
+ * Wait for a completion without submitting anything
+ *
+ * @param ring The ring
+ */
+static void uring_wait(struct Uring *ring) {
+	syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+/**
+ * Get a cleared submission queue entry, submitting the queued ones if the
+ * queue is full. If the kernel takes none of them, it is waited for with
+ * a completion rather than asked again at once.
+ *
+ * @param ring The ring
+ * @param user_data Identifies the operation in its completion
+ * @return the entry
+ */
+static struct io_uring_sqe *uring_sqe(struct Uring *ring, unsigned long long user_data) {
+	while (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+		unsigned queued = ring->to_submit;
+		if (uring_enter(ring, 0) == 0 && ring->to_submit == queued) {
+			uring_wait(ring);
+		}
+	}
+
+	unsigned index = ring->tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = user_data;
+	ring->sq_array[index] = index;
+	ring->tail++;
+	ring->to_submit++;
+	return sqe;
+}
+
+/**
+ * Hand a provided buffer back to the kernel
+ *
+ * @param ring The ring
+ * @param bid The buffer's id
+ */
+static void uring_return_buf(struct Uring *ring, unsigned short bid) {
+	struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (NUM_BUFS - 1)];
+	buf->addr = (unsigned long long) (ring->bufs + (size_t) bid * BUF_SIZE);
+	buf->len = BUF_SIZE;
+	buf->bid = bid;
+	ring->buf_tail++;
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Close the ring and release its mappings, provided buffers and eventfd.
+ * The kernel cancels whatever is still in flight when the ring is closed.
+ * The calling thread stops deferring commits.
+ *
+ * @param ring The ring, set up by uring_init
+ */
+static void uring_free(struct Uring *ring) {
+	int saved_errno = errno;
+	calc_defer_commits(0);
+	if (ring->notifier != NULL) {
+		calc_notifier_destroy(ring->notifier);		/* before commitfd can be reused */
+	}
+	close(ring->fd);
+	if (ring->commitfd >= 0) {
+		close(ring->commitfd);
+	}
+	munmap(ring->mem, ring->mem_size);
+	munmap(ring->sqes, ring->sqes_size);
+	free(ring->buf_ring);
+	free(ring->bufs);
+	errno = saved_errno;
+}
+
+/**
+ * Create the ring, map its queues and register the provided buffers
+ *
+ * @param ring The ring to set up
+ * @return 0 on success, URING_UNSUPPORTED if the kernel can't provide
+ *         what is needed, -1 on other errors
+ */
+static int uring_init(struct Uring *ring) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (ring->fd < 0) {
+		return errno == ENOSYS || errno == EPERM ? URING_UNSUPPORTED : -1;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(ring->fd);
+		return URING_UNSUPPORTED;
+	}
+
+	/* both queues live in one mapping */
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+	size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	char *mem = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                 ring->fd, IORING_OFF_SQ_RING);
+	struct io_uring_sqe *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                                 ring->fd, IORING_OFF_SQES);
+	if (mem == MAP_FAILED || sqes == MAP_FAILED) {
+		if (mem != MAP_FAILED) {
+			munmap(mem, ring_size);
+		}
+		if (sqes != MAP_FAILED) {
+			munmap(sqes, sqes_size);
+		}
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->mem = mem;
+	ring->mem_size = ring_size;
+	ring->sqes_size = sqes_size;
+
+	ring->sq_head = (unsigned *) (mem + params.sq_off.head);
+	ring->sq_tail = (unsigned *) (mem + params.sq_off.tail);
+	ring->sq_mask = (unsigned *) (mem + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (mem + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+	ring->sqes = sqes;
+	ring->tail = *ring->sq_tail;
+	ring->to_submit = 0;
+	ring->cq_head = (unsigned *) (mem + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (mem + params.cq_off.tail);
+	ring->cq_mask = (unsigned *) (mem + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (mem + params.cq_off.cqes);
+
+	/* the buffer ring must be page aligned */
+	void *buf_ring;
+	if (posix_memalign(&buf_ring, sysconf(_SC_PAGESIZE), NUM_BUFS * sizeof(struct io_uring_buf)) != 0) {
+		munmap(ring->mem, ring->mem_size);
+		munmap(ring->sqes, ring->sqes_size);
+		close(ring->fd);
+		return -1;
+	}
+	ring->buf_ring = buf_ring;
+	ring->buf_ring->tail = 0;
+	ring->bufs = Malloc((size_t) NUM_BUFS * BUF_SIZE);
+	ring->buf_tail = 0;
+	ring->accept_failing = 0;
+	ring->commitfd = -1;
+	ring->notifier = NULL;
+	ring->parked = NULL;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long long) ring->buf_ring;
+	reg.ring_entries = NUM_BUFS;
+	reg.bgid = BUF_GROUP;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		uring_free(ring);
+		return URING_UNSUPPORTED;		/* provided buffer rings need Linux 5.19 */
+	}
+
+	for (unsigned short bid = 0; bid < NUM_BUFS; bid++) {
+		uring_return_buf(ring, bid);
+	}
+
+	ring->commitfd = eventfd(0, EFD_CLOEXEC);
+	if (ring->commitfd < 0) {
+		uring_free(ring);
+		return -1;
+	}
+	ring->notifier = calc_notifier_create(ring->commitfd);
+	return 0;
+}
+
+/**
+ * Queue a multishot accept, which completes once per new connection
+ *
+ * @param ring The ring
+ * @param listenfd The listening socket
+ */
+static void queue_accept(struct Uring *ring, int listenfd) {
+	struct io_uring_sqe *sqe = uring_sqe(ring, OP_ACCEPT);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listenfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/**
+ * Queue a timeout after which the accept is queued again
+ *
+ * @param ring The ring
+ */
+static void queue_retry_accept(struct Uring *ring) {
+	ring->backoff.tv_sec = 0;
+	ring->backoff.tv_nsec = ACCEPT_BACKOFF_MS * 1000000L;
+	struct io_uring_sqe *sqe = uring_sqe(ring, OP_RETRY_ACCEPT);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (unsigned long long) &ring->backoff;
+	sqe->len = 1;
+}
+
+/**
+ * Queue a read of the commitfd, which completes once deferred commits
+ * have settled
+ *
+ * @param ring The ring
+ */
+static void queue_commit_read(struct Uring *ring) {
+	struct io_uring_sqe *sqe = uring_sqe(ring, OP_COMMIT);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = ring->commitfd;
+	sqe->addr = (unsigned long long) &ring->commit_count;
+	sqe->len = sizeof(ring->commit_count);
+}
+
+/**
+ * Put a connection whose output is held on the ring's parked list,
+ * unless it is there already
+ *
+ * @param ring The ring
+ * @param conn The connection
+ */
+static void conn_park(struct Uring *ring, struct UringConn *conn) {
+	if (conn->parked) {
+		return;
+	}
+	conn->parked = 1;
+	conn->parked_prev = NULL;
+	conn->parked_next = ring->parked;
+	if (conn->parked_next != NULL) {
+		conn->parked_next->parked_prev = conn;
+	}
+	ring->parked = conn;
+}
+
+/**
+ * Take a connection off the ring's parked list, if it is on it
+ *
+ * @param ring The ring
+ * @param conn The connection
+ */
+static void conn_unpark(struct Uring *ring, struct UringConn *conn) {
+	if (!conn->parked) {
+		return;
+	}
+	if (conn->parked_prev != NULL) {
+		conn->parked_prev->parked_next = conn->parked_next;
+	} else {
+		ring->parked = conn->parked_next;
+	}
+	if (conn->parked_next != NULL) {
+		conn->parked_next->parked_prev = conn->parked_prev;
+	}
+	conn->parked = 0;
+}
+
+/**
+ * Queue a receive into whichever provided buffer the kernel picks
+ *
+ * @param ring The ring
+ * @param conn The connection
+ */
+static void queue_recv(struct Uring *ring, struct UringConn *conn) {
+	struct io_uring_sqe *sqe = uring_sqe(ring, (uintptr_t) conn | OP_RECV);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUF_GROUP;
+	sqe->len = BUF_SIZE;
+	conn->recv_pending = 1;
+}
+
+/**
+ * Queue a send of what is left in conn->sending
+ *
+ * @param ring The ring
+ * @param conn The connection
+ */
+static void queue_send(struct Uring *ring, struct UringConn *conn) {
+	struct io_uring_sqe *sqe = uring_sqe(ring, (uintptr_t) conn | OP_SEND);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = conn->fd;
+	sqe->addr = (unsigned long long) conn->sending.data;
+	sqe->len = conn->sending.len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	conn->send_pending = 1;
+}
+
+/**
+ * Start sending the connection's output that no deferred commit holds,
+ * unless a send is in flight, parking the connection while some is held.
+ * If the log failed, the held output is never sent and the connection
+ * fails.
+ *
+ * @param ring The ring
+ * @param conn The connection
+ */
+static void conn_flush(struct Uring *ring, struct UringConn *conn) {
+	if (conn->send_pending || conn->out.len == 0 || conn->failed) {
+		return;
+	}
+
+	long ready = proto_session_ready(&conn->session, conn->out.len, ring->notifier);
+	if (ready < 0) {
+		conn->failed = 1;
+		if (conn->recv_pending) {
+			shutdown(conn->fd, SHUT_RDWR);		/* make the receive complete */
+		}
+		return;
+	}
+	if ((size_t) ready < conn->out.len) {
+		conn_park(ring, conn);
+	} else {
+		conn_unpark(ring, conn);
+	}
+	if (ready == 0) {
+		return;
+	}
+
+	if ((size_t) ready == conn->out.len) {
+		/* sending is empty; its memory becomes the next out */
+		struct OutBuf empty = conn->sending;
+		conn->sending = conn->out;
+		conn->out = empty;
+	} else {
+		outbuf_append(&conn->sending, conn->out.data, ready);
+		outbuf_consume(&conn->out, ready);
+	}
+	proto_session_sent(&conn->session, ready);
+	queue_send(ring, conn);
+}
+
+/**
+ * Free a connection once the session is over and nothing is in flight,
+ * and otherwise receive more input if it is wanted
+ *
+ * @param ring The ring
+ * @param conn The connection
+ */
+static void conn_update(struct Uring *ring, struct UringConn *conn) {
+	if (conn->closing || conn->failed) {
+		int unsent = !conn->failed && (conn->out.len > 0 || conn->send_pending);
+		if (!conn->recv_pending && !conn->send_pending && !unsent) {
+			conn_unpark(ring, conn);
+			close(conn->fd);
+			outbuf_free(&conn->out);
+			outbuf_free(&conn->sending);
+			proto_session_free(&conn->session);
+			free(conn);
+		}
+		return;
+	}
+
+	if (!conn->recv_pending && conn->out.len + conn->sending.len < OUT_HIGH_WATER) {
+		queue_recv(ring, conn);
+	}
+}
+
+/**
+ * Process received input: complete requests are handled, and the start
+ * of an incomplete one is kept in conn->in
+ *
+ * @param conn The connection
+ * @param data The input, which is overwritten
+ * @param len Number of bytes of input
+ */
+static void conn_input(struct UringConn *conn, char *data, size_t len) {
+	enum ProtoCommand command = PROTO_EXPR;
+
+	if (conn->in_len == 0) {
+		/* no partial line is waiting, so use the received buffer in place */
+		size_t used = proto_session_process(&conn->session, data, len, 0, &conn->out, &command);
+		data += used;
+		len -= used;
+	}
+
+	while (len > 0 && command == PROTO_EXPR) {
+		size_t n = len < CONN_INBUF - conn->in_len ? len : CONN_INBUF - conn->in_len;
+		memcpy(conn->in + conn->in_len, data, n);
+		conn->in_len += n;
+		data += n;
+		len -= n;
+
+		size_t used = proto_session_process(&conn->session, conn->in, conn->in_len, 0, &conn->out, &command);
+		conn->in_len -= used;
+		memmove(conn->in, conn->in + used, conn->in_len);
+	}
+
+	if (command != PROTO_EXPR) {
+		conn->closing = 1;
+	}
+}
+
+/**
+ * Handle the completion of a receive
+ *
+ * @param ring The ring
+ * @param conn The connection
+ * @param cqe The completion
+ */
+static void complete_recv(struct Uring *ring, struct UringConn *conn, const struct io_uring_cqe *cqe) {
+	conn->recv_pending = 0;
+
+	if (cqe->res > 0) {
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (!conn->closing && !conn->failed) {
+			conn_input(conn, ring->bufs + (size_t) bid * BUF_SIZE, cqe->res);
+		}
+		uring_return_buf(ring, bid);
+	} else if (cqe->res == 0) {
+		if (!conn->closing && !conn->failed) {
+			/* end of input: a final line may lack its newline */
+			enum ProtoCommand command;
+			proto_session_process(&conn->session, conn->in, conn->in_len, 1, &conn->out, &command);
+			conn->in_len = 0;
+		}
+		conn->closing = 1;
+	} else if (cqe->res != -ENOBUFS) {
+		conn->failed = 1;		/* on -ENOBUFS every buffer was in use; just receive again */
+	}
+
+	conn_flush(ring, conn);
+	conn_update(ring, conn);
+}
+
+/**
+ * Handle the completion of a send
+ *
+ * @param ring The ring
+ * @param conn The connection
+ * @param cqe The completion
+ */
+static void complete_send(struct Uring *ring, struct UringConn *conn, const struct io_uring_cqe *cqe) {
+	conn->send_pending = 0;
+
+	if (cqe->res < 0) {
+		conn->failed = 1;
+		if (conn->recv_pending) {
+			shutdown(conn->fd, SHUT_RDWR);		/* make the receive complete */
+		}
+	} else {
+		outbuf_consume(&conn->sending, cqe->res);
+		if (conn->sending.len > 0) {
+			queue_send(ring, conn);		/* the socket took only part of it */
+		} else {
+			conn_flush(ring, conn);
+		}
+	}
+
+	conn_update(ring, conn);
+}
+
+/**
+ * Handle a completion of the multishot accept
+ *
+ * @param registry The server's namespaces
+ * @param ring The ring
+ * @param listenfd The listening socket
+ * @param cqe The completion
+ */
+static void complete_accept(struct CalcRegistry *registry, struct Uring *ring, int listenfd,
+                            const struct io_uring_cqe *cqe) {
+	if (cqe->res >= 0) {
+		struct UringConn *conn = Malloc(sizeof(struct UringConn));
+		conn->fd = cqe->res;
+		conn->in_len = 0;
+		proto_session_init(&conn->session, registry);
+		outbuf_init(&conn->out);
+		outbuf_init(&conn->sending);
+		conn->recv_pending = 0;
+		conn->send_pending = 0;
+		conn->closing = 0;
+		conn->failed = 0;
+		conn->parked = 0;
+		queue_recv(ring, conn);
+		ring->accept_failing = 0;
+	} else if (cqe->res == -EMFILE || cqe->res == -ENFILE || cqe->res == -ENOMEM || cqe->res == -ENOBUFS) {
+		/* accepting again at once would fail again; let connections close first */
+		if (!ring->accept_failing) {
+			fprintf(stderr, "accept: %s, retrying every %d ms\n", strerror(-cqe->res), ACCEPT_BACKOFF_MS);
+			ring->accept_failing = 1;
+		}
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			queue_retry_accept(ring);
+		}
+		return;
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		queue_accept(ring, listenfd);		/* the kernel ended the multishot accept */
+	}
+}
+
+/**
+ * Retry the held output of every parked connection once the commitfd
+ * read completes, and read it again. Those still held are parked again,
+ * on a fresh list.
+ *
+ * @param ring The ring
+ */
+static void complete_commit(struct Uring *ring) {
+	struct UringConn *conn = ring->parked;
+	ring->parked = NULL;
+	while (conn != NULL) {
+		struct UringConn *next = conn->parked_next;
+		conn->parked = 0;
+		conn_flush(ring, conn);
+		conn_update(ring, conn);
+		conn = next;
+	}
+	queue_commit_read(ring);
+}
+
+/**
+ * Serve clients on the calling thread through io_uring until a fatal
+ * error occurs
+ *
+ * @param registry The server's namespaces
+ * @param listenfd The listening socket
+ * @return URING_UNSUPPORTED if this kernel can't run the loop, in which
+ *         case nothing has been accepted, or -1 on other errors (it does
+ *         not return otherwise)
+ */
+int uring_run(struct CalcRegistry *registry, int listenfd) {
+	struct Uring ring;
+	int rc = uring_init(&ring);
+	if (rc < 0) {
+		return rc;
+	}
+
+	int accepted = 0;
+	calc_defer_commits(1);
+	queue_accept(&ring, listenfd);
+	queue_commit_read(&ring);
+
+	while (1) {
+		if (uring_enter(&ring, 1) < 0) {
+			uring_free(&ring);
+			return -1;
+		}
+
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+			struct UringConn *conn = (struct UringConn *) (uintptr_t) (cqe.user_data & ~(uintptr_t) OP_MASK);
+
+			switch (cqe.user_data & OP_MASK) {
+			case OP_ACCEPT:
+				if (cqe.res == -EINVAL && !accepted) {
+					uring_free(&ring);
+					return URING_UNSUPPORTED;		/* multishot accept needs Linux 5.19 */
+				}
+				accepted |= cqe.res >= 0;
+				complete_accept(registry, &ring, listenfd, &cqe);
+				break;
+			case OP_RECV:
+				complete_recv(&ring, conn, &cqe);
+				break;
+			case OP_SEND:
+				complete_send(&ring, conn, &cqe);
+				break;
+			case OP_RETRY_ACCEPT:
+				queue_accept(&ring, listenfd);
+				break;
+			case OP_COMMIT:
+				complete_commit(&ring);
+				break;
+			}
+			/* free the entry at once, so that the kernel has room while uring_sqe waits */
+			__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+		}
+	}
+}
@@ -0,0 +1,11 @@
+#ifndef CALCURING_H
+#define CALCURING_H
+
+#include "calcRegistry.h"
+
+/* returned by uring_run when the kernel lacks a feature it needs */
+#define URING_UNSUPPORTED (-2)
+
+int uring_run(struct CalcRegistry *registry, int listenfd);
+
+#endif /* CALCURING_H */
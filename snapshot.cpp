@@ -0,0 +1,236 @@
+#include "snapshot.h"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// identifies a snapshot file, and its format version
+#define SNAPSHOT_MAGIC "CALCSNP2"
+
+// bytes of the header: magic, sequence number, variable count, bytes of names
+#define HEADER_SIZE 32
+
+// bytes of an index entry: name offset, name length, value
+#define INDEX_ENTRY 16
+
+// bytes written at a time
+#define WRITE_CHUNK (1 << 20)
+
+Snapshot::Snapshot(const char *map, size_t map_size, uint64_t seq_number, uint64_t count, uint64_t names_size)
+    : map(map), map_size(map_size), seq_number(seq_number), count(count), index(map + HEADER_SIZE),
+      names(map + HEADER_SIZE + count * INDEX_ENTRY), names_size(names_size) {}
+
+Snapshot::~Snapshot() {
+    munmap((void *) map, map_size);
+}
+
+/**
+ * Read a little-endian 32-bit integer
+ * @return the integer at p
+ */
+static uint32_t get_u32(const char *p) {
+    const unsigned char *b = (const unsigned char *) p;
+    return b[0] | (uint32_t) b[1] << 8 | (uint32_t) b[2] << 16 | (uint32_t) b[3] << 24;
+}
+
+/**
+ * Read a little-endian 64-bit integer
+ * @return the integer at p
+ */
+static uint64_t get_u64(const char *p) {
+    return get_u32(p) | (uint64_t) get_u32(p + 4) << 32;
+}
+
+/**
+ * Append a little-endian integer of size bytes to out
+ */
+static void put(std::string &out, uint64_t v, int size) {
+    for (int i = 0; i < size; i++) {
+        out.push_back((char) (v >> (8 * i)));
+    }
+}
+
+/**
+ * Write all of data to fd
+ * @return true on success, false on error
+ */
+static bool write_all(int fd, const std::string &data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/**
+ * Map the snapshot at path. Pages are read only when a lookup touches them.
+ * @return the snapshot, or NULL (with errno set) if the file can't be
+ *         mapped or is not a snapshot
+ */
+Snapshot *Snapshot::open(const char *path) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+    size_t size = (size_t) st.st_size;
+    if (size < HEADER_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int saved = errno;
+    close(fd);      // the mapping keeps the file
+    if (map == MAP_FAILED) {
+        errno = saved;
+        return NULL;
+    }
+    madvise(map, size, MADV_RANDOM);        // lookups jump around, so don't read ahead
+
+    const char *p = (const char *) map;
+    uint64_t count = get_u64(p + 16);
+    uint64_t names_size = get_u64(p + 24);
+    if (memcmp(p, SNAPSHOT_MAGIC, 8) != 0 || count > (size - HEADER_SIZE) / INDEX_ENTRY ||
+        names_size != size - HEADER_SIZE - count * INDEX_ENTRY) {
+        munmap(map, size);
+        errno = EINVAL;
+        return NULL;
+    }
+    return new Snapshot(p, size, get_u64(p + 8), count, names_size);
+}
+
+/**
+ * Write vars, which are sorted by name, as a snapshot numbered seq. The
+ * file is written next to path, synced and renamed over it, so path always
+ * holds either the old snapshot or the complete new one.
+ * @return true on success, with the size of the file stored into bytes if
+ *         it is not NULL, or false (with errno set) on error
+ */
+bool Snapshot::write(const char *path, uint64_t seq, const std::vector<std::pair<std::string_view, int>> &vars,
+                     uint64_t *bytes) {
+    std::string tmp = std::string(path) + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    uint64_t names_size = 0;
+    for (const auto &var : vars) {
+        names_size += var.first.size();
+    }
+
+    std::string out(SNAPSHOT_MAGIC, 8);
+    put(out, seq, 8);
+    put(out, vars.size(), 8);
+    put(out, names_size, 8);
+
+    bool ok = true;
+    uint64_t offset = 0;
+    for (const auto &var : vars) {
+        put(out, offset, 8);
+        put(out, var.first.size(), 4);
+        put(out, (uint32_t) var.second, 4);
+        offset += var.first.size();
+        if (out.size() >= WRITE_CHUNK) {
+            ok = ok && write_all(fd, out);
+            out.clear();
+        }
+    }
+    for (const auto &var : vars) {
+        out.append(var.first.data(), var.first.size());
+        if (out.size() >= WRITE_CHUNK) {
+            ok = ok && write_all(fd, out);
+            out.clear();
+        }
+    }
+    ok = ok && write_all(fd, out) && fsync(fd) == 0;
+
+    int saved = errno;
+    close(fd);
+    if (ok && rename(tmp.c_str(), path) < 0) {
+        ok = false;
+        saved = errno;
+    }
+    if (!ok) {
+        unlink(tmp.c_str());
+        errno = saved;
+        return false;
+    }
+
+    // sync the directory too, so that the rename survives a crash
+    std::string dir(path);
+    size_t slash = dir.rfind('/');
+    dir = slash == std::string::npos ? "." : slash == 0 ? "/" : dir.substr(0, slash);
+    int dirfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd >= 0) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+    if (bytes != NULL) {
+        *bytes = HEADER_SIZE + vars.size() * INDEX_ENTRY + names_size;
+    }
+    return true;
+}
+
+/**
+ * Get the name of the i-th variable in name order
+ * @return the name, or an empty name if the index entry is corrupt
+ */
+std::string_view Snapshot::name(uint64_t i) const {
+    const char *entry = index + i * INDEX_ENTRY;
+    uint64_t offset = get_u64(entry);
+    uint32_t len = get_u32(entry + 8);
+    if (offset > names_size || len > names_size - offset) {
+        return std::string_view();
+    }
+    return std::string_view(names + offset, len);
+}
+
+/**
+ * Get the value of the i-th variable in name order
+ * @return the value
+ */
+int Snapshot::value(uint64_t i) const {
+    return (int) get_u32(index + i * INDEX_ENTRY + 12);
+}
+
+/**
+ * Binary-search the index for name
+ * @return true if found, with its value stored into value
+ */
+bool Snapshot::find(std::string_view name, int &value) const {
+    uint64_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int cmp = this->name(mid).compare(name);
+        if (cmp == 0) {
+            value = this->value(mid);
+            return true;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return false;
+}
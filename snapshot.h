@@ -0,0 +1,57 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * A read-only snapshot of a calculator's variables, mapped into memory.
+ * The file holds a header with a sequence number, an index sorted by name
+ * of (name offset, name length, value), and the names. The same format
+ * holds the variables changed by an incremental checkpoint. Lookups
+ * binary-search the index, so only the pages they touch are ever read from
+ * disk. All integers are little-endian.
+ */
+class Snapshot {
+private:
+    const char *map;            // the whole file
+    size_t map_size;
+    uint64_t seq_number;        // checkpoint sequence number
+    uint64_t count;             // number of variables
+    const char *index;          // count entries of INDEX_ENTRY bytes
+    const char *names;
+    uint64_t names_size;
+
+    Snapshot(const char *map, size_t map_size, uint64_t seq_number, uint64_t count, uint64_t names_size);
+
+public:
+    ~Snapshot();
+
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+
+    // map the snapshot at path
+    static Snapshot *open(const char *path);
+
+    // write variables, sorted by name, as a snapshot replacing path
+    static bool write(const char *path, uint64_t seq, const std::vector<std::pair<std::string_view, int>> &vars,
+                      uint64_t *bytes = NULL);
+
+    // find the value of name, returning false if it is not in the snapshot
+    bool find(std::string_view name, int &value) const;
+
+    // get the i-th variable in name order, i < size()
+    std::string_view name(uint64_t i) const;
+    int value(uint64_t i) const;
+
+    // number of variables
+    uint64_t size() const { return count; }
+
+    // sequence number of the last checkpoint the snapshot includes
+    uint64_t seq() const { return seq_number; }
+};
+
+#endif /* SNAPSHOT_H */
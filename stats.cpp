@@ -0,0 +1,208 @@
+#include "stats.h"
+
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+
+std::atomic<bool> ThreadStats::enabled(false);
+std::atomic<bool> ThreadStats::locks_enabled(false);
+
+// protects the list of live threads' counters and the total of exited ones
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadStats *live_stats = NULL;
+static CalcStats exited_stats;
+static CalcLockStats exited_lock_stats;
+
+/**
+ * The counters of one thread, which are added to the list of live
+ * threads' counters when the thread first counts something, and folded
+ * into the total of exited threads when it exits
+ */
+struct ThreadStatsHolder {
+    ThreadStats stats;
+
+    ThreadStatsHolder() {
+        pthread_mutex_lock(&stats_lock);
+        stats.next = live_stats;
+        if (live_stats != NULL) {
+            live_stats->prev = &stats;
+        }
+        live_stats = &stats;
+        pthread_mutex_unlock(&stats_lock);
+    }
+
+    ~ThreadStatsHolder() {
+        pthread_mutex_lock(&stats_lock);
+        stats.add_to(exited_stats);
+        stats.add_to(exited_lock_stats);
+        if (stats.prev != NULL) {
+            stats.prev->next = stats.next;
+        } else {
+            live_stats = stats.next;
+        }
+        if (stats.next != NULL) {
+            stats.next->prev = stats.prev;
+        }
+        pthread_mutex_unlock(&stats_lock);
+    }
+};
+
+ThreadStats::ThreadStats() : prev(NULL), next(NULL) {
+    for (int shape = 0; shape < CALC_NUM_SHAPES; shape++) {
+        evaluations[shape].store(0, std::memory_order_relaxed);
+        latency_ns[shape].store(0, std::memory_order_relaxed);
+        for (int i = 0; i < CALC_STATS_BUCKETS; i++) {
+            latency[shape][i].store(0, std::memory_order_relaxed);
+        }
+    }
+    for (int error = 0; error < CALC_NUM_ERRORS; error++) {
+        errors[error].store(0, std::memory_order_relaxed);
+    }
+    assignments.store(0, std::memory_order_relaxed);
+    lock_acquisitions.store(0, std::memory_order_relaxed);
+    lock_contended.store(0, std::memory_order_relaxed);
+    lock_wait_ns.store(0, std::memory_order_relaxed);
+    lock_hold_ns.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < CALC_STATS_BUCKETS; i++) {
+        lock_wait[i].store(0, std::memory_order_relaxed);
+        lock_hold[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Get the calling thread's counters, creating them on first use
+ * @return the counters
+ */
+ThreadStats &ThreadStats::local() {
+    static thread_local ThreadStatsHolder holder;
+    return holder.stats;
+}
+
+/**
+ * Read the monotonic clock
+ * @return the time in nanoseconds
+ */
+uint64_t ThreadStats::now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Find the latency bucket of a time: that of its highest bit, or the last
+ * @return the bucket's index
+ */
+int ThreadStats::bucket(uint64_t ns) {
+    int highest = ns < 2 ? 0 : 63 - __builtin_clzll(ns);
+    return highest < CALC_STATS_BUCKETS ? highest : CALC_STATS_BUCKETS - 1;
+}
+
+/**
+ * Count an evaluation of shape that took ns
+ */
+void ThreadStats::evaluated(CalcShape shape, uint64_t ns) {
+    if (!enabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+    ThreadStats &stats = local();
+    bump(stats.evaluations[shape]);
+    bump(stats.latency_ns[shape], ns);
+    bump(stats.latency[shape][bucket(ns)]);
+}
+
+/**
+ * Count an evaluation that failed because of error
+ */
+void ThreadStats::failed(CalcError error) {
+    if (enabled.load(std::memory_order_relaxed)) {
+        bump(local().errors[error]);
+    }
+}
+
+/**
+ * Count a successful assignment
+ */
+void ThreadStats::assigned() {
+    if (enabled.load(std::memory_order_relaxed)) {
+        bump(local().assignments);
+    }
+}
+
+/**
+ * Count an acquisition of shards, which had to wait wait_ns for them if it
+ * was contended
+ */
+void ThreadStats::locked(bool contended, uint64_t wait_ns) {
+    ThreadStats &stats = local();
+    bump(stats.lock_acquisitions);
+    if (contended) {
+        bump(stats.lock_contended);
+        bump(stats.lock_wait_ns, wait_ns);
+    }
+    bump(stats.lock_wait[bucket(wait_ns)]);
+}
+
+/**
+ * Count a release of shards that were held for hold_ns
+ */
+void ThreadStats::released(uint64_t hold_ns) {
+    ThreadStats &stats = local();
+    bump(stats.lock_hold_ns, hold_ns);
+    bump(stats.lock_hold[bucket(hold_ns)]);
+}
+
+/**
+ * Add this thread's counters into stats. Their owner may be counting
+ * meanwhile, so each counter is read once, atomically.
+ */
+void ThreadStats::add_to(CalcStats &stats) const {
+    for (int shape = 0; shape < CALC_NUM_SHAPES; shape++) {
+        stats.evaluations[shape] += evaluations[shape].load(std::memory_order_relaxed);
+        stats.latency_ns[shape] += latency_ns[shape].load(std::memory_order_relaxed);
+        for (int i = 0; i < CALC_STATS_BUCKETS; i++) {
+            stats.latency[shape][i] += latency[shape][i].load(std::memory_order_relaxed);
+        }
+    }
+    for (int error = 0; error < CALC_NUM_ERRORS; error++) {
+        stats.errors[error] += errors[error].load(std::memory_order_relaxed);
+    }
+    stats.assignments += assignments.load(std::memory_order_relaxed);
+}
+
+/**
+ * Add this thread's lock counters into stats, as the other add_to does
+ */
+void ThreadStats::add_to(CalcLockStats &stats) const {
+    stats.acquisitions += lock_acquisitions.load(std::memory_order_relaxed);
+    stats.contended += lock_contended.load(std::memory_order_relaxed);
+    stats.wait_ns += lock_wait_ns.load(std::memory_order_relaxed);
+    stats.hold_ns += lock_hold_ns.load(std::memory_order_relaxed);
+    for (int i = 0; i < CALC_STATS_BUCKETS; i++) {
+        stats.wait[i] += lock_wait[i].load(std::memory_order_relaxed);
+        stats.hold[i] += lock_hold[i].load(std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Add up the counters of exited threads and of every live one
+ */
+void ThreadStats::collect(CalcStats &stats) {
+    pthread_mutex_lock(&stats_lock);
+    stats = exited_stats;
+    for (const ThreadStats *thread = live_stats; thread != NULL; thread = thread->next) {
+        thread->add_to(stats);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Add up the lock counters of exited threads and of every live one
+ */
+void ThreadStats::collect(CalcLockStats &stats) {
+    pthread_mutex_lock(&stats_lock);
+    stats = exited_lock_stats;
+    for (const ThreadStats *thread = live_stats; thread != NULL; thread = thread->next) {
+        thread->add_to(stats);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
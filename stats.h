@@ -0,0 +1,89 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <atomic>
+#include "calc.h"
+
+/**
+ * Counters of the evaluations made by one thread, and of the shard locks
+ * they took, in every calculator.
+ * Only the owning thread writes them, so an increment is a plain load and
+ * store with no locked instruction, and each thread's counters sit on
+ * cache lines of their own; collect reads them all as relaxed atomics and
+ * adds them up. When a thread exits, its counters are folded into a total
+ * kept for exited threads, so nothing is lost.
+ */
+class alignas(64) ThreadStats {
+private:
+    std::atomic<uint64_t> evaluations[CALC_NUM_SHAPES];
+    std::atomic<uint64_t> latency_ns[CALC_NUM_SHAPES];
+    std::atomic<uint64_t> latency[CALC_NUM_SHAPES][CALC_STATS_BUCKETS];
+    std::atomic<uint64_t> errors[CALC_NUM_ERRORS];
+    std::atomic<uint64_t> assignments;
+    std::atomic<uint64_t> lock_acquisitions;
+    std::atomic<uint64_t> lock_contended;
+    std::atomic<uint64_t> lock_wait_ns;
+    std::atomic<uint64_t> lock_wait[CALC_STATS_BUCKETS];
+    std::atomic<uint64_t> lock_hold_ns;
+    std::atomic<uint64_t> lock_hold[CALC_STATS_BUCKETS];
+    ThreadStats *prev, *next;       // list of every live thread's counters
+
+    // add n to a counter of the calling thread
+    static void bump(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // the latency bucket of a time, see CALC_STATS_BUCKETS
+    static int bucket(uint64_t ns);
+
+    // add every counter into stats
+    void add_to(CalcStats &stats) const;
+    void add_to(CalcLockStats &stats) const;
+
+    // the calling thread's counters
+    static ThreadStats &local();
+
+    friend struct ThreadStatsHolder;
+
+public:
+    ThreadStats();
+
+    ThreadStats(const ThreadStats &) = delete;
+    ThreadStats &operator=(const ThreadStats &) = delete;
+
+    // whether evaluations are counted and timed, see calc_enable_stats
+    static std::atomic<bool> enabled;
+
+    // read the clock when an evaluation starts, or get 0 if stats are off
+    static uint64_t start() {
+        return enabled.load(std::memory_order_relaxed) ? now_ns() : 0;
+    }
+
+    // count an evaluation of shape that took ns
+    static void evaluated(CalcShape shape, uint64_t ns);
+
+    // count an evaluation that failed
+    static void failed(CalcError error);
+
+    // count a successful assignment
+    static void assigned();
+
+    // whether shard locks are counted and timed, see calc_enable_lock_stats
+    static std::atomic<bool> locks_enabled;
+
+    // count an acquisition of shards, which waited wait_ns if contended
+    static void locked(bool contended, uint64_t wait_ns);
+
+    // count a release of shards held for hold_ns
+    static void released(uint64_t hold_ns);
+
+    // add up the counters of every thread into stats
+    static void collect(CalcStats &stats);
+    static void collect(CalcLockStats &stats);
+
+    // read CLOCK_MONOTONIC, in nanoseconds
+    static uint64_t now_ns();
+};
+
+#endif /* STATS_H */
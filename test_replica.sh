@@ -0,0 +1,65 @@
+#! /bin/bash
+
+if [ $# -ne 2 ]; then
+	echo "Usage: test_replica.sh <primary port> <replica port>"
+	exit 1
+fi
+
+primary_port="$1"
+replica_port="$2"
+socket="/tmp/calc_replica_test.$$.sock"
+
+# Send lines to a server on port, print its answers
+talk() {
+	local port="$1"
+	shift
+	exec 3<>/dev/tcp/localhost/$port || return 1
+	printf '%s\n' "$@" quit >&3
+	timeout 10 cat <&3
+	exec 3<&-
+}
+
+# Fail unless actual is expected
+check() {
+	if [ "$2" != "$3" ]; then
+		echo "FAILED: $1"
+		echo "expected:"
+		echo "$3"
+		echo "got:"
+		echo "$2"
+		kill -9 $PRIMARY_PID $REPLICA_PID
+		exit 1
+	fi
+}
+
+# Start the primary, and a replica that follows it
+./calcServer -P $socket $primary_port &
+PRIMARY_PID=$!
+sleep 0.5
+talk $primary_port "a = 6" "b = a * 7" "USE other" "c = 1" > /dev/null
+./calcServer -R $socket $replica_port &
+REPLICA_PID=$!
+sleep 0.5
+
+# What was assigned before the replica connected arrives in a dump
+check "dump" "$(talk $replica_port "b" "USE other" "c")" "$(printf '42\nOK\n1')"
+
+# Assignments arriving later are streamed
+talk $primary_port "a = 10" "USE other" "d = c + 2" > /dev/null
+sleep 0.5
+check "stream" "$(talk $replica_port "a" "b" "USE other" "d")" "$(printf '10\n42\nOK\n3')"
+
+# The replica refuses assignments of its own
+check "read-only" "$(talk $replica_port "a = 1" "a")" "$(printf 'Error\n10')"
+
+# and reports how far behind it is
+status="$(talk $replica_port "REPLICATION")"
+case "$status" in
+	"replica connected 1 position "*" behind 0 lag_ms "*) ;;
+	*) check "lag" "$status" "replica connected 1 position ... behind 0 lag_ms ..." ;;
+esac
+check "primary" "$(talk $primary_port "REPLICATION")" "primary replicas 1 position $(echo "$status" | cut -d' ' -f5)"
+
+echo "replication passed"
+kill -9 $PRIMARY_PID $REPLICA_PID
+rm -f $socket
@@ -9,15 +9,78 @@ port="$1"
 input_file="$2"
 output_file="$3"
 
+# Send raw bytes to the server on port, print its answers
+talk() {
+	exec 3<>/dev/tcp/localhost/$1 || return 1
+	printf "$2" >&3
+	timeout 10 cat <&3
+	exec 3<&-
+}
+
+# Fail unless actual is expected
+check() {
+	if [ "$2" != "$3" ]; then
+		echo "FAILED: $1"
+		echo "expected:"
+		echo "$3"
+		echo "got:"
+		echo "$2"
+		kill -9 $CALC_PID
+		exit 1
+	fi
+}
+
 # Start server process
 ./calcServer $port &
 CALC_PID=$!
+sleep 0.5
 
 # Send input to server, capture its output
 timeout 10 nc localhost $port < $input_file > $output_file
 
-# Could do additional sessions here if desired...
+# Commands end with "\r\n" as well as "\n"
+check "crlf quit" "$(talk $port 'a = 2\r\nquit\r\na\r\n')" "2"
+check "crlf commands" "$(talk $port 'a = 3\r\nstats\r\nquit\r\n' | grep -c '^END')" "1"
 
 # Kill server process
 sleep 1
 kill -9 $CALC_PID
+wait $CALC_PID 2> /dev/null
+
+# No namespaces past the limit, which counts the default one
+./calcServer -n 3 $port 2> /dev/null &
+CALC_PID=$!
+sleep 0.5
+check "limit" "$(talk $port 'USE a\nUSE b\nUSE c\nUSE a\nquit\n')" "$(printf 'OK\nOK\nError\nOK')"
+kill -9 $CALC_PID
+wait $CALC_PID 2> /dev/null
+
+# Namespaces and line endings in every mode
+modes="thread epoll reuseport pool"
+if [ -x ./calcServer_uring ]; then
+	modes="$modes uring"
+fi
+for mode in $modes; do
+	server=./calcServer
+	if [ $mode = uring ]; then
+		server=./calcServer_uring
+	fi
+	$server -m $mode $port 2> /dev/null &
+	CALC_PID=$!
+	sleep 0.5
+
+	# each namespace has variables of its own, kept across connections
+	check "$mode: use" "$(talk $port 'USE a\nx = 1\nUSE b\nx\nx = 2\nUSE a\nx\nquit\n')" "$(printf 'OK\n1\nOK\nError\n2\nOK\n1')"
+	check "$mode: use again" "$(talk $port 'USE b\nx\nquit\n')" "$(printf 'OK\n2')"
+	check "$mode: default" "$(talk $port 'x\nquit\n')" "Error"
+
+	# a bad name is refused, and the session stays where it was
+	check "$mode: bad name" "$(talk $port 'USE a\nUSE no.dots\nUSE \nx\nquit\n')" "$(printf 'OK\nError\nError\n1')"
+
+	# "\r\n" ends commands and USE lines too
+	check "$mode: crlf" "$(talk $port 'USE b\r\nx + 1\r\nstats\r\nquit\r\nx\r\n' | grep -v '^STAT')" "$(printf 'OK\n3\nEND')"
+
+	kill -9 $CALC_PID
+	wait $CALC_PID 2> /dev/null
+done
+echo "All server sessions passed"
@@ -0,0 +1,174 @@
+#include "trace.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+std::atomic<bool> TraceRing::enabled(false);
+
+// protects the lists of rings
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceRing *all_rings = NULL;
+static TraceRing *free_rings = NULL;
+
+/**
+ * The ring a thread records into, taken when the thread first records an
+ * event, either from a thread that has exited or newly made, and given
+ * back when the thread exits
+ */
+struct TraceRingHolder {
+    TraceRing *ring;
+    uint32_t tid;
+
+    TraceRingHolder() : tid((uint32_t) syscall(SYS_gettid)) {
+        pthread_mutex_lock(&trace_lock);
+        ring = free_rings;
+        if (ring != NULL) {
+            free_rings = ring->next_free;
+        }
+        pthread_mutex_unlock(&trace_lock);
+
+        if (ring == NULL) {
+            ring = new TraceRing();
+            pthread_mutex_lock(&trace_lock);
+            ring->next = all_rings;
+            all_rings = ring;
+            pthread_mutex_unlock(&trace_lock);
+        }
+    }
+
+    ~TraceRingHolder() {
+        pthread_mutex_lock(&trace_lock);
+        ring->next_free = free_rings;
+        free_rings = ring;
+        pthread_mutex_unlock(&trace_lock);
+    }
+};
+
+TraceRing::TraceRing() : next(NULL), next_free(NULL) {
+    for (int i = 0; i < CALC_TRACE_EVENTS; i++) {
+        slots[i].time_ns.store(0, std::memory_order_relaxed);
+        slots[i].event.store(0, std::memory_order_relaxed);
+    }
+    head.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * Get the calling thread's ring, taking one on first use
+ * @return the ring, with the thread's id stored into tid
+ */
+TraceRing &TraceRing::local(uint32_t &tid) {
+    static thread_local TraceRingHolder holder;
+    tid = holder.tid;
+    return *holder.ring;
+}
+
+/**
+ * Pack the fields of an event other than its time into one word
+ * @return the word
+ */
+static uint64_t pack(uint32_t tid, CalcTracePhase phase, char kind, unsigned arg) {
+    return (uint64_t) tid << 32 | (uint64_t) phase << 24 | (uint64_t) (uint8_t) kind << 16
+        | (arg < 0xffff ? arg : 0xffff);
+}
+
+/**
+ * Record an event of the calling thread, overwriting its oldest one once
+ * the ring is full
+ */
+void TraceRing::record(CalcTracePhase phase, char kind, unsigned arg) {
+    uint32_t tid;
+    TraceRing &ring = local(tid);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+    uint64_t at = ring.head.load(std::memory_order_relaxed);
+    Slot &slot = ring.slots[at % CALC_TRACE_EVENTS];
+    slot.time_ns.store((uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec, std::memory_order_relaxed);
+    slot.event.store(pack(tid, phase, kind, arg), std::memory_order_relaxed);
+    ring.head.store(at + 1, std::memory_order_release);
+}
+
+/**
+ * Append the ring's events, oldest first, to out as CalcTraceRecords. The
+ * owner may record meanwhile, so the events it could have overwritten
+ * while they were copied are dropped afterwards.
+ */
+void TraceRing::copy_to(std::string &out) const {
+    uint64_t last = head.load(std::memory_order_acquire);
+    uint64_t first = last > CALC_TRACE_EVENTS ? last - CALC_TRACE_EVENTS : 0;
+    size_t start = out.size();
+
+    out.reserve(start + (last - first) * sizeof(CalcTraceRecord));
+    for (uint64_t i = first; i < last; i++) {
+        const Slot &slot = slots[i % CALC_TRACE_EVENTS];
+        uint64_t event = slot.event.load(std::memory_order_relaxed);
+        CalcTraceRecord record;
+        record.time_ns = slot.time_ns.load(std::memory_order_relaxed);
+        record.tid = (uint32_t) (event >> 32);
+        record.phase = (uint8_t) (event >> 24);
+        record.kind = (uint8_t) (event >> 16);
+        record.arg = (uint16_t) event;
+        out.append((const char *) &record, sizeof(record));
+    }
+
+    // event i is overwritten by event i + CALC_TRACE_EVENTS, which may be
+    // in progress even before head shows it
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t now = head.load(std::memory_order_relaxed);
+    if (now + 1 > first + CALC_TRACE_EVENTS) {
+        uint64_t lost = now + 1 - CALC_TRACE_EVENTS - first;
+        if (lost > last - first) {
+            lost = last - first;
+        }
+        out.erase(start, lost * sizeof(CalcTraceRecord));
+    }
+}
+
+/**
+ * Write the events of every ring to path, which is first written under
+ * a temporary name and then renamed, so it is never seen half written
+ * @return the number of events written, or -1 with errno set on error
+ */
+long TraceRing::dump(const char *path) {
+    std::string out(CALC_TRACE_MAGIC);
+
+    pthread_mutex_lock(&trace_lock);
+    for (const TraceRing *ring = all_rings; ring != NULL; ring = ring->next) {
+        ring->copy_to(out);
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    std::string tmp = std::string(path) + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < out.size()) {
+        ssize_t n = ::write(fd, out.data() + done, out.size() - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            int saved = errno;
+            close(fd);
+            unlink(tmp.c_str());
+            errno = saved;
+            return -1;
+        }
+        done += n;
+    }
+    if (close(fd) < 0 || rename(tmp.c_str(), path) < 0) {
+        int saved = errno;
+        unlink(tmp.c_str());
+        errno = saved;
+        return -1;
+    }
+    return (long) ((out.size() - strlen(CALC_TRACE_MAGIC)) / sizeof(CalcTraceRecord));
+}
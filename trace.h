@@ -0,0 +1,68 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include "calc.h"
+
+/**
+ * The last CALC_TRACE_EVENTS events recorded by a thread. Only the thread
+ * that owns the ring writes it: it fills the slot at head and then
+ * publishes the event by advancing head, so recording takes no lock and
+ * no locked instruction. A dump copies the slots behind head, then reads
+ * head again and drops the events the owner may have overwritten
+ * meanwhile. Rings are never freed: when a thread exits, its ring is kept,
+ * events and all, for the next thread that traces.
+ */
+class alignas(64) TraceRing {
+private:
+    struct Slot {
+        std::atomic<uint64_t> time_ns;
+        std::atomic<uint64_t> event;    // tid, phase, kind and arg, see pack
+    };
+
+    Slot slots[CALC_TRACE_EVENTS];
+    std::atomic<uint64_t> head;         // number of events ever recorded
+    TraceRing *next;                    // list of every ring
+    TraceRing *next_free;               // list of rings no thread owns
+
+    // the calling thread's ring, and its kernel thread id
+    static TraceRing &local(uint32_t &tid);
+
+    // record an event in the calling thread's ring
+    static void record(CalcTracePhase phase, char kind, unsigned arg);
+
+    // append the events still in the ring to out
+    void copy_to(std::string &out) const;
+
+    friend struct TraceRingHolder;
+
+public:
+    TraceRing();
+
+    TraceRing(const TraceRing &) = delete;
+    TraceRing &operator=(const TraceRing &) = delete;
+
+    // whether events are recorded, see calc_enable_trace
+    static std::atomic<bool> enabled;
+
+    // record the start of a phase, if tracing is on
+    static void begin(CalcTracePhase phase, unsigned arg = 0) {
+        if (enabled.load(std::memory_order_relaxed)) {
+            record(phase, CALC_TRACE_BEGIN, arg);
+        }
+    }
+
+    // record the end of a phase, if tracing is on
+    static void end(CalcTracePhase phase, unsigned arg = 0) {
+        if (enabled.load(std::memory_order_relaxed)) {
+            record(phase, CALC_TRACE_END, arg);
+        }
+    }
+
+    // write every ring's events to a file, see calc_trace_dump
+    static long dump(const char *path);
+};
+
+#endif /* TRACE_H */
@@ -0,0 +1,257 @@
+#include "varTable.h"
+#include "snapshot.h"
+
+#include <cstring>
+#include <new>
+
+// entries per chunk of the entry arena, must be a power of two
+#define ENTRY_CHUNK_BITS 10
+#define ENTRY_CHUNK (1u << ENTRY_CHUNK_BITS)
+
+// bytes per block of the name arena
+#define NAME_BLOCK 16384
+
+// bucket count of a new table
+#define INITIAL_BUCKETS 16
+
+VarTable::VarTable()
+    : buckets(new Bucket[INITIAL_BUCKETS]()), mask(INITIAL_BUCKETS - 1), num_entries(0), base(NULL),
+      name_next(NULL), name_left(0) {}
+
+VarTable::~VarTable() {
+    delete[] buckets;
+    for (VarEntry *chunk : entry_chunks) {
+        delete[] chunk;
+    }
+    for (char *block : name_blocks) {
+        delete[] block;
+    }
+}
+
+/**
+ * Hash a variable name with 64-bit FNV-1a
+ * @return the hash of name
+ */
+uint64_t VarTable::hash(std::string_view name) {
+    uint64_t h = 14695981039346656037ull;
+    for (char c : name) {
+        h ^= (unsigned char) c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/**
+ * Look up a variable by name and its precomputed hash
+ * @return the entry, or NULL if name was never interned
+ */
+VarEntry *VarTable::find(std::string_view name, uint64_t hash) const {
+    uint32_t tag = (uint32_t) (hash >> 32);
+
+    for (uint32_t i = (uint32_t) hash & mask; buckets[i].slot != 0; i = (i + 1) & mask) {
+        if (buckets[i].tag == tag) {
+            VarEntry *entry = get(buckets[i].slot - 1);
+            if (entry->get_name() == name) {
+                return entry;
+            }
+        }
+    }
+
+    return NULL;        // reached an empty bucket, so name is not present
+}
+
+/**
+ * Look up a variable, creating an undefined entry for it if it is not present
+ * @return the entry for name
+ */
+VarEntry *VarTable::intern(std::string_view name, uint64_t hash) {
+    VarEntry *entry = find(name, hash);
+    if (entry != NULL) {
+        return entry;
+    }
+
+    uint32_t id = num_entries;
+    if ((id & (ENTRY_CHUNK - 1)) == 0) {
+        entry_chunks.push_back(new VarEntry[ENTRY_CHUNK]);       // current chunk is full
+    }
+
+    entry = get(id);
+    entry->name = store_name(name);
+    entry->name_len = (uint32_t) name.size();
+    entry->id = id;
+    entry->hash = hash;
+    entry->next = NULL;
+    entry->value.store(0, std::memory_order_relaxed);
+    entry->defined.store(false, std::memory_order_relaxed);
+    entry->dirty = false;
+    int value;
+    if (base != NULL && base->find(name, value)) {
+        entry->store(value);
+    }
+    num_entries++;
+
+    if ((uint64_t) num_entries * 4 > (uint64_t) (mask + 1) * 3) {
+        grow();     // keep the load factor at or below 3/4
+    } else {
+        insert_bucket(id, hash);
+    }
+
+    return entry;
+}
+
+/**
+ * Get an entry by id
+ * @return the entry with the given id
+ */
+VarEntry *VarTable::get(uint32_t id) const {
+    return &entry_chunks[id >> ENTRY_CHUNK_BITS][id & (ENTRY_CHUNK - 1)];
+}
+
+/**
+ * Copy name into the name arena
+ * @return pointer to the stored copy
+ */
+const char *VarTable::store_name(std::string_view name) {
+    if (name.size() > name_left) {
+        size_t size = name.size() > NAME_BLOCK ? name.size() : NAME_BLOCK;
+        name_next = new char[size];
+        name_left = size;
+        name_blocks.push_back(name_next);
+    }
+
+    char *copy = name_next;
+    memcpy(copy, name.data(), name.size());
+    name_next += name.size();
+    name_left -= name.size();
+    return copy;
+}
+
+/**
+ * Put entry id into the first free bucket of its probe sequence
+ */
+void VarTable::insert_bucket(uint32_t id, uint64_t hash) {
+    uint32_t i = (uint32_t) hash & mask;
+    while (buckets[i].slot != 0) {
+        i = (i + 1) & mask;
+    }
+    buckets[i].tag = (uint32_t) (hash >> 32);
+    buckets[i].slot = id + 1;
+}
+
+/**
+ * Double the number of buckets and reinsert all entries using their
+ * stored hashes. Entries themselves do not move.
+ */
+void VarTable::grow() {
+    delete[] buckets;
+    mask = mask * 2 + 1;
+    buckets = new Bucket[mask + 1]();
+
+    for (uint32_t id = 0; id < num_entries; id++) {
+        insert_bucket(id, get(id)->hash);
+    }
+}
+
+LockFreeVarTable::LockFreeVarTable(uint32_t num_buckets) : num_entries(0), base(NULL) {
+    uint32_t count = 1;
+    while (count < num_buckets) {
+        count *= 2;
+    }
+    mask = count - 1;
+    buckets = new std::atomic<VarEntry *>[count];
+    for (uint32_t i = 0; i < count; i++) {
+        buckets[i].store(NULL, std::memory_order_relaxed);
+    }
+}
+
+LockFreeVarTable::~LockFreeVarTable() {
+    for (uint32_t i = 0; i <= mask; i++) {
+        VarEntry *entry = buckets[i].load(std::memory_order_relaxed);
+        while (entry != NULL) {
+            VarEntry *next = entry->next;
+            entry->~VarEntry();
+            delete[] (char *) entry;
+            entry = next;
+        }
+    }
+    delete[] buckets;
+}
+
+/**
+ * Walk a chain starting at entry looking for name
+ * @return the entry, or NULL if it is not in the chain
+ */
+VarEntry *LockFreeVarTable::search(VarEntry *entry, std::string_view name, uint64_t hash) {
+    for (; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->get_name() == name) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Look up a variable by name and its precomputed hash
+ * @return the entry, or NULL if name was never interned
+ */
+VarEntry *LockFreeVarTable::find(std::string_view name, uint64_t hash) const {
+    return search(buckets[hash & mask].load(std::memory_order_acquire), name, hash);
+}
+
+/**
+ * Look up a variable, creating an undefined entry for it if it is not present.
+ * If another thread interns the same name concurrently, both get its entry.
+ * @return the entry for name
+ */
+VarEntry *LockFreeVarTable::intern(std::string_view name, uint64_t hash) {
+    std::atomic<VarEntry *> &head = buckets[hash & mask];
+    VarEntry *first = head.load(std::memory_order_acquire);
+
+    VarEntry *entry = search(first, name, hash);
+    if (entry != NULL) {
+        return entry;
+    }
+
+    // the entry and its name share one allocation
+    char *mem = new char[sizeof(VarEntry) + name.size()];
+    entry = new (mem) VarEntry();
+    memcpy(mem + sizeof(VarEntry), name.data(), name.size());
+    entry->name = mem + sizeof(VarEntry);
+    entry->name_len = (uint32_t) name.size();
+    entry->hash = hash;
+    entry->value.store(0, std::memory_order_relaxed);
+    entry->defined.store(false, std::memory_order_relaxed);
+    entry->dirty = false;
+    int value;
+    if (base != NULL && base->find(name, value)) {
+        entry->store(value);        // before the entry is published, so no assignment can be overwritten
+    }
+
+    while (1) {
+        entry->next = first;
+        if (head.compare_exchange_weak(first, entry, std::memory_order_release, std::memory_order_acquire)) {
+            entry->id = num_entries.fetch_add(1, std::memory_order_relaxed);
+            return entry;
+        }
+
+        // first now holds the new head, which may be the same name from another thread
+        VarEntry *winner = search(first, name, hash);
+        if (winner != NULL) {
+            entry->~VarEntry();
+            delete[] mem;
+            return winner;
+        }
+    }
+}
+
+/**
+ * Append every entry to out. Entries interned concurrently may or may not
+ * be included.
+ */
+void LockFreeVarTable::collect(std::vector<VarEntry *> &out) const {
+    for (uint32_t i = 0; i <= mask; i++) {
+        for (VarEntry *entry = buckets[i].load(std::memory_order_acquire); entry != NULL; entry = entry->next) {
+            out.push_back(entry);
+        }
+    }
+}
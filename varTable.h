@@ -0,0 +1,149 @@
+#ifndef VARTABLE_H
+#define VARTABLE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string_view>
+#include <vector>
+
+class Snapshot;
+
+/**
+ * A variable stored in a VarTable or LockFreeVarTable. Entries are never
+ * moved or freed while the table exists, so a pointer to one can be kept
+ * as a resolved slot. An interned entry has no value until it is stored.
+ * value and defined are atomic so that lock-free readers can use load
+ * while another thread uses store; under a lock they cost nothing extra.
+ * dirty belongs to the Calc, which tracks assignments for checkpoints.
+ */
+struct VarEntry {
+    const char *name;       // not NUL-terminated, see name_len
+    uint32_t name_len;
+    uint32_t id;            // dense index, usable with VarTable::get
+    uint64_t hash;
+    VarEntry *next;         // next entry in the same bucket, LockFreeVarTable only
+    std::atomic<int> value;
+    std::atomic<bool> defined;
+    bool dirty;             // assigned since the last checkpoint began
+
+    std::string_view get_name() const { return std::string_view(name, name_len); }
+
+    // read the value into out, returning false if the variable is undefined
+    bool load(int &out) const {
+        if (!defined.load(std::memory_order_acquire)) {
+            return false;
+        }
+        out = value.load(std::memory_order_relaxed);
+        return true;
+    }
+
+    // assign a value, defining the variable
+    void store(int v) {
+        value.store(v, std::memory_order_relaxed);
+        defined.store(true, std::memory_order_release);     // publishes value to load
+    }
+};
+
+/**
+ * Hash table from variable name to VarEntry using open addressing with
+ * linear probing. Buckets hold a hash tag and an entry id, so probing only
+ * touches entries whose tag matches. Entries and names live in chunked
+ * arenas that are never reallocated; growing the table only rebuilds the
+ * bucket array. A new entry takes its value from the base snapshot, if the
+ * table has one. Not thread-safe: callers synchronize.
+ */
+class VarTable {
+private:
+    struct Bucket {
+        uint32_t tag;       // high bits of the entry's hash
+        uint32_t slot;      // entry id + 1, or 0 if the bucket is empty
+    };
+
+    Bucket *buckets;
+    uint32_t mask;          // bucket count - 1, bucket count is a power of two
+    uint32_t num_entries;
+
+    const Snapshot *base;   // values of variables not yet interned, or NULL
+
+    std::vector<VarEntry *> entry_chunks;
+    std::vector<char *> name_blocks;
+    char *name_next;        // free space in the last name block
+    size_t name_left;
+
+    // copy a name into the name arena
+    const char *store_name(std::string_view name);
+
+    // place entry id into the bucket array
+    void insert_bucket(uint32_t id, uint64_t hash);
+
+    // double the bucket array and reinsert every entry
+    void grow();
+
+public:
+    VarTable();
+    ~VarTable();
+
+    VarTable(const VarTable &) = delete;
+    VarTable &operator=(const VarTable &) = delete;
+
+    // hash a variable name, to be passed to find and intern
+    static uint64_t hash(std::string_view name);
+
+    // get the entry for name, or NULL if it was never interned
+    VarEntry *find(std::string_view name, uint64_t hash) const;
+
+    // get the entry for name, creating an undefined one if needed
+    VarEntry *intern(std::string_view name, uint64_t hash);
+
+    // get an entry by its id, which must be less than size()
+    VarEntry *get(uint32_t id) const;
+
+    // number of interned entries
+    uint32_t size() const { return num_entries; }
+
+    // give entries interned from now on their values in snapshot
+    void set_base(const Snapshot *snapshot) { base = snapshot; }
+};
+
+/**
+ * Hash table from variable name to VarEntry that needs no lock. Each bucket
+ * is the head of a singly linked chain; a new entry is published by a
+ * compare-and-swap on the head, and entries are never unlinked, so readers
+ * just follow the chain. The bucket count is fixed at construction. Like
+ * VarTable, a new entry takes its value from the base snapshot.
+ */
+class LockFreeVarTable {
+private:
+    std::atomic<VarEntry *> *buckets;
+    uint32_t mask;          // bucket count - 1, bucket count is a power of two
+    std::atomic<uint32_t> num_entries;
+    const Snapshot *base;   // values of variables not yet interned, or NULL
+
+    // search a chain for name
+    static VarEntry *search(VarEntry *entry, std::string_view name, uint64_t hash);
+
+public:
+    // num_buckets is rounded up to a power of two
+    explicit LockFreeVarTable(uint32_t num_buckets);
+    ~LockFreeVarTable();
+
+    LockFreeVarTable(const LockFreeVarTable &) = delete;
+    LockFreeVarTable &operator=(const LockFreeVarTable &) = delete;
+
+    // get the entry for name, or NULL if it was never interned
+    VarEntry *find(std::string_view name, uint64_t hash) const;
+
+    // get the entry for name, creating an undefined one if needed
+    VarEntry *intern(std::string_view name, uint64_t hash);
+
+    // number of interned entries
+    uint32_t size() const { return num_entries.load(std::memory_order_relaxed); }
+
+    // give entries interned from now on their values in snapshot
+    void set_base(const Snapshot *snapshot) { base = snapshot; }
+
+    // append every entry to out
+    void collect(std::vector<VarEntry *> &out) const;
+};
+
+#endif /* VARTABLE_H */
@@ -0,0 +1,579 @@
+#include "wal.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// bytes of a record before its name: checksum, name length, value
+#define RECORD_HEADER 12
+
+// initial value of a checksum
+#define CHECKSUM_SEED 2166136261u
+
+Wal::Wal(int fd, const char *path, uint64_t size, unsigned interval_us, const std::vector<uint64_t> &segments)
+    : fd(fd), path(path), interval_us(interval_us), appended(size), durable(size), flushing(false), failed(false),
+      segments(segments), rotated_fd(-1), rotated_end(0), flusher_started(false), stopping(false) {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&flushed, NULL);
+    pthread_cond_init(&wanted, NULL);
+}
+
+Wal::~Wal() {
+    if (flusher_started) {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_signal(&wanted);
+        pthread_mutex_unlock(&lock);
+        pthread_join(flusher, NULL);
+    }
+
+    writing.clear();
+    writing.swap(pending);
+    flush(fd);      // every caller of store has committed, so this is normally empty
+    close(fd);
+    for (auto &waiter : waiters) {
+        waiter.second();        // only if its caller stopped waiting without it
+    }
+    pthread_cond_destroy(&wanted);
+    pthread_cond_destroy(&flushed);
+    pthread_mutex_destroy(&lock);
+}
+
+/**
+ * Write a little-endian 32-bit integer
+ */
+static void put_u32(char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (char) (v >> (8 * i));
+    }
+}
+
+/**
+ * Read a little-endian 32-bit integer
+ * @return the integer at p
+ */
+static uint32_t get_u32(const char *p) {
+    const unsigned char *b = (const unsigned char *) p;
+    return b[0] | (uint32_t) b[1] << 8 | (uint32_t) b[2] << 16 | (uint32_t) b[3] << 24;
+}
+
+/**
+ * Continue a 32-bit FNV-1a checksum h over data[0..len-1]. A record's
+ * checksum covers everything after it, so that a record torn by a crash
+ * is recognized.
+ * @return the updated checksum
+ */
+static uint32_t checksum(uint32_t h, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Get the name of a file rotate renamed
+ * @return path.n
+ */
+static std::string segment_path(const std::string &path, uint64_t n) {
+    return path + "." + std::to_string(n);
+}
+
+/**
+ * Sync the directory holding path, so that files created or renamed in it
+ * survive a crash
+ * @return true on success, false on error
+ */
+static bool sync_dir(const std::string &path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int dirfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        return false;
+    }
+    bool ok = fsync(dirfd) == 0;
+    close(dirfd);
+    return ok;
+}
+
+/**
+ * Find the segments of the log at path
+ * @return their numbers, in order
+ */
+static std::vector<uint64_t> find_segments(const std::string &path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    std::string prefix = (slash == std::string::npos ? path : path.substr(slash + 1)) + ".";
+
+    std::vector<uint64_t> segments;
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) {
+        return segments;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        const char *name = ent->d_name;
+        if (strncmp(name, prefix.c_str(), prefix.size()) != 0) {
+            continue;
+        }
+        const char *digits = name + prefix.size();
+        size_t len = strlen(digits);
+        if (len > 0 && len < 20 && strspn(digits, "0123456789") == len) {
+            segments.push_back(strtoull(digits, NULL, 10));
+        }
+    }
+    closedir(d);
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+/**
+ * Read all of the file fd into data
+ * @return true on success, false (with errno set) on error
+ */
+static bool read_all(int fd, std::string &data) {
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data.append(buf, n);
+    }
+    return true;
+}
+
+/**
+ * Append a record of the assignment name = value to out, in the format of
+ * the log, so that other streams of assignments can use it too
+ */
+void Wal::encode(std::string &out, std::string_view name, int value) {
+    char header[RECORD_HEADER];
+    put_u32(header + 4, (uint32_t) name.size());
+    put_u32(header + 8, (uint32_t) value);
+
+    uint32_t h = checksum(CHECKSUM_SEED, header + 4, RECORD_HEADER - 4);
+    put_u32(header, checksum(h, name.data(), name.size()));
+    out.append(header, RECORD_HEADER);
+    out.append(name.data(), name.size());
+}
+
+/**
+ * Pass every complete record at the start of data to apply, in order. A
+ * record whose checksum is wrong ends the records; if corrupt is not NULL,
+ * it is set to whether that is why they ended, rather than a record that
+ * is cut short.
+ * @return the position after the last complete record
+ */
+size_t Wal::decode(std::string_view data, const std::function<void(std::string_view, int)> &apply, bool *corrupt) {
+    size_t pos = 0;
+    bool bad = false;
+    while (data.size() - pos >= RECORD_HEADER) {
+        const char *record = data.data() + pos;
+        uint32_t name_len = get_u32(record + 4);
+        if (name_len > data.size() - pos - RECORD_HEADER) {
+            break;
+        }
+        if (get_u32(record) != checksum(CHECKSUM_SEED, record + 4, RECORD_HEADER - 4 + name_len)) {
+            bad = true;
+            break;
+        }
+        apply(std::string_view(record + RECORD_HEADER, name_len), (int) get_u32(record + 8));
+        pos += RECORD_HEADER + name_len;
+    }
+    if (corrupt != NULL) {
+        *corrupt = bad;
+    }
+    return pos;
+}
+
+/**
+ * Open the log at path, creating it if it does not exist. Every complete
+ * record, first in the segments and then in path itself, is passed to apply
+ * in order; anything after the last one in path, left by a crash in the
+ * middle of a write, is cut off.
+ * @return the log, or NULL (with errno set) if a file can't be used
+ */
+Wal *Wal::open(const char *path, unsigned interval_us, const std::function<void(std::string_view, int)> &apply) {
+    std::vector<uint64_t> segments = find_segments(path);
+    for (uint64_t n : segments) {
+        int fd = ::open(segment_path(path, n).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return NULL;
+        }
+        std::string data;
+        bool ok = read_all(fd, data);
+        int saved = errno;
+        close(fd);
+        if (!ok) {
+            errno = saved;
+            return NULL;
+        }
+        decode(data, apply);        // torn or corrupt records end it, since nothing after them was acknowledged
+    }
+
+    int fd = ::open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    std::string data;
+    if (!read_all(fd, data)) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+
+    size_t pos = decode(data, apply);
+    if (pos < data.size() && ftruncate(fd, pos) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+    return new Wal(fd, path, pos, interval_us, segments);
+}
+
+/**
+ * Store value into entry and append a record of the assignment. Both happen
+ * under the log's lock, so the log orders assignments to a variable the way
+ * they were stored even when no other lock serializes them. What the entry
+ * held before is kept until the record is durable, to undo the store if it
+ * never becomes so.
+ * @return the position after the record, to be passed to commit, or 0 if
+ *         the log has failed, in which case nothing is stored
+ */
+uint64_t Wal::store(VarEntry *entry, int value) {
+    char header[RECORD_HEADER];
+    put_u32(header + 4, entry->name_len);
+    put_u32(header + 8, (uint32_t) value);
+
+    uint32_t h = checksum(CHECKSUM_SEED, header + 4, RECORD_HEADER - 4);
+    put_u32(header, checksum(h, entry->name, entry->name_len));
+
+    pthread_mutex_lock(&lock);
+    if (failed) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    pending_undo.push_back(Undo{ entry, entry->value.load(std::memory_order_relaxed),
+                                 entry->defined.load(std::memory_order_relaxed) });
+    entry->store(value);
+    pending.append(header, RECORD_HEADER);
+    pending.append(entry->name, entry->name_len);
+    appended += RECORD_HEADER + entry->name_len;
+    uint64_t lsn = appended;
+    pthread_mutex_unlock(&lock);
+    return lsn;
+}
+
+/**
+ * Wait until every record up to position lsn is on disk. If no thread is
+ * flushing, this one becomes the flusher: it waits interval_us for other
+ * threads to append, then writes and syncs all pending records at once.
+ * Otherwise it waits for the flusher, whose sync may already cover lsn.
+ * @return true if the records are durable, false if the log failed and
+ *         their stores were undone
+ */
+bool Wal::commit(uint64_t lsn) {
+    pthread_mutex_lock(&lock);
+    while (durable < lsn && !failed) {
+        if (flushing) {
+            pthread_cond_wait(&flushed, &lock);
+            continue;
+        }
+
+        flushing = true;
+        if (interval_us > 0) {
+            pthread_mutex_unlock(&lock);
+            usleep(interval_us);        // let concurrent writers join this sync
+            pthread_mutex_lock(&lock);
+        }
+        writing.clear();
+        writing.swap(pending);
+        writing_undo.swap(pending_undo);
+        uint64_t end = appended;
+        pthread_mutex_unlock(&lock);
+
+        bool ok = flush(fd);
+
+        pthread_mutex_lock(&lock);
+        if (ok) {
+            durable = end;
+            writing_undo.clear();
+        } else {
+            fail();
+        }
+        flushing = false;
+        pthread_cond_broadcast(&flushed);
+        wake_waiters();
+    }
+    bool ok = settled(lsn) > 0;
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+/**
+ * Check whether position lsn, returned by store, is durable
+ * @return 1 if it is, -1 if the log failed first and its store was
+ *         undone, 0 if it may still become durable
+ */
+int Wal::status(uint64_t lsn) {
+    pthread_mutex_lock(&lock);
+    int result = settled(lsn);
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+/**
+ * Check whether position lsn is durable, as status does, with the lock held.
+ * Undone positions are remembered, since a checkpoint later makes every
+ * position up to appended durable.
+ */
+int Wal::settled(uint64_t lsn) const {
+    for (const auto &range : undone) {
+        if (lsn > range.first && lsn <= range.second) {
+            return -1;
+        }
+    }
+    return durable >= lsn ? 1 : failed ? -1 : 0;
+}
+
+/**
+ * Ask for position lsn to become durable without waiting for it: the
+ * flusher thread syncs the log and then calls done, from its own thread
+ * with the log locked, so done must be quick and must not use the log. If
+ * the flusher can't be started, this thread commits instead.
+ * @return status(lsn), and if that is 0, done will be called
+ */
+int Wal::notify(uint64_t lsn, const std::function<void()> &done) {
+    pthread_mutex_lock(&lock);
+    int result = settled(lsn);
+    if (result == 0 && !flusher_started) {
+        flusher_started = pthread_create(&flusher, NULL, flush_loop, this) == 0;
+    }
+    bool queued = result == 0 && flusher_started;
+    if (queued) {
+        waiters.emplace_back(lsn, done);
+        pthread_cond_signal(&wanted);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (result == 0 && !queued) {
+        result = commit(lsn) ? 1 : -1;
+    }
+    return result;
+}
+
+/**
+ * Call and forget every waiter whose position is now durable or undone
+ */
+void Wal::wake_waiters() {
+    size_t kept = 0;
+    for (size_t i = 0; i < waiters.size(); i++) {
+        if (settled(waiters[i].first) != 0) {
+            waiters[i].second();
+        } else {
+            waiters[kept++] = std::move(waiters[i]);
+        }
+    }
+    waiters.resize(kept);
+}
+
+/**
+ * Commit everything appended whenever a waiter is added, until the log is
+ * destroyed. A commit covers the waiters added while it waits interval_us,
+ * which is how one sync serves many clients of an event loop.
+ * @return NULL
+ */
+void *Wal::flush_loop(void *arg) {
+    Wal *wal = static_cast<Wal *>(arg);
+
+    pthread_mutex_lock(&wal->lock);
+    while (!wal->stopping) {
+        if (wal->waiters.empty()) {
+            pthread_cond_wait(&wal->wanted, &wal->lock);
+            continue;
+        }
+        uint64_t lsn = wal->appended;       // at least every waiter's position
+        pthread_mutex_unlock(&wal->lock);
+        wal->commit(lsn);       // which wakes the waiters it settles
+        pthread_mutex_lock(&wal->lock);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return NULL;
+}
+
+/**
+ * Run save while no record can be stored or written, and if save succeeds
+ * in making every variable durable some other way, such as a snapshot,
+ * empty the log and delete its segments: their records are no longer
+ * needed. Threads waiting in commit are released, since save covered their
+ * records too.
+ * @return the result of save
+ */
+bool Wal::checkpoint(const std::function<bool()> &save) {
+    pthread_mutex_lock(&lock);
+    while (flushing) {
+        pthread_cond_wait(&flushed, &lock);
+    }
+
+    bool ok = save();
+    if (ok) {
+        if (ftruncate(fd, 0) == 0) {
+            pending.clear();        // otherwise they are written later, which is harmless
+            failed = false;
+        }
+        for (uint64_t n : segments) {
+            unlink(segment_path(path, n).c_str());
+        }
+        if (!segments.empty()) {
+            sync_dir(path);
+        }
+        segments.clear();
+        durable = appended;
+        pending_undo.clear();       // save made those stores durable
+        pthread_cond_broadcast(&flushed);
+        wake_waiters();
+    }
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+/**
+ * Rename the file to the next segment and start a new one at the same path,
+ * so that every record stored before this call is in the segment and every
+ * one stored after it is in the new file. The caller makes sure no store is
+ * in progress. Records still pending belong to the segment, so this thread
+ * becomes the flusher until it calls finish_rotate, which it must do next.
+ * @return the segment's number, or 0 (with errno set) if the log failed or
+ *         the files can't be renamed or created
+ */
+uint64_t Wal::rotate() {
+    pthread_mutex_lock(&lock);
+    while (flushing) {
+        pthread_cond_wait(&flushed, &lock);
+    }
+    uint64_t n = segments.empty() ? 1 : segments.back() + 1;
+    std::string name = segment_path(path, n);
+    if (failed) {
+        pthread_mutex_unlock(&lock);
+        errno = EIO;
+        return 0;
+    }
+    if (rename(path.c_str(), name.c_str()) < 0) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    int new_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (new_fd < 0) {
+        int saved = errno;
+        rename(name.c_str(), path.c_str());
+        pthread_mutex_unlock(&lock);
+        errno = saved;
+        return 0;
+    }
+
+    segments.push_back(n);
+    rotated_fd = fd;
+    rotated_end = appended;
+    fd = new_fd;
+    writing.clear();
+    writing.swap(pending);
+    writing_undo.swap(pending_undo);
+    flushing = true;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+/**
+ * Write the records left for the segment by rotate and sync it, along with
+ * the directory, then let other threads flush the new file. Until then no
+ * record in the new file is acknowledged, so none survives a crash that the
+ * older ones don't.
+ * @return true on success, false if the log failed
+ */
+bool Wal::finish_rotate() {
+    bool ok = flush(rotated_fd) && sync_dir(path);
+    close(rotated_fd);
+    rotated_fd = -1;
+
+    pthread_mutex_lock(&lock);
+    if (ok) {
+        durable = rotated_end;
+        writing_undo.clear();
+    } else {
+        fail();
+    }
+    flushing = false;
+    pthread_cond_broadcast(&flushed);
+    wake_waiters();
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+/**
+ * Delete the segments numbered up to segment, once a checkpoint has made
+ * all of their records durable some other way. The deletions are synced:
+ * replaying a segment after a later checkpoint would undo assignments.
+ */
+void Wal::release(uint64_t segment) {
+    std::vector<std::string> names;
+    pthread_mutex_lock(&lock);
+    while (!segments.empty() && segments.front() <= segment) {
+        names.push_back(segment_path(path, segments.front()));
+        segments.erase(segments.begin());
+    }
+    pthread_mutex_unlock(&lock);
+
+    for (const std::string &name : names) {
+        unlink(name.c_str());
+    }
+    if (!names.empty()) {
+        sync_dir(path);
+    }
+}
+
+/**
+ * Mark the log failed and undo the stores of every record that is not
+ * durable, newest first, so that each variable gets back the value it had
+ * before them. No store can come in meanwhile: they take the lock too.
+ */
+void Wal::fail() {
+    failed = true;
+    undone.emplace_back(durable, appended);
+    for (std::vector<Undo> *undo : { &pending_undo, &writing_undo }) {
+        for (auto it = undo->rbegin(); it != undo->rend(); ++it) {
+            it->entry->value.store(it->value, std::memory_order_relaxed);
+            it->entry->defined.store(it->defined, std::memory_order_release);
+        }
+        undo->clear();
+    }
+}
+
+/**
+ * Write the records in writing to the end of fd and sync it
+ * @return true on success, false if the write or the sync failed
+ */
+bool Wal::flush(int fd) {
+    size_t done = 0;
+    while (done < writing.size()) {
+        ssize_t n = write(fd, writing.data() + done, writing.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += n;
+    }
+    return writing.empty() || fdatasync(fd) == 0;
+}
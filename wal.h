@@ -0,0 +1,121 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "varTable.h"
+
+/**
+ * Write-ahead log of assignments: an append-only file of records, each a
+ * checksum, the name's length, the value and the name. store appends a
+ * record to a buffer in memory; commit makes it durable with group commit.
+ * The first thread that needs a flush writes and syncs everything appended
+ * so far, and threads that need one meanwhile wait for it, usually finding
+ * their records covered by the same sync. If a write or sync fails, every
+ * assignment not yet durable is undone, newest first, and the log takes
+ * no more until a checkpoint empties it.
+ *
+ * A thread that must not block, such as an event loop, calls notify
+ * instead of commit: a flusher thread, started the first time one is
+ * needed, then syncs for it and calls it back.
+ *
+ * rotate starts a new file at the same path, renaming the old one to
+ * path.N, so that a checkpoint can later drop the records it covers.
+ * Opening replays the segments in order, then the current file.
+ */
+class Wal {
+private:
+    // what a store replaced, to put back if its record never becomes durable
+    struct Undo {
+        VarEntry *entry;
+        int value;
+        bool defined;
+    };
+
+    int fd;
+    std::string path;
+    unsigned interval_us;       // how long a flushing thread waits for more records
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;
+    std::string pending;        // records appended but not yet written
+    std::string writing;        // records being written by the flushing thread
+    std::vector<Undo> pending_undo;     // one per record of pending, in order
+    std::vector<Undo> writing_undo;     // one per record of writing
+    uint64_t appended;          // bytes ever appended, the position after the last record
+    uint64_t durable;           // position up to which records are safe on disk
+    bool flushing;              // whether a thread is writing
+    bool failed;                // a write or sync failed, so nothing more becomes durable
+    std::vector<uint64_t> segments;     // numbers of the older files, in order
+    int rotated_fd;             // the file rotate renamed, until finish_rotate writes it
+    uint64_t rotated_end;       // position of the last record in that file
+    std::vector<std::pair<uint64_t, uint64_t>> undone;     // positions after and up to which records were undone
+    std::vector<std::pair<uint64_t, std::function<void()>>> waiters;   // called when their positions are settled
+    pthread_cond_t wanted;      // signalled when a waiter is added or stopping is set
+    pthread_t flusher;          // syncs for the waiters
+    bool flusher_started;
+    bool stopping;              // whether the flusher is to exit
+
+    Wal(int fd, const char *path, uint64_t size, unsigned interval_us, const std::vector<uint64_t> &segments);
+
+    // write writing to fd and sync it
+    bool flush(int fd);
+
+    // give up on the records not yet durable, undoing their stores; the lock is held
+    void fail();
+
+    // status of position lsn; the lock is held
+    int settled(uint64_t lsn) const;
+
+    // call the waiters whose positions are settled; the lock is held
+    void wake_waiters();
+
+    // thread body of the flusher
+    static void *flush_loop(void *arg);
+
+public:
+    ~Wal();
+
+    Wal(const Wal &) = delete;
+    Wal &operator=(const Wal &) = delete;
+
+    // open the log at path, passing every record already in it to apply
+    static Wal *open(const char *path, unsigned interval_us,
+                     const std::function<void(std::string_view, int)> &apply);
+
+    // store value into entry and append the assignment, in the same order, or 0 if the log failed
+    uint64_t store(VarEntry *entry, int value);
+
+    // wait until the log is durable up to position lsn, returned by store
+    bool commit(uint64_t lsn);
+
+    // 1 if position lsn is durable, -1 if its record was undone, 0 if neither yet
+    int status(uint64_t lsn);
+
+    // have the flusher make lsn durable and then call done, unless status(lsn), returned, is not 0
+    int notify(uint64_t lsn, const std::function<void()> &done);
+
+    // run save with stores blocked, then empty the log if save succeeded
+    bool checkpoint(const std::function<bool()> &save);
+
+    // start a new file, returning the old one's segment number or 0
+    uint64_t rotate();
+
+    // make the records in the file rotate renamed durable
+    bool finish_rotate();
+
+    // delete the segments up to number segment, which a checkpoint covers
+    void release(uint64_t segment);
+
+    // append a record of name = value to out
+    static void encode(std::string &out, std::string_view name, int value);
+
+    // pass the complete records at the start of data to apply, returning their size
+    static size_t decode(std::string_view data, const std::function<void(std::string_view, int)> &apply,
+                         bool *corrupt = NULL);
+};
+
+#endif /* WAL_H */